@@ -33,9 +33,16 @@
 #include <sys/time.h>
 
 #include "audio.h"
+#include "nullsink.h"
 
+/* The format libspotify delivers, which the device is opened with ahead of
+   the first track */
+#define EXPECTED_RATE 44100
+#define EXPECTED_CHANNELS 2
+/* Frames of silence written at a time */
+#define SILENCE_FRAMES 1024
 
-static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
+static snd_pcm_t *alsa_open(const char *dev, int rate, int channels)
 {
 	snd_pcm_hw_params_t *hwp;
 	snd_pcm_sw_params_t *swp;
@@ -171,53 +178,168 @@ static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
 	return h;
 }
 
+/* An opened output device: an ALSA device, or a simulated one, see
+   nullsink.h */
+typedef struct audio_output {
+	snd_pcm_t *pcm;
+	spotd_null_sink null_sink;
+	int is_null;
+	int rate;
+	int channels;
+} audio_output_t;
+
+static int output_open(audio_output_t *out, const char *dev, int rate, int channels)
+{
+	out->is_null = spotd_null_sink_is_device(dev);
+
+	if (out->is_null) {
+		if (spotd_null_sink_open(&out->null_sink, dev, rate, channels) < 0)
+			return -1;
+	} else if (!(out->pcm = alsa_open(dev, rate, channels))) {
+		return -1;
+	}
+
+	out->rate = rate;
+	out->channels = channels;
+
+	return 0;
+}
+
+static void output_close(audio_output_t *out)
+{
+	if (out->is_null)
+		spotd_null_sink_close(&out->null_sink);
+	else if (out->pcm)
+		snd_pcm_close(out->pcm);
+
+	out->pcm = NULL;
+	out->rate = 0;
+	out->channels = 0;
+}
+
+/* Frames written to the device that have not been heard yet */
+static long output_delay(audio_output_t *out)
+{
+	snd_pcm_sframes_t delay;
+
+	if (out->is_null)
+		return spotd_null_sink_delay(&out->null_sink);
+
+	if (snd_pcm_delay(out->pcm, &delay) < 0 || delay < 0)
+		return 0;
+
+	return delay;
+}
+
+static void output_write(audio_output_t *out, const int16_t *samples, int frames)
+{
+	int c;
+
+	if (out->is_null) {
+		spotd_null_sink_write(&out->null_sink, samples, frames);
+		return;
+	}
+
+	c = snd_pcm_wait(out->pcm, 1000);
+
+	if (c >= 0)
+		c = snd_pcm_avail_update(out->pcm);
+
+	if (c == -EPIPE)
+		snd_pcm_prepare(out->pcm);
+
+	snd_pcm_writei(out->pcm, samples, frames);
+}
+
+static void output_write_silence(audio_output_t *out, int frames)
+{
+	int16_t *silence;
+	int n;
+
+	if (frames <= 0)
+		return;
+
+	silence = calloc(SILENCE_FRAMES * out->channels, sizeof(int16_t));
+
+	for (; frames > 0; frames -= n) {
+		n = frames < SILENCE_FRAMES ? frames : SILENCE_FRAMES;
+		output_write(out, silence, n);
+	}
+
+	free(silence);
+}
+
 static void* alsa_audio_start(void *aux)
 {
 	audio_fifo_t *af = aux;
-	snd_pcm_t *h = NULL;
-	int c;
-	int cur_channels = 0;
-	int cur_rate = 0;
+	audio_output_t out;
+	audio_sync_t sync;
+	const int16_t *samples;
+	int frames, silence;
 
 	audio_fifo_data_t *afd;
 
-	for (;;) {
-		afd = audio_get(af);
+	memset(&out, 0, sizeof(out));
+	memset(&sync, 0, sizeof(sync));
 
-		if (!h || cur_rate != afd->rate || cur_channels != afd->channels) {
-			if (h) snd_pcm_close(h);
+	/* Opening the device can take long, so it is done before the first
+	   samples arrive rather than when they do */
+	if (output_open(&out, af->device, EXPECTED_RATE, EXPECTED_CHANNELS) < 0) {
+		fprintf(stderr, "audio: Unable to open output device %s ahead of playback\n",
+		        af->device);
+	}
 
-			cur_rate = afd->rate;
-			cur_channels = afd->channels;
+	for (;;) {
+		afd = audio_get(af);
 
-			h = alsa_open("default", cur_rate, cur_channels);
+		if (out.rate != afd->rate || out.channels != afd->channels) {
+			output_close(&out);
 
-			if (!h) {
-				fprintf(stderr, "Unable to open ALSA device (%d channels, %d Hz), dying\n",
-				        cur_channels, cur_rate);
+			if (output_open(&out, af->device, afd->rate, afd->channels) < 0) {
+				fprintf(stderr, "Unable to open output device %s (%d channels, %d Hz), dying\n",
+				        af->device, afd->channels, afd->rate);
 				exit(1);
 			}
-		}
 
-		c = snd_pcm_wait(h, 1000);
+			audio_sync_reset(&sync);
+		}
 
-		if (c >= 0)
-			c = snd_pcm_avail_update(h);
+		audio_apply_volume(afd);
+
+		/* In sync mode the samples are played at their presentation time,
+		   corrected for what the device has not played yet */
+		if (af->clock) {
+			samples = audio_sync_samples(&sync, afd, audio_clock_now_us(af->clock),
+			                             output_delay(&out), &silence, &frames);
+			output_write_silence(&out, silence);
+			audio_fifo_set_sync(af, &sync);
+		} else {
+			samples = afd->samples;
+			frames = afd->nsamples;
+		}
 
-		if (c == -EPIPE)
-			snd_pcm_prepare(h);
+		if (frames > 0)
+			output_write(&out, samples, frames);
 
-		snd_pcm_writei(h, afd->samples, afd->nsamples);
+		audio_fifo_played(af, afd);
 		free(afd);
 	}
 }
 
-void audio_init(audio_fifo_t *af)
+void audio_init(audio_fifo_t *af, const char *device, audio_clock_t *clock)
 {
 	pthread_t tid;
 
 	TAILQ_INIT(&af->q);
 	af->qlen = 0;
+	af->volume = 100;
+	af->paused = 0;
+	af->mark_pending = 0;
+	af->played_ms = 0;
+	af->device = device;
+	af->clock = clock;
+	af->sync_error_us = 0;
+	af->sync_ppm = 0;
 
 	pthread_mutex_init(&af->mutex, NULL);
 	pthread_cond_init(&af->cond, NULL);
@@ -26,16 +26,34 @@
 
 #include "audio.h"
 #include <stdlib.h>
+#include <string.h>
+#include "util.h"
+
+// Errors larger than this are corrected at once, by playing silence or by
+// skipping samples, in microseconds
+#define AUDIO_SYNC_STEP_US 20000
+// Largest resampling correction, in parts per million
+#define AUDIO_SYNC_MAX_PPM 1000
+// Weight of a new error measurement in the smoothed error
+#define AUDIO_SYNC_SMOOTHING 0.1
+// Correction for the smoothed error, in parts per million per microsecond
+#define AUDIO_SYNC_KP 0.5
+// Correction learned for the drift of the device, in parts per million per
+// microsecond of error and second
+#define AUDIO_SYNC_KI 0.05
 
 audio_fifo_data_t* audio_get(audio_fifo_t *af) {
   audio_fifo_data_t *afd;
   pthread_mutex_lock(&af->mutex);
 
-  while (!(afd = TAILQ_FIRST(&af->q)))
+  while (!(afd = TAILQ_FIRST(&af->q)) || af->paused)
   pthread_cond_wait(&af->cond, &af->mutex);
 
   TAILQ_REMOVE(&af->q, afd, link);
   af->qlen -= afd->nsamples;
+  afd->volume = af->volume;
+  afd->marked = af->mark_pending;
+  af->mark_pending = 0;
 
   pthread_mutex_unlock(&af->mutex);
   return afd;
@@ -54,3 +72,260 @@ void audio_fifo_flush(audio_fifo_t *af) {
   af->qlen = 0;
   pthread_mutex_unlock(&af->mutex);
 }
+
+void audio_fifo_set_volume(audio_fifo_t *af, int volume) {
+  pthread_mutex_lock(&af->mutex);
+  af->volume = volume;
+  pthread_mutex_unlock(&af->mutex);
+}
+
+void audio_fifo_set_paused(audio_fifo_t *af, int paused) {
+  pthread_mutex_lock(&af->mutex);
+  af->paused = paused;
+  pthread_cond_signal(&af->cond);
+  pthread_mutex_unlock(&af->mutex);
+}
+
+/**
+ * Mark the next samples queued, to learn when they are played, see
+ * audio_fifo_played_ms(). Used to measure the time to first audio.
+ *
+ * @param  af  The audio fifo
+ */
+void audio_fifo_mark(audio_fifo_t *af) {
+  pthread_mutex_lock(&af->mutex);
+  af->mark_pending = 1;
+  af->played_ms = 0;
+  pthread_mutex_unlock(&af->mutex);
+}
+
+/**
+ * Tell that samples taken with audio_get() were written to the output
+ * device. Called by the audio output thread.
+ *
+ * @param  af  The audio fifo
+ * @param  afd  The samples written
+ */
+void audio_fifo_played(audio_fifo_t *af, audio_fifo_data_t *afd) {
+  if (!afd->marked) {
+    return;
+  }
+
+  pthread_mutex_lock(&af->mutex);
+  af->played_ms = monotonic_ms();
+  pthread_mutex_unlock(&af->mutex);
+}
+
+/**
+ * Get the time the samples marked with audio_fifo_mark() were played
+ *
+ * @param  af  The audio fifo
+ * @return  The time from monotonic_ms(), 0 if they have not been played yet
+ */
+int64_t audio_fifo_played_ms(audio_fifo_t *af) {
+  int64_t played_ms;
+
+  pthread_mutex_lock(&af->mutex);
+  played_ms = af->played_ms;
+  pthread_mutex_unlock(&af->mutex);
+
+  return played_ms;
+}
+
+/**
+ * Store the state of the synchronization of an output, for reporting.
+ * Called by the audio output thread.
+ *
+ * @param  af  The audio fifo
+ * @param  sync  The synchronization state of the output
+ */
+void audio_fifo_set_sync(audio_fifo_t *af, const audio_sync_t *sync) {
+  pthread_mutex_lock(&af->mutex);
+  af->sync_error_us = (int) sync->error_us;
+  af->sync_ppm = sync->ppm;
+  pthread_mutex_unlock(&af->mutex);
+}
+
+void audio_apply_volume(audio_fifo_data_t *afd) {
+  int i, n;
+
+  if (afd->volume >= 100) {
+    return;
+  }
+
+  n = afd->nsamples * afd->channels;
+
+  for (i = 0; i < n; i++) {
+    afd->samples[i] = (int16_t) (afd->samples[i] * afd->volume / 100);
+  }
+}
+
+/**
+ * Initialize a sync clock. It starts running.
+ *
+ * @param  clock  The clock
+ */
+void audio_clock_init(audio_clock_t *clock) {
+  clock->paused_us = 0;
+  clock->paused_since_us = 0;
+  pthread_mutex_init(&clock->mutex, NULL);
+}
+
+/**
+ * Get the time of a sync clock
+ *
+ * @param  clock  The clock
+ * @return  The time in microseconds. The clock does not advance while it is
+ *   paused.
+ */
+int64_t audio_clock_now_us(audio_clock_t *clock) {
+  int64_t now_us;
+
+  pthread_mutex_lock(&clock->mutex);
+  now_us = clock->paused_since_us != 0 ? clock->paused_since_us : monotonic_us();
+  now_us -= clock->paused_us;
+  pthread_mutex_unlock(&clock->mutex);
+
+  return now_us;
+}
+
+/**
+ * Stop a sync clock, or start it again
+ *
+ * @param  clock  The clock
+ * @param  paused  Non-zero to stop the clock
+ */
+void audio_clock_set_paused(audio_clock_t *clock, int paused) {
+  pthread_mutex_lock(&clock->mutex);
+
+  if (paused && clock->paused_since_us == 0) {
+    clock->paused_since_us = monotonic_us();
+  } else if (!paused && clock->paused_since_us != 0) {
+    clock->paused_us += monotonic_us() - clock->paused_since_us;
+    clock->paused_since_us = 0;
+  }
+
+  pthread_mutex_unlock(&clock->mutex);
+}
+
+/**
+ * Forget the position in the stream, after a gap in the output. The
+ * correction learned for the drift of the device is kept.
+ *
+ * @param  sync  The synchronization state of the output
+ */
+void audio_sync_reset(audio_sync_t *sync) {
+  sync->phase = 0;
+  sync->error_us = 0;
+  sync->have_last = 0;
+}
+
+/**
+ * Get an input frame for resampling. Frame 0 is the last frame of the
+ * previous samples, if they are kept.
+ */
+static const int16_t *sync_frame(const audio_sync_t *sync, const audio_fifo_data_t *afd,
+                                 int index) {
+  if (sync->have_last) {
+    if (index == 0) {
+      return sync->last;
+    }
+    index--;
+  }
+
+  return afd->samples + index * afd->channels;
+}
+
+/**
+ * Align samples with their presentation time. The error is measured from
+ * when the first sample would be heard if written now. Large errors are
+ * corrected by playing silence first, or by skipping the samples that are
+ * too late. Small errors, and the drift of the device clock, are corrected
+ * by resampling.
+ *
+ * @param  sync  The synchronization state of the output
+ * @param  afd  The samples to play
+ * @param  now_us  The time of the sync clock
+ * @param  delay  Frames written to the device, but not heard yet
+ * @param  silence  Receives the number of frames of silence to write before
+ *   the samples
+ * @param  frames  Receives the number of frames to write
+ * @return  The samples to write. Points into afd, or into a buffer owned by
+ *   sync that is valid until the next call.
+ */
+const int16_t *audio_sync_samples(audio_sync_t *sync, audio_fifo_data_t *afd, int64_t now_us,
+                                  long delay, int *silence, int *frames) {
+  int channels = afd->channels, total, count, skip, index, c;
+  const int16_t *a, *b;
+  int64_t error_us;
+  double ratio, position, fraction;
+
+  *silence = 0;
+  *frames = afd->nsamples;
+
+  if (afd->pts_us == 0 || channels > AUDIO_SYNC_MAX_CHANNELS || afd->nsamples == 0) {
+    return afd->samples;
+  }
+
+  error_us = now_us + (int64_t) delay * 1000000 / afd->rate - afd->pts_us;
+
+  if (error_us < -AUDIO_SYNC_STEP_US) {
+    audio_sync_reset(sync);
+    *silence = (int) (-error_us * afd->rate / 1000000);
+    return afd->samples;
+  }
+
+  if (error_us > AUDIO_SYNC_STEP_US) {
+    audio_sync_reset(sync);
+    skip = (int) (error_us * afd->rate / 1000000);
+    *frames = skip < afd->nsamples ? afd->nsamples - skip : 0;
+    return afd->samples + (afd->nsamples - *frames) * channels;
+  }
+
+  // Proportional to the smoothed error, plus what has been learned about
+  // the drift of the device
+  sync->error_us += (error_us - sync->error_us) * AUDIO_SYNC_SMOOTHING;
+  sync->integral_ppm += sync->error_us * AUDIO_SYNC_KI * afd->nsamples / afd->rate;
+  if (sync->integral_ppm > AUDIO_SYNC_MAX_PPM) {
+    sync->integral_ppm = AUDIO_SYNC_MAX_PPM;
+  } else if (sync->integral_ppm < -AUDIO_SYNC_MAX_PPM) {
+    sync->integral_ppm = -AUDIO_SYNC_MAX_PPM;
+  }
+
+  sync->ppm = (int) (sync->error_us * AUDIO_SYNC_KP + sync->integral_ppm);
+  if (sync->ppm > AUDIO_SYNC_MAX_PPM) {
+    sync->ppm = AUDIO_SYNC_MAX_PPM;
+  } else if (sync->ppm < -AUDIO_SYNC_MAX_PPM) {
+    sync->ppm = -AUDIO_SYNC_MAX_PPM;
+  }
+
+  // Linear interpolation, playing faster when late
+  ratio = 1.0 + sync->ppm / 1000000.0;
+  total = afd->nsamples + sync->have_last;
+
+  // Playing slower makes up to one frame in 1000 more
+  if (sync->buffer_frames < total + total / 500 + 2) {
+    sync->buffer_frames = total + total / 500 + 2;
+    sync->buffer = realloc(sync->buffer, sync->buffer_frames * channels * sizeof(int16_t));
+  }
+
+  count = 0;
+  for (position = sync->phase; position < total - 1; position += ratio) {
+    index = (int) position;
+    fraction = position - index;
+    a = sync_frame(sync, afd, index);
+    b = sync_frame(sync, afd, index + 1);
+
+    for (c = 0; c < channels; c++) {
+      sync->buffer[count * channels + c] = (int16_t) (a[c] + (b[c] - a[c]) * fraction);
+    }
+    count++;
+  }
+
+  sync->phase = position - (total - 1);
+  memcpy(sync->last, afd->samples + (afd->nsamples - 1) * channels, channels * sizeof(int16_t));
+  sync->have_last = 1;
+
+  *frames = count;
+  return sync->buffer;
+}
@@ -31,25 +31,77 @@
 #include <stdint.h>
 #include "queue.h"
 
+/* --- Constants --- */
+#define AUDIO_SYNC_MAX_CHANNELS 8
+
 /* --- Types --- */
 typedef struct audio_fifo_data {
 	TAILQ_ENTRY(audio_fifo_data) link;
 	int channels;
 	int rate;
 	int nsamples;
+	int volume; /* Volume to play the samples at, set by audio_get() */
+	int marked; /* Non-zero for the first samples taken after audio_fifo_mark() */
+	int64_t pts_us; /* Sync clock time the first sample is to be heard at, 0 to play
+	                   the samples as soon as possible */
 	int16_t samples[0];
 } audio_fifo_data_t;
 
+/* A clock shared by the outputs that play in sync. It follows the monotonic
+   clock, but stands still while playback is paused, so that the samples held
+   back keep their presentation times. */
+typedef struct audio_clock {
+	int64_t paused_us; /* Time spent in earlier pauses */
+	int64_t paused_since_us; /* Start of the current pause, 0 while running */
+	pthread_mutex_t mutex;
+} audio_clock_t;
+
+/* State of an output that plays samples at their presentation times. Small
+   errors, such as the drift between the device clock and the sync clock, are
+   corrected by resampling slightly faster or slower. */
+typedef struct audio_sync {
+	double phase; /* Position of the next output frame, in input frames */
+	double error_us; /* Smoothed presentation error, positive when late */
+	double integral_ppm; /* Correction learned for the drift of the device */
+	int ppm; /* Current correction, positive when playing faster */
+	int have_last; /* Non-zero if last holds the previous input frame */
+	int16_t last[AUDIO_SYNC_MAX_CHANNELS];
+	int16_t *buffer; /* Resampled samples */
+	int buffer_frames;
+} audio_sync_t;
+
 typedef struct audio_fifo {
 	TAILQ_HEAD(, audio_fifo_data) q;
 	int qlen;
+	int volume;
+	int paused; /* Non-zero while the samples are held back */
+	int mark_pending; /* Set by audio_fifo_mark() until samples are taken */
+	int64_t played_ms; /* Time the marked samples were played, 0 until then */
+	const char *device; /* The output device the samples are played on */
+	audio_clock_t *clock; /* The sync clock, NULL if the samples have no
+	                         presentation times */
+	int sync_error_us; /* Presentation error, set by the output thread */
+	int sync_ppm; /* Resampling correction, set by the output thread */
 	pthread_mutex_t mutex;
 	pthread_cond_t cond;
 } audio_fifo_t;
 
 /* --- Functions --- */
-extern void audio_init(audio_fifo_t *af);
+extern void audio_init(audio_fifo_t *af, const char *device, audio_clock_t *clock);
 extern void audio_fifo_flush(audio_fifo_t *af);
+extern void audio_fifo_set_volume(audio_fifo_t *af, int volume);
+extern void audio_fifo_set_paused(audio_fifo_t *af, int paused);
+extern void audio_fifo_mark(audio_fifo_t *af);
+extern void audio_fifo_played(audio_fifo_t *af, audio_fifo_data_t *afd);
+extern int64_t audio_fifo_played_ms(audio_fifo_t *af);
 audio_fifo_data_t* audio_get(audio_fifo_t *af);
+void audio_apply_volume(audio_fifo_data_t *afd);
+void audio_clock_init(audio_clock_t *clock);
+int64_t audio_clock_now_us(audio_clock_t *clock);
+void audio_clock_set_paused(audio_clock_t *clock, int paused);
+void audio_sync_reset(audio_sync_t *sync);
+const int16_t *audio_sync_samples(audio_sync_t *sync, audio_fifo_data_t *afd, int64_t now_us,
+                                  long delay, int *silence, int *frames);
+void audio_fifo_set_sync(audio_fifo_t *af, const audio_sync_t *sync);
 
 #endif /* _SPOTD_AUDIO_H_ */
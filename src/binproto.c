@@ -0,0 +1,332 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#include "binproto.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/* --- Function definitions --- */
+static void write_frame(spotd_buffer *out, const spotd_binary_request *request,
+                        spotd_binary_result result, const void *payload,
+                        size_t payload_length, const void *extra, size_t extra_length);
+static uint8_t command_opcode(spotd_command_type type);
+
+/* -- Functions --- */
+
+/**
+ * Parse the body of a binary request frame
+ *
+ * @param  body  The frame body, without the length prefix
+ * @param  length  Length of the frame body
+ * @param  request  Receives the decoded request header, in host byte order.
+ *   The opcode is zero if the header could not be decoded.
+ * @return  The parsed command if the frame contained a valid command, NULL
+ *   otherwise. The resulting command must be freed with spotd_command_release().
+ */
+spotd_command *spotd_binary_parse_request(const char *body, size_t length,
+                                          spotd_binary_request *request) {
+  spotd_binary_playlist playlist;
+  char **arguments;
+  char *argument;
+  size_t link_length;
+
+  memset(request, 0, sizeof(spotd_binary_request));
+
+  if (length < sizeof(spotd_binary_request)) {
+    return NULL;
+  }
+
+  memcpy(request, body, sizeof(spotd_binary_request));
+  request->arg_length = ntohs(request->arg_length);
+  request->request_id = ntohl(request->request_id);
+
+  if (request->arg_length != length - sizeof(spotd_binary_request)) {
+    return NULL;
+  }
+
+  switch (request->opcode) {
+  case SPOTD_BINARY_OP_PLAY:
+  case SPOTD_BINARY_OP_QUEUE_ADD:
+    if (request->arg_length == 0 || request->arg_length >= SPOTD_LINK_MAX) {
+      return NULL;
+    }
+
+    argument = (char *) malloc(request->arg_length + 1);
+    memcpy(argument, body + sizeof(spotd_binary_request), request->arg_length);
+    argument[request->arg_length] = '\0';
+
+    arguments = (char **) malloc(1 * sizeof(char *));
+    arguments[0] = argument;
+
+    return spotd_command_create(request->opcode == SPOTD_BINARY_OP_PLAY ?
+                                SPOTD_COMMAND_PLAY_TRACK : SPOTD_COMMAND_QUEUE_ADD,
+                                1, arguments);
+  case SPOTD_BINARY_OP_STOP:
+    return spotd_command_create(SPOTD_COMMAND_STOP, 0, NULL);
+  case SPOTD_BINARY_OP_STATUS:
+    return spotd_command_create(SPOTD_COMMAND_STATUS, 0, NULL);
+  case SPOTD_BINARY_OP_PAUSE:
+    return spotd_command_create(SPOTD_COMMAND_PAUSE, 0, NULL);
+  case SPOTD_BINARY_OP_RESUME:
+    return spotd_command_create(SPOTD_COMMAND_RESUME, 0, NULL);
+  case SPOTD_BINARY_OP_SUBSCRIBE:
+    return spotd_command_create(SPOTD_COMMAND_SUBSCRIBE, 0, NULL);
+  case SPOTD_BINARY_OP_UNSUBSCRIBE:
+    return spotd_command_create(SPOTD_COMMAND_UNSUBSCRIBE, 0, NULL);
+  case SPOTD_BINARY_OP_VOLUME:
+    if (request->arg_length != 1 || (uint8_t) body[sizeof(spotd_binary_request)] > 100) {
+      return NULL;
+    }
+
+    // Pass the volume on as text, like the text protocol does
+    argument = (char *) malloc(4);
+    snprintf(argument, 4, "%d", (uint8_t) body[sizeof(spotd_binary_request)]);
+
+    arguments = (char **) malloc(1 * sizeof(char *));
+    arguments[0] = argument;
+
+    return spotd_command_create(SPOTD_COMMAND_VOLUME, 1, arguments);
+  case SPOTD_BINARY_OP_QUEUE_REMOVE:
+    if (request->arg_length != 1 ||
+        (uint8_t) body[sizeof(spotd_binary_request)] >= SPOTD_QUEUE_MAX) {
+      return NULL;
+    }
+
+    argument = (char *) malloc(4);
+    snprintf(argument, 4, "%d", (uint8_t) body[sizeof(spotd_binary_request)]);
+
+    arguments = (char **) malloc(1 * sizeof(char *));
+    arguments[0] = argument;
+
+    return spotd_command_create(SPOTD_COMMAND_QUEUE_REMOVE, 1, arguments);
+  case SPOTD_BINARY_OP_QUEUE_NEXT:
+    return spotd_command_create(SPOTD_COMMAND_QUEUE_NEXT, 0, NULL);
+  case SPOTD_BINARY_OP_PLAYLIST_PLAY:
+    if (request->arg_length <= sizeof(spotd_binary_playlist) ||
+        request->arg_length - sizeof(spotd_binary_playlist) >= SPOTD_LINK_MAX) {
+      return NULL;
+    }
+
+    memcpy(&playlist, body + sizeof(spotd_binary_request), sizeof(spotd_binary_playlist));
+    playlist.start = ntohl(playlist.start);
+    if (playlist.start > INT32_MAX) {
+      return NULL;
+    }
+
+    link_length = request->arg_length - sizeof(spotd_binary_playlist);
+    argument = (char *) malloc(link_length + 1);
+    memcpy(argument, body + sizeof(spotd_binary_request) + sizeof(spotd_binary_playlist),
+           link_length);
+    argument[link_length] = '\0';
+
+    arguments = (char **) malloc(2 * sizeof(char *));
+    arguments[0] = argument;
+    arguments[1] = (char *) malloc(12);
+    snprintf(arguments[1], 12, "%u", playlist.start);
+
+    return spotd_command_create(SPOTD_COMMAND_PLAYLIST_PLAY, 2, arguments);
+  case SPOTD_BINARY_OP_PLAYLIST_NEXT:
+    return spotd_command_create(SPOTD_COMMAND_PLAYLIST_NEXT, 0, NULL);
+  case SPOTD_BINARY_OP_QUEUE_CLEAR:
+    return spotd_command_create(SPOTD_COMMAND_QUEUE_CLEAR, 0, NULL);
+  default:
+    return NULL;
+  }
+}
+
+/**
+ * Write a response frame without a payload
+ *
+ * @param  out  The buffer to write the frame to
+ * @param  request  The request being responded to
+ * @param  result  The result of the request
+ */
+void spotd_binary_write_response(spotd_buffer *out, const spotd_binary_request *request,
+                                 spotd_binary_result result) {
+  write_frame(out, request, result, NULL, 0, NULL, 0);
+}
+
+/**
+ * Write a response frame for a status request
+ *
+ * @param  out  The buffer to write the frame to
+ * @param  request  The request being responded to
+ * @param  status  The player status to send
+ */
+void spotd_binary_write_status(spotd_buffer *out, const spotd_binary_request *request,
+                               const spotd_status *status) {
+  spotd_binary_status payload;
+  size_t link_length = strlen(status->track_link);
+
+  payload.state = (uint8_t) status->state;
+  payload.volume = (uint8_t) status->volume;
+  payload.link_length = htons((uint16_t) link_length);
+  payload.position_ms = htonl((uint32_t) status->position_ms);
+  payload.duration_ms = htonl((uint32_t) status->duration_ms);
+
+  write_frame(out, request, SPOTD_BINARY_RESULT_OK, &payload, sizeof(payload),
+              status->track_link, link_length);
+}
+
+/**
+ * Write an event frame
+ *
+ * @param  out  The buffer to write the frame to
+ * @param  event  The event to send
+ */
+void spotd_binary_write_event(spotd_buffer *out, const spotd_event *event) {
+  spotd_binary_request request;
+  spotd_binary_event payload;
+  size_t text_length = strlen(event->text);
+
+  memset(&request, 0, sizeof(request));
+  request.opcode = SPOTD_BINARY_OP_EVENT;
+
+  payload.type = (uint8_t) event->type;
+  payload.reserved = 0;
+  payload.text_length = htons((uint16_t) text_length);
+  payload.value = htonl((uint32_t) event->value);
+
+  write_frame(out, &request, SPOTD_BINARY_RESULT_OK, &payload, sizeof(payload),
+              event->text, text_length);
+}
+
+/**
+ * Write the deferred response to a command
+ *
+ * @param  out  The buffer to write the frame to
+ * @param  origin  The origin of the command
+ * @param  result  The result of the command
+ * @param  error  The error, if the command failed
+ * @param  message  The error message, if the command failed
+ */
+void spotd_binary_write_completion(spotd_buffer *out, const spotd_command_origin *origin,
+                                   spotd_command_result result, spotd_error error,
+                                   const char *message) {
+  spotd_binary_request request;
+  spotd_binary_error payload;
+
+  memset(&request, 0, sizeof(request));
+  request.opcode = command_opcode(origin->type);
+  request.request_id = origin->request_id;
+
+  switch (result) {
+  case SPOTD_RESULT_OK:
+    write_frame(out, &request, SPOTD_BINARY_RESULT_OK, NULL, 0, NULL, 0);
+    break;
+  case SPOTD_RESULT_LOADING:
+    write_frame(out, &request, SPOTD_BINARY_RESULT_LOADING, NULL, 0, NULL, 0);
+    break;
+  case SPOTD_RESULT_STARTED:
+    write_frame(out, &request, SPOTD_BINARY_RESULT_STARTED, NULL, 0, NULL, 0);
+    break;
+  default:
+    payload.error = htonl((uint32_t) error);
+    write_frame(out, &request, SPOTD_BINARY_RESULT_FAILED, &payload, sizeof(payload),
+                message, strlen(message));
+    break;
+  }
+}
+
+/**
+ * Get the opcode of a command type
+ *
+ * @param  type  The command type
+ * @return  The binary protocol opcode
+ */
+static uint8_t command_opcode(spotd_command_type type) {
+  switch (type) {
+  case SPOTD_COMMAND_PLAY_TRACK:
+    return SPOTD_BINARY_OP_PLAY;
+  case SPOTD_COMMAND_STOP:
+    return SPOTD_BINARY_OP_STOP;
+  case SPOTD_COMMAND_STATUS:
+    return SPOTD_BINARY_OP_STATUS;
+  case SPOTD_COMMAND_SUBSCRIBE:
+    return SPOTD_BINARY_OP_SUBSCRIBE;
+  case SPOTD_COMMAND_UNSUBSCRIBE:
+    return SPOTD_BINARY_OP_UNSUBSCRIBE;
+  case SPOTD_COMMAND_VOLUME:
+    return SPOTD_BINARY_OP_VOLUME;
+  case SPOTD_COMMAND_PAUSE:
+    return SPOTD_BINARY_OP_PAUSE;
+  case SPOTD_COMMAND_RESUME:
+    return SPOTD_BINARY_OP_RESUME;
+  case SPOTD_COMMAND_QUEUE_ADD:
+    return SPOTD_BINARY_OP_QUEUE_ADD;
+  case SPOTD_COMMAND_QUEUE_REMOVE:
+    return SPOTD_BINARY_OP_QUEUE_REMOVE;
+  case SPOTD_COMMAND_QUEUE_NEXT:
+    return SPOTD_BINARY_OP_QUEUE_NEXT;
+  case SPOTD_COMMAND_QUEUE_CLEAR:
+    return SPOTD_BINARY_OP_QUEUE_CLEAR;
+  case SPOTD_COMMAND_PLAYLIST_PLAY:
+    return SPOTD_BINARY_OP_PLAYLIST_PLAY;
+  case SPOTD_COMMAND_PLAYLIST_NEXT:
+    return SPOTD_BINARY_OP_PLAYLIST_NEXT;
+  default:
+    return 0;
+  }
+}
+
+/**
+ * Write a complete response frame, with its length prefix
+ *
+ * @param  out  The buffer to write the frame to
+ * @param  request  The request being responded to
+ * @param  result  The result of the request
+ * @param  payload  Fixed part of the payload, can be NULL
+ * @param  payload_length  Length of the fixed part of the payload
+ * @param  extra  Variable part of the payload, can be NULL
+ * @param  extra_length  Length of the variable part of the payload
+ */
+static void write_frame(spotd_buffer *out, const spotd_binary_request *request,
+                        spotd_binary_result result, const void *payload,
+                        size_t payload_length, const void *extra, size_t extra_length) {
+  spotd_binary_response response;
+  uint32_t frame_length;
+
+  frame_length = htonl((uint32_t) (sizeof(response) + payload_length + extra_length));
+
+  response.opcode = request->opcode;
+  response.result = (uint8_t) result;
+  response.payload_length = htons((uint16_t) (payload_length + extra_length));
+  response.request_id = htonl(request->request_id);
+
+  spotd_buffer_append(out, &frame_length, sizeof(frame_length));
+  spotd_buffer_append(out, &response, sizeof(response));
+
+  if (payload_length > 0) {
+    spotd_buffer_append(out, payload, payload_length);
+  }
+
+  if (extra_length > 0) {
+    spotd_buffer_append(out, extra, extra_length);
+  }
+}
@@ -0,0 +1,145 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#ifndef _SPOTD_BINPROTO_H_
+#define _SPOTD_BINPROTO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "types.h"
+#include "buffer.h"
+
+/*
+ * The binary protocol is negotiated by sending "BINARY" as a text command
+ * after the greeting. Once the server replies with "OK BINARY <version>", all
+ * further traffic on the connection is binary frames.
+ *
+ * Every frame starts with a 32-bit big-endian length of the frame body. A
+ * request body is a spotd_binary_request followed by arg_length bytes of
+ * argument. A response body is a spotd_binary_response followed by
+ * payload_length bytes of payload. All multi-byte fields are big-endian.
+ *
+ * Requests with SPOTD_BINARY_FLAG_DEFERRED set are answered once the command
+ * has been executed, with its real result. A PLAY may first be answered with
+ * SPOTD_BINARY_RESULT_LOADING, followed by STARTED or FAILED. Clients should
+ * use distinct request IDs for deferred requests.
+ */
+
+/* --- Constants --- */
+#define SPOTD_BINARY_VERSION 1
+// Size of the frame length prefix
+#define SPOTD_BINARY_LENGTH_SIZE 4
+// Maximum size of a frame body
+#define SPOTD_BINARY_MAX_FRAME 4096
+// Request flag: answer with the real result once the command is executed
+#define SPOTD_BINARY_FLAG_DEFERRED 0x01
+
+/* --- Types --- */
+typedef enum spotd_binary_opcode {
+  SPOTD_BINARY_OP_PLAY          = 1,  // Play the track given as the argument
+  SPOTD_BINARY_OP_STOP          = 2,  // Stop playback
+  SPOTD_BINARY_OP_STATUS        = 3,  // Report the player status
+  SPOTD_BINARY_OP_SUBSCRIBE     = 4,  // Start pushing events
+  SPOTD_BINARY_OP_UNSUBSCRIBE   = 5,  // Stop pushing events
+  SPOTD_BINARY_OP_VOLUME        = 6,  // Set the volume, the argument is one byte 0-100
+  SPOTD_BINARY_OP_EVENT         = 7,  // Pushed event, sent by the server only
+  SPOTD_BINARY_OP_PAUSE         = 8,  // Pause playback
+  SPOTD_BINARY_OP_RESUME        = 9,  // Resume paused playback
+  SPOTD_BINARY_OP_QUEUE_ADD     = 10, // Queue the track given as the argument
+  SPOTD_BINARY_OP_QUEUE_REMOVE  = 11, // Remove a queued track, the argument is its one byte index
+  SPOTD_BINARY_OP_QUEUE_NEXT    = 12, // Play the first track of the play queue
+  SPOTD_BINARY_OP_QUEUE_CLEAR   = 13, // Remove all play queue entries
+  SPOTD_BINARY_OP_PLAYLIST_PLAY = 14, // Play a playlist, see spotd_binary_playlist
+  SPOTD_BINARY_OP_PLAYLIST_NEXT = 15  // Play the next track of the playlist
+} spotd_binary_opcode;
+
+typedef enum spotd_binary_result {
+  SPOTD_BINARY_RESULT_OK              = 0, // Command accepted
+  SPOTD_BINARY_RESULT_INVALID_COMMAND = 1, // Unknown opcode or bad argument
+  SPOTD_BINARY_RESULT_FAILED          = 2, // Command failed
+  SPOTD_BINARY_RESULT_RATE_LIMITED    = 3, // Too many commands, try again later
+  SPOTD_BINARY_RESULT_LOADING         = 4, // The track is loading, a final result follows
+  SPOTD_BINARY_RESULT_STARTED         = 5  // The track started playing
+} spotd_binary_result;
+
+typedef struct spotd_binary_request {
+  uint8_t opcode;
+  uint8_t flags;
+  uint16_t arg_length;
+  uint32_t request_id;
+} spotd_binary_request;
+
+typedef struct spotd_binary_response {
+  uint8_t opcode;
+  uint8_t result;
+  uint16_t payload_length;
+  uint32_t request_id;
+} spotd_binary_response;
+
+// Payload of a response to SPOTD_BINARY_OP_STATUS, followed by link_length
+// bytes of the current track link
+typedef struct spotd_binary_status {
+  uint8_t state;
+  uint8_t volume;
+  uint16_t link_length;
+  uint32_t position_ms;
+  uint32_t duration_ms;
+} spotd_binary_status;
+
+// Payload of a SPOTD_BINARY_OP_EVENT frame, followed by text_length bytes of
+// text. Event frames have a request_id of zero.
+typedef struct spotd_binary_event {
+  uint8_t type;
+  uint8_t reserved;
+  uint16_t text_length;
+  uint32_t value;
+} spotd_binary_event;
+
+// Argument of SPOTD_BINARY_OP_PLAYLIST_PLAY, followed by the playlist link, or
+// the index of the playlist in the user's playlists as decimal text
+typedef struct spotd_binary_playlist {
+  uint32_t start;  // Index of the track to start at
+} spotd_binary_playlist;
+
+// Payload of a deferred SPOTD_BINARY_RESULT_FAILED response, followed by
+// the error message
+typedef struct spotd_binary_error {
+  uint32_t error;  // A spotd_error
+} spotd_binary_error;
+
+/* --- Functions --- */
+spotd_command *spotd_binary_parse_request(const char *body, size_t length,
+                                          spotd_binary_request *request);
+void spotd_binary_write_response(spotd_buffer *out, const spotd_binary_request *request,
+                                 spotd_binary_result result);
+void spotd_binary_write_status(spotd_buffer *out, const spotd_binary_request *request,
+                               const spotd_status *status);
+void spotd_binary_write_event(spotd_buffer *out, const spotd_event *event);
+void spotd_binary_write_completion(spotd_buffer *out, const spotd_command_origin *origin,
+                                   spotd_command_result result, spotd_error error,
+                                   const char *message);
+
+#endif /* _SPOTD_BINPROTO_H_ */
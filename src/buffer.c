@@ -0,0 +1,95 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#include "buffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Initialize an empty buffer
+ *
+ * @param  buffer  The buffer to initialize
+ */
+void spotd_buffer_init(spotd_buffer *buffer) {
+  buffer->data = NULL;
+  buffer->length = 0;
+  buffer->capacity = 0;
+}
+
+/**
+ * Append data to the end of a buffer, growing it if needed
+ *
+ * @param  buffer  The buffer to append to
+ * @param  data  The data to append
+ * @param  length  Length of the data in bytes
+ */
+void spotd_buffer_append(spotd_buffer *buffer, const void *data, size_t length) {
+  size_t capacity = buffer->capacity;
+
+  if (buffer->length + length > capacity) {
+    if (capacity == 0) {
+      capacity = 256;
+    }
+
+    while (buffer->length + length > capacity) {
+      capacity *= 2;
+    }
+
+    buffer->data = (char *) realloc(buffer->data, capacity);
+    buffer->capacity = capacity;
+  }
+
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+}
+
+/**
+ * Remove data from the start of a buffer
+ *
+ * @param  buffer  The buffer to consume data from
+ * @param  length  Number of bytes to remove
+ */
+void spotd_buffer_consume(spotd_buffer *buffer, size_t length) {
+  if (length >= buffer->length) {
+    buffer->length = 0;
+    return;
+  }
+
+  memmove(buffer->data, buffer->data + length, buffer->length - length);
+  buffer->length -= length;
+}
+
+/**
+ * Free the memory held by a buffer. The buffer can be reused after calling
+ * spotd_buffer_init() on it again.
+ *
+ * @param  buffer  The buffer to free
+ */
+void spotd_buffer_free(spotd_buffer *buffer) {
+  free(buffer->data);
+  spotd_buffer_init(buffer);
+}
@@ -0,0 +1,45 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#ifndef _SPOTD_BUFFER_H_
+#define _SPOTD_BUFFER_H_
+
+#include <stddef.h>
+
+/* --- Types --- */
+typedef struct spotd_buffer {
+  char *data;
+  size_t length;
+  size_t capacity;
+} spotd_buffer;
+
+/* --- Functions --- */
+void spotd_buffer_init(spotd_buffer *buffer);
+void spotd_buffer_append(spotd_buffer *buffer, const void *data, size_t length);
+void spotd_buffer_consume(spotd_buffer *buffer, size_t length);
+void spotd_buffer_free(spotd_buffer *buffer);
+
+#endif /* _SPOTD_BUFFER_H_ */
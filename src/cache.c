@@ -0,0 +1,244 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#include "cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+
+/* --- Constants --- */
+// Minimum number of hash buckets
+#define MIN_BUCKETS 16
+
+/* --- Function definitions --- */
+static uint32_t hash_key(const char *key);
+static spotd_cache_entry **find_entry(spotd_cache *cache, const char *key, uint32_t hash);
+static void remove_entry(spotd_cache *cache, spotd_cache_entry **slot);
+
+/* --- Functions --- */
+
+/**
+ * Initialize an empty cache
+ *
+ * @param  cache  The cache
+ * @param  capacity  Maximum number of entries. A cache with a capacity of 0
+ *   keeps nothing.
+ * @param  release  Called to free values that leave the cache, can be NULL
+ */
+void spotd_cache_init(spotd_cache *cache, size_t capacity, spotd_cache_release release) {
+  memset(cache, 0, sizeof(spotd_cache));
+
+  // One bucket per entry at most
+  cache->num_buckets = MIN_BUCKETS;
+  while (cache->num_buckets < capacity) {
+    cache->num_buckets *= 2;
+  }
+
+  cache->buckets = (spotd_cache_entry **) calloc(cache->num_buckets,
+                                                 sizeof(spotd_cache_entry *));
+  cache->capacity = capacity;
+  cache->release = release;
+  TAILQ_INIT(&cache->lru);
+}
+
+/**
+ * Make entries added from now on expire after a time. Expired entries are
+ * treated as missing, and released when they are looked up or evicted.
+ *
+ * @param  cache  The cache
+ * @param  ttl_ms  Time to live in milliseconds, 0 to keep entries until
+ *   they are evicted
+ */
+void spotd_cache_set_ttl(spotd_cache *cache, int64_t ttl_ms) {
+  cache->ttl_ms = ttl_ms;
+}
+
+/**
+ * Free all entries and the memory allocated for a cache
+ *
+ * @param  cache  The cache
+ */
+void spotd_cache_free(spotd_cache *cache) {
+  spotd_cache_clear(cache);
+  free(cache->buckets);
+  cache->buckets = NULL;
+}
+
+/**
+ * Look up a value, and mark it as the most recently used one
+ *
+ * @param  cache  The cache
+ * @param  key  The key
+ * @return  The value, or NULL if it is not in the cache or has expired. The
+ *   value still belongs to the cache.
+ */
+void *spotd_cache_get(spotd_cache *cache, const char *key) {
+  spotd_cache_entry **slot = find_entry(cache, key, hash_key(key));
+
+  if (*slot != NULL && (*slot)->expires_ms != 0 && monotonic_ms() >= (*slot)->expires_ms) {
+    remove_entry(cache, slot);
+  }
+
+  if (*slot == NULL) {
+    __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  __atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+
+  TAILQ_REMOVE(&cache->lru, *slot, lru);
+  TAILQ_INSERT_HEAD(&cache->lru, *slot, lru);
+
+  return (*slot)->value;
+}
+
+/**
+ * Add a value to the cache, replacing the value with the same key. The
+ * least recently used entry is evicted if the cache is full.
+ *
+ * @param  cache  The cache
+ * @param  key  The key, copied by the cache
+ * @param  value  The value. It belongs to the cache from now on.
+ */
+void spotd_cache_put(spotd_cache *cache, const char *key, void *value) {
+  spotd_cache_entry *entry;
+  spotd_cache_entry **slot;
+  uint32_t hash = hash_key(key);
+
+  if (cache->capacity == 0) {
+    if (cache->release != NULL) {
+      cache->release(value);
+    }
+    return;
+  }
+
+  slot = find_entry(cache, key, hash);
+
+  if (*slot != NULL) {
+    remove_entry(cache, slot);
+  } else if (cache->size == cache->capacity) {
+    entry = TAILQ_LAST(&cache->lru, spotd_cache_entry_list);
+    remove_entry(cache, find_entry(cache, entry->key, entry->hash));
+    __atomic_add_fetch(&cache->evictions, 1, __ATOMIC_RELAXED);
+  }
+
+  entry = (spotd_cache_entry *) malloc(sizeof(spotd_cache_entry));
+  entry->hash = hash;
+  entry->key = strdup(key);
+  entry->value = value;
+  entry->expires_ms = cache->ttl_ms > 0 ? monotonic_ms() + cache->ttl_ms : 0;
+  entry->next = cache->buckets[hash & (cache->num_buckets - 1)];
+  cache->buckets[hash & (cache->num_buckets - 1)] = entry;
+  TAILQ_INSERT_HEAD(&cache->lru, entry, lru);
+  __atomic_add_fetch(&cache->size, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Remove a value from the cache and release it
+ *
+ * @param  cache  The cache
+ * @param  key  The key of the value
+ */
+void spotd_cache_remove(spotd_cache *cache, const char *key) {
+  spotd_cache_entry **slot = find_entry(cache, key, hash_key(key));
+
+  if (*slot != NULL) {
+    remove_entry(cache, slot);
+  }
+}
+
+/**
+ * Remove and release all values
+ *
+ * @param  cache  The cache
+ */
+void spotd_cache_clear(spotd_cache *cache) {
+  spotd_cache_entry *entry;
+
+  while ((entry = TAILQ_FIRST(&cache->lru)) != NULL) {
+    remove_entry(cache, find_entry(cache, entry->key, entry->hash));
+  }
+}
+
+/* --- Helpers --- */
+
+/**
+ * Hash a key with 32-bit FNV-1a
+ *
+ * @param  key  The key
+ * @return  The hash of the key
+ */
+static uint32_t hash_key(const char *key) {
+  uint32_t hash = 2166136261u;
+
+  while (*key != '\0') {
+    hash ^= (unsigned char) *key++;
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+/**
+ * Find the bucket chain link pointing to an entry
+ *
+ * @param  cache  The cache
+ * @param  key  The key of the entry
+ * @param  hash  The hash of the key
+ * @return  The link pointing to the entry, or the NULL link at the end of
+ *   the chain if there is no such entry
+ */
+static spotd_cache_entry **find_entry(spotd_cache *cache, const char *key, uint32_t hash) {
+  spotd_cache_entry **slot = &cache->buckets[hash & (cache->num_buckets - 1)];
+
+  while (*slot != NULL && ((*slot)->hash != hash || strcmp((*slot)->key, key) != 0)) {
+    slot = &(*slot)->next;
+  }
+
+  return slot;
+}
+
+/**
+ * Unlink an entry, release its value and free it
+ *
+ * @param  cache  The cache
+ * @param  slot  The bucket chain link pointing to the entry
+ */
+static void remove_entry(spotd_cache *cache, spotd_cache_entry **slot) {
+  spotd_cache_entry *entry = *slot;
+
+  *slot = entry->next;
+  TAILQ_REMOVE(&cache->lru, entry, lru);
+  __atomic_sub_fetch(&cache->size, 1, __ATOMIC_RELAXED);
+
+  if (cache->release != NULL) {
+    cache->release(entry->value);
+  }
+
+  free(entry->key);
+  free(entry);
+}
@@ -0,0 +1,80 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#ifndef _SPOTD_CACHE_H_
+#define _SPOTD_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "queue.h"
+
+/*
+ * A cache from string keys to values, with least recently used eviction.
+ * Entries are found through a hash table and kept on a list in order of
+ * use, so lookups, insertions and evictions are O(1). Values are owned by
+ * the cache and freed with its release function when they are evicted or
+ * replaced. Optionally, entries expire a fixed time after they were added.
+ *
+ * A cache is not synchronized. Only the size and the counters may be read
+ * from other threads, with __atomic_load_n().
+ */
+
+/* --- Types --- */
+typedef void (*spotd_cache_release)(void *value);
+
+typedef struct spotd_cache_entry {
+  TAILQ_ENTRY(spotd_cache_entry) lru;  // Most recently used first
+  struct spotd_cache_entry *next;      // Next entry in the same bucket
+  uint32_t hash;
+  char *key;
+  void *value;
+  int64_t expires_ms;  // Monotonic time the entry expires at, 0 for never
+} spotd_cache_entry;
+
+typedef struct spotd_cache {
+  spotd_cache_entry **buckets;
+  size_t num_buckets;  // A power of two
+  size_t size;
+  size_t capacity;
+  TAILQ_HEAD(spotd_cache_entry_list, spotd_cache_entry) lru;
+  spotd_cache_release release;
+  int64_t ttl_ms;  // Time to live of new entries, 0 for no limit
+  // Counters
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+} spotd_cache;
+
+/* --- Functions --- */
+void spotd_cache_init(spotd_cache *cache, size_t capacity, spotd_cache_release release);
+void spotd_cache_set_ttl(spotd_cache *cache, int64_t ttl_ms);
+void spotd_cache_free(spotd_cache *cache);
+void *spotd_cache_get(spotd_cache *cache, const char *key);
+void spotd_cache_put(spotd_cache *cache, const char *key, void *value);
+void spotd_cache_remove(spotd_cache *cache, const char *key);
+void spotd_cache_clear(spotd_cache *cache);
+
+#endif /* _SPOTD_CACHE_H_ */
@@ -0,0 +1,483 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#include "handoff.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "buffer.h"
+
+/* --- Constants --- */
+#define HANDOFF_VERSION 1
+// Time to wait for the other process at every step of a handoff
+#define HANDOFF_TIMEOUT_MS 5000
+// Maximum size of a handoff message
+#define HANDOFF_MAX_MESSAGE 16384
+
+/* --- Function definitions --- */
+static int set_unix_address(struct sockaddr_un *address, const char *path);
+static void set_timeout(int socket_desc);
+static int receive_line(int socket_desc, char *line, size_t size);
+static spotd_player_state parse_player_state(const char *name);
+
+/* -- Functions --- */
+
+/**
+ * Listen for handoff requests from a new spotd process. A stale socket file
+ * left at the path is removed.
+ *
+ * @param  path  The path of the handoff socket
+ * @return  The listening socket, or -1 on error
+ */
+int spotd_handoff_listen(const char *path) {
+  struct sockaddr_un address;
+  int socket_desc;
+
+  if (set_unix_address(&address, path) < 0) {
+    return -1;
+  }
+
+  socket_desc = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (socket_desc == -1) {
+    perror("Could not create handoff socket");
+    return -1;
+  }
+
+  unlink(path);
+  if (bind(socket_desc, (struct sockaddr *) &address, sizeof(address)) < 0 ||
+      listen(socket_desc, 1) < 0) {
+    perror("Handoff socket bind failed. Error");
+    close(socket_desc);
+    return -1;
+  }
+
+  return socket_desc;
+}
+
+/**
+ * Connect to the handoff socket of a running spotd process
+ *
+ * @param  path  The path of the handoff socket
+ * @return  The connected socket, or -1 if no process is listening
+ */
+int spotd_handoff_connect(const char *path) {
+  struct sockaddr_un address;
+  int socket_desc;
+
+  if (set_unix_address(&address, path) < 0) {
+    return -1;
+  }
+
+  socket_desc = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (socket_desc == -1) {
+    perror("Could not create handoff socket");
+    return -1;
+  }
+
+  if (connect(socket_desc, (struct sockaddr *) &address, sizeof(address)) < 0) {
+    close(socket_desc);
+    return -1;
+  }
+
+  set_timeout(socket_desc);
+
+  return socket_desc;
+}
+
+/**
+ * Wait for the handoff request of a connected process
+ *
+ * @param  socket_desc  The accepted handoff connection
+ * @return  SPOTD_ERROR_OK if a handoff was requested
+ */
+spotd_error spotd_handoff_read_request(int socket_desc) {
+  char line[64];
+  int version;
+
+  set_timeout(socket_desc);
+
+  if (receive_line(socket_desc, line, sizeof(line)) < 0 ||
+      sscanf(line, "HANDOFF %d", &version) != 1 || version != HANDOFF_VERSION) {
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  return SPOTD_ERROR_OK;
+}
+
+/**
+ * Send the listening sockets and the player state to the new process
+ *
+ * @param  socket_desc  The handoff connection
+ * @param  state  The player state
+ * @param  sockets  The listening sockets
+ * @param  num_sockets  Number of listening sockets
+ * @return  returns a spotd_error
+ */
+spotd_error spotd_handoff_send(int socket_desc, const spotd_handoff_state *state,
+                               const spotd_server_socket *sockets, int num_sockets) {
+  spotd_buffer message;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(sizeof(int) * SPOTD_SERVER_MAX_SOCKETS)];
+  char line[32 + SPOTD_LINK_MAX];
+  ssize_t sent;
+  int i, length;
+
+  if (num_sockets > SPOTD_SERVER_MAX_SOCKETS) {
+    num_sockets = SPOTD_SERVER_MAX_SOCKETS;
+  }
+
+  spotd_buffer_init(&message);
+  spotd_handoff_format_state(&message, state);
+
+  for (i = 0; i < num_sockets; i++) {
+    length = snprintf(line, sizeof(line), "SOCKET %d %d %d\n", sockets[i].protocol,
+                      sockets[i].is_unix, sockets[i].worker);
+    spotd_buffer_append(&message, line, length);
+  }
+
+  iov.iov_base = message.data;
+  iov.iov_len = message.length;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  if (num_sockets > 0) {
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_sockets);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_sockets);
+
+    for (i = 0; i < num_sockets; i++) {
+      memcpy(CMSG_DATA(cmsg) + i * sizeof(int), &sockets[i].socket_desc, sizeof(int));
+    }
+  }
+
+  sent = sendmsg(socket_desc, &msg, MSG_NOSIGNAL);
+  spotd_buffer_free(&message);
+
+  if (sent < 0) {
+    perror("Failed sending handoff state");
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  return SPOTD_ERROR_OK;
+}
+
+/**
+ * Wait for the new process to confirm that it has taken over
+ *
+ * @param  socket_desc  The handoff connection
+ * @return  SPOTD_ERROR_OK if the new process is serving on the sockets
+ */
+spotd_error spotd_handoff_wait_ack(int socket_desc) {
+  char line[16];
+
+  if (receive_line(socket_desc, line, sizeof(line)) < 0 || strcmp(line, "OK") != 0) {
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  return SPOTD_ERROR_OK;
+}
+
+/**
+ * Ask the running process to hand off, and receive its listening sockets
+ * and player state
+ *
+ * @param  socket_desc  The connection from spotd_handoff_connect()
+ * @param  state  Receives the player state
+ * @param  sockets  Receives the listening sockets, SPOTD_SERVER_MAX_SOCKETS
+ *   entries
+ * @param  num_sockets  Receives the number of listening sockets
+ * @return  returns a spotd_error
+ */
+spotd_error spotd_handoff_request(int socket_desc, spotd_handoff_state *state,
+                                  spotd_server_socket *sockets, int *num_sockets) {
+  char request[32];
+  char message[HANDOFF_MAX_MESSAGE + 1];
+  char control[CMSG_SPACE(sizeof(int) * SPOTD_SERVER_MAX_SOCKETS)];
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  ssize_t received;
+  int i, length;
+
+  *num_sockets = 0;
+
+  length = snprintf(request, sizeof(request), "HANDOFF %d\n", HANDOFF_VERSION);
+  if (send(socket_desc, request, length, MSG_NOSIGNAL) < 0) {
+    perror("Failed requesting a handoff");
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  iov.iov_base = message;
+  iov.iov_len = HANDOFF_MAX_MESSAGE;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  received = recvmsg(socket_desc, &msg, 0);
+  if (received <= 0) {
+    fprintf(stderr, "No handoff state received\n");
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      *num_sockets = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+      for (i = 0; i < *num_sockets; i++) {
+        memcpy(&sockets[i].socket_desc, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      }
+    }
+  }
+
+  message[received] = '\0';
+
+  if ((msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+      spotd_handoff_parse_state(message, state, sockets, *num_sockets) != SPOTD_ERROR_OK) {
+    fprintf(stderr, "Invalid handoff state\n");
+
+    for (i = 0; i < *num_sockets; i++) {
+      close(sockets[i].socket_desc);
+    }
+    *num_sockets = 0;
+
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  return SPOTD_ERROR_OK;
+}
+
+/**
+ * Tell the old process that the new server is running on its sockets
+ *
+ * @param  socket_desc  The handoff connection
+ * @return  returns a spotd_error
+ */
+spotd_error spotd_handoff_ack(int socket_desc) {
+  if (send(socket_desc, "OK\n", 3, MSG_NOSIGNAL) < 0) {
+    perror("Failed acknowledging the handoff");
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  return SPOTD_ERROR_OK;
+}
+
+/**
+ * Write the player state as the text lines of a handoff message
+ *
+ * @param  out  The buffer to write to
+ * @param  state  The player state
+ */
+void spotd_handoff_format_state(spotd_buffer *out, const spotd_handoff_state *state) {
+  char line[32 + SPOTD_LINK_MAX];
+  int i, length;
+
+  length = snprintf(line, sizeof(line), "SPOTD-HANDOFF %d\nSTATE %s\nPOSITION %d\nVOLUME %d\n",
+                    HANDOFF_VERSION, spotd_player_state_name(state->state),
+                    state->position_ms, state->volume);
+  spotd_buffer_append(out, line, length);
+
+  if (state->track_link[0] != '\0') {
+    length = snprintf(line, sizeof(line), "TRACK %s\n", state->track_link);
+    spotd_buffer_append(out, line, length);
+  }
+
+  if (state->play_link[0] != '\0') {
+    length = snprintf(line, sizeof(line), "PLAY %s\n", state->play_link);
+    spotd_buffer_append(out, line, length);
+  }
+
+  for (i = 0; i < state->queue_length; i++) {
+    length = snprintf(line, sizeof(line), "QUEUE %s\n", state->queue[i]);
+    spotd_buffer_append(out, line, length);
+  }
+
+  if (state->playlist_link[0] != '\0') {
+    length = snprintf(line, sizeof(line), "PLAYLIST %d %s\n", state->playlist_cursor,
+                      state->playlist_link);
+    spotd_buffer_append(out, line, length);
+  }
+}
+
+/**
+ * Parse the text part of a handoff message
+ *
+ * @param  message  The message, modified while parsing
+ * @param  state  Receives the player state
+ * @param  sockets  The received sockets, their descriptions are filled in.
+ *   Can be NULL if num_sockets is 0.
+ * @param  num_sockets  Number of received sockets
+ * @return  returns a spotd_error
+ */
+spotd_error spotd_handoff_parse_state(char *message, spotd_handoff_state *state,
+                                      spotd_server_socket *sockets, int num_sockets) {
+  char *line, *value, *saveptr;
+  int version = 0, num_described = 0, protocol;
+
+  memset(state, 0, sizeof(*state));
+  state->volume = 100;
+
+  for (line = strtok_r(message, "\n", &saveptr); line != NULL;
+       line = strtok_r(NULL, "\n", &saveptr)) {
+    value = strchr(line, ' ');
+    if (value == NULL) {
+      continue;
+    }
+    *value++ = '\0';
+
+    if (strcmp(line, "SPOTD-HANDOFF") == 0) {
+      version = atoi(value);
+    } else if (strcmp(line, "STATE") == 0) {
+      state->state = parse_player_state(value);
+    } else if (strcmp(line, "POSITION") == 0) {
+      state->position_ms = atoi(value);
+    } else if (strcmp(line, "VOLUME") == 0) {
+      state->volume = atoi(value);
+    } else if (strcmp(line, "TRACK") == 0) {
+      snprintf(state->track_link, SPOTD_LINK_MAX, "%s", value);
+    } else if (strcmp(line, "PLAY") == 0) {
+      snprintf(state->play_link, SPOTD_LINK_MAX, "%s", value);
+    } else if (strcmp(line, "QUEUE") == 0 && state->queue_length < SPOTD_QUEUE_MAX) {
+      snprintf(state->queue[state->queue_length++], SPOTD_LINK_MAX, "%s", value);
+    } else if (strcmp(line, "PLAYLIST") == 0) {
+      if (sscanf(value, "%d %127s", &state->playlist_cursor, state->playlist_link) != 2) {
+        state->playlist_link[0] = '\0';
+      }
+    } else if (strcmp(line, "SOCKET") == 0 && num_described < num_sockets) {
+      if (sscanf(value, "%d %d %d", &protocol, &sockets[num_described].is_unix,
+                 &sockets[num_described].worker) != 3) {
+        return SPOTD_ERROR_OTHER_PERMANENT;
+      }
+      sockets[num_described++].protocol = (spotd_protocol) protocol;
+    }
+  }
+
+  if (version != HANDOFF_VERSION || num_described != num_sockets) {
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  return SPOTD_ERROR_OK;
+}
+
+/**
+ * Fill in the address of a Unix domain socket
+ *
+ * @param  address  The address to fill in
+ * @param  path  The path of the socket
+ * @return  0 on success, -1 if the path is too long
+ */
+static int set_unix_address(struct sockaddr_un *address, const char *path) {
+  if (strlen(path) >= sizeof(address->sun_path)) {
+    fprintf(stderr, "Handoff socket path too long: %s\n", path);
+    return -1;
+  }
+
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  strcpy(address->sun_path, path);
+
+  return 0;
+}
+
+/**
+ * Limit how long receiving from a handoff connection may block
+ *
+ * @param  socket_desc  The handoff connection
+ */
+static void set_timeout(int socket_desc) {
+  struct timeval timeout;
+
+  timeout.tv_sec = HANDOFF_TIMEOUT_MS / 1000;
+  timeout.tv_usec = (HANDOFF_TIMEOUT_MS % 1000) * 1000;
+
+  setsockopt(socket_desc, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+/**
+ * Receive a single message, and strip the trailing newline
+ *
+ * @param  socket_desc  The handoff connection
+ * @param  line  Receives the message
+ * @param  size  Size of line
+ * @return  The length of the message, or -1 on error or timeout
+ */
+static int receive_line(int socket_desc, char *line, size_t size) {
+  ssize_t received;
+
+  do {
+    received = recv(socket_desc, line, size - 1, 0);
+  } while (received < 0 && errno == EINTR);
+
+  if (received <= 0) {
+    return -1;
+  }
+
+  line[received] = '\0';
+
+  if (line[received - 1] == '\n') {
+    line[--received] = '\0';
+  }
+
+  return (int) received;
+}
+
+/**
+ * Get the player state with the given name
+ *
+ * @param  name  The state name, see spotd_player_state_name()
+ * @return  The player state, SPOTD_PLAYER_STOPPED for unknown names
+ */
+static spotd_player_state parse_player_state(const char *name) {
+  static const spotd_player_state states[] = {
+    SPOTD_PLAYER_LOADING, SPOTD_PLAYER_PLAYING, SPOTD_PLAYER_PAUSED
+  };
+  size_t i;
+
+  for (i = 0; i < sizeof(states) / sizeof(states[0]); i++) {
+    if (strcmp(name, spotd_player_state_name(states[i])) == 0) {
+      return states[i];
+    }
+  }
+
+  return SPOTD_PLAYER_STOPPED;
+}
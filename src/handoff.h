@@ -0,0 +1,86 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#ifndef _SPOTD_HANDOFF_H_
+#define _SPOTD_HANDOFF_H_
+
+#include "types.h"
+#include "server.h"
+#include "buffer.h"
+
+/*
+ * Hot restart. A new spotd process started with the same handoff socket path
+ * as a running one logs in to Spotify, then connects to it and asks for a
+ * handoff at once, as every step is only waited for a few seconds. The
+ * running process pauses playback and replies with a single message holding
+ * its listening sockets (SCM_RIGHTS) and its player state as text lines:
+ *
+ *   SPOTD-HANDOFF 1
+ *   STATE PLAYING
+ *   POSITION 81234
+ *   VOLUME 80
+ *   TRACK spotify:track:...
+ *   PLAY spotify:track:...        (a PLAY not executed yet, optional)
+ *   QUEUE spotify:track:...       (once per play queue entry, in order)
+ *   PLAYLIST <cursor> spotify:...  (the playlist being played, optional)
+ *   SOCKET <protocol> <is_unix> <worker>  (once per passed socket, in order)
+ *
+ * Unknown lines are ignored, so that the state can grow between versions.
+ * The same text, without SOCKET lines, is kept in the state file, see
+ * statefile.h.
+ * The new process starts its server on the passed sockets and acknowledges
+ * with "OK", and the old process exits. Without the acknowledgement the old
+ * process resumes playback and keeps running.
+ */
+
+/* --- Types --- */
+typedef struct spotd_handoff_state {
+  spotd_player_state state;
+  int position_ms;
+  int volume;
+  char track_link[SPOTD_LINK_MAX];
+  char play_link[SPOTD_LINK_MAX];  // Track of a PLAY not executed yet, or empty
+  int queue_length;
+  char queue[SPOTD_QUEUE_MAX][SPOTD_LINK_MAX];
+  char playlist_link[SPOTD_LINK_MAX];  // The playlist being played, or empty
+  int playlist_cursor;                 // Index of its next track
+} spotd_handoff_state;
+
+/* --- Functions --- */
+int spotd_handoff_listen(const char *path);
+int spotd_handoff_connect(const char *path);
+spotd_error spotd_handoff_read_request(int socket_desc);
+spotd_error spotd_handoff_send(int socket_desc, const spotd_handoff_state *state,
+                               const spotd_server_socket *sockets, int num_sockets);
+spotd_error spotd_handoff_wait_ack(int socket_desc);
+spotd_error spotd_handoff_request(int socket_desc, spotd_handoff_state *state,
+                                  spotd_server_socket *sockets, int *num_sockets);
+spotd_error spotd_handoff_ack(int socket_desc);
+void spotd_handoff_format_state(spotd_buffer *out, const spotd_handoff_state *state);
+spotd_error spotd_handoff_parse_state(char *message, spotd_handoff_state *state,
+                                      spotd_server_socket *sockets, int num_sockets);
+
+#endif /* _SPOTD_HANDOFF_H_ */
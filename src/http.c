@@ -0,0 +1,446 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#define _GNU_SOURCE
+
+#include "http.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+/* --- Function definitions --- */
+static const char *find_line_end(const char *data, const char *end);
+static int parse_request_line(const char *line, const char *line_end,
+                              spotd_http_request *request);
+static int copy_token(const char *start, const char *end, char *out, size_t out_size);
+static const char *reason_phrase(int status_code);
+static int hex_value(char c);
+
+/* -- Functions --- */
+
+/**
+ * Parse an HTTP request from the start of the received data. Requests are
+ * parsed incrementally: if the data does not yet hold a complete request,
+ * nothing is consumed and the caller should wait for more data.
+ *
+ * @param  data  The received data
+ * @param  length  Length of the received data
+ * @param  request  Receives the parsed request. The body points into data.
+ * @return  The length of the complete request in bytes, 0 if the request is
+ *   incomplete, or -1 if the request is malformed or too large
+ */
+int spotd_http_parse_request(const char *data, size_t length, spotd_http_request *request) {
+  const char *header_end, *line, *line_end, *colon, *value, *end;
+  size_t header_length, content_length = 0;
+
+  header_end = memmem(data, length, "\r\n\r\n", 4);
+
+  if (header_end == NULL) {
+    return length > SPOTD_HTTP_MAX_HEADER ? -1 : 0;
+  }
+
+  header_length = header_end - data + 4;
+
+  if (header_length > SPOTD_HTTP_MAX_HEADER) {
+    return -1;
+  }
+
+  memset(request, 0, sizeof(spotd_http_request));
+  end = header_end + 2;
+
+  // The request line
+  line_end = find_line_end(data, end);
+
+  if (parse_request_line(data, line_end, request) < 0) {
+    return -1;
+  }
+
+  // The headers
+  for (line = line_end + 2; line < end; line = line_end + 2) {
+    line_end = find_line_end(line, end);
+    colon = memchr(line, ':', line_end - line);
+
+    if (colon == NULL) {
+      return -1;
+    }
+
+    // Skip leading whitespace of the value
+    for (value = colon + 1; value < line_end && (*value == ' ' || *value == '\t'); value++);
+
+    if (colon - line == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+      content_length = strtoul(value, NULL, 10);
+    } else if (colon - line == 10 && strncasecmp(line, "Connection", 10) == 0) {
+      if (line_end - value >= 5 && strncasecmp(value, "close", 5) == 0) {
+        request->keep_alive = 0;
+      } else if (line_end - value >= 10 && strncasecmp(value, "keep-alive", 10) == 0) {
+        request->keep_alive = 1;
+      }
+    } else if (colon - line == 7 && strncasecmp(line, "Upgrade", 7) == 0) {
+      request->upgrade_websocket = line_end - value == 9 && strncasecmp(value, "websocket", 9) == 0;
+    } else if (colon - line == 17 && strncasecmp(line, "Sec-WebSocket-Key", 17) == 0) {
+      if (copy_token(value, line_end, request->websocket_key,
+                     sizeof(request->websocket_key)) < 0) {
+        return -1;
+      }
+    } else if (colon - line == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+      // Chunked request bodies are not supported
+      return -1;
+    }
+  }
+
+  if (content_length > SPOTD_HTTP_MAX_BODY) {
+    return -1;
+  }
+
+  if (length < header_length + content_length) {
+    return 0;
+  }
+
+  request->body = data + header_length;
+  request->body_length = content_length;
+
+  return (int) (header_length + content_length);
+}
+
+/**
+ * Write the status line and headers of an HTTP response with a JSON body
+ *
+ * @param  out  The buffer to write the headers to
+ * @param  status_code  The HTTP status code
+ * @param  body_length  Length of the body that follows the headers
+ * @param  keep_alive  Non-zero if the connection is kept open
+ */
+void spotd_http_write_header(spotd_buffer *out, int status_code, size_t body_length,
+                             int keep_alive) {
+  char header[256];
+  int header_length;
+
+  header_length = snprintf(header, sizeof(header),
+      "HTTP/1.1 %d %s\r\n"
+      "Content-Type: application/json\r\n"
+      "Content-Length: %zu\r\n"
+      "Connection: %s\r\n"
+      "\r\n",
+      status_code, reason_phrase(status_code), body_length,
+      keep_alive ? "keep-alive" : "close");
+
+  spotd_buffer_append(out, header, header_length);
+}
+
+/**
+ * Write a complete HTTP response with a JSON body
+ *
+ * @param  out  The buffer to write the response to
+ * @param  status_code  The HTTP status code
+ * @param  body  The JSON body
+ * @param  body_length  Length of the body
+ * @param  keep_alive  Non-zero if the connection is kept open
+ */
+void spotd_http_write_response(spotd_buffer *out, int status_code, const char *body,
+                               size_t body_length, int keep_alive) {
+  spotd_http_write_header(out, status_code, body_length, keep_alive);
+  spotd_buffer_append(out, body, body_length);
+}
+
+/**
+ * Append a string to a buffer as a quoted and escaped JSON string
+ *
+ * @param  out  The buffer to append to
+ * @param  str  The string to append
+ */
+void spotd_json_append_string(spotd_buffer *out, const char *str) {
+  char escaped[8];
+  const char *run;
+
+  spotd_buffer_append(out, "\"", 1);
+
+  for (run = str; *str != '\0'; str++) {
+    if (*str != '"' && *str != '\\' && (unsigned char) *str >= 0x20) {
+      continue;
+    }
+
+    // Flush the run of characters that need no escaping
+    spotd_buffer_append(out, run, str - run);
+    run = str + 1;
+
+    if (*str == '"' || *str == '\\') {
+      escaped[0] = '\\';
+      escaped[1] = *str;
+      spotd_buffer_append(out, escaped, 2);
+    } else {
+      snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char) *str);
+      spotd_buffer_append(out, escaped, 6);
+    }
+  }
+
+  spotd_buffer_append(out, run, str - run);
+  spotd_buffer_append(out, "\"", 1);
+}
+
+/**
+ * Get the value of a string member of a flat JSON object. This is not a full
+ * JSON parser, it is meant for the small request bodies of the HTTP API.
+ *
+ * @param  json  The JSON text, does not need to be NUL terminated
+ * @param  length  Length of the JSON text
+ * @param  key  The member name to look for
+ * @param  value  Receives the unescaped value
+ * @param  value_size  Size of the value buffer
+ * @return  0 on success, -1 if the member was not found or does not fit
+ */
+int spotd_json_get_string(const char *json, size_t length, const char *key,
+                          char *value, size_t value_size) {
+  const char *p = json, *end = json + length;
+  size_t key_length = strlen(key), n;
+
+  while (p < end) {
+    p = memchr(p, '"', end - p);
+
+    if (p == NULL || (size_t) (end - p) < key_length + 2) {
+      return -1;
+    }
+
+    if (strncmp(p + 1, key, key_length) != 0 || p[key_length + 1] != '"') {
+      p++;
+      continue;
+    }
+
+    // Found the key, skip to the value
+    for (p += key_length + 2; p < end && isspace((unsigned char) *p); p++);
+    if (p == end || *p != ':') {
+      continue;
+    }
+    for (p++; p < end && isspace((unsigned char) *p); p++);
+    if (p == end || *p != '"') {
+      return -1;
+    }
+
+    // Copy the value, removing escapes
+    for (p++, n = 0; p < end && *p != '"'; p++) {
+      if (*p == '\\' && p + 1 < end) {
+        p++;
+      }
+      if (n + 1 >= value_size) {
+        return -1;
+      }
+      value[n++] = *p;
+    }
+
+    if (p == end) {
+      return -1;
+    }
+
+    value[n] = '\0';
+    return 0;
+  }
+
+  return -1;
+}
+
+/**
+ * Get the URL decoded value of a query string parameter
+ *
+ * @param  query  The query string, without the leading question mark
+ * @param  key  The parameter name
+ * @param  value  Receives the decoded value
+ * @param  value_size  Size of the value buffer
+ * @return  0 on success, -1 if the parameter was not found or does not fit
+ */
+int spotd_http_get_query_param(const char *query, const char *key,
+                               char *value, size_t value_size) {
+  size_t key_length = strlen(key), n;
+  const char *p = query;
+
+  while (*p != '\0') {
+    if (strncmp(p, key, key_length) == 0 && p[key_length] == '=') {
+      for (p += key_length + 1, n = 0; *p != '\0' && *p != '&'; p++) {
+        if (n + 1 >= value_size) {
+          return -1;
+        }
+
+        if (*p == '%' && hex_value(p[1]) >= 0 && hex_value(p[2]) >= 0) {
+          value[n++] = (char) (hex_value(p[1]) * 16 + hex_value(p[2]));
+          p += 2;
+        } else if (*p == '+') {
+          value[n++] = ' ';
+        } else {
+          value[n++] = *p;
+        }
+      }
+
+      value[n] = '\0';
+      return 0;
+    }
+
+    // Skip to the next parameter
+    p = strchr(p, '&');
+    if (p == NULL) {
+      break;
+    }
+    p++;
+  }
+
+  return -1;
+}
+
+/**
+ * Find the end of a header line
+ *
+ * @param  data  Start of the line
+ * @param  end  End of the header block
+ * @return  Pointer to the CR of the terminating CRLF
+ */
+static const char *find_line_end(const char *data, const char *end) {
+  const char *line_end = memmem(data, end - data, "\r\n", 2);
+
+  return line_end != NULL ? line_end : end;
+}
+
+/**
+ * Parse the request line: the method, the target and the protocol version
+ *
+ * @param  line  Start of the request line
+ * @param  line_end  End of the request line
+ * @param  request  Receives the method, path, query and keep-alive default
+ * @return  0 on success, -1 if the line is malformed
+ */
+static int parse_request_line(const char *line, const char *line_end,
+                              spotd_http_request *request) {
+  const char *target, *target_end, *version, *question;
+
+  target = memchr(line, ' ', line_end - line);
+  if (target == NULL) {
+    return -1;
+  }
+
+  if (target - line == 3 && strncmp(line, "GET", 3) == 0) {
+    request->method = SPOTD_HTTP_GET;
+  } else if (target - line == 4 && strncmp(line, "POST", 4) == 0) {
+    request->method = SPOTD_HTTP_POST;
+  } else {
+    request->method = SPOTD_HTTP_OTHER;
+  }
+
+  target++;
+  target_end = memchr(target, ' ', line_end - target);
+  if (target_end == NULL) {
+    return -1;
+  }
+
+  version = target_end + 1;
+  if (line_end - version != 8 || strncmp(version, "HTTP/1.", 7) != 0) {
+    return -1;
+  }
+
+  // HTTP/1.1 connections are persistent by default, HTTP/1.0 ones are not
+  request->keep_alive = version[7] == '1';
+
+  question = memchr(target, '?', target_end - target);
+  if (question != NULL) {
+    if (copy_token(question + 1, target_end, request->query, sizeof(request->query)) < 0) {
+      return -1;
+    }
+    target_end = question;
+  }
+
+  return copy_token(target, target_end, request->path, sizeof(request->path));
+}
+
+/**
+ * Copy a part of the request line to a NUL terminated buffer
+ *
+ * @param  start  Start of the token
+ * @param  end  End of the token
+ * @param  out  The output buffer
+ * @param  out_size  Size of the output buffer
+ * @return  0 on success, -1 if the token does not fit
+ */
+static int copy_token(const char *start, const char *end, char *out, size_t out_size) {
+  if ((size_t) (end - start) >= out_size) {
+    return -1;
+  }
+
+  memcpy(out, start, end - start);
+  out[end - start] = '\0';
+
+  return 0;
+}
+
+/**
+ * Get the reason phrase of an HTTP status code
+ *
+ * @param  status_code  The status code
+ * @return  The reason phrase
+ */
+static const char *reason_phrase(int status_code) {
+  switch (status_code) {
+  case 200:
+    return "OK";
+  case 202:
+    return "Accepted";
+  case 400:
+    return "Bad Request";
+  case 404:
+    return "Not Found";
+  case 405:
+    return "Method Not Allowed";
+  case 408:
+    return "Request Timeout";
+  case 409:
+    return "Conflict";
+  case 426:
+    return "Upgrade Required";
+  case 429:
+    return "Too Many Requests";
+  case 503:
+    return "Service Unavailable";
+  case 504:
+    return "Gateway Timeout";
+  default:
+    return "Internal Server Error";
+  }
+}
+
+/**
+ * Get the value of a hexadecimal digit
+ *
+ * @param  c  The digit
+ * @return  The value of the digit, or -1 if c is not a hexadecimal digit
+ */
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  } else if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  } else if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+
+  return -1;
+}
@@ -0,0 +1,73 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#ifndef _SPOTD_HTTP_H_
+#define _SPOTD_HTTP_H_
+
+#include <stddef.h>
+#include "buffer.h"
+
+/* --- Constants --- */
+// Maximum size of the request line and headers
+#define SPOTD_HTTP_MAX_HEADER 8192
+// Maximum size of a request body
+#define SPOTD_HTTP_MAX_BODY 65536
+// Maximum length of a request path
+#define SPOTD_HTTP_MAX_PATH 256
+// Maximum length of a Sec-WebSocket-Key header
+#define SPOTD_HTTP_MAX_WEBSOCKET_KEY 64
+
+/* --- Types --- */
+typedef enum spotd_http_method {
+  SPOTD_HTTP_OTHER = 0,
+  SPOTD_HTTP_GET   = 1,
+  SPOTD_HTTP_POST  = 2
+} spotd_http_method;
+
+typedef struct spotd_http_request {
+  spotd_http_method method;
+  char path[SPOTD_HTTP_MAX_PATH];
+  char query[SPOTD_HTTP_MAX_PATH];
+  int keep_alive;
+  int upgrade_websocket;  // Non-zero if the client asked for a WebSocket upgrade
+  char websocket_key[SPOTD_HTTP_MAX_WEBSOCKET_KEY];
+  const char *body;   // Points into the parsed data, not NUL terminated
+  size_t body_length;
+} spotd_http_request;
+
+/* --- Functions --- */
+int spotd_http_parse_request(const char *data, size_t length, spotd_http_request *request);
+void spotd_http_write_header(spotd_buffer *out, int status_code, size_t body_length,
+                             int keep_alive);
+void spotd_http_write_response(spotd_buffer *out, int status_code, const char *body,
+                               size_t body_length, int keep_alive);
+void spotd_json_append_string(spotd_buffer *out, const char *str);
+int spotd_json_get_string(const char *json, size_t length, const char *key,
+                          char *value, size_t value_size);
+int spotd_http_get_query_param(const char *query, const char *key,
+                               char *value, size_t value_size);
+
+#endif /* _SPOTD_HTTP_H_ */
@@ -30,14 +30,106 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/time.h>
 #include <signal.h>
+#include <grp.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <ctype.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 
 #include <libspotify/api.h>
 
 #include "types.h"
 #include "audio.h"
 #include "server.h"
+#include "handoff.h"
+#include "statefile.h"
+#include "cache.h"
+#include "util.h"
+
+/* --- Constants --- */
+// Interval of position events pushed to subscribers, in milliseconds
+#define POSITION_TICK_MS 1000
+// Maximum number of events handled per main loop iteration
+#define MAIN_LOOP_MAX_EVENTS 8
+// Number of play queue entries whose metadata is loaded ahead of time
+#define QUEUE_PREFETCH_TRACKS 3
+// Time left of the current track when the audio of the next queued track
+// starts loading, in milliseconds
+#define QUEUE_PREFETCH_AUDIO_MS 20000
+// Number of playlist tracks from the cursor on whose metadata is loaded
+#define PLAYLIST_WINDOW 16
+// Number of matches of a query fetched from Spotify and cached. Pages of
+// search results are taken from these.
+#define SEARCH_MAX_TRACKS 100
+// Maximum number of queries whose results are cached
+#define SEARCH_CACHE_SIZE 256
+// Time search results are cached for, in milliseconds
+#define SEARCH_CACHE_TTL_MS (10 * 60 * 1000)
+// Interval of state file updates while a track plays, in milliseconds
+#define STATE_SAVE_INTERVAL_MS 1000
+// Maximum number of tracks waiting to be loaded into the libspotify cache
+#define WARM_MAX_TRACKS 10000
+// Interval between tracks loaded into the libspotify cache, in milliseconds
+#define WARM_INTERVAL_MS 10000
+// Interval the main loop checks whether a starting track is heard yet, in
+// milliseconds
+#define FIRST_AUDIO_POLL_MS 20
+// Seconds of audio buffered for the zone furthest ahead
+#define ZONE_BUFFER_SECONDS 1
+// Seconds of audio a zone may fall behind before it loses audio, rather
+// than holding up the other zones
+#define ZONE_MAX_BACKLOG_SECONDS 3
+
+/* --- Types --- */
+// An entry of the play queue
+typedef struct queue_entry {
+  TAILQ_ENTRY(queue_entry) link;
+  char track_link[SPOTD_LINK_MAX];
+  sp_track *track;       // The track, NULL until its metadata is prefetched
+  int audio_prefetched;  // Non-zero once its audio has started loading
+} queue_entry_t;
+
+// An output zone: an audio device that plays the audio of the shared player
+typedef struct zone {
+  audio_fifo_t fifo;
+  int volume;               // Applied on top of the player volume, protected by fifo.mutex
+  uint64_t dropped_frames;  // Protected by fifo.mutex
+} zone_t;
+
+// A track waiting to be loaded into the libspotify cache
+typedef struct warm_entry {
+  TAILQ_ENTRY(warm_entry) link;
+  char track_link[SPOTD_LINK_MAX];
+} warm_entry_t;
+
+// The results of a search, cached by query
+typedef struct search_result {
+  int total;                  // Number of matches that can be paged through
+  int num_tracks;
+  spotd_search_track *tracks;
+} search_result_t;
+
+// A client waiting for the results of a search
+typedef struct search_waiter {
+  TAILQ_ENTRY(search_waiter) link;
+  spotd_command_origin origin;
+  int offset;
+  int limit;
+} search_waiter_t;
+
+// A search in progress, shared by all clients asking for the same query
+typedef struct pending_search {
+  TAILQ_ENTRY(pending_search) link;
+  char *query;  // The normalized query, the key of its results in the cache
+  sp_search *search;
+  TAILQ_HEAD(, search_waiter) waiters;
+} pending_search_t;
 
 /* --- Data --- */
 // The application key is specific to each project, and allows Spotify
@@ -46,16 +138,19 @@ extern const uint8_t g_appkey[];
 // The size of the application key.
 extern const size_t g_appkey_size;
 
-// The output queue for audo data
-static audio_fifo_t g_audiofifo;
-// Synchronization mutex for the main thread
-static pthread_mutex_t g_notify_mutex;
-// Synchronization condition variable for the main thread
-static pthread_cond_t g_notify_cond;
-// Synchronization variable telling the main thread to process events
-static int g_notify_do;
-// Non-zero when a track has ended and a new one has not been started yet
-static int g_playback_done;
+// The output zones, each with its own queue for audio data and output
+// thread
+static zone_t g_zones[SPOTD_MAX_ZONES];
+static int g_num_zones;
+// Synchronization mutex for the command queues and g_handoff_client
+static pthread_mutex_t g_command_mutex;
+// Event file descriptor telling the main loop to process libspotify events
+static int g_notify_fd;
+// Event file descriptor telling the main loop that the track has ended
+static int g_end_of_track_fd;
+// Event file descriptor telling the main loop that commands or a handoff
+// request are waiting
+static int g_command_fd;
 // The global session handle
 static sp_session *g_sess;
 // The session playlist container
@@ -64,18 +159,301 @@ static sp_playlistcontainer *g_playlistcontainer;
 static sp_track *g_current_track;
 // Handle to the queued track
 static sp_track *g_queued_track;
-// Handle to the command to be executed
-static spotd_command *g_command;
-
-// Set of signals to handle with handle_signals()
+// The command that queued g_queued_track
+static spotd_command_origin g_queued_origin;
+// Position to start g_queued_track at, in milliseconds
+static int g_queued_position_ms;
+// Non-zero if a track handed over paused is paused as soon as it starts
+static int g_resume_paused;
+// Non-zero once logged in to Spotify
+static int g_logged_in;
+// Credentials tried when logging in with the stored ones fails, NULL if
+// there are none
+static const char *g_login_username;
+static const char *g_login_password;
+// Commands waiting to be executed, protected by g_command_mutex
+static TAILQ_HEAD(command_queue, spotd_command) g_commands;
+// Commands executed before g_commands: STOP and PAUSE
+static struct command_queue g_priority_commands;
+// Tracks to play when the current one ends, changed by the main thread only
+static TAILQ_HEAD(play_queue, queue_entry) g_play_queue;
+// Number of entries in g_play_queue
+static int g_play_queue_length;
+// Synchronization mutex for changes to g_play_queue, which clients read
+static pthread_mutex_t g_play_queue_mutex;
+// Tracks by link, each holding a reference so that its metadata stays loaded
+static spotd_cache g_track_cache;
+// Search results by normalized query
+static spotd_cache g_search_cache;
+// Searches waiting for Spotify to answer
+static TAILQ_HEAD(, pending_search) g_pending_searches;
+// Tracks waiting to be loaded into the libspotify cache, see warm_cache()
+static TAILQ_HEAD(, warm_entry) g_warm_list;
+// Number of entries in g_warm_list, read by client threads
+static int g_warm_length;
+// The track being warmed up, waiting for its metadata. NULL if none.
+static sp_track *g_warm_track;
+// Time the next track is warmed up, from monotonic_ms()
+static int64_t g_next_warm;
+// Number of tracks warmed up, and of tracks that could not be loaded
+static uint64_t g_warm_prefetched;
+static uint64_t g_warm_failed;
+// The playlist being played, NULL if none
+static sp_playlist *g_playlist;
+// Index of the next track of g_playlist to play
+static int g_playlist_cursor;
+// Non-zero while g_playlist loads. Its first track is played once loaded.
+static int g_playlist_pending;
+// The command that asked for g_playlist while it loads
+static spotd_command_origin g_playlist_origin;
+// References to the tracks of g_playlist from g_playlist_window_start on
+static sp_track *g_playlist_window[PLAYLIST_WINDOW];
+// Index of the first track in g_playlist_window
+static int g_playlist_window_start;
+// Number of tracks in g_playlist_window
+static int g_playlist_window_length;
+// The player status reported to clients
+static spotd_status g_status;
+// The streaming bitrate, and the offline sync progress last reported by
+// libspotify, protected by g_status_mutex
+static int g_bitrate_kbps;
+static sp_offline_sync_status g_offline_status;
+static int g_offline_syncing;
+static int g_offline_playlists;
+// Time the process started, from monotonic_ms()
+static int64_t g_start_ms;
+// Non-zero while waiting for the first audio of the current track to play
+static int g_first_audio_pending;
+// Time the command that started the current track was received, 0 if the
+// track was not started by a client
+static int64_t g_first_audio_command_ms;
+// Startup times and time to first audio, see measure_first_audio().
+// Protected by g_status_mutex.
+static int g_login_ms;
+static int g_startup_ttfa_ms;
+static uint64_t g_ttfa_count;
+static uint64_t g_ttfa_total_ms;
+static int g_ttfa_last_ms;
+static int g_ttfa_min_ms;
+static int g_ttfa_max_ms;
+// Synchronization mutex for g_status
+static pthread_mutex_t g_status_mutex;
+// Synchronization mutex for audio delivered to the zones, taken before the
+// fifo mutexes of the zones
+static pthread_mutex_t g_delivery_mutex;
+// Frames delivered for the current track, protected by g_delivery_mutex
+static int g_delivered_frames;
+// Position the current track started at, protected by g_delivery_mutex
+static int g_start_position_ms;
+// Sample rate of the delivered frames, protected by g_delivery_mutex
+static int g_delivered_rate;
+// Clock the zones play in sync on, when g_sync_latency_ms is set
+static audio_clock_t g_sync_clock;
+// Time from delivery to playback when the zones play in sync, 0 to play
+// audio on each zone as soon as possible
+static int g_sync_latency_ms;
+// Sync clock time the next audio delivered is to be heard at, 0 to start
+// counting again from the next delivery. Protected by g_delivery_mutex.
+static int64_t g_next_pts_us;
+// Time of the next position event, from monotonic_ms()
+static int64_t g_next_position_tick;
+
+// Set of signals handled by the main loop through a signalfd
 static sigset_t g_handled_signal_set;
-// Synchronization variable telling the main thread to exit
-static int g_interrupted;
+// Socket listening for handoff requests, -1 if hot restart is disabled
+static int g_handoff_listener;
+// Handoff request waiting for the main thread, -1 for none. Protected by
+// g_command_mutex.
+static int g_handoff_client;
+// The state file, written by the main thread once g_save_state is set
+static spotd_state_file g_state_file;
+static int g_save_state;
+// The state last saved to g_state_file, with a zero position
+static spotd_handoff_state g_saved_state;
+// Time the position is saved next while a track plays, from monotonic_ms()
+static int64_t g_next_state_save;
 
 /* --- Function definitions --- */
 static sp_track *track_from_link(const char *link_str);
-static spotd_error play_track(sp_track *track);
+static void uncache_track(sp_track *track);
+static int starts_playback(spotd_command_type type);
+static spotd_error play_track(sp_track *track, const spotd_command_origin *origin,
+                              int position_ms);
 static void stop_playback(void);
+static spotd_error pause_playback(void);
+static spotd_error resume_playback(void);
+static void set_player_state(spotd_player_state state);
+static void update_status(spotd_player_state state, sp_track *track);
+static void publish_event(spotd_event_type type, int value, const char *text);
+static void set_volume(int volume);
+static void queue_clear(void);
+static void end_playlist(void);
+static void play_playlist_track(const spotd_command_origin *origin);
+static void update_playlist_window(void);
+static void search_tracks(const char *query, int offset, int limit,
+                          const spotd_command_origin *origin);
+static void offline_status_updated(sp_session *sess);
+
+/* --------------------------------  ZONES  -------------------------------- */
+
+/**
+ * Add an output zone. Zones are numbered from 0 in the order they are added.
+ *
+ * @param  device  The ALSA device the zone plays on
+ * @return  SPOTD_ERROR_INVALID_STATE if there are SPOTD_MAX_ZONES zones already
+ */
+static spotd_error add_zone(const char *device) {
+  zone_t *zone;
+
+  if (g_num_zones == SPOTD_MAX_ZONES || strlen(device) >= SPOTD_DEVICE_MAX) {
+    return SPOTD_ERROR_INVALID_STATE;
+  }
+
+  zone = &g_zones[g_num_zones++];
+  zone->fifo.device = device;
+  zone->volume = 100;
+  zone->dropped_frames = 0;
+
+  return SPOTD_ERROR_OK;
+}
+
+/**
+ * Start the output threads of all zones
+ */
+static void start_zones(void) {
+  int i;
+
+  if (g_sync_latency_ms > 0) {
+    audio_clock_init(&g_sync_clock);
+  }
+
+  for (i = 0; i < g_num_zones; i++) {
+    audio_init(&g_zones[i].fifo, g_zones[i].fifo.device,
+               g_sync_latency_ms > 0 ? &g_sync_clock : NULL);
+  }
+}
+
+/**
+ * Get the audio waiting to be played on the zone furthest ahead. The caller
+ * holds g_delivery_mutex.
+ *
+ * @return  The number of frames
+ */
+static int zones_backlog(void) {
+  int backlog = INT_MAX, i;
+
+  for (i = 0; i < g_num_zones; i++) {
+    pthread_mutex_lock(&g_zones[i].fifo.mutex);
+    if (g_zones[i].fifo.qlen < backlog) {
+      backlog = g_zones[i].fifo.qlen;
+    }
+    pthread_mutex_unlock(&g_zones[i].fifo.mutex);
+  }
+
+  return backlog;
+}
+
+/**
+ * Drop the audio waiting to be played on all zones
+ */
+static void zones_flush(void) {
+  int i;
+
+  pthread_mutex_lock(&g_delivery_mutex);
+  for (i = 0; i < g_num_zones; i++) {
+    audio_fifo_flush(&g_zones[i].fifo);
+  }
+  g_next_pts_us = 0;
+  pthread_mutex_unlock(&g_delivery_mutex);
+}
+
+/**
+ * Hold back the audio of all zones, or release it
+ *
+ * @param  paused  Non-zero to hold the audio back
+ */
+static void zones_set_paused(int paused) {
+  int i;
+
+  // Audio held back keeps its place on the sync clock
+  if (g_sync_latency_ms > 0) {
+    audio_clock_set_paused(&g_sync_clock, paused);
+  }
+
+  for (i = 0; i < g_num_zones; i++) {
+    audio_fifo_set_paused(&g_zones[i].fifo, paused);
+  }
+}
+
+/**
+ * Mark the next audio delivered, see zones_played_ms()
+ */
+static void zones_mark(void) {
+  int i;
+
+  for (i = 0; i < g_num_zones; i++) {
+    audio_fifo_mark(&g_zones[i].fifo);
+  }
+}
+
+/**
+ * Get the time the audio marked with zones_mark() was first played
+ *
+ * @return  The time from monotonic_ms() on the first zone that played it, 0
+ *   if no zone has played it yet
+ */
+static int64_t zones_played_ms(void) {
+  int64_t played_ms, first_ms = 0;
+  int i;
+
+  for (i = 0; i < g_num_zones; i++) {
+    played_ms = audio_fifo_played_ms(&g_zones[i].fifo);
+    if (played_ms != 0 && (first_ms == 0 || played_ms < first_ms)) {
+      first_ms = played_ms;
+    }
+  }
+
+  return first_ms;
+}
+
+/**
+ * Apply the player volume and the volume of each zone to the audio played
+ * on the zones
+ *
+ * @param  volume  The player volume, 0-100
+ */
+static void apply_zone_volumes(int volume) {
+  zone_t *zone;
+  int i;
+
+  for (i = 0; i < g_num_zones; i++) {
+    zone = &g_zones[i];
+    pthread_mutex_lock(&zone->fifo.mutex);
+    zone->fifo.volume = volume * zone->volume / 100;
+    pthread_mutex_unlock(&zone->fifo.mutex);
+  }
+}
+
+/**
+ * Set the volume of one zone, applied on top of the player volume
+ *
+ * @param  index  The zone
+ * @param  volume  The volume, 0-100
+ * @return  SPOTD_ERROR_INVALID_STATE if there is no such zone
+ */
+static spotd_error set_zone_volume(int index, int volume) {
+  if (index < 0 || index >= g_num_zones) {
+    return SPOTD_ERROR_INVALID_STATE;
+  }
+
+  pthread_mutex_lock(&g_zones[index].fifo.mutex);
+  g_zones[index].volume = volume;
+  pthread_mutex_unlock(&g_zones[index].fifo.mutex);
+
+  apply_zone_volumes(g_status.volume);
+
+  return SPOTD_ERROR_OK;
+}
 
 /* ---------------------------  SESSION CALLBACKS  ------------------------- */
 
@@ -85,12 +463,32 @@ static void stop_playback(void);
  * @sa sp_session_callbacks#logged_in
  */
 static void logged_in(sp_session *sess, sp_error error) {
+  const char *password = g_login_password;
+
+  // Stored credentials may have been revoked, the password given is tried
+  // once instead
+  if (SP_ERROR_OK != error && password != NULL) {
+    fprintf(stderr, "Login with stored credentials failed: %s, trying the password\n",
+            sp_error_message(error));
+    g_login_password = NULL;
+    sp_session_login(sess, g_login_username, password, 1, NULL);
+    return;
+  }
+
   if (SP_ERROR_OK != error) {
     fprintf(stderr, "Login failed: %s\n", sp_error_message(error));
     exit(2);
   }
 
   g_playlistcontainer = sp_session_playlistcontainer(sess);
+  g_logged_in = 1;
+
+  pthread_mutex_lock(&g_status_mutex);
+  g_login_ms = (int) (monotonic_ms() - g_start_ms);
+  pthread_mutex_unlock(&g_status_mutex);
+  printf("Logged in %d ms after start\n", g_login_ms);
+
+  offline_status_updated(sess);
 }
 
 /**
@@ -99,25 +497,28 @@ static void logged_in(sp_session *sess, sp_error error) {
  * @sa sp_session_callbacks#metadata_updated
  */
 static void metadata_updated(sp_session *sess) {
-  if (g_queued_track != NULL && g_current_track != g_queued_track) {
-    play_track(g_queued_track);
-    g_queued_track = NULL;
+  sp_track *track = g_queued_track;
+  spotd_command_origin origin = g_queued_origin;
+
+  if (track == NULL || g_current_track == track ||
+      sp_track_error(track) == SP_ERROR_IS_LOADING) {
+    return;
   }
+
+  g_queued_track = NULL;
+  play_track(track, &origin, g_queued_position_ms);
 }
 
 /**
  * This callback is called from an internal libspotify thread to ask
  * us to reiterate the main loop.
  *
- * We notify the main thread using a condition variable and a protected variable.
+ * We notify the main thread through an event file descriptor.
  *
  * @sa sp_session_callbacks#notify_main_thread
  */
 static void notify_main_thread(sp_session *sess) {
-  pthread_mutex_lock(&g_notify_mutex);
-  g_notify_do = 1;
-  pthread_cond_signal(&g_notify_cond);
-  pthread_mutex_unlock(&g_notify_mutex);
+  eventfd_write(g_notify_fd, 1);
 }
 
 /**
@@ -127,38 +528,71 @@ static void notify_main_thread(sp_session *sess) {
  */
 static int music_delivery(sp_session *sess, const sp_audioformat *format,
                           const void *frames, int num_frames) {
-  audio_fifo_t *af = &g_audiofifo;
+  audio_fifo_t *af;
   audio_fifo_data_t *afd;
+  int64_t pts_us, now_us;
   size_t s;
+  int i;
 
   if (num_frames == 0) {
     return 0; // Audio discontinuity, do nothing
   }
 
-  pthread_mutex_lock(&af->mutex);
+  pthread_mutex_lock(&g_delivery_mutex);
 
-  /* Buffer one second of audio */
-  if (af->qlen > format->sample_rate) {
-    pthread_mutex_unlock(&af->mutex);
+  /* Buffer one second of audio on the zone furthest ahead */
+  if (zones_backlog() > ZONE_BUFFER_SECONDS * format->sample_rate) {
+    pthread_mutex_unlock(&g_delivery_mutex);
 
     return 0;
   }
 
   s = num_frames * sizeof(int16_t) * format->channels;
 
-  afd = malloc(sizeof(audio_fifo_data_t) + s);
-  memcpy(afd->samples, frames, s);
+  // In sync mode the audio is stamped with the time it is to be heard on
+  // all zones. After a gap in delivery it is stamped anew.
+  pts_us = 0;
+  if (g_sync_latency_ms > 0) {
+    now_us = audio_clock_now_us(&g_sync_clock);
+    if (g_next_pts_us < now_us) {
+      g_next_pts_us = now_us + (int64_t) g_sync_latency_ms * 1000;
+    }
+    pts_us = g_next_pts_us;
+    g_next_pts_us += (int64_t) num_frames * 1000000 / format->sample_rate;
+  }
+
+  for (i = 0; i < g_num_zones; i++) {
+    af = &g_zones[i].fifo;
+    pthread_mutex_lock(&af->mutex);
+
+    // A zone whose output is stuck, say while its device is reopened, loses
+    // the audio rather than holding up the other zones
+    if (af->qlen > ZONE_MAX_BACKLOG_SECONDS * format->sample_rate) {
+      g_zones[i].dropped_frames += num_frames;
+      pthread_mutex_unlock(&af->mutex);
+      continue;
+    }
+
+    afd = malloc(sizeof(audio_fifo_data_t) + s);
+    memcpy(afd->samples, frames, s);
 
-  afd->nsamples = num_frames;
+    afd->nsamples = num_frames;
 
-  afd->rate = format->sample_rate;
-  afd->channels = format->channels;
+    afd->rate = format->sample_rate;
+    afd->channels = format->channels;
+    afd->pts_us = pts_us;
 
-  TAILQ_INSERT_TAIL(&af->q, afd, link);
-  af->qlen += num_frames;
+    TAILQ_INSERT_TAIL(&af->q, afd, link);
+    af->qlen += num_frames;
 
-  pthread_cond_signal(&af->cond);
-  pthread_mutex_unlock(&af->mutex);
+    pthread_cond_signal(&af->cond);
+    pthread_mutex_unlock(&af->mutex);
+  }
+
+  g_delivered_frames += num_frames;
+  g_delivered_rate = format->sample_rate;
+
+  pthread_mutex_unlock(&g_delivery_mutex);
 
   return num_frames;
 }
@@ -169,10 +603,7 @@ static int music_delivery(sp_session *sess, const sp_audioformat *format,
  * @sa sp_session_callbacks#end_of_track
  */
 static void end_of_track(sp_session *sess) {
-  pthread_mutex_lock(&g_notify_mutex);
-  g_playback_done = 1;
-  pthread_cond_signal(&g_notify_cond);
-  pthread_mutex_unlock(&g_notify_mutex);
+  eventfd_write(g_end_of_track_fd, 1);
 }
 
 /**
@@ -182,9 +613,40 @@ static void end_of_track(sp_session *sess) {
  * @sa sp_session_callbacks#play_token_lost
  */
 static void play_token_lost(sp_session *sess) {
+  publish_event(SPOTD_EVENT_ERROR, SPOTD_ERROR_OTHER_PERMANENT, "Play token lost");
   stop_playback();
 }
 
+/**
+ * Callback called when the offline sync progresses. The progress is kept
+ * for client threads, which may not call libspotify.
+ *
+ * @sa sp_session_callbacks#offline_status_updated
+ */
+static void offline_status_updated(sp_session *sess) {
+  sp_offline_sync_status status;
+  int syncing, num_playlists;
+
+  memset(&status, 0, sizeof(status));
+  syncing = sp_offline_sync_get_status(sess, &status) && status.syncing;
+  num_playlists = sp_offline_num_playlists(sess);
+
+  pthread_mutex_lock(&g_status_mutex);
+  g_offline_status = status;
+  g_offline_syncing = syncing;
+  g_offline_playlists = num_playlists;
+  pthread_mutex_unlock(&g_status_mutex);
+}
+
+/**
+ * Callback called when the offline sync fails
+ *
+ * @sa sp_session_callbacks#offline_error
+ */
+static void offline_error(sp_session *sess, sp_error error) {
+  fprintf(stderr, "Offline sync failed: %s\n", sp_error_message(error));
+}
+
 /**
  * This callback is called for log messages.
  *
@@ -205,6 +667,32 @@ static sp_session_callbacks session_callbacks = {
   .play_token_lost = &play_token_lost,
   .log_message = &log_message,
   .end_of_track = &end_of_track,
+  .offline_status_updated = &offline_status_updated,
+  .offline_error = &offline_error,
+};
+
+/**
+ * Callback called when a playlist is loaded, or its state changes otherwise
+ *
+ * @sa sp_playlist_callbacks#playlist_state_changed
+ */
+static void playlist_state_changed(sp_playlist *pl, void *userdata) {
+  spotd_command_origin origin;
+
+  if (pl != g_playlist || !g_playlist_pending || !sp_playlist_is_loaded(pl)) {
+    return;
+  }
+
+  origin = g_playlist_origin;
+  g_playlist_pending = 0;
+  play_playlist_track(&origin);
+}
+
+/**
+ * The playlist callbacks
+ */
+static sp_playlist_callbacks playlist_callbacks = {
+  .playlist_state_changed = &playlist_state_changed,
 };
 
 /**
@@ -226,33 +714,326 @@ static sp_session_config spconfig = {
 /* ---------------------------  SERVER CALLBACKS  -------------------------- */
 
 /**
- * This callback handles commands received from clients
+ * This callback handles commands received from clients. STOP and PAUSE are
+ * executed before the other queued commands, and a STOP cancels the queued
+ * commands that would start a track. A PAUSE keeps its place behind queued
+ * commands that start playback, which would undo it. Of consecutive queued
+ * PLAY commands only the latest one is kept.
  *
  * @param  command  Command received from a client
  */
 static void client_command_received (spotd_command *command) {
-  pthread_mutex_lock(&g_notify_mutex);
-  g_command = command;
-  pthread_cond_signal(&g_notify_cond);
-  pthread_mutex_unlock(&g_notify_mutex);
+  spotd_command *queued, *next;
+
+  command->origin.received_ms = monotonic_ms();
+
+  pthread_mutex_lock(&g_command_mutex);
+
+  switch (command->type) {
+  case SPOTD_COMMAND_STOP:
+    // The tracks asked for before a STOP are not played
+    for (queued = TAILQ_FIRST(&g_commands); queued != NULL; queued = next) {
+      next = TAILQ_NEXT(queued, link);
+
+      if (queued->type == SPOTD_COMMAND_PLAY_TRACK ||
+          queued->type == SPOTD_COMMAND_PLAYLIST_PLAY ||
+          queued->type == SPOTD_COMMAND_QUEUE_NEXT) {
+        TAILQ_REMOVE(&g_commands, queued, link);
+        spotd_server_complete_command(&queued->origin, SPOTD_RESULT_ERROR,
+                                      SPOTD_ERROR_CANCELLED, "Cancelled by STOP");
+        spotd_command_release(queued);
+      }
+    }
+    TAILQ_INSERT_TAIL(&g_priority_commands, command, link);
+    break;
+  case SPOTD_COMMAND_PAUSE:
+    TAILQ_FOREACH(queued, &g_commands, link) {
+      if (starts_playback(queued->type)) {
+        break;
+      }
+    }
+
+    if (queued == NULL) {
+      TAILQ_INSERT_TAIL(&g_priority_commands, command, link);
+    } else {
+      TAILQ_INSERT_TAIL(&g_commands, command, link);
+    }
+    break;
+  case SPOTD_COMMAND_PLAY_TRACK:
+    // A PLAY right before another one would be cut off at once
+    queued = TAILQ_LAST(&g_commands, command_queue);
+
+    if (queued != NULL && queued->type == SPOTD_COMMAND_PLAY_TRACK) {
+      TAILQ_REMOVE(&g_commands, queued, link);
+      spotd_server_complete_command(&queued->origin, SPOTD_RESULT_ERROR,
+                                    SPOTD_ERROR_CANCELLED, "Replaced by a later PLAY");
+      spotd_command_release(queued);
+    }
+    TAILQ_INSERT_TAIL(&g_commands, command, link);
+    break;
+  default:
+    TAILQ_INSERT_TAIL(&g_commands, command, link);
+    break;
+  }
+
+  pthread_mutex_unlock(&g_command_mutex);
+  eventfd_write(g_command_fd, 1);
+}
+
+/**
+ * Check whether a command starts or resumes playback
+ *
+ * @param  type  The command type
+ * @return  Non-zero if it does
+ */
+static int starts_playback(spotd_command_type type) {
+  switch (type) {
+  case SPOTD_COMMAND_PLAY_TRACK:
+  case SPOTD_COMMAND_RESUME:
+  case SPOTD_COMMAND_QUEUE_NEXT:
+  case SPOTD_COMMAND_PLAYLIST_PLAY:
+  case SPOTD_COMMAND_PLAYLIST_NEXT:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/**
+ * This callback reports the player status to clients. It is called from
+ * client threads.
+ *
+ * @param  status  Receives the player status
+ */
+static void client_status_requested (spotd_status *status) {
+  pthread_mutex_lock(&g_status_mutex);
+  *status = g_status;
+  pthread_mutex_unlock(&g_status_mutex);
+
+  if (status->state == SPOTD_PLAYER_PLAYING || status->state == SPOTD_PLAYER_PAUSED) {
+    // Frames still in the fifos have not been played yet. The position is
+    // the one heard on the zone furthest ahead.
+    pthread_mutex_lock(&g_delivery_mutex);
+    status->position_ms = g_start_position_ms;
+    if (g_delivered_rate > 0) {
+      status->position_ms += (int) ((int64_t) (g_delivered_frames - zones_backlog()) * 1000 /
+                                    g_delivered_rate);
+    }
+    // The end of the previous track may still be in the fifo
+    if (status->position_ms < g_start_position_ms) {
+      status->position_ms = g_start_position_ms;
+    }
+    pthread_mutex_unlock(&g_delivery_mutex);
+  }
+}
+
+/**
+ * This callback lists the play queue for clients. It is called from client
+ * threads.
+ *
+ * @param  links  Receives the track links, in play order
+ * @param  max_links  Maximum number of links to copy
+ * @return  The number of links copied
+ */
+static int client_queue_requested(char (*links)[SPOTD_LINK_MAX], int max_links) {
+  queue_entry_t *entry;
+  int num_links = 0;
+
+  pthread_mutex_lock(&g_play_queue_mutex);
+  TAILQ_FOREACH(entry, &g_play_queue, link) {
+    if (num_links == max_links) {
+      break;
+    }
+    memcpy(links[num_links++], entry->track_link, SPOTD_LINK_MAX);
+  }
+  pthread_mutex_unlock(&g_play_queue_mutex);
+
+  return num_links;
+}
+
+/**
+ * This callback lists the output zones for clients. It is called from
+ * client threads.
+ *
+ * @param  zones  Receives the zone status, by zone index
+ * @param  max_zones  Maximum number of zones to copy
+ * @return  The number of zones copied
+ */
+static int client_zones_requested(spotd_zone_status *zones, int max_zones) {
+  zone_t *zone;
+  int rate, i;
+
+  pthread_mutex_lock(&g_delivery_mutex);
+  rate = g_delivered_rate > 0 ? g_delivered_rate : 44100;
+  pthread_mutex_unlock(&g_delivery_mutex);
+
+  for (i = 0; i < g_num_zones && i < max_zones; i++) {
+    zone = &g_zones[i];
+    snprintf(zones[i].device, SPOTD_DEVICE_MAX, "%s", zone->fifo.device);
+
+    pthread_mutex_lock(&zone->fifo.mutex);
+    zones[i].volume = zone->volume;
+    zones[i].backlog_ms = (int) ((int64_t) zone->fifo.qlen * 1000 / rate);
+    zones[i].dropped_frames = zone->dropped_frames;
+    zones[i].sync_error_us = zone->fifo.sync_error_us;
+    zones[i].sync_ppm = zone->fifo.sync_ppm;
+    pthread_mutex_unlock(&zone->fifo.mutex);
+  }
+
+  return i;
+}
+
+/**
+ * This callback reports counters to clients. It is called from client
+ * threads.
+ *
+ * @param  stats  Receives the counters
+ */
+static void client_stats_requested(spotd_stats *stats) {
+  stats->track_cache_size = (int) __atomic_load_n(&g_track_cache.size, __ATOMIC_RELAXED);
+  stats->track_cache_hits = __atomic_load_n(&g_track_cache.hits, __ATOMIC_RELAXED);
+  stats->track_cache_misses = __atomic_load_n(&g_track_cache.misses, __ATOMIC_RELAXED);
+  stats->track_cache_evictions = __atomic_load_n(&g_track_cache.evictions, __ATOMIC_RELAXED);
+  stats->search_cache_size = (int) __atomic_load_n(&g_search_cache.size, __ATOMIC_RELAXED);
+  stats->search_cache_hits = __atomic_load_n(&g_search_cache.hits, __ATOMIC_RELAXED);
+  stats->search_cache_misses = __atomic_load_n(&g_search_cache.misses, __ATOMIC_RELAXED);
+  stats->search_cache_evictions = __atomic_load_n(&g_search_cache.evictions, __ATOMIC_RELAXED);
+  stats->warm_pending = __atomic_load_n(&g_warm_length, __ATOMIC_RELAXED);
+  stats->warm_prefetched = __atomic_load_n(&g_warm_prefetched, __ATOMIC_RELAXED);
+  stats->warm_failed = __atomic_load_n(&g_warm_failed, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&g_status_mutex);
+  stats->bitrate_kbps = g_bitrate_kbps;
+  stats->offline_playlists = g_offline_playlists;
+  stats->offline_syncing = g_offline_syncing;
+  stats->offline_queued_tracks = g_offline_status.queued_tracks;
+  stats->offline_queued_bytes = g_offline_status.queued_bytes;
+  stats->offline_done_tracks = g_offline_status.done_tracks;
+  stats->offline_done_bytes = g_offline_status.done_bytes;
+  stats->offline_error_tracks = g_offline_status.error_tracks;
+  stats->login_ms = g_login_ms;
+  stats->startup_ttfa_ms = g_startup_ttfa_ms;
+  stats->ttfa_count = g_ttfa_count;
+  stats->ttfa_last_ms = g_ttfa_last_ms;
+  stats->ttfa_min_ms = g_ttfa_min_ms;
+  stats->ttfa_max_ms = g_ttfa_max_ms;
+  stats->ttfa_avg_ms = g_ttfa_count > 0 ? (int) (g_ttfa_total_ms / g_ttfa_count) : 0;
+  pthread_mutex_unlock(&g_status_mutex);
 }
 
 static spotd_server_callbacks server_callbacks = {
   .command_received = &client_command_received,
+  .status_requested = &client_status_requested,
+  .queue_requested = &client_queue_requested,
+  .stats_requested = &client_stats_requested,
+  .zones_requested = &client_zones_requested,
 };
 
 /* ---------------------------  PLAYBACK CONTROLS  ------------------------- */
 
 /**
- * Creates an sp_track from a Spotify track link
+ * Push an event to subscribed clients
+ *
+ * @param  type  The event type
+ * @param  value  The event value, see spotd_event_type
+ * @param  text  The track link or error message, can be NULL
+ */
+static void publish_event(spotd_event_type type, int value, const char *text) {
+  spotd_event event;
+
+  event.type = type;
+  event.value = value;
+  snprintf(event.text, sizeof(event.text), "%s", text != NULL ? text : "");
+
+  spotd_server_publish_event(&event);
+}
+
+/**
+ * Set the playback volume
+ *
+ * @param  volume  The volume, 0-100
+ */
+static void set_volume(int volume) {
+  apply_zone_volumes(volume);
+
+  pthread_mutex_lock(&g_status_mutex);
+  g_status.volume = volume;
+  pthread_mutex_unlock(&g_status_mutex);
+
+  publish_event(SPOTD_EVENT_VOLUME, volume, NULL);
+}
+
+/**
+ * Change the player state reported to clients, keeping the current track
+ *
+ * @param  state  The new player state
+ */
+static void set_player_state(spotd_player_state state) {
+  pthread_mutex_lock(&g_status_mutex);
+  g_status.state = state;
+  pthread_mutex_unlock(&g_status_mutex);
+}
+
+/**
+ * Update the player status reported to clients
+ *
+ * @param  state  The new player state
+ * @param  track  The current track, NULL if there is none
+ */
+static void update_status(spotd_player_state state, sp_track *track) {
+  sp_link *link;
+
+  pthread_mutex_lock(&g_status_mutex);
+
+  g_status.state = state;
+  g_status.position_ms = 0;
+  g_status.duration_ms = 0;
+  g_status.track_link[0] = '\0';
+
+  if (track != NULL) {
+    link = sp_link_create_from_track(track, 0);
+
+    if (link != NULL) {
+      sp_link_as_string(link, g_status.track_link, SPOTD_LINK_MAX);
+      sp_link_release(link);
+    }
+
+    if (state == SPOTD_PLAYER_PLAYING) {
+      g_status.duration_ms = sp_track_duration(track);
+    }
+  }
+
+  pthread_mutex_unlock(&g_status_mutex);
+}
+
+/**
+ * Release a track held by the track cache
+ *
+ * @param  value  The track
+ */
+static void release_cached_track(void *value) {
+  sp_track_release((sp_track *) value);
+}
+
+/**
+ * Creates an sp_track from a Spotify track link. Recently used tracks are
+ * taken from the track cache, with their metadata already loaded.
  *
  * @param  link_str  The Spotify track link
- * @return an sp_track if the link passed was a valid link, NULL otherwise
+ * @return an sp_track if the link passed was a valid link, NULL otherwise.
+ *   The caller owns a reference to the track.
  */
 static sp_track *track_from_link(const char *link_str) {
   sp_link *link;
   sp_track *track;
 
+  track = (sp_track *) spotd_cache_get(&g_track_cache, link_str);
+
+  if (track != NULL) {
+    sp_track_add_ref(track);
+    return track;
+  }
+
   link = sp_link_create_from_string(link_str);
 
   if (link == NULL) {
@@ -260,21 +1041,61 @@ static sp_track *track_from_link(const char *link_str) {
     return NULL;
   }
 
-  sp_track_add_ref(track = sp_link_as_track(link));
+  track = sp_link_as_track(link);
+
+  // Albums, artists and playlists have valid links too
+  if (track == NULL) {
+    fprintf(stderr, "Error: \"%s\" is not a Spotify track link\n", link_str);
+    sp_link_release(link);
+    return NULL;
+  }
+
+  sp_track_add_ref(track);
   sp_link_release(link);
 
+  // One reference for the cache, one for the caller
+  sp_track_add_ref(track);
+  spotd_cache_put(&g_track_cache, link_str, track);
+
   return track;
 }
 
 /**
- * Play a track
+ * Remove a track that failed to load from the track cache, so that it is
+ * looked up again the next time it is asked for
+ *
+ * @param  track  The track
+ */
+static void uncache_track(sp_track *track) {
+  char link_str[SPOTD_LINK_MAX];
+  sp_link *link = sp_link_create_from_track(track, 0);
+
+  if (link == NULL) {
+    return;
+  }
+
+  sp_link_as_string(link, link_str, sizeof(link_str));
+  sp_link_release(link);
+
+  spotd_cache_remove(&g_track_cache, link_str);
+}
+
+/**
+ * Play a track. The client that sent the command is told whether playback
+ * started, failed, or has to wait for the track metadata to load.
  *
- * @param  link  The spotify link to the track
+ * @param  track  The track to play. The reference is taken over.
+ * @param  origin  The command asking for the track
+ * @param  position_ms  Position to start playing at
+ * @return  SPOTD_ERROR_OK if the track is playing or loading
  */
-static spotd_error play_track(sp_track *track) {
+static spotd_error play_track(sp_track *track, const spotd_command_origin *origin,
+                              int position_ms) {
   sp_error track_error;
 
   if (g_current_track && g_current_track == track) {
+    sp_track_release(track);
+    spotd_server_complete_command(origin, SPOTD_RESULT_STARTED, SPOTD_ERROR_OK, NULL);
     return SPOTD_ERROR_OK;
   }
 
@@ -285,15 +1106,50 @@ static spotd_error play_track(sp_track *track) {
   if (track_error == SP_ERROR_OK) {
     g_current_track = track;
     printf("Now playing \"%s\"...\n", sp_track_name(track));
+
+    pthread_mutex_lock(&g_delivery_mutex);
+    g_delivered_frames = 0;
+    g_start_position_ms = position_ms;
+    pthread_mutex_unlock(&g_delivery_mutex);
+    update_status(SPOTD_PLAYER_PLAYING, track);
     
     sp_session_player_load(g_sess, g_current_track);
+    if (position_ms > 0) {
+      sp_session_player_seek(g_sess, position_ms);
+    }
     sp_session_player_play(g_sess, 1);
+
+    g_next_position_tick = monotonic_ms() + POSITION_TICK_MS;
+    publish_event(SPOTD_EVENT_TRACK_STARTED, g_status.duration_ms, g_status.track_link);
+    spotd_server_complete_command(origin, SPOTD_RESULT_STARTED, SPOTD_ERROR_OK, NULL);
+
+    // A track that starts paused is not heard until resumed, which says
+    // nothing about how fast it started
+    g_first_audio_pending = !g_resume_paused;
+    g_first_audio_command_ms = origin->received_ms;
+    if (g_first_audio_pending) {
+      zones_mark();
+    }
+
+    if (g_resume_paused) {
+      g_resume_paused = 0;
+      pause_playback();
+    }
   } else if (track_error == SP_ERROR_OTHER_PERMANENT) {
     printf("Failed trying to play track\n");
+    uncache_track(track);
+    sp_track_release(track);
+    publish_event(SPOTD_EVENT_ERROR, SPOTD_ERROR_OTHER_PERMANENT, "Failed trying to play track");
+    spotd_server_complete_command(origin, SPOTD_RESULT_ERROR, SPOTD_ERROR_OTHER_PERMANENT,
+                                  "Failed trying to play track");
     return SPOTD_ERROR_OTHER_PERMANENT;
   } else if (track_error == SP_ERROR_IS_LOADING) {
     printf("Loading metadata for track...\n");
     g_queued_track = track;
+    g_queued_origin = *origin;
+    g_queued_position_ms = position_ms;
+    update_status(SPOTD_PLAYER_LOADING, track);
+    spotd_server_complete_command(origin, SPOTD_RESULT_LOADING, SPOTD_ERROR_OK, NULL);
   }
 
   /* Track not loaded? Then we need to wait for the metadata to
@@ -303,74 +1159,1465 @@ static spotd_error play_track(sp_track *track) {
 }
 
 /**
- * Stop the currently playing track, if there is one
+ * Stop the currently playing track, if there is one. A track still waiting
+ * for its metadata is not played.
  */
 static void stop_playback(void) {
+  if (g_queued_track != NULL) {
+    sp_track_release(g_queued_track);
+    g_queued_track = NULL;
+    g_resume_paused = 0;
+    spotd_server_complete_command(&g_queued_origin, SPOTD_RESULT_ERROR,
+                                  SPOTD_ERROR_CANCELLED, "Stopped while loading");
+
+    if (g_current_track == NULL) {
+      update_status(SPOTD_PLAYER_STOPPED, NULL);
+    }
+  }
+
   if (g_current_track != NULL) {
-    audio_fifo_flush(&g_audiofifo);
+    g_first_audio_pending = 0;
+    zones_flush();
+    zones_set_paused(0);
     sp_session_player_unload(g_sess);
     sp_track_release(g_current_track);
     g_current_track = NULL;
+    update_status(SPOTD_PLAYER_STOPPED, NULL);
+    publish_event(SPOTD_EVENT_STOPPED, 0, NULL);
   }
 }
 
-/* ---------------------------------  MAIN  -------------------------------- */
-
 /**
- * A track has ended. Remove it from the playlist.
+ * Pause the current track. The audio still in the fifo is held back, and
+ * played when playback is resumed.
  *
- * Called from the main loop when the music_delivery() callback has set
- * g_playback_done.
+ * @return  SPOTD_ERROR_INVALID_STATE if no track is playing
  */
-static void track_ended(void) {
-  if (g_current_track) {
-    printf("\"%s\" ended\n", sp_track_name(g_current_track));
+static spotd_error pause_playback(void) {
+  spotd_status status;
 
-    sp_track_release(g_current_track);
-    g_current_track = NULL;
+  if (g_current_track == NULL || g_status.state != SPOTD_PLAYER_PLAYING) {
+    return SPOTD_ERROR_INVALID_STATE;
   }
+
+  sp_session_player_play(g_sess, 0);
+  zones_set_paused(1);
+  set_player_state(SPOTD_PLAYER_PAUSED);
+
+  client_status_requested(&status);
+  publish_event(SPOTD_EVENT_PAUSED, status.position_ms, status.track_link);
+
+  return SPOTD_ERROR_OK;
 }
 
 /**
- * Show usage information
+ * Resume the paused track
  *
- * @param  progname  The program name
+ * @return  SPOTD_ERROR_INVALID_STATE if no track is paused
  */
-static void usage(const char *progname) {
-  fprintf(stderr, "usage: %s -u <username> -p <password>\n", progname);
-}
+static spotd_error resume_playback(void) {
+  spotd_status status;
 
-/**
- * Signal handler thread
- */
-static void *signal_handler_thread(void *arg) {
-  int sig;
-  for (;;) {
-    sigwait(&g_handled_signal_set, &sig);
-    
-    if (SIGINT == sig) {
-      pthread_mutex_lock(&g_notify_mutex);
-      g_interrupted = 1;
-      pthread_cond_signal(&g_notify_cond);
-      pthread_mutex_unlock(&g_notify_mutex);
-    }
+  if (g_current_track == NULL || g_status.state != SPOTD_PLAYER_PAUSED) {
+    return SPOTD_ERROR_INVALID_STATE;
+  }
+
+  zones_set_paused(0);
+  sp_session_player_play(g_sess, 1);
+  set_player_state(SPOTD_PLAYER_PLAYING);
+
+  client_status_requested(&status);
+  publish_event(SPOTD_EVENT_RESUMED, status.position_ms, status.track_link);
+  g_next_position_tick = monotonic_ms() + POSITION_TICK_MS;
+
+  return SPOTD_ERROR_OK;
+}
+
+/* -----------------------------  PLAY QUEUE  ------------------------------ */
+
+/**
+ * Add a track to the end of the play queue. Its metadata is loaded once it
+ * is among the next QUEUE_PREFETCH_TRACKS entries, see prefetch_queue().
+ *
+ * @param  link_str  The Spotify track link
+ * @return  SPOTD_ERROR_INVALID_LINK if the link is not a valid track link,
+ *   or SPOTD_ERROR_INVALID_STATE if the queue is full
+ */
+static spotd_error queue_add(const char *link_str) {
+  queue_entry_t *entry;
+  sp_link *link;
+  int valid;
+
+  if (g_play_queue_length == SPOTD_QUEUE_MAX) {
+    return SPOTD_ERROR_INVALID_STATE;
+  }
+
+  link = sp_link_create_from_string(link_str);
+
+  if (link == NULL) {
+    fprintf(stderr, "Error: \"%s\" is not a valid Spotify track link\n", link_str);
+    return SPOTD_ERROR_INVALID_LINK;
+  }
+
+  valid = sp_link_type(link) == SP_LINKTYPE_TRACK;
+  sp_link_release(link);
+
+  if (!valid) {
+    fprintf(stderr, "Error: \"%s\" is not a Spotify track link\n", link_str);
+    return SPOTD_ERROR_INVALID_LINK;
+  }
+
+  entry = (queue_entry_t *) malloc(sizeof(queue_entry_t));
+  snprintf(entry->track_link, SPOTD_LINK_MAX, "%s", link_str);
+  entry->track = NULL;
+  entry->audio_prefetched = 0;
+
+  pthread_mutex_lock(&g_play_queue_mutex);
+  TAILQ_INSERT_TAIL(&g_play_queue, entry, link);
+  g_play_queue_length++;
+  pthread_mutex_unlock(&g_play_queue_mutex);
+
+  return SPOTD_ERROR_OK;
+}
+
+/**
+ * Remove an entry from the play queue and free it
+ *
+ * @param  entry  The entry to remove
+ * @return  The track of the entry, if it was prefetched. The reference is
+ *   passed to the caller.
+ */
+static sp_track *queue_take(queue_entry_t *entry) {
+  sp_track *track = entry->track;
+
+  pthread_mutex_lock(&g_play_queue_mutex);
+  TAILQ_REMOVE(&g_play_queue, entry, link);
+  g_play_queue_length--;
+  pthread_mutex_unlock(&g_play_queue_mutex);
+
+  free(entry);
+
+  return track;
+}
+
+/**
+ * Remove the play queue entry at the given index
+ *
+ * @param  index  The index of the entry, 0 being the next track
+ * @return  SPOTD_ERROR_INVALID_STATE if there is no such entry
+ */
+static spotd_error queue_remove(int index) {
+  queue_entry_t *entry;
+  sp_track *track;
+
+  TAILQ_FOREACH(entry, &g_play_queue, link) {
+    if (index-- == 0) {
+      break;
+    }
+  }
+
+  if (entry == NULL) {
+    return SPOTD_ERROR_INVALID_STATE;
+  }
+
+  track = queue_take(entry);
+  if (track != NULL) {
+    sp_track_release(track);
+  }
+
+  return SPOTD_ERROR_OK;
+}
+
+/**
+ * Remove all entries from the play queue
+ */
+static void queue_clear(void) {
+  sp_track *track;
+
+  while (!TAILQ_EMPTY(&g_play_queue)) {
+    track = queue_take(TAILQ_FIRST(&g_play_queue));
+    if (track != NULL) {
+      sp_track_release(track);
+    }
+  }
+}
+
+/**
+ * Play the first track of the play queue
+ *
+ * @param  origin  The command asking for the track
+ * @return  SPOTD_ERROR_INVALID_STATE if the queue is empty
+ */
+static spotd_error play_next(const spotd_command_origin *origin) {
+  queue_entry_t *entry;
+  sp_track *track;
+  char link_str[SPOTD_LINK_MAX];
+
+  entry = TAILQ_FIRST(&g_play_queue);
+
+  if (entry == NULL) {
+    return SPOTD_ERROR_INVALID_STATE;
+  }
+
+  memcpy(link_str, entry->track_link, SPOTD_LINK_MAX);
+  track = queue_take(entry);
+
+  // Entries beyond the prefetch window are resolved now
+  if (track == NULL) {
+    track = track_from_link(link_str);
+  }
+
+  if (track == NULL) {
+    publish_event(SPOTD_EVENT_ERROR, SPOTD_ERROR_OTHER_PERMANENT, "Invalid track link");
+    spotd_server_complete_command(origin, SPOTD_RESULT_ERROR, SPOTD_ERROR_INVALID_LINK,
+                                  "Invalid track link");
+    return SPOTD_ERROR_OK;
+  }
+
+  play_track(track, origin, 0);
+
+  return SPOTD_ERROR_OK;
+}
+
+/**
+ * Load the metadata of the next QUEUE_PREFETCH_TRACKS queued tracks, and
+ * the audio of the first one once the current track is about to end. The
+ * next track then starts without waiting for libspotify.
+ */
+static void prefetch_queue(void) {
+  queue_entry_t *entry;
+  spotd_status status;
+  int i = 0;
+
+  TAILQ_FOREACH(entry, &g_play_queue, link) {
+    if (i++ == QUEUE_PREFETCH_TRACKS) {
+      break;
+    }
+
+    // Holding a track object makes libspotify load its metadata
+    if (entry->track == NULL) {
+      entry->track = track_from_link(entry->track_link);
+    }
+  }
+
+  entry = TAILQ_FIRST(&g_play_queue);
+
+  if (entry == NULL || entry->track == NULL || entry->audio_prefetched ||
+      sp_track_error(entry->track) != SP_ERROR_OK) {
+    return;
+  }
+
+  if (g_current_track != NULL) {
+    client_status_requested(&status);
+
+    if (status.duration_ms - status.position_ms > QUEUE_PREFETCH_AUDIO_MS) {
+      return;
+    }
+  }
+
+  sp_session_player_prefetch(g_sess, entry->track);
+  entry->audio_prefetched = 1;
+}
+
+/* ----------------------------  CACHE WARM-UP  ---------------------------- */
+
+/**
+ * Add tracks to be loaded into the libspotify cache, see warm_cache()
+ *
+ * @param  num_links  Number of track links
+ * @param  links  The track links
+ * @return  SPOTD_ERROR_INVALID_LINK if a link is not a track link, in which
+ *   case no track is added, or SPOTD_ERROR_INVALID_STATE if there is no room
+ *   for all of them
+ */
+static spotd_error warm_add(int num_links, char **links) {
+  warm_entry_t *entry;
+  sp_link *link;
+  int valid, i;
+
+  if (g_warm_length + num_links > WARM_MAX_TRACKS) {
+    return SPOTD_ERROR_INVALID_STATE;
+  }
+
+  for (i = 0; i < num_links; i++) {
+    if (strlen(links[i]) >= SPOTD_LINK_MAX ||
+        (link = sp_link_create_from_string(links[i])) == NULL) {
+      return SPOTD_ERROR_INVALID_LINK;
+    }
+
+    valid = sp_link_type(link) == SP_LINKTYPE_TRACK;
+    sp_link_release(link);
+
+    if (!valid) {
+      return SPOTD_ERROR_INVALID_LINK;
+    }
+  }
+
+  for (i = 0; i < num_links; i++) {
+    entry = (warm_entry_t *) malloc(sizeof(warm_entry_t));
+    snprintf(entry->track_link, SPOTD_LINK_MAX, "%s", links[i]);
+    TAILQ_INSERT_TAIL(&g_warm_list, entry, link);
+  }
+
+  __atomic_add_fetch(&g_warm_length, num_links, __ATOMIC_RELAXED);
+
+  return SPOTD_ERROR_OK;
+}
+
+/**
+ * Load the next track of the warm-up list into the libspotify cache, so
+ * that playing it later is served from disk. Tracks are warmed up one at a
+ * time, every WARM_INTERVAL_MS, and only when playback does not need the
+ * network: not while a track loads, nor while the audio of the next queued
+ * track may be prefetched.
+ *
+ * @param  next_timeout  The main loop timeout, shortened to the time the
+ *   next track is due
+ */
+static void warm_cache(int *next_timeout) {
+  warm_entry_t *entry;
+  spotd_status status;
+  sp_link *link;
+  sp_error error;
+  int64_t now;
+
+  if (g_warm_track == NULL && TAILQ_EMPTY(&g_warm_list)) {
+    return;
+  }
+
+  now = monotonic_ms();
+
+  if (g_warm_track == NULL) {
+    if (now < g_next_warm) {
+      if (*next_timeout > g_next_warm - now) {
+        *next_timeout = (int) (g_next_warm - now);
+      }
+      return;
+    }
+
+    if (g_queued_track != NULL) {
+      return;
+    }
+
+    if (g_current_track != NULL) {
+      client_status_requested(&status);
+
+      if (status.duration_ms - status.position_ms <= QUEUE_PREFETCH_AUDIO_MS) {
+        return;
+      }
+    }
+
+    entry = TAILQ_FIRST(&g_warm_list);
+    TAILQ_REMOVE(&g_warm_list, entry, link);
+    __atomic_sub_fetch(&g_warm_length, 1, __ATOMIC_RELAXED);
+
+    // Not taken from the track cache, which is kept for tracks played
+    link = sp_link_create_from_string(entry->track_link);
+    free(entry);
+
+    if (link == NULL) {
+      __atomic_add_fetch(&g_warm_failed, 1, __ATOMIC_RELAXED);
+      return;
+    }
+
+    sp_track_add_ref(g_warm_track = sp_link_as_track(link));
+    sp_link_release(link);
+  }
+
+  error = sp_track_error(g_warm_track);
+
+  if (error == SP_ERROR_IS_LOADING) {
+    return;
+  }
+
+  if (error == SP_ERROR_OK) {
+    sp_session_player_prefetch(g_sess, g_warm_track);
+    __atomic_add_fetch(&g_warm_prefetched, 1, __ATOMIC_RELAXED);
+  } else {
+    __atomic_add_fetch(&g_warm_failed, 1, __ATOMIC_RELAXED);
+  }
+
+  sp_track_release(g_warm_track);
+  g_warm_track = NULL;
+  g_next_warm = now + WARM_INTERVAL_MS;
+}
+
+/**
+ * Remove all tracks waiting to be warmed up
+ */
+static void warm_clear(void) {
+  warm_entry_t *entry;
+
+  while ((entry = TAILQ_FIRST(&g_warm_list)) != NULL) {
+    TAILQ_REMOVE(&g_warm_list, entry, link);
+    free(entry);
+  }
+
+  g_warm_length = 0;
+
+  if (g_warm_track != NULL) {
+    sp_track_release(g_warm_track);
+    g_warm_track = NULL;
+  }
+}
+
+/* ------------------------------  PLAYLISTS  ------------------------------ */
+
+/**
+ * Look up a playlist
+ *
+ * @param  playlist_str  A playlist link, or the index of a playlist in the
+ *   user's playlist container
+ * @return  The playlist, NULL if there is no such playlist. The caller owns
+ *   a reference to it.
+ */
+static sp_playlist *playlist_from_string(const char *playlist_str) {
+  sp_playlist *playlist = NULL;
+  sp_link *link;
+  int index;
+
+  if (isdigit((unsigned char) playlist_str[0])) {
+    index = parse_int(playlist_str, 0, INT32_MAX);
+
+    if (g_playlistcontainer != NULL && index >= 0 &&
+        index < sp_playlistcontainer_num_playlists(g_playlistcontainer)) {
+      playlist = sp_playlistcontainer_playlist(g_playlistcontainer, index);
+      if (playlist != NULL) {
+        sp_playlist_add_ref(playlist);
+      }
+    }
+  } else {
+    link = sp_link_create_from_string(playlist_str);
+
+    if (link != NULL) {
+      if (sp_link_type(link) == SP_LINKTYPE_PLAYLIST) {
+        playlist = sp_playlist_create(g_sess, link);
+      }
+      sp_link_release(link);
+    }
+  }
+
+  if (playlist == NULL) {
+    fprintf(stderr, "Error: \"%s\" is not a valid playlist\n", playlist_str);
+  }
+
+  return playlist;
+}
+
+/**
+ * Start playing a playlist. Only the tracks around the cursor are resolved,
+ * see update_playlist_window(), so that long playlists start at once.
+ *
+ * @param  playlist_str  A playlist link, or the index of a playlist in the
+ *   user's playlist container
+ * @param  start  Index of the track to start at
+ * @param  origin  The command asking for the playlist
+ * @param  play  Non-zero to play the track at start once the playlist is
+ *   loaded. Otherwise the playlist only continues after the current track.
+ * @return  SPOTD_ERROR_INVALID_LINK if there is no such playlist
+ */
+static spotd_error start_playlist(const char *playlist_str, int start,
+                                  const spotd_command_origin *origin, int play) {
+  sp_playlist *playlist;
+
+  playlist = playlist_from_string(playlist_str);
+
+  if (playlist == NULL) {
+    return SPOTD_ERROR_INVALID_LINK;
+  }
+
+  end_playlist();
+
+  g_playlist = playlist;
+  g_playlist_cursor = start;
+  g_playlist_window_start = start;
+  g_playlist_pending = play;
+  g_playlist_origin = *origin;
+  sp_playlist_add_callbacks(playlist, &playlist_callbacks, NULL);
+
+  if (play && sp_playlist_is_loaded(playlist)) {
+    g_playlist_pending = 0;
+    play_playlist_track(origin);
+  }
+
+  return SPOTD_ERROR_OK;
+}
+
+/**
+ * Stop playing the current playlist, and release its tracks
+ */
+static void end_playlist(void) {
+  int i;
+
+  if (g_playlist == NULL) {
+    return;
+  }
+
+  if (g_playlist_pending) {
+    spotd_server_complete_command(&g_playlist_origin, SPOTD_RESULT_ERROR,
+                                  SPOTD_ERROR_CANCELLED, "Cancelled while loading");
+  }
+
+  for (i = 0; i < g_playlist_window_length; i++) {
+    sp_track_release(g_playlist_window[i]);
+  }
+
+  sp_playlist_remove_callbacks(g_playlist, &playlist_callbacks, NULL);
+  sp_playlist_release(g_playlist);
+  g_playlist = NULL;
+  g_playlist_pending = 0;
+  g_playlist_window_length = 0;
+}
+
+/**
+ * Play the track at the cursor of the current playlist, skipping tracks
+ * that can not be played. The playlist ends after its last track. If the
+ * playlist is still loading, the track plays once it has loaded.
+ *
+ * @param  origin  The command asking for the track
+ */
+static void play_playlist_track(const spotd_command_origin *origin) {
+  sp_track *track;
+  sp_error track_error;
+
+  if (!sp_playlist_is_loaded(g_playlist)) {
+    g_playlist_pending = 1;
+    g_playlist_origin = *origin;
+    return;
+  }
+
+  while (g_playlist_cursor < sp_playlist_num_tracks(g_playlist)) {
+    track = sp_playlist_track(g_playlist, g_playlist_cursor++);
+    track_error = track != NULL ? sp_track_error(track) : SP_ERROR_OTHER_PERMANENT;
+
+    if (track_error == SP_ERROR_OK || track_error == SP_ERROR_IS_LOADING) {
+      sp_track_add_ref(track);
+      update_playlist_window();
+      play_track(track, origin, 0);
+      return;
+    }
+  }
+
+  puts("End of playlist");
+  spotd_server_complete_command(origin, SPOTD_RESULT_ERROR, SPOTD_ERROR_INVALID_STATE,
+                                "End of playlist");
+  end_playlist();
+}
+
+/**
+ * Move the window of resolved playlist tracks to the cursor: release the
+ * tracks the cursor has passed, and take references to the next
+ * PLAYLIST_WINDOW tracks so that libspotify loads their metadata. Called
+ * from the main loop, so tracks keep being resolved as the playlist loads.
+ */
+static void update_playlist_window(void) {
+  int num_tracks, i;
+
+  if (g_playlist == NULL) {
+    return;
+  }
+
+  for (i = 0; i < g_playlist_window_length &&
+              g_playlist_window_start + i < g_playlist_cursor; i++) {
+    sp_track_release(g_playlist_window[i]);
+  }
+
+  if (i > 0) {
+    g_playlist_window_length -= i;
+    g_playlist_window_start += i;
+    memmove(g_playlist_window, g_playlist_window + i,
+            g_playlist_window_length * sizeof(sp_track *));
+  }
+
+  if (g_playlist_window_length == 0) {
+    g_playlist_window_start = g_playlist_cursor;
+  }
+
+  num_tracks = sp_playlist_num_tracks(g_playlist);
+
+  while (g_playlist_window_length < PLAYLIST_WINDOW &&
+         g_playlist_window_start + g_playlist_window_length < num_tracks) {
+    g_playlist_window[g_playlist_window_length] =
+        sp_playlist_track(g_playlist, g_playlist_window_start + g_playlist_window_length);
+    sp_track_add_ref(g_playlist_window[g_playlist_window_length++]);
+  }
+}
+
+/* -----------------------  BITRATE AND OFFLINE SYNC  ---------------------- */
+
+/**
+ * Convert a bitrate in kbit/s to a libspotify bitrate
+ *
+ * @param  kbps  The bitrate, 96, 160 or 320
+ * @param  bitrate  Receives the libspotify bitrate
+ * @return  SPOTD_ERROR_UNSUPPORTED for other bitrates
+ */
+static spotd_error bitrate_from_kbps(int kbps, sp_bitrate *bitrate) {
+  switch (kbps) {
+  case 96:
+    *bitrate = SP_BITRATE_96k;
+    break;
+  case 160:
+    *bitrate = SP_BITRATE_160k;
+    break;
+  case 320:
+    *bitrate = SP_BITRATE_320k;
+    break;
+  default:
+    return SPOTD_ERROR_UNSUPPORTED;
+  }
+
+  return SPOTD_ERROR_OK;
+}
+
+/**
+ * Set the bitrate tracks are streamed at. Tracks already playing or in the
+ * cache keep theirs.
+ *
+ * @param  kbps  The bitrate in kbit/s, 96, 160 or 320
+ * @return  SPOTD_ERROR_UNSUPPORTED for other bitrates
+ */
+static spotd_error set_bitrate(int kbps) {
+  sp_bitrate bitrate;
+
+  if (bitrate_from_kbps(kbps, &bitrate) != SPOTD_ERROR_OK ||
+      sp_session_preferred_bitrate(g_sess, bitrate) != SP_ERROR_OK) {
+    return SPOTD_ERROR_UNSUPPORTED;
+  }
+
+  pthread_mutex_lock(&g_status_mutex);
+  g_bitrate_kbps = kbps;
+  pthread_mutex_unlock(&g_status_mutex);
+
+  return SPOTD_ERROR_OK;
+}
+
+/**
+ * Mark a playlist for offline sync, or unmark it. libspotify downloads the
+ * tracks of marked playlists in the background, and plays them from disk.
+ *
+ * @param  playlist_str  A playlist link, or the index of a playlist in the
+ *   user's playlist container
+ * @param  offline  Non-zero to mark the playlist, zero to unmark it
+ * @return  SPOTD_ERROR_INVALID_LINK if there is no such playlist, or
+ *   SPOTD_ERROR_INVALID_STATE if it is not in the user's playlist container
+ */
+static spotd_error set_offline_mode(const char *playlist_str, int offline) {
+  sp_playlist *playlist;
+  sp_error error;
+
+  playlist = playlist_from_string(playlist_str);
+
+  if (playlist == NULL) {
+    return SPOTD_ERROR_INVALID_LINK;
+  }
+
+  error = sp_playlist_set_offline_mode(g_sess, playlist, offline);
+  sp_playlist_release(playlist);
+
+  if (error != SP_ERROR_OK) {
+    fprintf(stderr, "Error: %s\n", sp_error_message(error));
+    return SPOTD_ERROR_INVALID_STATE;
+  }
+
+  offline_status_updated(g_sess);
+
+  return SPOTD_ERROR_OK;
+}
+
+/* -------------------------------  SEARCH  -------------------------------- */
+
+/**
+ * Normalize a search query, so that queries differing only in case and
+ * white space share their cached results
+ *
+ * @param  query  The query
+ * @param  normalized  Receives the query in lower case, with white space
+ *   trimmed and collapsed to single spaces
+ * @param  size  Size of normalized
+ */
+static void normalize_query(const char *query, char *normalized, size_t size) {
+  size_t length = 0;
+  int space = 0;
+
+  for (; *query != '\0' && length + 2 < size; query++) {
+    if (isspace((unsigned char) *query)) {
+      space = length > 0;
+    } else {
+      if (space) {
+        normalized[length++] = ' ';
+        space = 0;
+      }
+      normalized[length++] = (char) tolower((unsigned char) *query);
+    }
+  }
+
+  normalized[length] = '\0';
+}
+
+/**
+ * Answer a client with a page of cached search results
+ *
+ * @param  result  The search results
+ * @param  origin  The SEARCH command
+ * @param  offset  Index of the first result to send
+ * @param  limit  Maximum number of results to send
+ */
+static void send_search_page(const search_result_t *result, const spotd_command_origin *origin,
+                             int offset, int limit) {
+  spotd_search_page page;
+  int i;
+
+  page.total = result->total;
+  page.offset = offset;
+  page.num_tracks = 0;
+
+  for (i = offset; i < result->num_tracks && page.num_tracks < limit &&
+                   page.num_tracks < SPOTD_SEARCH_PAGE_MAX; i++) {
+    page.tracks[page.num_tracks++] = result->tracks[i];
+  }
+
+  spotd_server_complete_search(origin, &page);
+}
+
+/**
+ * Copy a track or artist name, replacing control characters so that the
+ * name fits on a text protocol line
+ *
+ * @param  dest  The buffer to copy to, SPOTD_NAME_MAX bytes
+ * @param  name  The name, can be NULL
+ */
+static void copy_name(char *dest, const char *name) {
+  char *c;
+
+  snprintf(dest, SPOTD_NAME_MAX, "%s", name != NULL ? name : "");
+
+  for (c = dest; *c != '\0'; c++) {
+    if ((unsigned char) *c < 0x20) {
+      *c = ' ';
+    }
+  }
+}
+
+/**
+ * Release cached search results
+ *
+ * @param  value  The search_result_t to release
+ */
+static void release_search_result(void *value) {
+  search_result_t *result = (search_result_t *) value;
+
+  free(result->tracks);
+  free(result);
+}
+
+/**
+ * Answer all clients waiting for a search with an error, and free it
+ *
+ * @param  pending  The search, already removed from g_pending_searches
+ * @param  error  The error
+ * @param  message  The error message
+ */
+static void fail_search(pending_search_t *pending, spotd_error error, const char *message) {
+  search_waiter_t *waiter;
+
+  while ((waiter = TAILQ_FIRST(&pending->waiters)) != NULL) {
+    TAILQ_REMOVE(&pending->waiters, waiter, link);
+    spotd_server_complete_command(&waiter->origin, SPOTD_RESULT_ERROR, error, message);
+    free(waiter);
+  }
+
+  free(pending->query);
+  free(pending);
+}
+
+/**
+ * Callback called when Spotify has answered a search. The results are
+ * cached, and sent to every client waiting for them.
+ *
+ * @sa search_complete_cb
+ */
+static void search_complete(sp_search *search, void *userdata) {
+  pending_search_t *pending = (pending_search_t *) userdata;
+  search_result_t *result;
+  search_waiter_t *waiter;
+  sp_track *track;
+  sp_link *link;
+  int i;
+
+  TAILQ_REMOVE(&g_pending_searches, pending, link);
+
+  if (sp_search_error(search) != SP_ERROR_OK) {
+    fprintf(stderr, "Search for \"%s\" failed: %s\n", pending->query,
+            sp_error_message(sp_search_error(search)));
+    sp_search_release(search);
+    fail_search(pending, SPOTD_ERROR_OTHER_PERMANENT, "Search failed");
+    return;
+  }
+
+  result = (search_result_t *) malloc(sizeof(search_result_t));
+  result->num_tracks = 0;
+  result->tracks = (spotd_search_track *) calloc(sp_search_num_tracks(search) + 1,
+                                                 sizeof(spotd_search_track));
+
+  for (i = 0; i < sp_search_num_tracks(search) && result->num_tracks < SEARCH_MAX_TRACKS; i++) {
+    track = sp_search_track(search, i);
+    link = sp_link_create_from_track(track, 0);
+
+    if (link == NULL) {
+      continue;
+    }
+
+    sp_link_as_string(link, result->tracks[result->num_tracks].link, SPOTD_LINK_MAX);
+    sp_link_release(link);
+
+    copy_name(result->tracks[result->num_tracks].name, sp_track_name(track));
+    copy_name(result->tracks[result->num_tracks].artist, sp_track_num_artists(track) > 0 ?
+              sp_artist_name(sp_track_artist(track, 0)) : NULL);
+    result->tracks[result->num_tracks].duration_ms = sp_track_duration(track);
+    result->num_tracks++;
+  }
+
+  // Only the fetched matches can be paged through
+  result->total = sp_search_total_tracks(search);
+  if (result->total > SEARCH_MAX_TRACKS || result->total < result->num_tracks) {
+    result->total = result->num_tracks;
+  }
+
+  sp_search_release(search);
+
+  TAILQ_FOREACH(waiter, &pending->waiters, link) {
+    send_search_page(result, &waiter->origin, waiter->offset, waiter->limit);
+  }
+
+  spotd_cache_put(&g_search_cache, pending->query, result);
+
+  while ((waiter = TAILQ_FIRST(&pending->waiters)) != NULL) {
+    TAILQ_REMOVE(&pending->waiters, waiter, link);
+    free(waiter);
+  }
+
+  free(pending->query);
+  free(pending);
+}
+
+/**
+ * Search for tracks. Results are answered from the cache if the query was
+ * searched for recently, and clients asking for a query that is already
+ * being searched for wait for the same search.
+ *
+ * @param  query  The search query
+ * @param  offset  Index of the first result to send
+ * @param  limit  Maximum number of results to send
+ * @param  origin  The SEARCH command
+ */
+static void search_tracks(const char *query, int offset, int limit,
+                          const spotd_command_origin *origin) {
+  search_result_t *result;
+  pending_search_t *pending;
+  search_waiter_t *waiter;
+  char normalized[256];
+
+  normalize_query(query, normalized, sizeof(normalized));
+
+  if (normalized[0] == '\0') {
+    spotd_server_complete_command(origin, SPOTD_RESULT_ERROR, SPOTD_ERROR_OTHER_PERMANENT,
+                                  "Empty query");
+    return;
+  }
+
+  result = (search_result_t *) spotd_cache_get(&g_search_cache, normalized);
+
+  if (result != NULL) {
+    send_search_page(result, origin, offset, limit);
+    return;
+  }
+
+  waiter = (search_waiter_t *) malloc(sizeof(search_waiter_t));
+  waiter->origin = *origin;
+  waiter->offset = offset;
+  waiter->limit = limit;
+
+  TAILQ_FOREACH(pending, &g_pending_searches, link) {
+    if (strcmp(pending->query, normalized) == 0) {
+      TAILQ_INSERT_TAIL(&pending->waiters, waiter, link);
+      return;
+    }
+  }
+
+  pending = (pending_search_t *) malloc(sizeof(pending_search_t));
+  pending->query = strdup(normalized);
+  TAILQ_INIT(&pending->waiters);
+  TAILQ_INSERT_TAIL(&pending->waiters, waiter, link);
+  TAILQ_INSERT_TAIL(&g_pending_searches, pending, link);
+
+  pending->search = sp_search_create(g_sess, normalized, 0, SEARCH_MAX_TRACKS, 0, 0, 0, 0,
+                                     0, 0, SP_SEARCH_STANDARD, &search_complete, pending);
+
+  if (pending->search == NULL) {
+    TAILQ_REMOVE(&g_pending_searches, pending, link);
+    fail_search(pending, SPOTD_ERROR_OTHER_PERMANENT, "Search failed");
+  }
+}
+
+/**
+ * Abandon all searches in progress, answering their clients with
+ * SPOTD_ERROR_CANCELLED
+ */
+static void cancel_searches(void) {
+  pending_search_t *pending;
+
+  while ((pending = TAILQ_FIRST(&g_pending_searches)) != NULL) {
+    TAILQ_REMOVE(&g_pending_searches, pending, link);
+    sp_search_release(pending->search);
+    fail_search(pending, SPOTD_ERROR_CANCELLED, "Cancelled");
+  }
+}
+
+/* -----------------------------  HOT RESTART  ----------------------------- */
+
+/**
+ * Handoff thread. Accepts handoff requests from new spotd processes, and
+ * passes them on to the main thread.
+ */
+static void *handoff_thread(void *arg) {
+  int client;
+
+  for (;;) {
+    client = accept(g_handoff_listener, NULL, NULL);
+
+    if (client < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Accepting a handoff request failed");
+      break;
+    }
+
+    if (spotd_handoff_read_request(client) != SPOTD_ERROR_OK) {
+      close(client);
+      continue;
+    }
+
+    pthread_mutex_lock(&g_command_mutex);
+    if (g_handoff_client < 0) {
+      g_handoff_client = client;
+      client = -1;
+      eventfd_write(g_command_fd, 1);
+    }
+    pthread_mutex_unlock(&g_command_mutex);
+
+    // A handoff is already in progress
+    if (client >= 0) {
+      close(client);
+    }
   }
 
   pthread_exit(NULL);
 }
 
+/**
+ * Start accepting handoff requests
+ *
+ * @param  path  The path of the handoff socket
+ */
+static void start_handoff_listener(const char *path) {
+  pthread_t handoff_thread_id;
+
+  g_handoff_listener = spotd_handoff_listen(path);
+
+  if (g_handoff_listener < 0) {
+    fprintf(stderr, "Warning: hot restart disabled\n");
+    return;
+  }
+
+  pthread_create(&handoff_thread_id, NULL, handoff_thread, NULL);
+  pthread_detach(handoff_thread_id);
+}
+
+/**
+ * Collect the player state passed on to a new process and saved to the
+ * state file: the status, the play queue and the playlist being played
+ *
+ * @param  state  Receives the player state
+ */
+static void collect_state(spotd_handoff_state *state) {
+  spotd_status status;
+  queue_entry_t *entry;
+  sp_link *link;
+
+  client_status_requested(&status);
+
+  memset(state, 0, sizeof(*state));
+  state->state = status.state;
+  state->position_ms = status.position_ms;
+  state->volume = status.volume;
+  snprintf(state->track_link, SPOTD_LINK_MAX, "%s", status.track_link);
+
+  TAILQ_FOREACH(entry, &g_play_queue, link) {
+    snprintf(state->queue[state->queue_length++], SPOTD_LINK_MAX, "%s", entry->track_link);
+  }
+
+  if (g_playlist != NULL && (link = sp_link_create_from_playlist(g_playlist)) != NULL) {
+    sp_link_as_string(link, state->playlist_link, SPOTD_LINK_MAX);
+    sp_link_release(link);
+    // A playlist still loading starts from its first track asked for
+    state->playlist_cursor = g_playlist_cursor;
+  }
+}
+
+/**
+ * Hand off to a new spotd process. Playback is paused, and the listening
+ * sockets and player state are passed on. If the new process does not take
+ * over, playback continues here.
+ *
+ * @param  client  The handoff connection
+ * @return  Non-zero if the new process took over, and this one should exit
+ */
+static int hand_off(int client) {
+  spotd_handoff_state state;
+  spotd_server_socket sockets[SPOTD_SERVER_MAX_SOCKETS];
+  spotd_command *command;
+  int num_sockets, was_playing;
+
+  puts("Handing off to a new spotd process...");
+
+  // Pause without telling clients, they will see the track continue
+  was_playing = g_current_track != NULL && g_status.state == SPOTD_PLAYER_PLAYING;
+  if (was_playing) {
+    sp_session_player_play(g_sess, 0);
+    zones_set_paused(1);
+  }
+
+  collect_state(&state);
+
+  // A track asked for, but not started yet. Only the last one would play.
+  pthread_mutex_lock(&g_command_mutex);
+  TAILQ_FOREACH(command, &g_commands, link) {
+    if (command->type == SPOTD_COMMAND_PLAY_TRACK) {
+      snprintf(state.play_link, SPOTD_LINK_MAX, "%s", command->argv[0]);
+    }
+  }
+  pthread_mutex_unlock(&g_command_mutex);
+
+  num_sockets = spotd_server_get_sockets(sockets, SPOTD_SERVER_MAX_SOCKETS);
+
+  if (spotd_handoff_send(client, &state, sockets, num_sockets) == SPOTD_ERROR_OK &&
+      spotd_handoff_wait_ack(client) == SPOTD_ERROR_OK) {
+    puts("Handed off");
+    close(client);
+    return 1;
+  }
+
+  fprintf(stderr, "Handoff failed, continuing\n");
+  close(client);
+
+  if (was_playing) {
+    zones_set_paused(0);
+    sp_session_player_play(g_sess, 1);
+  }
+
+  return 0;
+}
+
+/**
+ * Continue where the previous spotd process stopped: restore the volume,
+ * resume the track at the handed-over position, and restore the play queue,
+ * the playlist being played and a track that was asked for but not started
+ * yet
+ *
+ * @param  state  The handed-over player state
+ */
+static void restore_state(const spotd_handoff_state *state) {
+  spotd_command_origin origin;
+  spotd_command *command;
+  sp_track *track;
+  char **argv;
+  int i;
+
+  memset(&origin, 0, sizeof(origin));
+
+  set_volume(state->volume);
+
+  if (state->state != SPOTD_PLAYER_STOPPED && state->track_link[0] != '\0') {
+    track = track_from_link(state->track_link);
+
+    if (track != NULL) {
+      printf("Resuming \"%s\" at %d ms\n", state->track_link, state->position_ms);
+      g_resume_paused = state->state == SPOTD_PLAYER_PAUSED;
+      play_track(track, &origin, state->state == SPOTD_PLAYER_LOADING ? 0 : state->position_ms);
+    }
+  }
+
+  for (i = 0; i < state->queue_length; i++) {
+    queue_add(state->queue[i]);
+  }
+
+  // The playlist continues after the current track
+  if (state->playlist_link[0] != '\0') {
+    start_playlist(state->playlist_link, state->playlist_cursor, &origin,
+                   state->state == SPOTD_PLAYER_STOPPED);
+  }
+
+  if (state->play_link[0] != '\0') {
+    argv = (char **) malloc(sizeof(char *));
+    argv[0] = strdup(state->play_link);
+    command = spotd_command_create(SPOTD_COMMAND_PLAY_TRACK, 1, argv);
+
+    pthread_mutex_lock(&g_command_mutex);
+    TAILQ_INSERT_TAIL(&g_commands, command, link);
+    pthread_mutex_unlock(&g_command_mutex);
+  }
+}
+
+/**
+ * Take over from the running spotd process: receive its listening sockets
+ * and player state, start the server on the sockets and resume playback
+ *
+ * @param  path  The path of the handoff socket of the running process
+ * @param  server_config  The server configuration
+ * @return  returns a spotd_error
+ */
+static spotd_error take_over(const char *path, spotd_server_config *server_config) {
+  spotd_handoff_state state;
+  spotd_server_socket sockets[SPOTD_SERVER_MAX_SOCKETS];
+  spotd_error error;
+  int socket_desc, num_sockets;
+
+  puts("Taking over from the running spotd process...");
+
+  // Connected only now, the running process expects the request at once
+  socket_desc = spotd_handoff_connect(path);
+
+  if (socket_desc < 0) {
+    fprintf(stderr, "The running spotd process is gone\n");
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  error = spotd_handoff_request(socket_desc, &state, sockets, &num_sockets);
+
+  if (error != SPOTD_ERROR_OK) {
+    close(socket_desc);
+    return error;
+  }
+
+  server_config->inherited_sockets = sockets;
+  server_config->num_inherited_sockets = num_sockets;
+
+  error = spotd_server_start(server_config, &server_callbacks);
+
+  server_config->inherited_sockets = NULL;
+  server_config->num_inherited_sockets = 0;
+
+  if (error != SPOTD_ERROR_OK) {
+    close(socket_desc);
+    return error;
+  }
+
+  // The old process exits once it has the acknowledgement
+  spotd_handoff_ack(socket_desc);
+  close(socket_desc);
+  restore_state(&state);
+
+  return SPOTD_ERROR_OK;
+}
+
+/* -----------------------------  STATE FILE  ------------------------------ */
+
+/**
+ * Save the player state to the state file if it has changed. While a track
+ * plays, its position is saved every STATE_SAVE_INTERVAL_MS as well.
+ *
+ * @param  force  Non-zero to save the state even if it has not changed
+ */
+static void save_state(int force) {
+  spotd_handoff_state state;
+  int64_t now = monotonic_ms();
+  int position_ms;
+
+  collect_state(&state);
+
+  position_ms = state.position_ms;
+  state.position_ms = 0;
+
+  if (!force && memcmp(&state, &g_saved_state, sizeof(state)) == 0 &&
+      (state.state != SPOTD_PLAYER_PLAYING || now < g_next_state_save)) {
+    return;
+  }
+
+  g_saved_state = state;
+  g_next_state_save = now + STATE_SAVE_INTERVAL_MS;
+
+  state.position_ms = position_ms;
+  if (spotd_state_file_write(&g_state_file, &state) != SPOTD_ERROR_OK) {
+    fprintf(stderr, "Warning: the player state does not fit in the state file\n");
+  }
+}
+
+/* ---------------------------------  MAIN  -------------------------------- */
+
+/**
+ * A track has ended. Remove it from the playlist, and start the next track
+ * of the play queue or of the playlist being played.
+ *
+ * Called from the main loop when the end_of_track() callback has signalled
+ * g_end_of_track_fd.
+ */
+static void track_ended(void) {
+  spotd_command_origin origin;
+
+  if (g_current_track) {
+    printf("\"%s\" ended\n", sp_track_name(g_current_track));
+    publish_event(SPOTD_EVENT_TRACK_ENDED, 0, g_status.track_link);
+
+    sp_track_release(g_current_track);
+    g_current_track = NULL;
+    update_status(SPOTD_PLAYER_STOPPED, NULL);
+
+    // Queued tracks play before the rest of the playlist
+    memset(&origin, 0, sizeof(origin));
+    if (!TAILQ_EMPTY(&g_play_queue)) {
+      play_next(&origin);
+    } else if (g_playlist != NULL && !g_playlist_pending) {
+      play_playlist_track(&origin);
+    }
+  }
+}
+
+/**
+ * Push a position event to subscribers, if it is time for one
+ *
+ * @param  next_timeout  The time until the main loop wakes up next, in
+ *   milliseconds. Lowered if the next position event is due earlier.
+ */
+static void position_tick(int *next_timeout) {
+  spotd_status status;
+  int64_t now;
+
+  if (g_current_track == NULL || g_status.state != SPOTD_PLAYER_PLAYING) {
+    return;
+  }
+
+  now = monotonic_ms();
+
+  if (now >= g_next_position_tick) {
+    client_status_requested(&status);
+    publish_event(SPOTD_EVENT_POSITION, status.position_ms, status.track_link);
+    g_next_position_tick = now + POSITION_TICK_MS;
+  }
+
+  if (*next_timeout > g_next_position_tick - now) {
+    *next_timeout = (int) (g_next_position_tick - now);
+  }
+}
+
+/**
+ * Record the time to first audio once the first samples of a starting track
+ * have been written to the output device: from process start for the first
+ * track played, and from the command that started it for tracks started by
+ * clients.
+ *
+ * @param  next_timeout  The main loop timeout, shortened to check again soon
+ *   while the track is not heard yet
+ */
+static void measure_first_audio(int *next_timeout) {
+  int64_t played_ms;
+  int ttfa_ms;
+
+  if (!g_first_audio_pending) {
+    return;
+  }
+
+  played_ms = zones_played_ms();
+
+  if (played_ms == 0) {
+    if (*next_timeout > FIRST_AUDIO_POLL_MS) {
+      *next_timeout = FIRST_AUDIO_POLL_MS;
+    }
+    return;
+  }
+
+  g_first_audio_pending = 0;
+
+  pthread_mutex_lock(&g_status_mutex);
+
+  if (g_startup_ttfa_ms == 0) {
+    g_startup_ttfa_ms = (int) (played_ms - g_start_ms);
+    printf("First audio %d ms after start\n", g_startup_ttfa_ms);
+  }
+
+  if (g_first_audio_command_ms != 0) {
+    ttfa_ms = (int) (played_ms - g_first_audio_command_ms);
+
+    if (g_ttfa_count == 0 || ttfa_ms < g_ttfa_min_ms) {
+      g_ttfa_min_ms = ttfa_ms;
+    }
+    if (ttfa_ms > g_ttfa_max_ms) {
+      g_ttfa_max_ms = ttfa_ms;
+    }
+    g_ttfa_last_ms = ttfa_ms;
+    g_ttfa_total_ms += ttfa_ms;
+    g_ttfa_count++;
+  }
+
+  pthread_mutex_unlock(&g_status_mutex);
+}
+
+/**
+ * Start the server. Run on a thread of its own at startup, so that the
+ * sockets are set up while the libspotify session is created.
+ *
+ * @param  arg  The server configuration
+ * @return  The spotd_error of spotd_server_start()
+ */
+static void *server_start_thread(void *arg) {
+  spotd_server_config *config = (spotd_server_config *) arg;
+
+  return (void *) (intptr_t) spotd_server_start(config, &server_callbacks);
+}
+
+/**
+ * Show usage information
+ *
+ * @param  progname  The program name
+ */
+static void usage(const char *progname) {
+  fprintf(stderr, "usage: %s [-u <username> -p <password>] [-l <address>]... [-P <port>] [-H <port>] [-b <backlog>] [-R <threads>] [-c <max>] [-t <seconds>] [-T <seconds>] [-r <rate>] [-s <socket>] [-g <group>] [-x <socket>] [-S <file>] [-M <tracks>] [-C <dir>] [-D <dir>] [-Z <megabytes>] [-B <kbps>] [-O <kbps>] [-o <device>]... [-L <milliseconds>] [-U]\n", progname);
+}
+
+/**
+ * Add a file descriptor to the main loop
+ *
+ * @param  epoll_desc  The main loop epoll instance
+ * @param  fd  The file descriptor to wait on, or -1 if creating it failed
+ * @return  returns a spotd_error
+ */
+static spotd_error watch_fd(int epoll_desc, int fd) {
+  struct epoll_event event;
+
+  if (fd < 0) {
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+
+  if (epoll_ctl(epoll_desc, EPOLL_CTL_ADD, fd, &event) < 0) {
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  return SPOTD_ERROR_OK;
+}
+
+/**
+ * Create the file descriptors the main loop waits on: event file descriptors
+ * for libspotify, end of track and commands, a signalfd for SIGINT and a
+ * monotonic timer for libspotify timeouts. SIGINT must be blocked in all
+ * threads before this is called.
+ *
+ * @param  signal_fd  Receives the signalfd
+ * @param  timer_fd  Receives the timer
+ * @return  The epoll instance of the main loop, or -1 on failure
+ */
+static int create_main_loop(int *signal_fd, int *timer_fd) {
+  int epoll_desc;
+
+  epoll_desc = epoll_create1(EPOLL_CLOEXEC);
+
+  if (epoll_desc < 0) {
+    return -1;
+  }
+
+  g_notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  g_end_of_track_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  g_command_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  *signal_fd = signalfd(-1, &g_handled_signal_set, SFD_NONBLOCK | SFD_CLOEXEC);
+  *timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+  if (watch_fd(epoll_desc, g_notify_fd) != SPOTD_ERROR_OK ||
+      watch_fd(epoll_desc, g_end_of_track_fd) != SPOTD_ERROR_OK ||
+      watch_fd(epoll_desc, g_command_fd) != SPOTD_ERROR_OK ||
+      watch_fd(epoll_desc, *signal_fd) != SPOTD_ERROR_OK ||
+      watch_fd(epoll_desc, *timer_fd) != SPOTD_ERROR_OK) {
+    close(epoll_desc);
+    return -1;
+  }
+
+  return epoll_desc;
+}
+
+/**
+ * Arm the main loop timer
+ *
+ * @param  timer_fd  The timer
+ * @param  timeout  Time until the timer expires, in milliseconds. The timer
+ *   is disarmed if zero.
+ */
+static void set_main_loop_timer(int timer_fd, int timeout) {
+  struct itimerspec spec;
+
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec = timeout / 1000;
+  spec.it_value.tv_nsec = (long) (timeout % 1000) * 1000000;
+
+  timerfd_settime(timer_fd, 0, &spec, NULL);
+}
+
 int main(int argc, char **argv) {
   sp_session *sp;
   sp_error err;
   sp_track *track;
+  spotd_command *command;
+  spotd_error error;
   int next_timeout = 0;
   const char *username = NULL;
   const char *password = NULL;
+  const char *handoff_path = NULL;
+  const char *state_path = NULL;
+  char remembered_user[256];
+  pthread_t server_thread;
+  void *server_error;
+  const char *settings_path = NULL;
+  int cache_size_mb = -1;
+  int bitrate_kbps = 160;
+  int offline_bitrate_kbps = 0;
+  sp_bitrate bitrate;
+  spotd_handoff_state resume_state;
+  int resume = 0;
+  int track_cache_size = 1024;
+  int handoff_socket;
+  int taking_over = 0;
+  int handoff_client;
+  int handed_off = 0;
+  int interrupted = 0;
+  int playback_done;
+  int epoll_desc, signal_fd, timer_fd;
+  struct epoll_event events[MAIN_LOOP_MAX_EVENTS];
+  struct signalfd_siginfo siginfo;
+  eventfd_t value;
+  int num_events, i;
   int opt;
-  pthread_t signal_handler_thread_id;
+  struct group *group;
+  spotd_server_config server_config = {
+    .num_bind_addresses = 0,
+    .port = 8888,
+    .http_port = 0,
+    .backlog = 0,
+    .worker_threads = 1,
+    .max_connections = 512,
+    .idle_timeout_ms = 600 * 1000,
+    .command_timeout_ms = 10 * 1000,
+    .command_rate = 20,
+    .command_burst = 0,
+    .unix_socket_path = NULL,
+    .unix_socket_gid = (gid_t) -1,
+  };
+
+  g_start_ms = monotonic_ms();
 
   // Parse options
-  while ((opt = getopt(argc, argv, "u:p:")) != EOF) {
+  while ((opt = getopt(argc, argv, "u:p:l:P:H:b:R:c:t:T:r:s:g:x:S:M:C:D:Z:B:O:o:L:U")) != EOF) {
     switch (opt) {
     case 'u':
       username = optarg;
@@ -378,39 +2625,162 @@ int main(int argc, char **argv) {
     case 'p':
       password = optarg;
       break;
+    case 'l':
+      if (server_config.num_bind_addresses == SPOTD_SERVER_MAX_BIND_ADDRESSES) {
+        fprintf(stderr, "Error: too many bind addresses\n");
+        exit(1);
+      }
+      server_config.bind_addresses[server_config.num_bind_addresses++] = optarg;
+      break;
+    case 'P':
+      server_config.port = atoi(optarg);
+      break;
+    case 'H':
+      server_config.http_port = atoi(optarg);
+      break;
+    case 'b':
+      server_config.backlog = atoi(optarg);
+      break;
+    case 'R':
+      server_config.worker_threads = atoi(optarg);
+      break;
+    case 'c':
+      server_config.max_connections = atoi(optarg);
+      break;
+    case 't':
+      server_config.idle_timeout_ms = atoi(optarg) * 1000;
+      break;
+    case 'T':
+      server_config.command_timeout_ms = atoi(optarg) * 1000;
+      break;
+    case 'r':
+      server_config.command_rate = atoi(optarg);
+      break;
+    case 's':
+      server_config.unix_socket_path = optarg;
+      break;
+    case 'g':
+      group = getgrnam(optarg);
+      if (group == NULL) {
+        fprintf(stderr, "Error: unknown group \"%s\"\n", optarg);
+        exit(1);
+      }
+      server_config.unix_socket_gid = group->gr_gid;
+      break;
+    case 'x':
+      handoff_path = optarg;
+      break;
+    case 'S':
+      state_path = optarg;
+      break;
+    case 'M':
+      track_cache_size = atoi(optarg);
+      break;
+    case 'C':
+      spconfig.cache_location = optarg;
+      break;
+    case 'D':
+      settings_path = optarg;
+      break;
+    case 'Z':
+      cache_size_mb = atoi(optarg);
+      break;
+    case 'B':
+      bitrate_kbps = atoi(optarg);
+      break;
+    case 'O':
+      offline_bitrate_kbps = atoi(optarg);
+      break;
+    case 'o':
+      if (add_zone(optarg) != SPOTD_ERROR_OK) {
+        fprintf(stderr, "At most %d output devices of up to %d characters are supported\n",
+                SPOTD_MAX_ZONES, SPOTD_DEVICE_MAX - 1);
+        exit(1);
+      }
+      break;
+    case 'L':
+      g_sync_latency_ms = atoi(optarg);
+      break;
+    case 'U':
+      server_config.io_uring = 1;
+      break;
     default:
       exit(1);
     }
   }
 
-  // Print usage if not all require arguments were passed
-  if (!username || !password) {
-    usage(basename(argv[0]));
-    exit(1);
-  }
-
   // Init global variables
   g_current_track = NULL;
   g_queued_track = NULL;
+  TAILQ_INIT(&g_commands);
+  TAILQ_INIT(&g_priority_commands);
+  TAILQ_INIT(&g_play_queue);
+  pthread_mutex_init(&g_play_queue_mutex, NULL);
+  spotd_cache_init(&g_track_cache, track_cache_size > 0 ? track_cache_size : 0,
+                   release_cached_track);
+  spotd_cache_init(&g_search_cache, SEARCH_CACHE_SIZE, release_search_result);
+  spotd_cache_set_ttl(&g_search_cache, SEARCH_CACHE_TTL_MS);
+  TAILQ_INIT(&g_pending_searches);
+  TAILQ_INIT(&g_warm_list);
+  pthread_mutex_init(&g_status_mutex, NULL);
+  g_status.volume = 100;
+  pthread_mutex_init(&g_delivery_mutex, NULL);
+  if (g_num_zones == 0) {
+    add_zone("default");
+  }
 
-  // Initialize signal handling
-  g_interrupted = 0;
+  pthread_mutex_init(&g_command_mutex, NULL);
+
+  // Initialize signal handling. The signals are blocked before any thread
+  // is started, and are read from a signalfd by the main loop.
+  g_handoff_listener = -1;
+  g_handoff_client = -1;
   sigemptyset(&g_handled_signal_set);
   sigaddset(&g_handled_signal_set, SIGINT);
   pthread_sigmask(SIG_BLOCK, &g_handled_signal_set, NULL);
-  pthread_create(&signal_handler_thread_id, NULL, signal_handler_thread, NULL);
 
-  // Init the audio system
-  audio_init(&g_audiofifo);
+  epoll_desc = create_main_loop(&signal_fd, &timer_fd);
+
+  if (epoll_desc < 0) {
+    perror("Creating the main loop failed");
+    exit(1);
+  }
+
+  // Init the audio system, with an output thread for each zone
+  start_zones();
+
+  // With a spotd process already running, the server is started on its
+  // sockets once logged in. Until then the old process keeps playing. It
+  // only waits a few seconds for a request once connected, so the handoff
+  // connection is made by take_over() and this one only finds out whether
+  // there is a process listening.
+  if (handoff_path != NULL && (handoff_socket = spotd_handoff_connect(handoff_path)) >= 0) {
+    close(handoff_socket);
+    taking_over = 1;
+  }
+
+  // Without a running process to take over from, playback resumes where
+  // the state file says the last one was
+  if (state_path != NULL) {
+    if (spotd_state_file_open(&g_state_file, state_path) != SPOTD_ERROR_OK) {
+      exit(1);
+    }
+
+    resume = !taking_over &&
+             spotd_state_file_read(&g_state_file, &resume_state) == SPOTD_ERROR_OK;
+  }
 
-  // Start server
-  if (spotd_server_start(8888, &server_callbacks) != SPOTD_ERROR_OK) {
+  // Start the server while the session is created
+  if (!taking_over &&
+      pthread_create(&server_thread, NULL, server_start_thread, &server_config) != 0) {
     fprintf(stderr, "Error: %s\n", "failed starting a server");
     exit(1);
   }
 
-  // Create session
+  // Create session. The settings are kept with the cache unless asked
+  // otherwise.
   spconfig.application_key_size = g_appkey_size;
+  spconfig.settings_location = settings_path != NULL ? settings_path : spconfig.cache_location;
 
   err = sp_session_create(&spconfig, &sp);
 
@@ -421,77 +2791,320 @@ int main(int argc, char **argv) {
 
   g_sess = sp;
 
-  pthread_mutex_init(&g_notify_mutex, NULL);
-  pthread_cond_init(&g_notify_cond, NULL);
+  // Zero lets libspotify size the cache, by default 10% of the free space
+  if (cache_size_mb >= 0) {
+    sp_session_set_cache_size(sp, (size_t) cache_size_mb);
+  }
+
+  if (set_bitrate(bitrate_kbps) != SPOTD_ERROR_OK) {
+    fprintf(stderr, "Error: unsupported bitrate %d\n", bitrate_kbps);
+    exit(1);
+  }
+
+  // Changing the offline bitrate downloads nothing again, only new tracks
+  // are synced at it
+  if (offline_bitrate_kbps > 0) {
+    if (bitrate_from_kbps(offline_bitrate_kbps, &bitrate) != SPOTD_ERROR_OK) {
+      fprintf(stderr, "Error: unsupported bitrate %d\n", offline_bitrate_kbps);
+      exit(1);
+    }
+    sp_session_preferred_offline_bitrate(sp, bitrate, 0);
+  }
+
+  // Stored credentials log in without sending the password again, falling
+  // back to the password if they fail. A new login is remembered for the
+  // next start.
+  if (sp_session_remembered_user(sp, remembered_user, sizeof(remembered_user)) > 0 &&
+      (username == NULL || strcmp(username, remembered_user) == 0) &&
+      sp_session_relogin(sp) == SP_ERROR_OK) {
+    printf("Logging in as %s with stored credentials\n", remembered_user);
+    if (username != NULL && password != NULL) {
+      g_login_username = username;
+      g_login_password = password;
+    }
+  } else if (username != NULL && password != NULL) {
+    sp_session_login(sp, username, password, 1, NULL);
+  } else {
+    usage(basename(argv[0]));
+    exit(1);
+  }
+
+  if (!taking_over) {
+    pthread_join(server_thread, &server_error);
+
+    if ((spotd_error) (intptr_t) server_error != SPOTD_ERROR_OK) {
+      fprintf(stderr, "Error: %s\n", "failed starting a server");
+      exit(1);
+    }
+  }
 
-  sp_session_login(sp, username, password, 0, NULL);
-  pthread_mutex_lock(&g_notify_mutex);
+  if (handoff_path != NULL && !taking_over) {
+    start_handoff_listener(handoff_path);
+  }
 
   for (;;) {
-    if (next_timeout == 0) {
-      while(!g_notify_do && !g_playback_done && !g_interrupted && (g_command == NULL)) {
-        pthread_cond_wait(&g_notify_cond, &g_notify_mutex);
+    // libspotify asks to be called again at once with a zero timeout, in
+    // which case the loop only picks up what is ready without waiting
+    num_events = epoll_wait(epoll_desc, events, MAIN_LOOP_MAX_EVENTS, next_timeout > 0 ? -1 : 0);
+
+    if (num_events < 0) {
+      if (errno == EINTR) {
+        continue;
       }
-    } else {
-      struct timespec ts;
+      perror("Waiting for events failed");
+      break;
+    }
 
-      #if _POSIX_TIMERS > 0
-        clock_gettime(CLOCK_REALTIME, &ts);
-      #else
-        struct timeval tv;
-        gettimeofday(&tv, NULL);
-        TIMEVAL_TO_TIMESPEC(&tv, &ts);
-      #endif
+    playback_done = 0;
 
-      ts.tv_sec += next_timeout / 1000;
-      ts.tv_nsec += (next_timeout % 1000) * 1000000;
+    for (i = 0; i < num_events; i++) {
+      // Reading the event counters and the timer expiration count resets them
+      if (events[i].data.fd == signal_fd) {
+        while (read(signal_fd, &siginfo, sizeof(siginfo)) == sizeof(siginfo)) {
+          if (siginfo.ssi_signo == SIGINT) {
+            interrupted = 1;
+          }
+        }
+      } else if (eventfd_read(events[i].data.fd, &value) == 0 &&
+                 events[i].data.fd == g_end_of_track_fd) {
+        playback_done = 1;
+      }
+    }
 
-      pthread_cond_timedwait(&g_notify_cond, &g_notify_mutex, &ts);
+    if (interrupted) {
+      // Stop execution if interrupted
+      break;
     }
 
-    g_notify_do = 0;
-    pthread_mutex_unlock(&g_notify_mutex);
+    pthread_mutex_lock(&g_command_mutex);
+    handoff_client = g_handoff_client;
+    g_handoff_client = -1;
+    pthread_mutex_unlock(&g_command_mutex);
 
-    if (g_interrupted) {
-      // Stop execution if interrupted
+    if (handoff_client >= 0 && hand_off(handoff_client)) {
+      // A new process has taken over
+      handed_off = 1;
       break;
     }
 
-    if (g_playback_done) {
+    if (playback_done) {
       track_ended();
-      g_playback_done = 0;
     }
 
-    if (g_command != NULL) {
-      switch (g_command->type) {
+    // Execute all queued commands
+    for (;;) {
+      pthread_mutex_lock(&g_command_mutex);
+      if ((command = TAILQ_FIRST(&g_priority_commands)) != NULL) {
+        TAILQ_REMOVE(&g_priority_commands, command, link);
+      } else if ((command = TAILQ_FIRST(&g_commands)) != NULL) {
+        TAILQ_REMOVE(&g_commands, command, link);
+      }
+      pthread_mutex_unlock(&g_command_mutex);
+
+      if (command == NULL) {
+        break;
+      }
+
+      switch (command->type) {
       case SPOTD_COMMAND_PLAY_TRACK:
-        track = track_from_link(g_command->argv[0]);
+        end_playlist();
+        track = track_from_link(command->argv[0]);
         if (track != NULL) {
-          play_track(track);
+          play_track(track, &command->origin, 0);
+        } else {
+          publish_event(SPOTD_EVENT_ERROR, SPOTD_ERROR_OTHER_PERMANENT, "Invalid track link");
+          spotd_server_complete_command(&command->origin, SPOTD_RESULT_ERROR,
+                                        SPOTD_ERROR_INVALID_LINK, "Invalid track link");
         }
         break;
       case SPOTD_COMMAND_STOP:
+        end_playlist();
         stop_playback();
+        spotd_server_complete_command(&command->origin, SPOTD_RESULT_OK, SPOTD_ERROR_OK, NULL);
+        break;
+      case SPOTD_COMMAND_VOLUME:
+        set_volume(atoi(command->argv[0]));
+        spotd_server_complete_command(&command->origin, SPOTD_RESULT_OK, SPOTD_ERROR_OK, NULL);
+        break;
+      case SPOTD_COMMAND_PAUSE:
+        if (pause_playback() == SPOTD_ERROR_OK) {
+          spotd_server_complete_command(&command->origin, SPOTD_RESULT_OK, SPOTD_ERROR_OK, NULL);
+        } else {
+          spotd_server_complete_command(&command->origin, SPOTD_RESULT_ERROR,
+                                        SPOTD_ERROR_INVALID_STATE, "Not playing");
+        }
+        break;
+      case SPOTD_COMMAND_RESUME:
+        if (resume_playback() == SPOTD_ERROR_OK) {
+          spotd_server_complete_command(&command->origin, SPOTD_RESULT_OK, SPOTD_ERROR_OK, NULL);
+        } else {
+          spotd_server_complete_command(&command->origin, SPOTD_RESULT_ERROR,
+                                        SPOTD_ERROR_INVALID_STATE, "Not paused");
+        }
+        break;
+      case SPOTD_COMMAND_QUEUE_ADD:
+        error = queue_add(command->argv[0]);
+        if (error == SPOTD_ERROR_OK) {
+          spotd_server_complete_command(&command->origin, SPOTD_RESULT_OK, SPOTD_ERROR_OK, NULL);
+        } else {
+          spotd_server_complete_command(&command->origin, SPOTD_RESULT_ERROR, error,
+                                        error == SPOTD_ERROR_INVALID_LINK ?
+                                        "Invalid track link" : "Queue is full");
+        }
+        break;
+      case SPOTD_COMMAND_QUEUE_REMOVE:
+        if (queue_remove(atoi(command->argv[0])) == SPOTD_ERROR_OK) {
+          spotd_server_complete_command(&command->origin, SPOTD_RESULT_OK, SPOTD_ERROR_OK, NULL);
+        } else {
+          spotd_server_complete_command(&command->origin, SPOTD_RESULT_ERROR,
+                                        SPOTD_ERROR_INVALID_STATE, "No such queue entry");
+        }
+        break;
+      case SPOTD_COMMAND_QUEUE_NEXT:
+        if (play_next(&command->origin) != SPOTD_ERROR_OK) {
+          spotd_server_complete_command(&command->origin, SPOTD_RESULT_ERROR,
+                                        SPOTD_ERROR_INVALID_STATE, "Queue is empty");
+        }
         break;
+      case SPOTD_COMMAND_QUEUE_CLEAR:
+        queue_clear();
+        spotd_server_complete_command(&command->origin, SPOTD_RESULT_OK, SPOTD_ERROR_OK, NULL);
+        break;
+      case SPOTD_COMMAND_PLAYLIST_PLAY:
+        if (start_playlist(command->argv[0], atoi(command->argv[1]), &command->origin,
+                           1) != SPOTD_ERROR_OK) {
+          spotd_server_complete_command(&command->origin, SPOTD_RESULT_ERROR,
+                                        SPOTD_ERROR_INVALID_LINK, "Invalid playlist");
+        }
+        break;
+      case SPOTD_COMMAND_PLAYLIST_NEXT:
+        if (g_playlist != NULL && !g_playlist_pending) {
+          play_playlist_track(&command->origin);
+        } else {
+          spotd_server_complete_command(&command->origin, SPOTD_RESULT_ERROR,
+                                        SPOTD_ERROR_INVALID_STATE, "No playlist is playing");
+        }
+        break;
+      case SPOTD_COMMAND_SEARCH:
+        search_tracks(command->argv[0], atoi(command->argv[1]), atoi(command->argv[2]),
+                      &command->origin);
+        break;
+      case SPOTD_COMMAND_ZONE_VOLUME:
+        if (set_zone_volume(atoi(command->argv[0]), atoi(command->argv[1])) == SPOTD_ERROR_OK) {
+          spotd_server_complete_command(&command->origin, SPOTD_RESULT_OK, SPOTD_ERROR_OK, NULL);
+        } else {
+          spotd_server_complete_command(&command->origin, SPOTD_RESULT_ERROR,
+                                        SPOTD_ERROR_INVALID_STATE, "No such zone");
+        }
+        break;
+      case SPOTD_COMMAND_BITRATE:
+        if (set_bitrate(atoi(command->argv[0])) == SPOTD_ERROR_OK) {
+          spotd_server_complete_command(&command->origin, SPOTD_RESULT_OK, SPOTD_ERROR_OK, NULL);
+        } else {
+          spotd_server_complete_command(&command->origin, SPOTD_RESULT_ERROR,
+                                        SPOTD_ERROR_UNSUPPORTED, "Unsupported bitrate");
+        }
+        break;
+      case SPOTD_COMMAND_OFFLINE:
+        error = set_offline_mode(command->argv[0], atoi(command->argv[1]));
+        if (error == SPOTD_ERROR_OK) {
+          spotd_server_complete_command(&command->origin, SPOTD_RESULT_OK, SPOTD_ERROR_OK, NULL);
+        } else {
+          spotd_server_complete_command(&command->origin, SPOTD_RESULT_ERROR, error,
+                                        error == SPOTD_ERROR_INVALID_LINK ? "Invalid playlist" :
+                                        "Not one of the user's playlists");
+        }
+        break;
+      case SPOTD_COMMAND_WARM:
+        error = warm_add(command->argc, command->argv);
+        if (error == SPOTD_ERROR_OK) {
+          spotd_server_complete_command(&command->origin, SPOTD_RESULT_OK, SPOTD_ERROR_OK, NULL);
+        } else {
+          spotd_server_complete_command(&command->origin, SPOTD_RESULT_ERROR, error,
+                                        error == SPOTD_ERROR_INVALID_LINK ?
+                                        "Invalid track link" : "Warm-up list is full");
+        }
+        break;
+      default:
+        break;
+      }
+
+      spotd_command_release(command);
+    }
+
+    sp_session_process_events(sp, &next_timeout);
+
+    if (taking_over && g_logged_in) {
+      if (take_over(handoff_path, &server_config) != SPOTD_ERROR_OK) {
+        fprintf(stderr, "Error: %s\n", "failed taking over from the running process");
+        exit(1);
+      }
+
+      taking_over = 0;
+      start_handoff_listener(handoff_path);
+    }
+
+    // State changes are saved once this process is in charge of playback
+    if (state_path != NULL && !g_save_state && g_logged_in && !taking_over) {
+      if (resume) {
+        puts("Resuming from the state file");
+        restore_state(&resume_state);
       }
+      g_save_state = 1;
+    }
+
+    prefetch_queue();
+    update_playlist_window();
+    position_tick(&next_timeout);
+    measure_first_audio(&next_timeout);
+    warm_cache(&next_timeout);
 
-      spotd_command_release(g_command);
-      g_command = NULL;
+    if (g_save_state) {
+      save_state(0);
     }
 
-    do {
-      sp_session_process_events(sp, &next_timeout);
-    } while (next_timeout == 0);
+    set_main_loop_timer(timer_fd, next_timeout);
+  }
 
-    pthread_mutex_lock(&g_notify_mutex);
+  // Keep what was playing to resume from, unless a new process took over
+  if (g_save_state && !handed_off) {
+    save_state(1);
   }
 
   // Cleanup
   stop_playback();
-  spotd_server_stop();
+  queue_clear();
+  end_playlist();
+  cancel_searches();
+  warm_clear();
+  printf("Track cache: %" PRIu64 " hits, %" PRIu64 " misses\n",
+         g_track_cache.hits, g_track_cache.misses);
+  printf("Search cache: %" PRIu64 " hits, %" PRIu64 " misses\n",
+         g_search_cache.hits, g_search_cache.misses);
+  spotd_cache_free(&g_track_cache);
+  spotd_cache_free(&g_search_cache);
+  spotd_server_stop(handed_off);
+
+  // After a handoff, the socket file belongs to the new process
+  if (g_handoff_listener >= 0 && !handed_off) {
+    close(g_handoff_listener);
+    unlink(handoff_path);
+  }
+
   sp_playlistcontainer_release(g_playlistcontainer);
   sp_session_logout(g_sess);
   sp_session_release(g_sess);
 
+  if (state_path != NULL) {
+    spotd_state_file_close(&g_state_file);
+  }
+
+  close(timer_fd);
+  close(signal_fd);
+  close(g_command_fd);
+  close(g_end_of_track_fd);
+  close(g_notify_fd);
+  close(epoll_desc);
+
   return 0;
 }
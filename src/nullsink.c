@@ -0,0 +1,210 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#include "nullsink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "util.h"
+
+/* --- Constants --- */
+// Size of the device buffer, in milliseconds, about that of an ALSA device
+// opened by alsa-audio.c
+#define NULL_SINK_BUFFER_MS 90
+#define NULL_SINK_PATH_MAX 256
+#define NULL_SINK_MAX_SKEW_PPM 100000
+#define NULL_SINK_UNPACED "null:fast"
+
+/**
+ * Check whether a device name is one of a simulated device
+ *
+ * @param  device  The device name
+ * @return  Non-zero for a simulated device
+ */
+int spotd_null_sink_is_device(const char *device) {
+  return strcmp(device, "null") == 0 || strncmp(device, "null@", 5) == 0 ||
+         strncmp(device, "file:", 5) == 0 || strcmp(device, NULL_SINK_UNPACED) == 0;
+}
+
+/**
+ * Open a simulated device
+ *
+ * @param  sink  The device
+ * @param  device  The device name, see nullsink.h
+ * @param  rate  The sample rate
+ * @param  channels  The number of channels
+ * @return  0 on success, -1 if the name is invalid or the file can not be
+ *   opened
+ */
+int spotd_null_sink_open(spotd_null_sink *sink, const char *device, int rate, int channels) {
+  char path[NULL_SINK_PATH_MAX];
+  const char *skew;
+  char *end;
+  size_t length;
+  long value;
+
+  memset(sink, 0, sizeof(spotd_null_sink));
+  sink->rate = rate;
+  sink->channels = channels;
+  sink->buffer_frames = rate * NULL_SINK_BUFFER_MS / 1000;
+  sink->fd = -1;
+
+  if (strcmp(device, NULL_SINK_UNPACED) == 0) {
+    sink->unpaced = 1;
+    return 0;
+  }
+
+  // The clock skew is the part after the last @
+  length = strlen(device);
+  if ((skew = strrchr(device, '@')) != NULL) {
+    value = strtol(skew + 1, &end, 10);
+    if (skew[1] == '\0' || *end != '\0' || value < -NULL_SINK_MAX_SKEW_PPM ||
+        value > NULL_SINK_MAX_SKEW_PPM) {
+      return -1;
+    }
+
+    sink->skew_ppm = (int) value;
+    length = skew - device;
+  }
+
+  if (strncmp(device, "file:", 5) == 0) {
+    if (length - 5 == 0 || length - 5 >= sizeof(path)) {
+      return -1;
+    }
+
+    memcpy(path, device + 5, length - 5);
+    path[length - 5] = '\0';
+
+    sink->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (sink->fd < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Get the frames written to a simulated device that have not been played
+ *
+ * @param  sink  The device
+ * @return  The number of frames, as snd_pcm_delay() would report
+ */
+long spotd_null_sink_delay(spotd_null_sink *sink) {
+  uint64_t played;
+
+  if (sink->unpaced || sink->start_us == 0) {
+    return 0;
+  }
+
+  played = (uint64_t) ((double) (monotonic_us() - sink->start_us) * sink->rate *
+                       (1.0 + sink->skew_ppm / 1000000.0) / 1000000.0);
+
+  if (played >= sink->written) {
+    // Ran empty, the device stops
+    sink->start_us = 0;
+    sink->written = 0;
+    return 0;
+  }
+
+  return (long) (sink->written - played);
+}
+
+/**
+ * Write samples to a simulated device. Like snd_pcm_writei(), blocks until
+ * all samples fit in the device buffer.
+ *
+ * @param  sink  The device
+ * @param  samples  The interleaved samples
+ * @param  frames  The number of frames
+ */
+void spotd_null_sink_write(spotd_null_sink *sink, const int16_t *samples, int frames) {
+  const char *data;
+  long delay, space;
+  size_t length;
+  ssize_t n;
+
+  if (sink->unpaced) {
+    return;
+  }
+
+  while (frames > 0) {
+    delay = spotd_null_sink_delay(sink);
+    space = sink->buffer_frames - delay;
+
+    // Wait for a quarter of the buffer, or all of the rest, to be played
+    if (space < frames && space < sink->buffer_frames / 4) {
+      usleep((useconds_t) ((sink->buffer_frames / 4 - space) * 1000000LL / sink->rate));
+      continue;
+    }
+
+    if (space > frames) {
+      space = frames;
+    }
+
+    if (sink->start_us == 0) {
+      sink->start_us = monotonic_us();
+    }
+    sink->written += space;
+
+    data = (const char *) samples;
+    length = (size_t) space * sink->channels * sizeof(int16_t);
+    while (sink->fd >= 0 && length > 0) {
+      n = write(sink->fd, data, length);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        fprintf(stderr, "audio: Writing samples failed (%s), discarding them\n",
+                strerror(errno));
+        close(sink->fd);
+        sink->fd = -1;
+        break;
+      }
+      data += n;
+      length -= n;
+    }
+
+    samples += space * sink->channels;
+    frames -= space;
+  }
+}
+
+/**
+ * Close a simulated device
+ *
+ * @param  sink  The device
+ */
+void spotd_null_sink_close(spotd_null_sink *sink) {
+  if (sink->fd >= 0) {
+    close(sink->fd);
+    sink->fd = -1;
+  }
+}
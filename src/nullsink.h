@@ -0,0 +1,66 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#ifndef _SPOTD_NULLSINK_H_
+#define _SPOTD_NULLSINK_H_
+
+#include <stdint.h>
+
+/*
+ * Simulated output devices, for testing synchronized playback without sound
+ * hardware. A device named "null" discards the samples, "file:<path>"
+ * appends them to a file as raw interleaved S16 samples. Either may end in
+ * "@<ppm>" to simulate a device clock that runs that many parts per million
+ * fast, or slow if negative.
+ *
+ * The device plays from a buffer like a sound card: writes block while the
+ * buffer is full, and the buffer drains at the sample rate of the device
+ * clock. When it runs empty, the device stops until it is written again.
+ *
+ * "null:fast" discards the samples as soon as they are written, without a
+ * device clock, for benchmarking what comes before the device.
+ */
+
+/* --- Types --- */
+typedef struct spotd_null_sink {
+  int rate;
+  int channels;
+  int skew_ppm;        // Simulated error of the device clock
+  int buffer_frames;   // Frames the device buffers
+  int64_t start_us;    // Time the device started playing, 0 while stopped
+  uint64_t written;    // Frames written since the device started playing
+  int fd;              // File the samples are written to, -1 for none
+  int unpaced;         // Non-zero if the samples are played at once
+} spotd_null_sink;
+
+/* --- Functions --- */
+int spotd_null_sink_is_device(const char *device);
+int spotd_null_sink_open(spotd_null_sink *sink, const char *device, int rate, int channels);
+long spotd_null_sink_delay(spotd_null_sink *sink);
+void spotd_null_sink_write(spotd_null_sink *sink, const int16_t *samples, int frames);
+void spotd_null_sink_close(spotd_null_sink *sink);
+
+#endif /* _SPOTD_NULLSINK_H_ */
@@ -24,38 +24,271 @@
  * This file is part of spotd.
  */
 
+#define _GNU_SOURCE
+
 #include "server.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
+#include <errno.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <inttypes.h>
 
 #include "types.h"
 #include "util.h"
 #include "queue.h"
+#include "binproto.h"
+#include "http.h"
+#include "websocket.h"
+#include "uring.h"
+
+/* --- Constants --- */
+// Maximum length of a text command line
+#define MAX_LINE_LENGTH 2000
+// Maximum number of listening sockets per worker thread
+#define MAX_LISTENERS 16
+// Maximum number of worker threads
+#define MAX_WORKERS 64
+// Size of the buffer for a single recv() call
+#define RECV_BUFFER_SIZE 4096
+// Stop reading commands from a client while this much output is unsent
+#define MAX_OUTPUT_BUFFER (1024 * 1024)
+// Drop events for a subscriber while this much output is unsent
+#define MAX_SUBSCRIBER_BACKLOG (64 * 1024)
+// Maximum number of connections accepted in one go
+#define MAX_ACCEPTS_PER_WAKEUP 64
+// Connection IDs hold the index of their worker in the low bits
+#define WORKER_ID_BITS 6
+#define WORKER_ID_MASK ((1 << WORKER_ID_BITS) - 1)
+// Number of hash buckets for looking up connections by ID
+#define CONNECTION_BUCKETS 256
+// spotd_command_origin flag: the command came as a binary protocol frame
+#define ORIGIN_BINARY 0x01
+// Maximum length of a search query, including the terminating NUL
+#define MAX_SEARCH_QUERY 256
+// Number of search results returned when the client does not ask for more
+#define DEFAULT_SEARCH_LIMIT 10
+// io_uring submission queue size of a worker
+#define URING_ENTRIES 256
+// Number of registered receive buffers of a worker, a power of two
+#define URING_BUFFERS 64
+#define URING_BUFFER_GROUP 0
+// io_uring request kinds, in the low bits of the request user data. The
+// rest is the connection pointer, or the listener index for accepts.
+#define URING_REQ_WAKE   0
+#define URING_REQ_ACCEPT 1
+#define URING_REQ_RECV   2
+#define URING_REQ_SEND   3
+#define URING_REQ_CANCEL 4
+#define URING_REQ_BITS   3
+#define URING_REQ_MASK   ((1 << URING_REQ_BITS) - 1)
+// Time to wait before queueing a multishot request again, when the
+// submission queue was full
+#define URING_REARM_RETRY_MS 10
+// Minimum time between reports of connection requests finding the
+// submission queue full
+#define URING_FULL_REPORT_MS 1000
+
+/* --- Types --- */
+typedef struct server_listener {
+  int socket_desc;
+  int is_unix;
+  spotd_protocol protocol;
+} server_listener_t;
+
+// Wire formats of pushed events
+typedef enum server_event_format {
+  EVENT_FORMAT_TEXT = 0,         // Text protocol line
+  EVENT_FORMAT_BINARY,           // Binary protocol frame
+  EVENT_FORMAT_WEBSOCKET_JSON,   // WebSocket text frame with a JSON object
+  EVENT_FORMAT_WEBSOCKET_BINARY, // WebSocket binary frame with a binary protocol frame body
+  EVENT_FORMAT_COUNT
+} server_event_format;
+
+// An event serialized once for every format, shared by all workers
+typedef struct server_event {
+  int refcount;
+  size_t lengths[EVENT_FORMAT_COUNT];
+  char *data[EVENT_FORMAT_COUNT];
+} server_event_t;
+
+// The result of a command, on its way back to the connection it came from
+typedef struct server_completion {
+  spotd_command_origin origin;
+  spotd_command_result result;
+  spotd_error error;
+  char message[SPOTD_LINK_MAX];
+  spotd_search_page *search; // The results of a SEARCH, or NULL
+} server_completion_t;
+
+// A message to a worker: an event or a command result
+typedef struct server_message {
+  STAILQ_ENTRY(server_message) link;
+  server_event_t *event;
+  server_completion_t *completion;
+} server_message_t;
+
+typedef struct server_worker {
+  pthread_t thread_id;
+  server_listener_t listeners[MAX_LISTENERS];
+  int num_listeners;
+  // Pipe used to wake the worker up
+  int wake_pipe[2];
+  // Protects inbox and stopping
+  pthread_mutex_t mutex;
+  // Events to be pushed to the subscribers of this worker
+  STAILQ_HEAD(, server_message) inbox;
+  int stopping;
+  // Connections handled by this worker, only used by the worker thread
+  LIST_HEAD(, client_connection) connections;
+  int num_connections;
+  // Connections by ID, for routing command results
+  LIST_HEAD(, client_connection) connections_by_id[CONNECTION_BUCKETS];
+  // Poll set, rebuilt on every iteration of the event loop
+  struct pollfd *pfds;
+  client_connection_t **pfd_connections;
+  int pfds_capacity;
+  // Cached GET /status response. The body after the position is reused for
+  // as long as the rest of the status stays the same.
+  spotd_status cached_status;
+  int status_cache_valid;
+  spotd_buffer status_cache;
+  // Idle and command timeouts of the connections
+  spotd_timer_wheel timers;
+  // io_uring engine, used instead of poll() when use_uring is set
+  int use_uring;
+  spotd_uring ring;
+  // Closed connections waiting for their io_uring requests to complete
+  int num_retired;
+  // Multishot requests that found the submission queue full, queued again
+  // by the event loop
+  int wake_unarmed;
+  int accept_unarmed[MAX_LISTENERS];
+  // Set when a connection has a request to queue again, see uring_unarmed
+  int connections_unarmed;
+  int64_t unarmed_reported_ms;
+} server_worker_t;
 
 /* --- Globals --- */
 // Server callbacks
 static spotd_server_callbacks *g_callbacks;
-// Server thread id
-static pthread_t g_server_thread_id;
-// Self-pipe, for the event when the server needs to be stopped
-static int g_self_pipe[2];
-// A list of client threads
-static LIST_HEAD(, client_thread) g_client_threads;
-// Client thread list mutex
-static pthread_mutex_t g_client_threads_mutex;
+// Server configuration
+static spotd_server_config g_config;
+// Worker threads, each with its own listening sockets and connections
+static server_worker_t g_workers[MAX_WORKERS];
+// Number of worker threads
+static int g_num_workers;
+// Number of subscribed connections across all workers
+static int g_num_subscribers;
+// Number of connections across all workers
+static int g_num_connections;
+// Sequence number of the next connection ID
+static uint64_t g_next_connection_id;
+// Non-zero if the listening sockets now belong to another process
+static int g_handed_off;
 
 /* --- Function definitions --- */
-static void *server_thread(void *socket_desc);
-static int create_new_client_thread(int client_sock_desc);
-static void *connection_handler(void *socket_desc);
+static spotd_error create_worker_listeners(server_worker_t *worker, int first);
+static void adopt_listeners(const spotd_server_socket *sockets, int num_sockets);
+static spotd_error create_port_listeners(server_worker_t *worker, int port,
+                                         spotd_protocol protocol);
+static spotd_error create_tcp_listeners(server_worker_t *worker, const char *address, int port,
+                                        spotd_protocol protocol);
+static spotd_error create_tcp_listener(server_worker_t *worker, int family,
+                                       const struct sockaddr *address, socklen_t address_len,
+                                       int v6only, spotd_protocol protocol);
+static spotd_error create_unix_listener(server_worker_t *worker, const char *path);
+static void add_listener(server_worker_t *worker, int socket_desc, int is_unix,
+                         spotd_protocol protocol);
+static void close_listeners(server_worker_t *worker);
+static int check_peer_credentials(int client_sock_desc);
+static void *server_thread(void *worker_void_ptr);
+static void run_poll_loop(server_worker_t *worker);
+static int prepare_poll(server_worker_t *worker);
+static int start_uring(server_worker_t *worker);
+static void run_uring_loop(server_worker_t *worker);
+static void stop_uring(server_worker_t *worker);
+static int handle_completion(server_worker_t *worker, const struct io_uring_cqe *cqe);
+static void uring_arm_wake(server_worker_t *worker);
+static void uring_arm_accept(server_worker_t *worker, int listener_index);
+static void uring_update_recv(server_worker_t *worker, client_connection_t *connection);
+static void uring_send(client_connection_t *connection);
+static int uring_cancel(server_worker_t *worker, uint64_t user_data);
+static void uring_mark_unarmed(client_connection_t *connection);
+static void uring_rearm_connections(server_worker_t *worker);
+static void retire_connection(server_worker_t *worker, client_connection_t *connection);
+static void free_connection(client_connection_t *connection);
+static int post_message(server_worker_t *worker, server_message_t *message);
+static void post_completion(server_completion_t *completion);
+static void free_completion(server_completion_t *completion);
+static int drain_inbox(server_worker_t *worker);
+static void deliver_completion(server_worker_t *worker, const server_completion_t *completion);
+static void write_completion(client_connection_t *connection,
+                             const server_completion_t *completion);
+static void write_search_page(spotd_buffer *out, const spotd_search_page *page,
+                              const char *prefix);
+static void write_search_json(spotd_buffer *out, const spotd_search_page *page);
+static client_connection_t *find_connection(server_worker_t *worker, uint64_t id);
+static void accept_connections(server_worker_t *worker, server_listener_t *listener);
+static void accept_client(server_worker_t *worker, server_listener_t *listener, int client_sock);
+static void reject_connection(int client_sock_desc, spotd_protocol protocol);
+static void create_connection(server_worker_t *worker, int client_sock_desc,
+                              spotd_protocol protocol);
+static void close_connection(server_worker_t *worker, client_connection_t *connection);
+static void handle_connection_events(server_worker_t *worker, client_connection_t *connection,
+                                     short revents);
+static void handle_received(server_worker_t *worker, client_connection_t *connection,
+                            const char *data, size_t length);
+static void finish_io(server_worker_t *worker, client_connection_t *connection);
+static size_t pending_output(const client_connection_t *connection);
+static void update_command_timer(client_connection_t *connection, int consumed);
+static void idle_timer_expired(spotd_timer *timer, void *data);
+static void command_timer_expired(spotd_timer *timer, void *data);
+static void close_timed_out(client_connection_t *connection, int command_timeout);
+static int flush_output(client_connection_t *connection);
+static server_event_format connection_event_format(client_connection_t *connection);
+static void serialize_event(const spotd_event *event, server_event_format format,
+                            spotd_buffer *out);
+static void push_event(client_connection_t *connection, server_event_t *event);
+static void push_dropped_event(client_connection_t *connection);
+static void release_event(server_event_t *event);
+static int process_client_input(server_worker_t *worker, client_connection_t *connection);
+static void handle_text_line(client_connection_t *connection, char *line);
+static void handle_binary_frame(client_connection_t *connection, const char *body, size_t length);
+static void handle_websocket_frame(client_connection_t *connection,
+                                   const spotd_websocket_frame *frame);
+static void write_websocket_reply(client_connection_t *connection,
+                                  spotd_websocket_opcode opcode, const spotd_buffer *reply);
+static void handle_http_request(server_worker_t *worker, client_connection_t *connection,
+                                const spotd_http_request *request);
+static void write_http_status(server_worker_t *worker, client_connection_t *connection,
+                              int keep_alive);
+static void write_http_result(client_connection_t *connection, int status_code,
+                              const char *key, const char *value, int keep_alive);
+static void dispatch_http_command(client_connection_t *connection, spotd_command *command,
+                                  int keep_alive);
+static int is_http_path(const char *path);
+static int is_main_loop_command(spotd_command_type type);
+static int dispatch_command(client_connection_t *connection, spotd_command *command,
+                            spotd_status *status);
+static int take_rate_token(client_connection_t *connection);
+static spotd_command *create_playlist_command(const char *playlist, int start);
+static spotd_command *create_search_command(const char *query, int offset, int limit);
+static spotd_command *create_warm_command(const char *links, size_t length);
+static spotd_command *create_bitrate_command(int kbps);
+static spotd_command *create_offline_command(const char *playlist, int offline);
+static spotd_command *create_zone_volume_command(int zone, int volume);
 static spotd_command *parse_client_message(char *client_message);
 
 /* -- Functions --- */
@@ -63,324 +296,3185 @@ static spotd_command *parse_client_message(char *client_message);
 /**
  * Start the SPOTD server
  *
- * @param  port  The port to start the server on
+ * @param  config  The server configuration
  * @param  callbacks  The callbacks struct, to receive commands from clients
  * @return  returns a spotd_error
  */
-spotd_error spotd_server_start(int port, spotd_server_callbacks *callbacks) {
-  int socket_desc, *socket_desc_copy;
-  int yes = 1;
-  struct sockaddr_in server;
+spotd_error spotd_server_start(const spotd_server_config *config,
+                               spotd_server_callbacks *callbacks) {
+  spotd_error error;
+  server_worker_t *worker;
+  int i, j;
 
   g_callbacks = callbacks;
+  g_config = *config;
 
-  // Create socket
-  socket_desc = socket(AF_INET, SOCK_STREAM, 0);
-  if (socket_desc == -1) {
-    perror("Could not create socket");
-    return SPOTD_ERROR_OTHER_PERMANENT;
+  if (g_config.backlog <= 0) {
+    g_config.backlog = SOMAXCONN;
   }
-  puts("Socket created");
 
-  // Set socket options
-  if (setsockopt(socket_desc, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
-    perror("Failed setting server socket options");
-    return SPOTD_ERROR_OTHER_PERMANENT;
+  if (g_config.command_burst <= 0) {
+    g_config.command_burst = g_config.command_rate;
   }
 
-  // Prepare the sockaddr_in structure
-  server.sin_family = AF_INET;
-  server.sin_addr.s_addr = INADDR_ANY;
-  server.sin_port = htons( port );
-  memset(&(server.sin_zero), 0, 8);
-
-  // Bind
-  if (bind(socket_desc, (struct sockaddr *)&server, sizeof(server)) < 0) {
-    // Print the error message
-    perror("Bind failed. Error");
-    return SPOTD_ERROR_BIND_FAILED;
+  g_num_workers = g_config.worker_threads;
+  if (g_num_workers < 1) {
+    g_num_workers = 1;
+  } else if (g_num_workers > MAX_WORKERS) {
+    g_num_workers = MAX_WORKERS;
   }
-  puts("bind done");
 
-  // Start the server thread
-  socket_desc_copy = (int *)malloc(sizeof(int));
-  *socket_desc_copy = socket_desc;
+  g_num_subscribers = 0;
+  g_num_connections = 0;
+  g_next_connection_id = 1;
+  g_handed_off = 0;
+
+  if (g_config.num_inherited_sockets > 0) {
+    // Keep accepting on the sockets of the server being replaced
+    adopt_listeners(g_config.inherited_sockets, g_config.num_inherited_sockets);
+  } else {
+    // Create the listening sockets. With more than one worker thread, every
+    // thread gets its own TCP sockets bound with SO_REUSEPORT, and the kernel
+    // spreads incoming connections between them.
+    for (i = 0; i < g_num_workers; i++) {
+      error = create_worker_listeners(&g_workers[i], i == 0);
+
+      if (error != SPOTD_ERROR_OK) {
+        while (i >= 0) {
+          close_listeners(&g_workers[i--]);
+        }
+        return error;
+      }
+    }
+  }
 
-  if (pthread_create(&g_server_thread_id, NULL, server_thread, (void*) socket_desc_copy) < 0) {
-    perror("could not create thread");
+  if (g_workers[0].num_listeners == 0) {
+    fprintf(stderr, "No listening sockets configured\n");
     return SPOTD_ERROR_OTHER_PERMANENT;
   }
 
+  for (i = 0; i < g_num_workers; i++) {
+    worker = &g_workers[i];
+
+    // Create a pipe
+    pipe(&worker->wake_pipe[0]);
+    // Make both ends non-blocking
+    fcntl(worker->wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(worker->wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+    pthread_mutex_init(&worker->mutex, NULL);
+    STAILQ_INIT(&worker->inbox);
+    worker->stopping = 0;
+
+    LIST_INIT(&worker->connections);
+    worker->num_connections = 0;
+    for (j = 0; j < CONNECTION_BUCKETS; j++) {
+      LIST_INIT(&worker->connections_by_id[j]);
+    }
+    worker->pfds = NULL;
+    worker->pfd_connections = NULL;
+    worker->pfds_capacity = 0;
+    worker->status_cache_valid = 0;
+    spotd_buffer_init(&worker->status_cache);
+    worker->use_uring = 0;
+    worker->num_retired = 0;
+    worker->wake_unarmed = 0;
+    worker->connections_unarmed = 0;
+    worker->unarmed_reported_ms = 0;
+    memset(worker->accept_unarmed, 0, sizeof(worker->accept_unarmed));
+    spotd_timer_wheel_init(&worker->timers, monotonic_ms());
+  }
+
+  // Start the worker threads
+  for (i = 0; i < g_num_workers; i++) {
+    if (pthread_create(&g_workers[i].thread_id, NULL, server_thread, &g_workers[i]) != 0) {
+      perror("could not create thread");
+      for (j = i; j < g_num_workers; j++) {
+        close_listeners(&g_workers[j]);
+      }
+      g_num_workers = i;
+      spotd_server_stop(0);
+      return SPOTD_ERROR_OTHER_PERMANENT;
+    }
+  }
+
   return SPOTD_ERROR_OK;
 }
 
 /**
  * Stops the currently running server. Blocks until the server is stopped.
+ *
+ * @param  handed_off  Non-zero if the listening sockets were passed to a new
+ *   server process. The Unix socket file is then left in place.
  */
-void spotd_server_stop() {
-  write(g_self_pipe[1], "STOP", 4);
-  pthread_join(g_server_thread_id, NULL);
+void spotd_server_stop(int handed_off) {
+  server_worker_t *worker;
+  int i;
+
+  g_handed_off = handed_off;
+
+  for (i = 0; i < g_num_workers; i++) {
+    worker = &g_workers[i];
+
+    pthread_mutex_lock(&worker->mutex);
+    worker->stopping = 1;
+    pthread_mutex_unlock(&worker->mutex);
+
+    write(worker->wake_pipe[1], "S", 1);
+  }
+
+  for (i = 0; i < g_num_workers; i++) {
+    pthread_join(g_workers[i].thread_id, NULL);
+  }
+
+  puts("Server stopped...");
 }
 
 /**
- * Start the server thread
+ * Get the listening sockets of the running server, to pass them to the
+ * process replacing it. The sockets stay open until spotd_server_stop().
  *
- * @param  socket_desc  The server socket descriptor
+ * @param  sockets  Receives the sockets
+ * @param  max_sockets  Size of sockets
+ * @return  The number of sockets
  */
-static void *server_thread(void *socket_desc) {
-  int sock = *(int*)socket_desc;
-  int client_sock, c;
-  struct sockaddr_in client;
-  struct pollfd pfds[2];
+int spotd_server_get_sockets(spotd_server_socket *sockets, int max_sockets) {
+  server_worker_t *worker;
+  int i, j, n = 0;
+
+  for (i = 0; i < g_num_workers; i++) {
+    worker = &g_workers[i];
+
+    for (j = 0; j < worker->num_listeners && n < max_sockets; j++) {
+      sockets[n].socket_desc = worker->listeners[j].socket_desc;
+      sockets[n].is_unix = worker->listeners[j].is_unix;
+      sockets[n].protocol = worker->listeners[j].protocol;
+      sockets[n].worker = i;
+      n++;
+    }
+  }
 
-  free(socket_desc);
+  return n;
+}
 
-  // Create a pipe
-  pipe(&g_self_pipe[0]);
-  // Make the read end non-blocking
-  fcntl(g_self_pipe[0], F_SETFL, O_NONBLOCK);
+/**
+ * Push an event to all subscribed clients. The event is serialized once, and
+ * the serialized data is shared by all workers. Never blocks on the network,
+ * so this can be called from the main loop.
+ *
+ * @param  event  The event to push
+ */
+void spotd_server_publish_event(const spotd_event *event) {
+  server_event_t *shared;
+  server_message_t *message;
+  spotd_buffer serialized[EVENT_FORMAT_COUNT];
+  size_t total_length = 0;
+  char *data;
+  int i;
+
+  if (__atomic_load_n(&g_num_subscribers, __ATOMIC_RELAXED) == 0) {
+    return;
+  }
 
-  // Make the server socket non-blocking
-  fcntl(sock, F_SETFL, O_NONBLOCK);
+  // Serialize the event for every protocol
+  for (i = 0; i < EVENT_FORMAT_COUNT; i++) {
+    spotd_buffer_init(&serialized[i]);
+    serialize_event(event, (server_event_format) i, &serialized[i]);
+    total_length += serialized[i].length;
+  }
 
-  // Initialize the list of threads
-  LIST_INIT(&g_client_threads);
-  pthread_mutex_init(&g_client_threads_mutex, NULL);
+  shared = (server_event_t *) malloc(sizeof(server_event_t) + total_length);
+  shared->refcount = g_num_workers;
+  data = (char *) (shared + 1);
 
-  // Listen
-  listen(sock, 3);
+  for (i = 0; i < EVENT_FORMAT_COUNT; i++) {
+    shared->data[i] = data;
+    shared->lengths[i] = serialized[i].length;
+    memcpy(data, serialized[i].data, serialized[i].length);
+    data += serialized[i].length;
+    spotd_buffer_free(&serialized[i]);
+  }
 
-  // Accept incoming connections
-  puts("Waiting for incoming connections...");
-  c = sizeof(struct sockaddr_in);
+  // Hand the event to every worker
+  for (i = 0; i < g_num_workers; i++) {
+    message = (server_message_t *) malloc(sizeof(server_message_t));
+    message->event = shared;
+    message->completion = NULL;
 
-  // The main server polling loop
-  for (;;) {
-    // Setup server socket polling
-    pfds[0].fd = sock;
-    pfds[0].events = POLLIN;
-    // Setup pipe polling
-    pfds[1].fd = g_self_pipe[0];
-    pfds[1].events = POLLIN;
-
-    // Poll for events
-    poll(&pfds[0], 2, -1);
-
-    if (pfds[1].revents) {
-      // There's an event in the pipe, stop the server
-      puts("Stopping server...");
-      break;
-    } else if (pfds[0].revents) {
-      // There are events in the server socket, accept a connection
-      client_sock = accept(sock, (struct sockaddr *)&client, (socklen_t*)&c);
+    if (post_message(&g_workers[i], message) < 0) {
+      free(message);
+      release_event(shared);
+    }
+  }
+}
 
-      if (client_sock < 0) {
-        // Accept failed, continue the loop
-        continue;
-      }
+/**
+ * Send the result of a command back to the connection the command came
+ * from. Never blocks on the network, so this can be called from the main
+ * loop. Does nothing if the client did not ask for the result, or if the
+ * connection is gone.
+ *
+ * @param  origin  The origin of the command
+ * @param  result  The result of the command. SPOTD_RESULT_LOADING is
+ *   provisional, and must be followed by a final result.
+ * @param  error  The error, if the command failed
+ * @param  message  The error message, if the command failed, can be NULL
+ */
+void spotd_server_complete_command(const spotd_command_origin *origin,
+                                   spotd_command_result result, spotd_error error,
+                                   const char *message) {
+  server_completion_t *completion;
 
-      puts("Connection accepted");
+  if (origin->connection_id == 0) {
+    return;
+  }
 
-      if (create_new_client_thread(client_sock)) {
-        perror("could not create thread");
-      }
+  completion = (server_completion_t *) malloc(sizeof(server_completion_t));
+  completion->origin = *origin;
+  completion->result = result;
+  completion->error = error;
+  snprintf(completion->message, sizeof(completion->message), "%s",
+           message != NULL ? message : "");
+  completion->search = NULL;
+
+  post_completion(completion);
+}
+
+/**
+ * Send a page of search results to the connection a SEARCH command came
+ * from. Like spotd_server_complete_command(), this never blocks.
+ *
+ * @param  origin  The origin of the SEARCH command
+ * @param  page  The search results, copied
+ */
+void spotd_server_complete_search(const spotd_command_origin *origin,
+                                  const spotd_search_page *page) {
+  server_completion_t *completion;
+
+  if (origin->connection_id == 0) {
+    return;
+  }
+
+  completion = (server_completion_t *) malloc(sizeof(server_completion_t));
+  completion->origin = *origin;
+  completion->result = SPOTD_RESULT_OK;
+  completion->error = SPOTD_ERROR_OK;
+  completion->message[0] = '\0';
+  completion->search = (spotd_search_page *) malloc(sizeof(spotd_search_page));
+  memcpy(completion->search, page, sizeof(spotd_search_page));
+
+  post_completion(completion);
+}
+
+/**
+ * Create the listening sockets of a worker thread
+ *
+ * @param  worker  The worker to create the sockets for
+ * @param  first  Non-zero for the first worker, which also gets the Unix
+ *   socket listener
+ * @return  returns a spotd_error
+ */
+static spotd_error create_worker_listeners(server_worker_t *worker, int first) {
+  spotd_error error = SPOTD_ERROR_OK;
+
+  worker->num_listeners = 0;
+
+  if (g_config.port > 0) {
+    error = create_port_listeners(worker, g_config.port, SPOTD_PROTOCOL_CONTROL);
+  }
+
+  if (error == SPOTD_ERROR_OK && g_config.http_port > 0) {
+    error = create_port_listeners(worker, g_config.http_port, SPOTD_PROTOCOL_HTTP);
+  }
+
+  if (error == SPOTD_ERROR_OK && first && g_config.unix_socket_path != NULL) {
+    error = create_unix_listener(worker, g_config.unix_socket_path);
+  }
+
+  return error;
+}
+
+/**
+ * Use listening sockets taken over from another server process. Every socket
+ * goes to the worker that owned it before, so that SO_REUSEPORT groups stay
+ * spread over the workers.
+ *
+ * @param  sockets  The inherited sockets
+ * @param  num_sockets  Number of inherited sockets
+ */
+static void adopt_listeners(const spotd_server_socket *sockets, int num_sockets) {
+  server_worker_t *worker;
+  int i;
+
+  for (i = 0; i < g_num_workers; i++) {
+    g_workers[i].num_listeners = 0;
+  }
+
+  for (i = 0; i < num_sockets; i++) {
+    worker = &g_workers[sockets[i].worker % g_num_workers];
 
-      puts("Handler assigned");
+    if (worker->num_listeners >= MAX_LISTENERS) {
+      fprintf(stderr, "Too many listening sockets\n");
+      close(sockets[i].socket_desc);
+      continue;
     }
+
+    printf("Listening on inherited socket %d%s\n", sockets[i].socket_desc,
+           sockets[i].protocol == SPOTD_PROTOCOL_HTTP ? " (HTTP)" : "");
+
+    add_listener(worker, sockets[i].socket_desc, sockets[i].is_unix, sockets[i].protocol);
   }
+}
 
-  // Join all client threads
-  puts("Waiting for client threads to stop...");
+/**
+ * Create the TCP listening sockets for a port, on every configured bind
+ * address or on all interfaces
+ *
+ * @param  worker  The worker to add the sockets to
+ * @param  port  The port to listen on
+ * @param  protocol  The protocol spoken on the port
+ * @return  returns a spotd_error
+ */
+static spotd_error create_port_listeners(server_worker_t *worker, int port,
+                                         spotd_protocol protocol) {
+  spotd_error error = SPOTD_ERROR_OK;
+  struct sockaddr_in6 server6;
+  struct sockaddr_in server;
+  int i;
 
-  client_thread_t *first_thread;
-  pthread_t first_thread_id;
-  for (;;) {
-    pthread_mutex_lock(&g_client_threads_mutex);
-    first_thread = LIST_FIRST(&g_client_threads);
-    
-    if (first_thread != NULL) {
-      first_thread_id = first_thread->thread_id;
-    } else {
-      // All threads joined
-      pthread_mutex_unlock(&g_client_threads_mutex);
-      break;
+  if (g_config.num_bind_addresses > 0) {
+    // Bind to every configured address
+    for (i = 0; i < g_config.num_bind_addresses && error == SPOTD_ERROR_OK; i++) {
+      error = create_tcp_listeners(worker, g_config.bind_addresses[i], port, protocol);
+    }
+  } else {
+    // Bind to all interfaces, dual-stack if IPv6 is available
+    memset(&server6, 0, sizeof(server6));
+    server6.sin6_family = AF_INET6;
+    server6.sin6_addr = in6addr_any;
+    server6.sin6_port = htons(port);
+
+    error = create_tcp_listener(worker, AF_INET6, (struct sockaddr *) &server6,
+                                sizeof(server6), 0, protocol);
+
+    if (error == SPOTD_ERROR_UNSUPPORTED) {
+      memset(&server, 0, sizeof(server));
+      server.sin_family = AF_INET;
+      server.sin_addr.s_addr = INADDR_ANY;
+      server.sin_port = htons(port);
+
+      error = create_tcp_listener(worker, AF_INET, (struct sockaddr *) &server,
+                                  sizeof(server), 0, protocol);
     }
-    
-    pthread_mutex_unlock(&g_client_threads_mutex);
+  }
+
+  return error;
+}
 
-    puts("Joining thread...");
-    pthread_join(first_thread_id, NULL);
+/**
+ * Create TCP listening sockets for every address a bind address resolves to
+ *
+ * @param  worker  The worker to add the sockets to
+ * @param  address  A host name or a numeric IPv4 or IPv6 address
+ * @param  port  The port to listen on
+ * @param  protocol  The protocol spoken on the port
+ * @return  returns a spotd_error
+ */
+static spotd_error create_tcp_listeners(server_worker_t *worker, const char *address, int port,
+                                        spotd_protocol protocol) {
+  struct addrinfo hints, *result, *ai;
+  char service[16];
+  spotd_error error = SPOTD_ERROR_OK;
+  int r;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  snprintf(service, sizeof(service), "%d", port);
+
+  r = getaddrinfo(address, service, &hints, &result);
+  if (r != 0) {
+    fprintf(stderr, "Could not resolve bind address %s: %s\n", address, gai_strerror(r));
+    return SPOTD_ERROR_BIND_FAILED;
   }
 
-  puts("Server stopped...");
+  for (ai = result; ai != NULL && error == SPOTD_ERROR_OK; ai = ai->ai_next) {
+    // Explicit IPv6 addresses do not accept IPv4 connections, so that an IPv4
+    // address can be bound next to them
+    error = create_tcp_listener(worker, ai->ai_family, ai->ai_addr, ai->ai_addrlen, 1, protocol);
+  }
 
-  // Cleanup
-  close(g_self_pipe[1]);
-  close(g_self_pipe[0]);
-  close(sock);
+  freeaddrinfo(result);
 
-  // Stop the thread
-  pthread_exit(NULL);
+  return error;
 }
 
 /**
- * Create a new client thread
+ * Create a TCP listening socket
  *
- * @param  client_sock_desc  The client socket descriptor
- * @return  int  The error code returned by pthread_create()
+ * @param  worker  The worker to add the socket to
+ * @param  family  The address family, AF_INET or AF_INET6
+ * @param  address  The address to bind to
+ * @param  address_len  Length of the address
+ * @param  v6only  Value of the IPV6_V6ONLY option for IPv6 sockets
+ * @param  protocol  The protocol spoken on the socket
+ * @return  returns a spotd_error, SPOTD_ERROR_UNSUPPORTED if the address
+ *   family is not supported
+ */
+static spotd_error create_tcp_listener(server_worker_t *worker, int family,
+                                       const struct sockaddr *address, socklen_t address_len,
+                                       int v6only, spotd_protocol protocol) {
+  int socket_desc;
+  int yes = 1;
+  char host[NI_MAXHOST], service[NI_MAXSERV];
+
+  if (worker->num_listeners >= MAX_LISTENERS) {
+    fprintf(stderr, "Too many listening sockets\n");
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  // Create socket
+  socket_desc = socket(family, SOCK_STREAM, 0);
+  if (socket_desc == -1) {
+    if (errno == EAFNOSUPPORT) {
+      return SPOTD_ERROR_UNSUPPORTED;
+    }
+    perror("Could not create socket");
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  // Set socket options
+  if (setsockopt(socket_desc, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+    perror("Failed setting server socket options");
+    close(socket_desc);
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  if (g_num_workers > 1 &&
+      setsockopt(socket_desc, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+    perror("Failed enabling SO_REUSEPORT");
+    close(socket_desc);
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  if (family == AF_INET6 &&
+      setsockopt(socket_desc, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(int)) == -1) {
+    perror("Failed setting IPV6_V6ONLY");
+    close(socket_desc);
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  // Bind
+  if (bind(socket_desc, address, address_len) < 0) {
+    // Print the error message
+    perror("Bind failed. Error");
+    close(socket_desc);
+    return SPOTD_ERROR_BIND_FAILED;
+  }
+
+  if (getnameinfo(address, address_len, host, sizeof(host), service, sizeof(service),
+                  NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+    printf("Listening on [%s]:%s%s\n", host, service,
+           protocol == SPOTD_PROTOCOL_HTTP ? " (HTTP)" : "");
+  }
+
+  add_listener(worker, socket_desc, 0, protocol);
+
+  return SPOTD_ERROR_OK;
+}
+
+/**
+ * Create a Unix domain listening socket. A stale socket file left at the
+ * path is removed.
+ *
+ * @param  worker  The worker to add the socket to
+ * @param  path  The path of the socket
+ * @return  returns a spotd_error
  */
-static int create_new_client_thread(int client_sock_desc) {
-  int pthread_return_code;
+static spotd_error create_unix_listener(server_worker_t *worker, const char *path) {
+  int socket_desc;
+  struct sockaddr_un server;
+
+  if (strlen(path) >= sizeof(server.sun_path)) {
+    fprintf(stderr, "Unix socket path too long: %s\n", path);
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  if (worker->num_listeners >= MAX_LISTENERS) {
+    fprintf(stderr, "Too many listening sockets\n");
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
 
-  // Create a client thread object
-  client_thread_t *new_client_thread;
-  new_client_thread = (client_thread_t*) malloc(sizeof(client_thread_t));
-  new_client_thread->socket_desc = client_sock_desc;
+  // Create socket
+  socket_desc = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (socket_desc == -1) {
+    perror("Could not create Unix socket");
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
 
-  // Insert to the list of client threads
-  pthread_mutex_lock(&g_client_threads_mutex);
-  LIST_INSERT_HEAD(&g_client_threads, new_client_thread, link);
-  pthread_mutex_unlock(&g_client_threads_mutex);
+  // Prepare the sockaddr_un structure
+  memset(&server, 0, sizeof(server));
+  server.sun_family = AF_UNIX;
+  strcpy(server.sun_path, path);
 
-  // Create a new thread for the client
-  pthread_return_code = pthread_create(&new_client_thread->thread_id, NULL, connection_handler, (void*) new_client_thread);
-  if (pthread_return_code < 0) {
-    // Cleanup if thread creation fails
-    pthread_mutex_lock(&g_client_threads_mutex);
-    LIST_REMOVE(new_client_thread, link);
-    pthread_mutex_unlock(&g_client_threads_mutex);
-    free(new_client_thread);
+  // Bind
+  unlink(path);
+  if (bind(socket_desc, (struct sockaddr *)&server, sizeof(server)) < 0) {
+    perror("Unix socket bind failed. Error");
+    close(socket_desc);
+    return SPOTD_ERROR_BIND_FAILED;
   }
+  printf("Listening on %s\n", path);
+
+  add_listener(worker, socket_desc, 1, SPOTD_PROTOCOL_CONTROL);
 
-  return pthread_return_code;
+  return SPOTD_ERROR_OK;
 }
 
 /**
- * Handle connections
+ * Start listening on a bound socket, and add it to a worker
  *
- * @param  socket_desc  The client socket descriptor
+ * @param  worker  The worker to add the socket to
+ * @param  socket_desc  The bound socket descriptor
+ * @param  is_unix  Non-zero if the socket is a Unix domain socket
+ * @param  protocol  The protocol spoken on the socket
  */
-static void *connection_handler(void *thread_void_ptr) {
-  client_thread_t *thread = (client_thread_t*) thread_void_ptr;
-  int sock = thread->socket_desc;
-  int read_size, need_detach;
-  char message_buf[2000], client_message[2000], *message;
-  spotd_command *command;
+static void add_listener(server_worker_t *worker, int socket_desc, int is_unix,
+                         spotd_protocol protocol) {
+  // Make the server socket non-blocking
+  fcntl(socket_desc, F_SETFL, O_NONBLOCK);
 
-  struct pollfd pfds[2];
+  // Listen
+  listen(socket_desc, g_config.backlog);
 
-  // Initialize need_detach to true
-  need_detach = 1;
+  worker->listeners[worker->num_listeners].socket_desc = socket_desc;
+  worker->listeners[worker->num_listeners].is_unix = is_unix;
+  worker->listeners[worker->num_listeners].protocol = protocol;
+  worker->num_listeners++;
+}
 
-  // Make the client socket non-blocking
-  fcntl(sock, F_SETFL, O_NONBLOCK);
+/**
+ * Close the listening sockets of a worker, and remove the Unix socket file
+ *
+ * @param  worker  The worker to close the sockets of
+ */
+static void close_listeners(server_worker_t *worker) {
+  int i;
 
-  // Send the greetings message to the client
-  snprintf(message_buf, 2000, "spotd v%s\n", VERSION);
-  write(sock, message_buf, strlen(message_buf));
+  for (i = 0; i < worker->num_listeners; i++) {
+    close(worker->listeners[i].socket_desc);
 
-  // The main client polling loop
-  for (;;) {
-    // Setup client socket polling
-    pfds[0].fd = sock;
-    pfds[0].events = POLLIN;
-    // Setup pipe polling
-    pfds[1].fd = g_self_pipe[0];
-    pfds[1].events = POLLIN;
-
-    // Poll for events
-    poll(&pfds[0], 2, -1);
-
-    if (pfds[1].revents) {
-      // There's an event in the pipe, stop the polling loop
-      puts("Disconnecting client...");
-      // Thread doesn't need to be detached, it will be joined
-      need_detach = 0;
-      break;
-    } else if (pfds[0].revents) {
-      // There are events in the client socket, receive the message from the client
-      read_size = recv(sock, client_message, 2000, 0);
+    if (worker->listeners[i].is_unix && !g_handed_off && g_config.unix_socket_path != NULL) {
+      unlink(g_config.unix_socket_path);
+    }
+  }
 
-      // Check for errors
-      if (read_size == 0) {
-        puts("Client disconnected");
-        break;
-      } else if (read_size < 0) {
-        perror("recv failed");
-        break;
-      }
+  worker->num_listeners = 0;
+}
+
+/**
+ * Check if the peer of a Unix socket connection is allowed to control the
+ * server. Root, the user running the server and members of the configured
+ * group are allowed.
+ *
+ * @param  client_sock_desc  The client socket descriptor
+ * @return  1 if the peer is allowed, 0 otherwise
+ */
+static int check_peer_credentials(int client_sock_desc) {
+  struct ucred credentials;
+  socklen_t length = sizeof(credentials);
 
-      // Add the end of string marker
-      client_message[read_size] = '\0';
+  if (getsockopt(client_sock_desc, SOL_SOCKET, SO_PEERCRED, &credentials, &length) < 0) {
+    perror("Failed getting peer credentials");
+    return 0;
+  }
 
-      // Try to parse a command from the client message
-      command = parse_client_message(client_message);
+  if (credentials.uid == 0 || credentials.uid == geteuid()) {
+    return 1;
+  }
 
-      if (command != NULL) {
-        // Pass the message to a callback, if it is set
-        if (g_callbacks->command_received != NULL) {
-          g_callbacks->command_received(command);
-        }
+  if (g_config.unix_socket_gid != (gid_t) -1 && credentials.gid == g_config.unix_socket_gid) {
+    return 1;
+  }
 
-        // Send ok response
-        message = "OK\n";
-        write(sock, message, strlen(message));
-      } else {
-        // Send invalid command response
-        message = "INVALID COMMAND\n";
-        write(sock, message, strlen(message));
-      }
+  printf("Rejected Unix socket peer (pid %d, uid %d)\n",
+         (int) credentials.pid, (int) credentials.uid);
+  return 0;
+}
 
-      // clear the message buffer
-      memset(client_message, 0, 2000);
+/**
+ * Start a worker thread. The worker runs an event loop that accepts
+ * connections on its listening sockets and serves all of its clients.
+ *
+ * @param  worker_void_ptr  The server_worker_t to run
+ */
+static void *server_thread(void *worker_void_ptr) {
+  server_worker_t *worker = (server_worker_t*) worker_void_ptr;
+  client_connection_t *connection;
+
+  if (g_config.io_uring) {
+    worker->use_uring = start_uring(worker) == 0;
+
+    if (!worker->use_uring) {
+      puts("io_uring is not available, using poll");
     }
   }
 
-  // Detach the thread if it will not be joined
-  if (need_detach) {
-    pthread_detach(pthread_self());
+  // Accept incoming connections
+  puts("Waiting for incoming connections...");
+
+  if (worker->use_uring) {
+    run_uring_loop(worker);
+  } else {
+    run_poll_loop(worker);
+  }
+
+  puts("Stopping server...");
+
+  // Disconnect all clients
+  while ((connection = LIST_FIRST(&worker->connections)) != NULL) {
+    puts("Disconnecting client...");
+    close_connection(worker, connection);
   }
 
   // Cleanup
-  close(sock);
+  drain_inbox(worker);
 
-  pthread_mutex_lock(&g_client_threads_mutex);
-  LIST_REMOVE(thread, link);
-  pthread_mutex_unlock(&g_client_threads_mutex);
+  if (worker->use_uring) {
+    stop_uring(worker);
+  }
 
-  free(thread);
+  close_listeners(worker);
+  close(worker->wake_pipe[0]);
+  close(worker->wake_pipe[1]);
+  free(worker->pfds);
+  free(worker->pfd_connections);
+  spotd_buffer_free(&worker->status_cache);
 
   // Stop the thread
   pthread_exit(NULL);
 }
 
 /**
- * Parse a client message
+ * Run the event loop of a worker with poll(), until the server is stopped
  *
- * @param  client_message  The client message to parse
- * @return  The parsed command if the message contained a valid command, NULL
- *   otherwise. The resulting command must be freed with spotd_command_release().
+ * @param  worker  The worker
  */
-static spotd_command *parse_client_message(char *client_message) {
-  // Strip the message of \r and \n chars
-  char *stripped_message = strip_str(client_message, "\r\n");
-  int message_length = strlen(stripped_message);
-  spotd_command *command = NULL;
-  char **arguments;
+static void run_poll_loop(server_worker_t *worker) {
+  int i, num_pfds, first_connection;
 
-  // Check if the message is a valid command
-  if (strncmp(stripped_message, "PLAY ", 5) == 0) {
-    // The PLAY command has one argument, allocate memory for it
-    arguments = (char**) malloc(1 * sizeof(char*));
-    char *track_name = (char *) malloc(message_length - 5 + 1);
+  first_connection = worker->num_listeners + 1;
 
-    // Copy the argument and add it to the arguments array
-    strncpy(track_name, stripped_message + 5, message_length - 5);
-    track_name[message_length - 5] = '\0';
-    arguments[0] = track_name;
+  // The main server polling loop
+  for (;;) {
+    // Time out connections before building the poll set, so that the
+    // timer callbacks can close connections
+    spotd_timer_wheel_advance(&worker->timers, monotonic_ms());
 
-    // Create the PLAY command object
-    command = spotd_command_create(SPOTD_COMMAND_PLAY_TRACK, 1, arguments);
+    num_pfds = prepare_poll(worker);
+
+    // Poll for events, until the next timer is due
+    if (poll(worker->pfds, num_pfds,
+             spotd_timer_wheel_next_timeout(&worker->timers, monotonic_ms())) <= 0) {
+      continue;
+    }
+
+    // Handling the events of a connection may only close that connection
+    for (i = first_connection; i < num_pfds; i++) {
+      if (worker->pfds[i].revents) {
+        handle_connection_events(worker, worker->pfd_connections[i], worker->pfds[i].revents);
+      }
+    }
+
+    for (i = 0; i < worker->num_listeners; i++) {
+      if (worker->pfds[i + 1].revents) {
+        accept_connections(worker, &worker->listeners[i]);
+      }
+    }
+
+    // The inbox is drained last, as delivering events and command results
+    // closes any connection, which would leave a freed one in the poll set
+    if (worker->pfds[0].revents && drain_inbox(worker)) {
+      // The server is being stopped
+      return;
+    }
+  }
+}
+
+/**
+ * Build the poll set of a worker. The wake pipe comes first, then the
+ * listening sockets and then the client connections.
+ *
+ * @param  worker  The worker
+ * @return  The number of entries in the poll set
+ */
+static int prepare_poll(server_worker_t *worker) {
+  client_connection_t *connection;
+  int i, n, needed;
+
+  needed = 1 + worker->num_listeners + worker->num_connections;
+
+  if (needed > worker->pfds_capacity) {
+    worker->pfds_capacity = needed * 2;
+    worker->pfds = (struct pollfd *) realloc(worker->pfds,
+        worker->pfds_capacity * sizeof(struct pollfd));
+    worker->pfd_connections = (client_connection_t **) realloc(worker->pfd_connections,
+        worker->pfds_capacity * sizeof(client_connection_t *));
+  }
+
+  // Setup pipe polling
+  worker->pfds[0].fd = worker->wake_pipe[0];
+  worker->pfds[0].events = POLLIN;
+  worker->pfd_connections[0] = NULL;
+  n = 1;
+
+  // Setup server socket polling
+  for (i = 0; i < worker->num_listeners; i++, n++) {
+    worker->pfds[n].fd = worker->listeners[i].socket_desc;
+    worker->pfds[n].events = POLLIN;
+    worker->pfd_connections[n] = NULL;
+  }
+
+  // Setup client socket polling. Clients that do not read their responses
+  // are not read from until the output is sent.
+  LIST_FOREACH(connection, &worker->connections, link) {
+    worker->pfds[n].fd = connection->socket_desc;
+    worker->pfds[n].events = 0;
+
+    if (!connection->closing && connection->output.length < MAX_OUTPUT_BUFFER) {
+      worker->pfds[n].events |= POLLIN;
+    }
+
+    if (connection->output.length > 0) {
+      worker->pfds[n].events |= POLLOUT;
+    }
+
+    worker->pfd_connections[n] = connection;
+    n++;
+  }
+
+  return n;
+}
+
+/**
+ * Set up the io_uring engine of a worker
+ *
+ * @param  worker  The worker
+ * @return  0 on success, -1 if the kernel does not support the features used
+ */
+static int start_uring(server_worker_t *worker) {
+  if (spotd_uring_init(&worker->ring, URING_ENTRIES) < 0) {
+    return -1;
+  }
+
+  if (spotd_uring_setup_buffers(&worker->ring, URING_BUFFER_GROUP, URING_BUFFERS,
+                                RECV_BUFFER_SIZE) < 0) {
+    spotd_uring_free(&worker->ring);
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Run the event loop of a worker with io_uring, until the server is stopped.
+ * Listening sockets use multishot accepts and connections multishot receives
+ * into the registered buffers, so that a request is submitted once instead
+ * of a system call for every event. Everything queued while handling the
+ * completions is submitted with a single io_uring_enter() call.
+ *
+ * @param  worker  The worker
+ */
+static void run_uring_loop(server_worker_t *worker) {
+  struct io_uring_cqe *cqe, completion;
+  int i, timeout_ms, unarmed, stopping = 0;
+
+  uring_arm_wake(worker);
+
+  for (i = 0; i < worker->num_listeners; i++) {
+    uring_arm_accept(worker, i);
+  }
+
+  while (!stopping) {
+    spotd_timer_wheel_advance(&worker->timers, monotonic_ms());
+
+    // Requests that found the submission queue full are queued again,
+    // until then the loop does not wait long for events
+    if (worker->wake_unarmed) {
+      uring_arm_wake(worker);
+    }
+
+    for (i = 0; i < worker->num_listeners; i++) {
+      if (worker->accept_unarmed[i]) {
+        uring_arm_accept(worker, i);
+      }
+    }
+
+    if (worker->connections_unarmed) {
+      uring_rearm_connections(worker);
+    }
+
+    unarmed = worker->wake_unarmed || worker->connections_unarmed;
+
+    for (i = 0; i < worker->num_listeners; i++) {
+      unarmed |= worker->accept_unarmed[i];
+    }
+
+    timeout_ms = spotd_timer_wheel_next_timeout(&worker->timers, monotonic_ms());
+
+    if (unarmed && (timeout_ms < 0 || timeout_ms > URING_REARM_RETRY_MS)) {
+      timeout_ms = URING_REARM_RETRY_MS;
+    }
+
+    if (spotd_uring_wait(&worker->ring, timeout_ms) < 0) {
+      perror("io_uring_enter failed");
+      break;
+    }
+
+    while ((cqe = spotd_uring_peek_cqe(&worker->ring)) != NULL) {
+      // Free the completion slot before handling it, handlers queue requests
+      completion = *cqe;
+      spotd_uring_cqe_seen(&worker->ring);
+
+      if (handle_completion(worker, &completion)) {
+        stopping = 1;
+      }
+    }
+  }
+}
+
+/**
+ * Wait for the requests of the closed connections to complete, and tear
+ * down the io_uring engine of a worker
+ *
+ * @param  worker  The worker
+ */
+static void stop_uring(server_worker_t *worker) {
+  struct io_uring_cqe *cqe, completion;
+  int64_t deadline = monotonic_ms() + 1000;
+
+  while (worker->num_retired > 0 && monotonic_ms() < deadline) {
+    spotd_uring_wait(&worker->ring, 100);
+
+    while ((cqe = spotd_uring_peek_cqe(&worker->ring)) != NULL) {
+      completion = *cqe;
+      spotd_uring_cqe_seen(&worker->ring);
+      handle_completion(worker, &completion);
+    }
+  }
+
+  spotd_uring_free(&worker->ring);
+}
+
+/**
+ * Handle an io_uring completion
+ *
+ * @param  worker  The worker
+ * @param  cqe  The completion
+ * @return  1 if the worker is being stopped, 0 otherwise
+ */
+static int handle_completion(server_worker_t *worker, const struct io_uring_cqe *cqe) {
+  client_connection_t *connection;
+  int more = cqe->flags & IORING_CQE_F_MORE;
+  unsigned buffer_id;
+
+  switch (cqe->user_data & URING_REQ_MASK) {
+  case URING_REQ_WAKE:
+    if (!more) {
+      uring_arm_wake(worker);
+    }
+    return drain_inbox(worker);
+
+  case URING_REQ_ACCEPT:
+    if (cqe->res >= 0) {
+      accept_client(worker, &worker->listeners[cqe->user_data >> URING_REQ_BITS], cqe->res);
+    } else if (cqe->res != -ECANCELED) {
+      fprintf(stderr, "accept failed: %s\n", strerror(-cqe->res));
+    }
+
+    if (!more) {
+      uring_arm_accept(worker, (int) (cqe->user_data >> URING_REQ_BITS));
+    }
+    return 0;
+
+  case URING_REQ_RECV:
+    connection = (client_connection_t *) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_REQ_MASK);
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+      if (cqe->res > 0 && !connection->retired) {
+        handle_received(worker, connection,
+                        spotd_uring_buffer(&worker->ring, buffer_id), cqe->res);
+      }
+
+      spotd_uring_recycle_buffer(&worker->ring, buffer_id);
+    }
+
+    if (!more) {
+      connection->recv_armed = 0;
+      connection->recv_cancelled = 0;
+      connection->uring_requests--;
+    }
+
+    if (connection->retired) {
+      if (connection->uring_requests == 0) {
+        free_connection(connection);
+      }
+      return 0;
+    }
+
+    if (cqe->res == 0) {
+      puts("Client disconnected");
+      close_connection(worker, connection);
+      return 0;
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+      fprintf(stderr, "recv failed: %s\n", strerror(-cqe->res));
+      close_connection(worker, connection);
+      return 0;
+    }
+
+    finish_io(worker, connection);
+    return 0;
+
+  case URING_REQ_SEND:
+    connection = (client_connection_t *) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_REQ_MASK);
+    connection->send_armed = 0;
+    connection->uring_requests--;
+
+    if (connection->retired) {
+      if (connection->uring_requests == 0) {
+        free_connection(connection);
+      }
+      return 0;
+    }
+
+    if (cqe->res < 0) {
+      close_connection(worker, connection);
+      return 0;
+    }
+
+    spotd_buffer_consume(&connection->sending, cqe->res);
+    connection->last_activity_ms = monotonic_ms();
+
+    finish_io(worker, connection);
+    return 0;
+
+  default:
+    // Cancellations
+    return 0;
+  }
+}
+
+/**
+ * Watch the wake pipe of a worker. If the submission queue is full, the
+ * event loop tries again.
+ *
+ * @param  worker  The worker
+ */
+static void uring_arm_wake(server_worker_t *worker) {
+  struct io_uring_sqe *sqe = spotd_uring_get_sqe(&worker->ring);
+
+  if (sqe == NULL) {
+    if (!worker->wake_unarmed) {
+      fprintf(stderr, "io_uring submission queue full, retrying the wake poll\n");
+    }
+    worker->wake_unarmed = 1;
+    return;
+  }
+
+  worker->wake_unarmed = 0;
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = worker->wake_pipe[0];
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = URING_REQ_WAKE;
+}
+
+/**
+ * Start accepting connections on a listening socket. If the submission
+ * queue is full, the event loop tries again.
+ *
+ * @param  worker  The worker
+ * @param  listener_index  Index of the listening socket
+ */
+static void uring_arm_accept(server_worker_t *worker, int listener_index) {
+  struct io_uring_sqe *sqe = spotd_uring_get_sqe(&worker->ring);
+
+  if (sqe == NULL) {
+    if (!worker->accept_unarmed[listener_index]) {
+      fprintf(stderr, "io_uring submission queue full, retrying the accept\n");
+    }
+    worker->accept_unarmed[listener_index] = 1;
+    return;
+  }
+
+  worker->accept_unarmed[listener_index] = 0;
+
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = worker->listeners[listener_index].socket_desc;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = (uint64_t) listener_index << URING_REQ_BITS | URING_REQ_ACCEPT;
+}
+
+/**
+ * Start or stop receiving from a connection. Like the poll() engine, a
+ * client is not read from while it does not read its responses.
+ *
+ * @param  worker  The worker
+ * @param  connection  The connection
+ */
+static void uring_update_recv(server_worker_t *worker, client_connection_t *connection) {
+  struct io_uring_sqe *sqe;
+  uint64_t user_data = (uintptr_t) connection | URING_REQ_RECV;
+  int wanted = !connection->closing && pending_output(connection) < MAX_OUTPUT_BUFFER;
+
+  if (wanted && !connection->recv_armed) {
+    sqe = spotd_uring_get_sqe(&worker->ring);
+
+    if (sqe == NULL) {
+      uring_mark_unarmed(connection);
+      return;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = connection->socket_desc;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = user_data;
+
+    connection->recv_armed = 1;
+    connection->uring_requests++;
+  } else if (!wanted && connection->recv_armed && !connection->recv_cancelled) {
+    if (uring_cancel(worker, user_data) < 0) {
+      uring_mark_unarmed(connection);
+      return;
+    }
+    connection->recv_cancelled = 1;
+  }
+}
+
+/**
+ * Hand the buffered output of a connection to the kernel. Only one send is
+ * in flight at a time. The data being sent is moved to the sending buffer,
+ * so that output can be appended while the kernel reads it.
+ *
+ * @param  connection  The connection
+ */
+static void uring_send(client_connection_t *connection) {
+  struct io_uring_sqe *sqe;
+  spotd_buffer swap;
+
+  if (connection->send_armed) {
+    return;
+  }
+
+  if (connection->sending.length == 0) {
+    if (connection->output.length == 0) {
+      return;
+    }
+
+    swap = connection->sending;
+    connection->sending = connection->output;
+    connection->output = swap;
+  }
+
+  sqe = spotd_uring_get_sqe(&connection->worker->ring);
+
+  if (sqe == NULL) {
+    uring_mark_unarmed(connection);
+    return;
+  }
+
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = connection->socket_desc;
+  sqe->addr = (uintptr_t) connection->sending.data;
+  sqe->len = connection->sending.length;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = (uintptr_t) connection | URING_REQ_SEND;
+
+  connection->send_armed = 1;
+  connection->uring_requests++;
+}
+
+/**
+ * Cancel an io_uring request
+ *
+ * @param  worker  The worker
+ * @param  user_data  The user data of the request
+ * @return  0 on success, -1 if the submission queue is full
+ */
+static int uring_cancel(server_worker_t *worker, uint64_t user_data) {
+  struct io_uring_sqe *sqe = spotd_uring_get_sqe(&worker->ring);
+
+  if (sqe == NULL) {
+    return -1;
+  }
+
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = user_data;
+  sqe->user_data = URING_REQ_CANCEL;
+
+  return 0;
+}
+
+/**
+ * Remember that a request of a connection found the submission queue full,
+ * so that the event loop queues it again
+ *
+ * @param  connection  The connection
+ */
+static void uring_mark_unarmed(client_connection_t *connection) {
+  server_worker_t *worker = connection->worker;
+  int64_t now = monotonic_ms();
+
+  if (now - worker->unarmed_reported_ms >= URING_FULL_REPORT_MS) {
+    fprintf(stderr, "io_uring submission queue full, retrying connection requests\n");
+    worker->unarmed_reported_ms = now;
+  }
+
+  connection->uring_unarmed = 1;
+  worker->connections_unarmed = 1;
+}
+
+/**
+ * Queue the receives, sends and cancellations of the connections that found
+ * the submission queue full again
+ *
+ * @param  worker  The worker
+ */
+static void uring_rearm_connections(server_worker_t *worker) {
+  client_connection_t *connection, *next;
+
+  worker->connections_unarmed = 0;
+
+  for (connection = LIST_FIRST(&worker->connections); connection != NULL; connection = next) {
+    // The connection may be closed once its output is sent
+    next = LIST_NEXT(connection, link);
+
+    if (connection->uring_unarmed) {
+      connection->uring_unarmed = 0;
+      finish_io(worker, connection);
+    }
+  }
+}
+
+/**
+ * Close the socket of a connection that still has io_uring requests in
+ * flight. A queued send still goes out, but nothing more is received. The
+ * connection is freed once the last request completes.
+ *
+ * @param  worker  The worker
+ * @param  connection  The connection
+ */
+static void retire_connection(server_worker_t *worker, client_connection_t *connection) {
+  // Queued requests take their reference to the socket when submitted
+  spotd_uring_submit(&worker->ring);
+
+  // The shutdown ends the receive even if the cancellation can not be queued
+  if (connection->recv_armed) {
+    shutdown(connection->socket_desc, SHUT_RD);
+    uring_cancel(worker, (uintptr_t) connection | URING_REQ_RECV);
+  }
+
+  close(connection->socket_desc);
+  connection->retired = 1;
+  worker->num_retired++;
+}
+
+/**
+ * Queue a message for a worker, and wake the worker up
+ *
+ * @param  worker  The worker
+ * @param  message  The message
+ * @return  0 on success, -1 if the worker is stopping and the message was
+ *   not queued
+ */
+static int post_message(server_worker_t *worker, server_message_t *message) {
+  int was_empty;
+
+  pthread_mutex_lock(&worker->mutex);
+  if (worker->stopping) {
+    pthread_mutex_unlock(&worker->mutex);
+    return -1;
+  }
+  was_empty = STAILQ_EMPTY(&worker->inbox);
+  STAILQ_INSERT_TAIL(&worker->inbox, message, link);
+  pthread_mutex_unlock(&worker->mutex);
+
+  // Only wake the worker if it has not been woken up already
+  if (was_empty) {
+    write(worker->wake_pipe[1], "M", 1);
+  }
+
+  return 0;
+}
+
+/**
+ * Queue a command result for the worker owning the connection the command
+ * came from
+ *
+ * @param  completion  The command result. It belongs to the worker from now
+ *   on.
+ */
+static void post_completion(server_completion_t *completion) {
+  server_message_t *message;
+  int worker_index = (int) (completion->origin.connection_id & WORKER_ID_MASK);
+
+  if (worker_index >= g_num_workers) {
+    free_completion(completion);
+    return;
+  }
+
+  message = (server_message_t *) malloc(sizeof(server_message_t));
+  message->event = NULL;
+  message->completion = completion;
+
+  if (post_message(&g_workers[worker_index], message) < 0) {
+    free_completion(completion);
+    free(message);
+  }
+}
+
+/**
+ * Free a command result
+ *
+ * @param  completion  The command result
+ */
+static void free_completion(server_completion_t *completion) {
+  free(completion->search);
+  free(completion);
+}
+
+/**
+ * Handle the messages sent to a worker: push queued events to subscribers,
+ * and send command results to the connections waiting for them.
+ *
+ * @param  worker  The worker
+ * @return  1 if the worker is being stopped, 0 otherwise
+ */
+static int drain_inbox(server_worker_t *worker) {
+  char wake_buf[64];
+  server_message_t *message;
+  client_connection_t *connection, *next;
+  int stopping;
+
+  // Empty the pipe before taking the messages, so that no wakeup is lost
+  while (read(worker->wake_pipe[0], wake_buf, sizeof(wake_buf)) > 0);
+
+  for (;;) {
+    pthread_mutex_lock(&worker->mutex);
+    message = STAILQ_FIRST(&worker->inbox);
+    if (message != NULL) {
+      STAILQ_REMOVE_HEAD(&worker->inbox, link);
+    }
+    stopping = worker->stopping;
+    pthread_mutex_unlock(&worker->mutex);
+
+    if (message == NULL) {
+      break;
+    }
+
+    if (message->event != NULL) {
+      LIST_FOREACH(connection, &worker->connections, link) {
+        if (connection->subscribed) {
+          push_event(connection, message->event);
+        }
+      }
+
+      release_event(message->event);
+    } else {
+      deliver_completion(worker, message->completion);
+      free_completion(message->completion);
+    }
+
+    free(message);
+  }
+
+  // Send the pushed events right away
+  for (connection = LIST_FIRST(&worker->connections); connection != NULL; connection = next) {
+    next = LIST_NEXT(connection, link);
+
+    if (connection->subscribed && connection->output.length > 0 && flush_output(connection) < 0) {
+      close_connection(worker, connection);
+    }
+  }
+
+  return stopping;
+}
+
+/**
+ * Send the result of a command to the connection it came from. An HTTP
+ * connection waiting for the result goes on with its pipelined requests,
+ * or is closed if it asked for that. As the connection may be freed, this
+ * is only called from drain_inbox().
+ *
+ * @param  worker  The worker
+ * @param  completion  The command result
+ */
+static void deliver_completion(server_worker_t *worker, const server_completion_t *completion) {
+  client_connection_t *connection = find_connection(worker, completion->origin.connection_id);
+
+  if (connection == NULL || connection->closing) {
+    return;
+  }
+
+  if (connection->protocol == SPOTD_PROTOCOL_HTTP) {
+    // HTTP has no provisional responses
+    if (!connection->awaiting_result || completion->result == SPOTD_RESULT_LOADING) {
+      return;
+    }
+
+    write_completion(connection, completion);
+    connection->awaiting_result = 0;
+    spotd_timer_cancel(&worker->timers, &connection->command_timer);
+
+    if (!connection->http_keep_alive) {
+      connection->closing = 1;
+    } else if (process_client_input(worker, connection) < 0) {
+      puts("Protocol error, disconnecting client");
+      connection->closing = 1;
+    }
+
+    update_command_timer(connection, 1);
+  } else {
+    write_completion(connection, completion);
+  }
+
+  finish_io(worker, connection);
+}
+
+/**
+ * Write the result of a command in the protocol of a connection
+ *
+ * @param  connection  The client connection
+ * @param  completion  The command result
+ */
+static void write_completion(client_connection_t *connection,
+                             const server_completion_t *completion) {
+  const spotd_command_origin *origin = &completion->origin;
+  spotd_buffer body, reply;
+  char text[64 + SPOTD_LINK_MAX];
+  char prefix[16] = "";
+  int status_code;
+
+  if (connection->protocol == SPOTD_PROTOCOL_HTTP) {
+    spotd_buffer_init(&body);
+
+    if (completion->search != NULL) {
+      status_code = 200;
+      write_search_json(&body, completion->search);
+    } else if (completion->result == SPOTD_RESULT_ERROR) {
+      switch (completion->error) {
+      case SPOTD_ERROR_INVALID_LINK:
+        status_code = 400;
+        break;
+      case SPOTD_ERROR_CANCELLED:
+      case SPOTD_ERROR_INVALID_STATE:
+        status_code = 409;
+        break;
+      default:
+        status_code = 500;
+        break;
+      }
+
+      snprintf(text, sizeof(text), "{\"code\":%d,\"error\":", completion->error);
+      spotd_buffer_append(&body, text, strlen(text));
+      spotd_json_append_string(&body, completion->message);
+      spotd_buffer_append(&body, "}", 1);
+    } else {
+      status_code = 200;
+      snprintf(text, sizeof(text), "{\"result\":\"%s\"}",
+               completion->result == SPOTD_RESULT_STARTED ? "started" : "ok");
+      spotd_buffer_append(&body, text, strlen(text));
+    }
+
+    spotd_http_write_response(&connection->output, status_code, body.data, body.length,
+                              connection->http_keep_alive);
+    spotd_buffer_free(&body);
+    return;
+  }
+
+  spotd_buffer_init(&reply);
+
+  if (origin->flags & ORIGIN_BINARY) {
+    spotd_binary_write_completion(&reply, origin, completion->result,
+                                  completion->error, completion->message);
+  } else {
+    // Only SEARCH is answered without a request ID
+    if (origin->request_id != 0) {
+      snprintf(prefix, sizeof(prefix), "#%u ", origin->request_id);
+    }
+
+    if (completion->search != NULL) {
+      write_search_page(&reply, completion->search, prefix);
+    } else {
+      if (completion->result == SPOTD_RESULT_ERROR) {
+        snprintf(text, sizeof(text), "%sERROR %d %s\n", prefix,
+                 completion->error, completion->message);
+      } else {
+        snprintf(text, sizeof(text), "%s%s\n", prefix,
+                 spotd_command_result_name(completion->result));
+      }
+      spotd_buffer_append(&reply, text, strlen(text));
+    }
+  }
+
+  if (connection->protocol == SPOTD_PROTOCOL_WEBSOCKET) {
+    write_websocket_reply(connection, (origin->flags & ORIGIN_BINARY) ?
+                          SPOTD_WEBSOCKET_OP_BINARY : SPOTD_WEBSOCKET_OP_TEXT, &reply);
+  } else {
+    spotd_buffer_append(&connection->output, reply.data, reply.length);
+  }
+
+  spotd_buffer_free(&reply);
+}
+
+/**
+ * Write a page of search results as text protocol lines: a RESULTS line
+ * with the total number of matches, the offset and the number of tracks,
+ * followed by a TRACK line for every track
+ *
+ * @param  out  The buffer to write to
+ * @param  page  The search results
+ * @param  prefix  The request ID prefix of every line
+ */
+static void write_search_page(spotd_buffer *out, const spotd_search_page *page,
+                              const char *prefix) {
+  const spotd_search_track *track;
+  char line[64 + SPOTD_LINK_MAX + 2 * SPOTD_NAME_MAX];
+  int i;
+
+  snprintf(line, sizeof(line), "%sRESULTS %d %d %d\n", prefix, page->total, page->offset,
+           page->num_tracks);
+  spotd_buffer_append(out, line, strlen(line));
+
+  for (i = 0; i < page->num_tracks; i++) {
+    track = &page->tracks[i];
+    snprintf(line, sizeof(line), "%sTRACK %s %d %s - %s\n", prefix, track->link,
+             track->duration_ms, track->artist, track->name);
+    spotd_buffer_append(out, line, strlen(line));
+  }
+}
+
+/**
+ * Write a page of search results as a JSON object
+ *
+ * @param  out  The buffer to write to
+ * @param  page  The search results
+ */
+static void write_search_json(spotd_buffer *out, const spotd_search_page *page) {
+  const spotd_search_track *track;
+  char text[64];
+  int i;
+
+  snprintf(text, sizeof(text), "{\"total\":%d,\"offset\":%d,\"tracks\":[", page->total,
+           page->offset);
+  spotd_buffer_append(out, text, strlen(text));
+
+  for (i = 0; i < page->num_tracks; i++) {
+    track = &page->tracks[i];
+
+    spotd_buffer_append(out, i > 0 ? ",{\"link\":" : "{\"link\":", i > 0 ? 9 : 8);
+    spotd_json_append_string(out, track->link);
+    spotd_buffer_append(out, ",\"name\":", 8);
+    spotd_json_append_string(out, track->name);
+    spotd_buffer_append(out, ",\"artist\":", 10);
+    spotd_json_append_string(out, track->artist);
+    snprintf(text, sizeof(text), ",\"duration_ms\":%d}", track->duration_ms);
+    spotd_buffer_append(out, text, strlen(text));
+  }
+
+  spotd_buffer_append(out, "]}", 2);
+}
+
+/**
+ * Find a connection of a worker by its ID
+ *
+ * @param  worker  The worker
+ * @param  id  The connection ID
+ * @return  The connection, or NULL if it is gone
+ */
+static client_connection_t *find_connection(server_worker_t *worker, uint64_t id) {
+  client_connection_t *connection;
+
+  LIST_FOREACH(connection, &worker->connections_by_id[(id >> WORKER_ID_BITS) % CONNECTION_BUCKETS],
+               id_link) {
+    if (connection->id == id) {
+      return connection;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Accept pending connections on a listening socket
+ *
+ * @param  worker  The worker that owns the listening socket
+ * @param  listener  The listening socket
+ */
+static void accept_connections(server_worker_t *worker, server_listener_t *listener) {
+  int client_sock, i;
+  socklen_t c;
+  struct sockaddr_storage client;
+
+  for (i = 0; i < MAX_ACCEPTS_PER_WAKEUP; i++) {
+    // There are events in the server socket, accept a connection
+    c = sizeof(client);
+    client_sock = accept(listener->socket_desc, (struct sockaddr *)&client, &c);
+
+    if (client_sock < 0) {
+      // No more pending connections, or accept failed
+      return;
+    }
+
+    accept_client(worker, listener, client_sock);
+  }
+}
+
+/**
+ * Check an accepted client against the access rules and the connection
+ * limit, and create its connection
+ *
+ * @param  worker  The worker that owns the listening socket
+ * @param  listener  The listening socket
+ * @param  client_sock  The accepted client socket
+ */
+static void accept_client(server_worker_t *worker, server_listener_t *listener, int client_sock) {
+  const char *message;
+
+  if (listener->is_unix && !check_peer_credentials(client_sock)) {
+    message = "ACCESS DENIED\n";
+    write(client_sock, message, strlen(message));
+    close(client_sock);
+    return;
+  }
+
+  if (g_config.max_connections > 0 &&
+      __atomic_load_n(&g_num_connections, __ATOMIC_RELAXED) >= g_config.max_connections) {
+    puts("Too many connections, rejecting client");
+    reject_connection(client_sock, listener->protocol);
+    return;
+  }
+
+  puts("Connection accepted");
+  create_connection(worker, client_sock, listener->protocol);
+}
+
+/**
+ * Tell a client that the server is full, and close the connection
+ *
+ * @param  client_sock_desc  The client socket descriptor
+ * @param  protocol  The protocol of the listener the client connected to
+ */
+static void reject_connection(int client_sock_desc, spotd_protocol protocol) {
+  spotd_buffer message;
+  const char *body = "{\"error\":\"too many connections\"}";
+
+  spotd_buffer_init(&message);
+
+  if (protocol == SPOTD_PROTOCOL_HTTP) {
+    spotd_http_write_response(&message, 503, body, strlen(body), 0);
+  } else {
+    spotd_buffer_append(&message, "TOO MANY CONNECTIONS\n", 21);
+  }
+
+  // The socket is still blocking, and the message fits in the socket buffer
+  send(client_sock_desc, message.data, message.length, MSG_NOSIGNAL);
+  close(client_sock_desc);
+
+  spotd_buffer_free(&message);
+}
+
+/**
+ * Create a connection object for an accepted client, and greet the client
+ * if it uses the control protocol
+ *
+ * @param  worker  The worker that will handle the connection
+ * @param  client_sock_desc  The client socket descriptor
+ * @param  protocol  The protocol spoken on the connection
+ */
+static void create_connection(server_worker_t *worker, int client_sock_desc,
+                              spotd_protocol protocol) {
+  client_connection_t *connection;
+  char message_buf[64];
+
+  // Make the client socket non-blocking
+  fcntl(client_sock_desc, F_SETFL, O_NONBLOCK);
+
+  connection = (client_connection_t*) malloc(sizeof(client_connection_t));
+  connection->id = __atomic_fetch_add(&g_next_connection_id, 1, __ATOMIC_RELAXED)
+                   << WORKER_ID_BITS | (uint64_t) (worker - g_workers);
+  connection->worker = worker;
+  connection->socket_desc = client_sock_desc;
+  connection->protocol = protocol;
+  connection->binary = 0;
+  connection->subscribed = 0;
+  connection->closing = 0;
+  connection->dropped_events = 0;
+  connection->awaiting_result = 0;
+  connection->http_keep_alive = 0;
+  spotd_buffer_init(&connection->input);
+  spotd_buffer_init(&connection->output);
+  spotd_buffer_init(&connection->sending);
+  connection->uring_requests = 0;
+  connection->recv_armed = 0;
+  connection->recv_cancelled = 0;
+  connection->send_armed = 0;
+  connection->uring_unarmed = 0;
+  connection->retired = 0;
+  connection->last_activity_ms = monotonic_ms();
+  connection->rate_tokens = (int64_t) g_config.command_burst * 1000;
+  connection->rate_refill_ms = connection->last_activity_ms;
+  spotd_timer_init(&connection->idle_timer, idle_timer_expired, connection);
+  spotd_timer_init(&connection->command_timer, command_timer_expired, connection);
+
+  LIST_INSERT_HEAD(&worker->connections, connection, link);
+  LIST_INSERT_HEAD(&worker->connections_by_id[(connection->id >> WORKER_ID_BITS) % CONNECTION_BUCKETS],
+                   connection, id_link);
+  worker->num_connections++;
+  __atomic_add_fetch(&g_num_connections, 1, __ATOMIC_RELAXED);
+
+  if (g_config.idle_timeout_ms > 0) {
+    spotd_timer_schedule(&worker->timers, &connection->idle_timer,
+                         connection->last_activity_ms + g_config.idle_timeout_ms);
+  }
+
+  // Send the greetings message to the client. HTTP clients speak first.
+  if (protocol == SPOTD_PROTOCOL_CONTROL) {
+    snprintf(message_buf, sizeof(message_buf), "spotd v%s\n", VERSION);
+    spotd_buffer_append(&connection->output, message_buf, strlen(message_buf));
+  }
+
+  finish_io(worker, connection);
+}
+
+/**
+ * Close a client connection and free it
+ *
+ * @param  worker  The worker that handles the connection
+ * @param  connection  The connection to close
+ */
+static void close_connection(server_worker_t *worker, client_connection_t *connection) {
+  if (connection->subscribed) {
+    __atomic_sub_fetch(&g_num_subscribers, 1, __ATOMIC_RELAXED);
+  }
+
+  spotd_timer_cancel(&worker->timers, &connection->idle_timer);
+  spotd_timer_cancel(&worker->timers, &connection->command_timer);
+
+  spotd_buffer_free(&connection->input);
+  spotd_buffer_free(&connection->output);
+
+  LIST_REMOVE(connection, link);
+  LIST_REMOVE(connection, id_link);
+  worker->num_connections--;
+  __atomic_sub_fetch(&g_num_connections, 1, __ATOMIC_RELAXED);
+
+  if (connection->uring_requests > 0) {
+    retire_connection(worker, connection);
+  } else {
+    close(connection->socket_desc);
+    free_connection(connection);
+  }
+}
+
+/**
+ * Free a closed connection
+ *
+ * @param  connection  The connection
+ */
+static void free_connection(client_connection_t *connection) {
+  if (connection->retired) {
+    connection->worker->num_retired--;
+  }
+
+  spotd_buffer_free(&connection->sending);
+  free(connection);
+}
+
+/**
+ * Handle poll events of a client connection
+ *
+ * @param  worker  The worker that handles the connection
+ * @param  connection  The connection
+ * @param  revents  The events returned by poll()
+ */
+static void handle_connection_events(server_worker_t *worker, client_connection_t *connection,
+                                     short revents) {
+  char client_message[RECV_BUFFER_SIZE];
+  ssize_t read_size;
+
+  if (revents & (POLLIN | POLLHUP | POLLERR)) {
+    // There are events in the client socket, receive the message from the client
+    read_size = recv(connection->socket_desc, client_message, sizeof(client_message), 0);
+
+    // Check for errors
+    if (read_size == 0) {
+      puts("Client disconnected");
+      close_connection(worker, connection);
+      return;
+    } else if (read_size < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("recv failed");
+        close_connection(worker, connection);
+        return;
+      }
+    } else {
+      handle_received(worker, connection, client_message, read_size);
+    }
+  }
+
+  finish_io(worker, connection);
+}
+
+/**
+ * Handle data received from a client
+ *
+ * @param  worker  The worker that handles the connection
+ * @param  connection  The connection
+ * @param  data  The received data
+ * @param  length  Length of the received data
+ */
+static void handle_received(server_worker_t *worker, client_connection_t *connection,
+                            const char *data, size_t length) {
+  size_t pending;
+
+  if (connection->closing) {
+    return;
+  }
+
+  connection->last_activity_ms = monotonic_ms();
+
+  // Handle every complete command received so far
+  spotd_buffer_append(&connection->input, data, length);
+  pending = connection->input.length;
+
+  if (process_client_input(worker, connection) < 0) {
+    puts("Protocol error, disconnecting client");
+    connection->closing = 1;
+  }
+
+  update_command_timer(connection, connection->input.length < pending);
+}
+
+/**
+ * Send the responses of a connection, and close it if it failed or is done.
+ * With io_uring, also keep receiving from the connection while it reads its
+ * responses.
+ *
+ * @param  worker  The worker that handles the connection
+ * @param  connection  The connection
+ */
+static void finish_io(server_worker_t *worker, client_connection_t *connection) {
+  if (flush_output(connection) < 0 ||
+      (connection->closing && pending_output(connection) == 0)) {
+    close_connection(worker, connection);
+    return;
+  }
+
+  if (worker->use_uring) {
+    uring_update_recv(worker, connection);
+  }
+}
+
+/**
+ * Get the amount of output not sent to a client yet
+ *
+ * @param  connection  The connection
+ * @return  The number of bytes
+ */
+static size_t pending_output(const client_connection_t *connection) {
+  return connection->output.length + connection->sending.length;
+}
+
+/**
+ * Start, restart or stop the deadline for the command a client is sending.
+ * The deadline starts when the first byte of a command is received.
+ *
+ * @param  connection  The client connection
+ * @param  consumed  Non-zero if complete commands were taken from the input
+ */
+static void update_command_timer(client_connection_t *connection, int consumed) {
+  spotd_timer_wheel *timers = &connection->worker->timers;
+
+  // The deadline of a command waiting for its result is kept
+  if (g_config.command_timeout_ms <= 0 || connection->awaiting_result) {
+    return;
+  }
+
+  if (connection->input.length == 0 || connection->closing) {
+    spotd_timer_cancel(timers, &connection->command_timer);
+  } else if (consumed || !connection->command_timer.active) {
+    // A new command was started
+    spotd_timer_schedule(timers, &connection->command_timer,
+                         connection->last_activity_ms + g_config.command_timeout_ms);
+  }
+}
+
+/**
+ * Called when a connection may have been idle for the idle timeout. The
+ * timer is not moved on every read and write, so the last activity is
+ * checked first.
+ *
+ * @param  timer  The idle timer
+ * @param  data  The client connection
+ */
+static void idle_timer_expired(spotd_timer *timer, void *data) {
+  client_connection_t *connection = (client_connection_t *) data;
+  int64_t now = monotonic_ms();
+
+  if (now - connection->last_activity_ms < g_config.idle_timeout_ms) {
+    spotd_timer_schedule(&connection->worker->timers, timer,
+                         connection->last_activity_ms + g_config.idle_timeout_ms);
+    return;
+  }
+
+  // Subscribers are quiet while nothing happens. They are alive as long as
+  // they keep up with the events.
+  if (connection->subscribed && pending_output(connection) == 0) {
+    spotd_timer_schedule(&connection->worker->timers, timer, now + g_config.idle_timeout_ms);
+    return;
+  }
+
+  puts("Connection idle, disconnecting client");
+  close_timed_out(connection, 0);
+}
+
+/**
+ * Called when a client did not finish sending a command in time
+ *
+ * @param  timer  The command timer
+ * @param  data  The client connection
+ */
+static void command_timer_expired(spotd_timer *timer, void *data) {
+  puts("Command timed out, disconnecting client");
+  close_timed_out((client_connection_t *) data, 1);
+}
+
+/**
+ * Tell a client that timed out why it is disconnected, if the protocol
+ * allows it, and close the connection. The notice is sent on a best effort
+ * basis, the connection is closed right away.
+ *
+ * @param  connection  The client connection
+ * @param  command_timeout  Non-zero if a command timed out, zero if the
+ *   connection was idle
+ */
+static void close_timed_out(client_connection_t *connection, int command_timeout) {
+  switch (connection->protocol) {
+  case SPOTD_PROTOCOL_CONTROL:
+    if (!connection->binary) {
+      spotd_buffer_append(&connection->output, "TIMEOUT\n", 8);
+    }
+    break;
+  case SPOTD_PROTOCOL_HTTP:
+    if (connection->awaiting_result) {
+      write_http_result(connection, 504, "error", "command timed out", 0);
+    } else if (command_timeout) {
+      write_http_result(connection, 408, "error", "request timeout", 0);
+    }
+    break;
+  case SPOTD_PROTOCOL_WEBSOCKET:
+    // Close with status 1008, policy violation, or 1001, going away
+    spotd_websocket_write_frame(&connection->output, SPOTD_WEBSOCKET_OP_CLOSE,
+                                command_timeout ? "\x03\xf0" : "\x03\xe9", 2);
+    break;
+  }
+
+  flush_output(connection);
+  close_connection(connection->worker, connection);
+}
+
+/**
+ * Send as much buffered output to a client as the socket accepts. With
+ * io_uring, the output is handed to the kernel instead.
+ *
+ * @param  connection  The client connection
+ * @return  0 on success, -1 if the connection failed
+ */
+static int flush_output(client_connection_t *connection) {
+  ssize_t written;
+
+  if (connection->worker->use_uring) {
+    // Errors are reported when the send completes
+    uring_send(connection);
+  } else {
+    while (connection->output.length > 0) {
+      written = send(connection->socket_desc, connection->output.data,
+                     connection->output.length, MSG_NOSIGNAL);
+
+      if (written < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          break;
+        } else if (errno == EINTR) {
+          continue;
+        }
+        return -1;
+      }
+
+      spotd_buffer_consume(&connection->output, written);
+      connection->last_activity_ms = monotonic_ms();
+    }
+  }
+
+  // Tell the client about events it missed, once it catches up
+  if (connection->dropped_events > 0 && pending_output(connection) < MAX_SUBSCRIBER_BACKLOG / 2) {
+    push_dropped_event(connection);
+  }
+
+  return 0;
+}
+
+/**
+ * Get the format in which events are pushed to a connection
+ *
+ * @param  connection  The subscribed connection
+ * @return  The event format
+ */
+static server_event_format connection_event_format(client_connection_t *connection) {
+  if (connection->protocol == SPOTD_PROTOCOL_WEBSOCKET) {
+    return connection->binary ? EVENT_FORMAT_WEBSOCKET_BINARY : EVENT_FORMAT_WEBSOCKET_JSON;
+  }
+
+  return connection->binary ? EVENT_FORMAT_BINARY : EVENT_FORMAT_TEXT;
+}
+
+/**
+ * Serialize an event in one of the event formats
+ *
+ * @param  event  The event to serialize
+ * @param  format  The format to serialize the event in
+ * @param  out  The buffer to write the serialized event to
+ */
+static void serialize_event(const spotd_event *event, server_event_format format,
+                            spotd_buffer *out) {
+  spotd_buffer payload;
+  char text[64 + SPOTD_LINK_MAX];
+
+  switch (format) {
+  case EVENT_FORMAT_TEXT:
+    snprintf(text, sizeof(text), "EVENT %s %d%s%s\n",
+             spotd_event_type_name(event->type), event->value,
+             event->text[0] != '\0' ? " " : "", event->text);
+    spotd_buffer_append(out, text, strlen(text));
+    break;
+  case EVENT_FORMAT_BINARY:
+    spotd_binary_write_event(out, event);
+    break;
+  case EVENT_FORMAT_WEBSOCKET_JSON:
+    spotd_buffer_init(&payload);
+    snprintf(text, sizeof(text), "{\"event\":\"%s\",\"value\":%d,\"text\":",
+             spotd_event_type_name(event->type), event->value);
+    spotd_buffer_append(&payload, text, strlen(text));
+    spotd_json_append_string(&payload, event->text);
+    spotd_buffer_append(&payload, "}", 1);
+
+    spotd_websocket_write_frame(out, SPOTD_WEBSOCKET_OP_TEXT, payload.data, payload.length);
+    spotd_buffer_free(&payload);
+    break;
+  case EVENT_FORMAT_WEBSOCKET_BINARY:
+    // WebSocket frames are delimited already, the length prefix is left out
+    spotd_buffer_init(&payload);
+    spotd_binary_write_event(&payload, event);
+
+    spotd_websocket_write_frame(out, SPOTD_WEBSOCKET_OP_BINARY,
+                                payload.data + SPOTD_BINARY_LENGTH_SIZE,
+                                payload.length - SPOTD_BINARY_LENGTH_SIZE);
+    spotd_buffer_free(&payload);
+    break;
+  default:
+    break;
+  }
+}
+
+/**
+ * Append an event to the output buffer of a subscriber. If the subscriber
+ * is too far behind, the event is dropped instead, so that a slow client
+ * can not make the server buffer without bounds.
+ *
+ * @param  connection  The subscribed connection
+ * @param  event  The serialized event
+ */
+static void push_event(client_connection_t *connection, server_event_t *event) {
+  server_event_format format = connection_event_format(connection);
+
+  if (pending_output(connection) + event->lengths[format] > MAX_SUBSCRIBER_BACKLOG) {
+    connection->dropped_events++;
+    return;
+  }
+
+  spotd_buffer_append(&connection->output, event->data[format], event->lengths[format]);
+}
+
+/**
+ * Append a SPOTD_EVENT_DROPPED event with the number of dropped events to
+ * the output buffer of a subscriber
+ *
+ * @param  connection  The subscribed connection
+ */
+static void push_dropped_event(client_connection_t *connection) {
+  spotd_event event;
+
+  event.type = SPOTD_EVENT_DROPPED;
+  event.value = connection->dropped_events;
+  event.text[0] = '\0';
+
+  serialize_event(&event, connection_event_format(connection), &connection->output);
+
+  connection->dropped_events = 0;
+}
+
+/**
+ * Release a worker's reference to a shared event
+ *
+ * @param  event  The event to release
+ */
+static void release_event(server_event_t *event) {
+  if (__atomic_sub_fetch(&event->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(event);
+  }
+}
+
+/**
+ * Handle all complete commands in the input buffer of a client. Incomplete
+ * commands are left in the buffer until more data is received. Responses are
+ * written to the output buffer of the client.
+ *
+ * @param  worker  The worker that handles the connection
+ * @param  connection  The client connection
+ * @return  0 on success, -1 if the client violated the protocol and should be
+ *   disconnected
+ */
+static int process_client_input(server_worker_t *worker, client_connection_t *connection) {
+  spotd_buffer *input = &connection->input;
+  spotd_http_request request;
+  char *newline;
+  size_t line_length;
+  spotd_websocket_frame frame;
+  uint32_t frame_length;
+  int request_length;
+
+  for (;;) {
+    if (connection->protocol == SPOTD_PROTOCOL_HTTP) {
+      // HTTP requests are parsed once the headers and body are complete.
+      // Pipelined requests are answered in order, so nothing more is
+      // handled while a response waits for the result of a command.
+      if (connection->awaiting_result) {
+        return 0;
+      }
+
+      request_length = spotd_http_parse_request(input->data, input->length, &request);
+
+      if (request_length < 0) {
+        write_http_result(connection, 400, "error", "bad request", 0);
+        return -1;
+      } else if (request_length == 0) {
+        return 0;
+      }
+
+      handle_http_request(worker, connection, &request);
+      spotd_buffer_consume(input, request_length);
+
+      if (connection->protocol == SPOTD_PROTOCOL_HTTP && !request.keep_alive &&
+          !connection->awaiting_result) {
+        connection->closing = 1;
+        return 0;
+      }
+    } else if (connection->protocol == SPOTD_PROTOCOL_WEBSOCKET) {
+      request_length = spotd_websocket_parse_frame(input->data, input->length, &frame);
+
+      if (request_length < 0) {
+        // Close with status 1002, protocol error
+        spotd_websocket_write_frame(&connection->output, SPOTD_WEBSOCKET_OP_CLOSE, "\x03\xea", 2);
+        return -1;
+      } else if (request_length == 0) {
+        return 0;
+      }
+
+      handle_websocket_frame(connection, &frame);
+      spotd_buffer_consume(input, request_length);
+
+      if (connection->closing) {
+        return 0;
+      }
+    } else if (connection->binary) {
+      // Binary frames are prefixed with their length
+      if (input->length < SPOTD_BINARY_LENGTH_SIZE) {
+        return 0;
+      }
+
+      memcpy(&frame_length, input->data, SPOTD_BINARY_LENGTH_SIZE);
+      frame_length = ntohl(frame_length);
+
+      if (frame_length > SPOTD_BINARY_MAX_FRAME) {
+        return -1;
+      }
+
+      if (input->length < SPOTD_BINARY_LENGTH_SIZE + frame_length) {
+        return 0;
+      }
+
+      handle_binary_frame(connection, input->data + SPOTD_BINARY_LENGTH_SIZE, frame_length);
+      spotd_buffer_consume(input, SPOTD_BINARY_LENGTH_SIZE + frame_length);
+    } else {
+      // Text commands are terminated by a newline
+      newline = memchr(input->data, '\n', input->length);
+
+      if (newline == NULL) {
+        return input->length > MAX_LINE_LENGTH ? -1 : 0;
+      }
+
+      line_length = newline - input->data;
+      *newline = '\0';
+
+      if (line_length > 0 && input->data[line_length - 1] == '\r') {
+        input->data[line_length - 1] = '\0';
+      }
+
+      handle_text_line(connection, input->data);
+      spotd_buffer_consume(input, line_length + 1);
+    }
+  }
+}
+
+/**
+ * Handle a single text protocol line. A command may start with a request ID,
+ * "#<id> ". Responses to such a command start with the same ID, and
+ * commands executed by the main loop are answered with their real result
+ * once they have been executed.
+ *
+ * @param  connection  The client connection
+ * @param  line  The line, without the terminating newline
+ */
+static void handle_text_line(client_connection_t *connection, char *line) {
+  spotd_buffer *out = &connection->output;
+  spotd_command *command;
+  spotd_command_type type;
+  spotd_status status;
+  spotd_stats stats;
+  spotd_zone_status zones[SPOTD_MAX_ZONES];
+  char response[96 + SPOTD_LINK_MAX];
+  char prefix[16] = "";
+  unsigned long request_id = 0;
+  char *end;
+  int deferred, num_zones, i;
+
+  if (line[0] == '#') {
+    request_id = strtoul(line + 1, &end, 10);
+
+    if (!isdigit((unsigned char) line[1]) || *end != ' ' ||
+        request_id == 0 || request_id > UINT32_MAX) {
+      spotd_buffer_append(out, "INVALID COMMAND\n", 16);
+      return;
+    }
+
+    snprintf(prefix, sizeof(prefix), "#%lu ", request_id);
+    line = end + 1;
+  }
+
+  // Switch to the binary protocol if requested
+  if (strcmp(line, "BINARY") == 0) {
+    snprintf(response, sizeof(response), "%sOK BINARY %d\n", prefix, SPOTD_BINARY_VERSION);
+    spotd_buffer_append(out, response, strlen(response));
+    connection->binary = 1;
+    return;
+  }
+
+  // Try to parse a command from the client message
+  command = parse_client_message(line);
+
+  if (command == NULL) {
+    // Send invalid command response
+    snprintf(response, sizeof(response), "%sINVALID COMMAND\n", prefix);
+    spotd_buffer_append(out, response, strlen(response));
+    return;
+  }
+
+  type = command->type;
+  // Search results are sent once the search completes, also to clients that
+  // did not give a request ID
+  deferred = (request_id != 0 && is_main_loop_command(type)) || type == SPOTD_COMMAND_SEARCH;
+
+  if (deferred) {
+    command->origin.connection_id = connection->id;
+    command->origin.request_id = (uint32_t) request_id;
+  }
+
+  if (dispatch_command(connection, command, &status) < 0) {
+    snprintf(response, sizeof(response), "%sRATE LIMITED\n", prefix);
+    spotd_buffer_append(out, response, strlen(response));
+  } else if (type == SPOTD_COMMAND_STATUS) {
+    snprintf(response, sizeof(response), "%sSTATUS %s %d %d %d %s\n", prefix,
+             spotd_player_state_name(status.state), status.position_ms,
+             status.duration_ms, status.volume, status.track_link);
+    spotd_buffer_append(out, response, strlen(response));
+  } else if (type == SPOTD_COMMAND_OFFLINE_STATUS) {
+    memset(&stats, 0, sizeof(stats));
+    if (g_callbacks->stats_requested != NULL) {
+      g_callbacks->stats_requested(&stats);
+    }
+
+    snprintf(response, sizeof(response),
+             "%sOFFLINE %s %d %d %d %" PRIu64 " %d %" PRIu64 " %d\n", prefix,
+             stats.offline_syncing ? "SYNCING" : "IDLE", stats.bitrate_kbps,
+             stats.offline_playlists, stats.offline_queued_tracks, stats.offline_queued_bytes,
+             stats.offline_done_tracks, stats.offline_done_bytes, stats.offline_error_tracks);
+    spotd_buffer_append(out, response, strlen(response));
+  } else if (type == SPOTD_COMMAND_ZONES) {
+    num_zones = 0;
+    if (g_callbacks->zones_requested != NULL) {
+      num_zones = g_callbacks->zones_requested(zones, SPOTD_MAX_ZONES);
+    }
+
+    snprintf(response, sizeof(response), "%sZONES %d\n", prefix, num_zones);
+    spotd_buffer_append(out, response, strlen(response));
+
+    for (i = 0; i < num_zones; i++) {
+      snprintf(response, sizeof(response), "%sZONE %d %d %d %" PRIu64 " %d %d %s\n", prefix,
+               i, zones[i].volume, zones[i].backlog_ms, zones[i].dropped_frames,
+               zones[i].sync_error_us, zones[i].sync_ppm, zones[i].device);
+      spotd_buffer_append(out, response, strlen(response));
+    }
+  } else if (!deferred) {
+    // Send ok response
+    snprintf(response, sizeof(response), "%sOK\n", prefix);
+    spotd_buffer_append(out, response, strlen(response));
+  }
+}
+
+/**
+ * Handle a single binary protocol frame
+ *
+ * @param  connection  The client connection
+ * @param  body  The frame body, without the length prefix
+ * @param  length  Length of the frame body
+ */
+static void handle_binary_frame(client_connection_t *connection, const char *body, size_t length) {
+  spotd_buffer *out = &connection->output;
+  spotd_binary_request request;
+  spotd_command *command;
+  spotd_command_type type;
+  spotd_status status;
+  int deferred;
+
+  command = spotd_binary_parse_request(body, length, &request);
+
+  if (command == NULL) {
+    spotd_binary_write_response(out, &request, SPOTD_BINARY_RESULT_INVALID_COMMAND);
+    return;
+  }
+
+  type = command->type;
+  deferred = (request.flags & SPOTD_BINARY_FLAG_DEFERRED) && is_main_loop_command(type);
+
+  if (deferred) {
+    command->origin.connection_id = connection->id;
+    command->origin.request_id = request.request_id;
+    command->origin.flags = ORIGIN_BINARY;
+  }
+
+  if (dispatch_command(connection, command, &status) < 0) {
+    spotd_binary_write_response(out, &request, SPOTD_BINARY_RESULT_RATE_LIMITED);
+  } else if (type == SPOTD_COMMAND_STATUS) {
+    spotd_binary_write_status(out, &request, &status);
+  } else if (!deferred) {
+    spotd_binary_write_response(out, &request, SPOTD_BINARY_RESULT_OK);
+  }
+}
+
+/**
+ * Handle a single WebSocket frame. Commands are answered with a frame of the
+ * same type, holding the text or binary protocol response.
+ *
+ * @param  connection  The client connection
+ * @param  frame  The parsed frame
+ */
+static void handle_websocket_frame(client_connection_t *connection,
+                                   const spotd_websocket_frame *frame) {
+  spotd_buffer output, reply;
+  char line[SPOTD_WEBSOCKET_MAX_PAYLOAD + 1];
+
+  switch (frame->opcode) {
+  case SPOTD_WEBSOCKET_OP_TEXT:
+  case SPOTD_WEBSOCKET_OP_BINARY:
+    // Let the protocol handlers write the response to a separate buffer,
+    // to be sent as the payload of a single frame
+    output = connection->output;
+    spotd_buffer_init(&connection->output);
+
+    if (frame->opcode == SPOTD_WEBSOCKET_OP_TEXT) {
+      memcpy(line, frame->payload, frame->payload_length);
+      line[frame->payload_length] = '\0';
+      handle_text_line(connection, line);
+    } else {
+      handle_binary_frame(connection, frame->payload, frame->payload_length);
+    }
+
+    reply = connection->output;
+    connection->output = output;
+
+    write_websocket_reply(connection, frame->opcode, &reply);
+    spotd_buffer_free(&reply);
+    break;
+  case SPOTD_WEBSOCKET_OP_PING:
+    spotd_websocket_write_frame(&connection->output, SPOTD_WEBSOCKET_OP_PONG,
+                                frame->payload, frame->payload_length);
+    break;
+  case SPOTD_WEBSOCKET_OP_CLOSE:
+    // Echo the status code and close once it is sent
+    spotd_websocket_write_frame(&connection->output, SPOTD_WEBSOCKET_OP_CLOSE,
+                                frame->payload, frame->payload_length < 2 ? 0 : 2);
+    connection->closing = 1;
+    break;
+  default:
+    break;
+  }
+}
+
+/**
+ * Send the response written by a protocol handler as a WebSocket frame
+ *
+ * @param  connection  The client connection
+ * @param  opcode  SPOTD_WEBSOCKET_OP_TEXT for a text protocol response, or
+ *   SPOTD_WEBSOCKET_OP_BINARY for a binary protocol frame
+ * @param  reply  The response, nothing is sent if it is empty
+ */
+static void write_websocket_reply(client_connection_t *connection,
+                                  spotd_websocket_opcode opcode, const spotd_buffer *reply) {
+  if (reply->length == 0) {
+    return;
+  }
+
+  if (opcode == SPOTD_WEBSOCKET_OP_TEXT) {
+    // Without the newline
+    spotd_websocket_write_frame(&connection->output, opcode, reply->data, reply->length - 1);
+  } else {
+    // Without the length prefix
+    spotd_websocket_write_frame(&connection->output, opcode,
+                                reply->data + SPOTD_BINARY_LENGTH_SIZE,
+                                reply->length - SPOTD_BINARY_LENGTH_SIZE);
+  }
+}
+
+/**
+ * Handle a single HTTP request. The API has the endpoints GET /status,
+ * GET /stats, GET /queue, POST /play, POST /stop, POST /pause, POST /resume,
+ * POST /queue, /queue/remove, /queue/next and /queue/clear for the play
+ * queue, POST /playlist and /playlist/next, GET /search, POST /warm,
+ * POST /bitrate, GET /offline, POST /offline and /offline/remove for the
+ * offline sync, and GET /zones and POST /zone/volume for the output zones.
+ * GET /ws upgrades the connection to a WebSocket that receives events.
+ *
+ * @param  worker  The worker that handles the connection
+ * @param  connection  The client connection
+ * @param  request  The parsed request
+ */
+static void handle_http_request(server_worker_t *worker, client_connection_t *connection,
+                                const spotd_http_request *request) {
+  spotd_buffer body;
+  spotd_command *command;
+  spotd_status status;
+  spotd_stats stats;
+  char link[SPOTD_LINK_MAX];
+  char links[SPOTD_QUEUE_MAX][SPOTD_LINK_MAX];
+  char query[MAX_SEARCH_QUERY];
+  spotd_zone_status zones[SPOTD_MAX_ZONES];
+  char text[1024];
+  char format[16];
+  char **arguments;
+  int keep_alive = request->keep_alive;
+  int num_links, num_zones, index, limit, i;
+
+  if (strcmp(request->path, "/status") == 0 && request->method == SPOTD_HTTP_GET) {
+    write_http_status(worker, connection, keep_alive);
+  } else if (strcmp(request->path, "/stats") == 0 && request->method == SPOTD_HTTP_GET) {
+    memset(&stats, 0, sizeof(stats));
+    if (g_callbacks->stats_requested != NULL) {
+      g_callbacks->stats_requested(&stats);
+    }
+
+    snprintf(text, sizeof(text),
+             "{\"track_cache\":{\"size\":%d,\"hits\":%" PRIu64 ",\"misses\":%" PRIu64
+             ",\"evictions\":%" PRIu64 "},"
+             "\"search_cache\":{\"size\":%d,\"hits\":%" PRIu64 ",\"misses\":%" PRIu64
+             ",\"evictions\":%" PRIu64 "},"
+             "\"warm\":{\"pending\":%d,\"prefetched\":%" PRIu64 ",\"failed\":%" PRIu64 "},"
+             "\"startup\":{\"login_ms\":%d,\"first_audio_ms\":%d},"
+             "\"first_audio\":{\"count\":%" PRIu64 ",\"last_ms\":%d,\"min_ms\":%d"
+             ",\"max_ms\":%d,\"avg_ms\":%d}}",
+             stats.track_cache_size, stats.track_cache_hits, stats.track_cache_misses,
+             stats.track_cache_evictions, stats.search_cache_size, stats.search_cache_hits,
+             stats.search_cache_misses, stats.search_cache_evictions, stats.warm_pending,
+             stats.warm_prefetched, stats.warm_failed, stats.login_ms, stats.startup_ttfa_ms,
+             stats.ttfa_count, stats.ttfa_last_ms, stats.ttfa_min_ms, stats.ttfa_max_ms,
+             stats.ttfa_avg_ms);
+    spotd_http_write_response(&connection->output, 200, text, strlen(text), keep_alive);
+  } else if (strcmp(request->path, "/queue") == 0 && request->method == SPOTD_HTTP_GET) {
+    command = spotd_command_create(SPOTD_COMMAND_STATUS, 0, NULL);
+    dispatch_command(connection, command, &status);
+
+    num_links = 0;
+    if (g_callbacks->queue_requested != NULL) {
+      num_links = g_callbacks->queue_requested(links, SPOTD_QUEUE_MAX);
+    }
+
+    spotd_buffer_init(&body);
+    spotd_buffer_append(&body, "{\"current\":", 11);
+    if (status.state != SPOTD_PLAYER_STOPPED && status.track_link[0] != '\0') {
+      spotd_json_append_string(&body, status.track_link);
+    } else {
+      spotd_buffer_append(&body, "null", 4);
+    }
+    spotd_buffer_append(&body, ",\"next\":[", 9);
+    for (i = 0; i < num_links; i++) {
+      if (i > 0) {
+        spotd_buffer_append(&body, ",", 1);
+      }
+      spotd_json_append_string(&body, links[i]);
+    }
+    spotd_buffer_append(&body, "]}", 2);
+
+    spotd_http_write_response(&connection->output, 200, body.data, body.length, keep_alive);
+    spotd_buffer_free(&body);
+  } else if ((strcmp(request->path, "/play") == 0 || strcmp(request->path, "/queue") == 0) &&
+             request->method == SPOTD_HTTP_POST) {
+    // The link can be passed in a JSON body or in the query string
+    if (spotd_json_get_string(request->body, request->body_length, "link",
+                              link, sizeof(link)) < 0 &&
+        spotd_http_get_query_param(request->query, "link", link, sizeof(link)) < 0) {
+      link[0] = '\0';
+    }
+
+    if (link[0] == '\0') {
+      write_http_result(connection, 400, "error", "missing link", keep_alive);
+      return;
+    }
+
+    arguments = (char**) malloc(1 * sizeof(char*));
+    arguments[0] = (char *) malloc(strlen(link) + 1);
+    strcpy(arguments[0], link);
+
+    command = spotd_command_create(strcmp(request->path, "/play") == 0 ?
+                                   SPOTD_COMMAND_PLAY_TRACK : SPOTD_COMMAND_QUEUE_ADD,
+                                   1, arguments);
+    dispatch_http_command(connection, command, keep_alive);
+  } else if (strcmp(request->path, "/queue/remove") == 0 &&
+             request->method == SPOTD_HTTP_POST) {
+    // The index can be passed in the query string only
+    if (spotd_http_get_query_param(request->query, "index", link, sizeof(link)) < 0 ||
+        (index = parse_int(link, 0, SPOTD_QUEUE_MAX - 1)) < 0) {
+      write_http_result(connection, 400, "error", "missing index", keep_alive);
+      return;
+    }
+
+    arguments = (char**) malloc(1 * sizeof(char*));
+    arguments[0] = (char *) malloc(12);
+    snprintf(arguments[0], 12, "%d", index);
+
+    command = spotd_command_create(SPOTD_COMMAND_QUEUE_REMOVE, 1, arguments);
+    dispatch_http_command(connection, command, keep_alive);
+  } else if (strcmp(request->path, "/playlist") == 0 && request->method == SPOTD_HTTP_POST) {
+    // The playlist link or index can be passed in a JSON body or in the
+    // query string, the track to start at in the query string only
+    if (spotd_json_get_string(request->body, request->body_length, "playlist",
+                              link, sizeof(link)) < 0 &&
+        spotd_http_get_query_param(request->query, "playlist", link, sizeof(link)) < 0) {
+      link[0] = '\0';
+    }
+
+    if (link[0] == '\0') {
+      write_http_result(connection, 400, "error", "missing playlist", keep_alive);
+      return;
+    }
+
+    index = 0;
+    if (spotd_http_get_query_param(request->query, "start", format, sizeof(format)) == 0 &&
+        (index = parse_int(format, 0, INT32_MAX)) < 0) {
+      write_http_result(connection, 400, "error", "invalid start", keep_alive);
+      return;
+    }
+
+    command = create_playlist_command(link, index);
+    dispatch_http_command(connection, command, keep_alive);
+  } else if (strcmp(request->path, "/search") == 0 && request->method == SPOTD_HTTP_GET) {
+    // The query, and the page of results to return, are passed in the
+    // query string
+    if (spotd_http_get_query_param(request->query, "q", query, sizeof(query)) < 0 ||
+        query[0] == '\0') {
+      write_http_result(connection, 400, "error", "missing query", keep_alive);
+      return;
+    }
+
+    index = 0;
+    if (spotd_http_get_query_param(request->query, "offset", format, sizeof(format)) == 0 &&
+        (index = parse_int(format, 0, INT32_MAX)) < 0) {
+      write_http_result(connection, 400, "error", "invalid offset", keep_alive);
+      return;
+    }
+
+    limit = DEFAULT_SEARCH_LIMIT;
+    if (spotd_http_get_query_param(request->query, "limit", format, sizeof(format)) == 0 &&
+        (limit = parse_int(format, 1, SPOTD_SEARCH_PAGE_MAX)) < 0) {
+      write_http_result(connection, 400, "error", "invalid limit", keep_alive);
+      return;
+    }
+
+    command = create_search_command(query, index, limit);
+    dispatch_http_command(connection, command, keep_alive);
+  } else if (strcmp(request->path, "/offline") == 0 && request->method == SPOTD_HTTP_GET) {
+    memset(&stats, 0, sizeof(stats));
+    if (g_callbacks->stats_requested != NULL) {
+      g_callbacks->stats_requested(&stats);
+    }
+
+    snprintf(text, sizeof(text),
+             "{\"bitrate\":%d,\"playlists\":%d,\"syncing\":%s,\"queued_tracks\":%d,"
+             "\"queued_bytes\":%" PRIu64 ",\"done_tracks\":%d,\"done_bytes\":%" PRIu64
+             ",\"error_tracks\":%d}",
+             stats.bitrate_kbps, stats.offline_playlists,
+             stats.offline_syncing ? "true" : "false", stats.offline_queued_tracks,
+             stats.offline_queued_bytes, stats.offline_done_tracks, stats.offline_done_bytes,
+             stats.offline_error_tracks);
+    spotd_http_write_response(&connection->output, 200, text, strlen(text), keep_alive);
+  } else if ((strcmp(request->path, "/offline") == 0 ||
+              strcmp(request->path, "/offline/remove") == 0) &&
+             request->method == SPOTD_HTTP_POST) {
+    // The playlist link or index can be passed in a JSON body or in the
+    // query string
+    if (spotd_json_get_string(request->body, request->body_length, "playlist",
+                              link, sizeof(link)) < 0 &&
+        spotd_http_get_query_param(request->query, "playlist", link, sizeof(link)) < 0) {
+      link[0] = '\0';
+    }
+
+    if (link[0] == '\0') {
+      write_http_result(connection, 400, "error", "missing playlist", keep_alive);
+      return;
+    }
+
+    command = create_offline_command(link, strcmp(request->path, "/offline") == 0);
+    dispatch_http_command(connection, command, keep_alive);
+  } else if (strcmp(request->path, "/bitrate") == 0 && request->method == SPOTD_HTTP_POST) {
+    // The bitrate can be passed in the query string only
+    if (spotd_http_get_query_param(request->query, "kbps", format, sizeof(format)) < 0 ||
+        (index = parse_int(format, 1, INT32_MAX)) < 0) {
+      write_http_result(connection, 400, "error", "missing kbps", keep_alive);
+      return;
+    }
+
+    command = create_bitrate_command(index);
+    dispatch_http_command(connection, command, keep_alive);
+  } else if (strcmp(request->path, "/zones") == 0 && request->method == SPOTD_HTTP_GET) {
+    num_zones = 0;
+    if (g_callbacks->zones_requested != NULL) {
+      num_zones = g_callbacks->zones_requested(zones, SPOTD_MAX_ZONES);
+    }
+
+    spotd_buffer_init(&body);
+    spotd_buffer_append(&body, "[", 1);
+    for (i = 0; i < num_zones; i++) {
+      // Device names can hold a file path
+      snprintf(text, sizeof(text), "%s{\"zone\":%d,\"device\":", i > 0 ? "," : "", i);
+      spotd_buffer_append(&body, text, strlen(text));
+      spotd_json_append_string(&body, zones[i].device);
+      snprintf(text, sizeof(text),
+               ",\"volume\":%d,\"backlog_ms\":%d,\"dropped_frames\":%" PRIu64
+               ",\"sync_error_us\":%d,\"sync_ppm\":%d}",
+               zones[i].volume, zones[i].backlog_ms, zones[i].dropped_frames,
+               zones[i].sync_error_us, zones[i].sync_ppm);
+      spotd_buffer_append(&body, text, strlen(text));
+    }
+    spotd_buffer_append(&body, "]", 1);
+
+    spotd_http_write_response(&connection->output, 200, body.data, body.length, keep_alive);
+    spotd_buffer_free(&body);
+  } else if (strcmp(request->path, "/zone/volume") == 0 && request->method == SPOTD_HTTP_POST) {
+    // The zone and its volume can be passed in the query string only
+    if (spotd_http_get_query_param(request->query, "zone", format, sizeof(format)) < 0 ||
+        (index = parse_int(format, 0, SPOTD_MAX_ZONES - 1)) < 0) {
+      write_http_result(connection, 400, "error", "missing zone", keep_alive);
+      return;
+    }
+
+    if (spotd_http_get_query_param(request->query, "level", format, sizeof(format)) < 0 ||
+        (limit = parse_int(format, 0, 100)) < 0) {
+      write_http_result(connection, 400, "error", "missing level", keep_alive);
+      return;
+    }
+
+    command = create_zone_volume_command(index, limit);
+    dispatch_http_command(connection, command, keep_alive);
+  } else if (strcmp(request->path, "/warm") == 0 && request->method == SPOTD_HTTP_POST) {
+    // The track links are passed in the body, separated by whitespace
+    command = create_warm_command(request->body, request->body_length);
+
+    if (command == NULL) {
+      write_http_result(connection, 400, "error", "missing or too many links", keep_alive);
+      return;
+    }
+
+    dispatch_http_command(connection, command, keep_alive);
+  } else if (strcmp(request->path, "/playlist/next") == 0 &&
+             request->method == SPOTD_HTTP_POST) {
+    command = spotd_command_create(SPOTD_COMMAND_PLAYLIST_NEXT, 0, NULL);
+    dispatch_http_command(connection, command, keep_alive);
+  } else if (strcmp(request->path, "/queue/next") == 0 && request->method == SPOTD_HTTP_POST) {
+    command = spotd_command_create(SPOTD_COMMAND_QUEUE_NEXT, 0, NULL);
+    dispatch_http_command(connection, command, keep_alive);
+  } else if (strcmp(request->path, "/queue/clear") == 0 && request->method == SPOTD_HTTP_POST) {
+    command = spotd_command_create(SPOTD_COMMAND_QUEUE_CLEAR, 0, NULL);
+    dispatch_http_command(connection, command, keep_alive);
+  } else if (strcmp(request->path, "/stop") == 0 && request->method == SPOTD_HTTP_POST) {
+    command = spotd_command_create(SPOTD_COMMAND_STOP, 0, NULL);
+    dispatch_http_command(connection, command, keep_alive);
+  } else if (strcmp(request->path, "/pause") == 0 && request->method == SPOTD_HTTP_POST) {
+    command = spotd_command_create(SPOTD_COMMAND_PAUSE, 0, NULL);
+    dispatch_http_command(connection, command, keep_alive);
+  } else if (strcmp(request->path, "/resume") == 0 && request->method == SPOTD_HTTP_POST) {
+    command = spotd_command_create(SPOTD_COMMAND_RESUME, 0, NULL);
+    dispatch_http_command(connection, command, keep_alive);
+  } else if (strcmp(request->path, "/ws") == 0 && request->method == SPOTD_HTTP_GET) {
+    if (!request->upgrade_websocket || request->websocket_key[0] == '\0') {
+      write_http_result(connection, 426, "error", "websocket upgrade required", keep_alive);
+      return;
+    }
+
+    spotd_websocket_write_handshake(&connection->output, request->websocket_key);
+    connection->protocol = SPOTD_PROTOCOL_WEBSOCKET;
+
+    // Events are JSON text frames, unless binary frames are asked for
+    connection->binary =
+        spotd_http_get_query_param(request->query, "format", format, sizeof(format)) == 0 &&
+        strcmp(format, "binary") == 0;
+
+    // WebSocket clients are subscribed right away
+    command = spotd_command_create(SPOTD_COMMAND_SUBSCRIBE, 0, NULL);
+    dispatch_command(connection, command, &status);
+  } else if (is_http_path(request->path)) {
+    write_http_result(connection, 405, "error", "method not allowed", keep_alive);
+  } else {
+    write_http_result(connection, 404, "error", "not found", keep_alive);
+  }
+}
+
+/**
+ * Dispatch a command received over HTTP. The response is written once the
+ * result of the command arrives, see deliver_completion().
+ *
+ * @param  connection  The client connection
+ * @param  command  The command to dispatch
+ * @param  keep_alive  Non-zero if the connection is kept open
+ */
+static void dispatch_http_command(client_connection_t *connection, spotd_command *command,
+                                  int keep_alive) {
+  spotd_status status;
+
+  command->origin.connection_id = connection->id;
+
+  if (dispatch_command(connection, command, &status) < 0) {
+    write_http_result(connection, 429, "error", "rate limited", keep_alive);
+    return;
+  }
+
+  connection->awaiting_result = 1;
+  connection->http_keep_alive = keep_alive;
+
+  if (g_config.command_timeout_ms > 0) {
+    spotd_timer_schedule(&connection->worker->timers, &connection->command_timer,
+                         monotonic_ms() + g_config.command_timeout_ms);
+  }
+}
+
+/**
+ * Check whether a path is one of the HTTP API endpoints
+ *
+ * @param  path  The request path
+ * @return  Non-zero if the path is an endpoint
+ */
+static int is_http_path(const char *path) {
+  static const char *paths[] = {
+    "/status", "/stats", "/queue", "/play", "/stop", "/pause", "/resume", "/ws",
+    "/queue/remove", "/queue/next", "/queue/clear", "/playlist", "/playlist/next", "/search",
+    "/warm", "/offline", "/offline/remove", "/bitrate", "/zones", "/zone/volume"
+  };
+  size_t i;
+
+  for (i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+    if (strcmp(path, paths[i]) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Check whether a command is executed by the main loop, and so can be
+ * answered with its real result
+ *
+ * @param  type  The command type
+ * @return  Non-zero for commands passed to the command_received callback
+ */
+static int is_main_loop_command(spotd_command_type type) {
+  return type != SPOTD_COMMAND_STATUS && type != SPOTD_COMMAND_SUBSCRIBE &&
+         type != SPOTD_COMMAND_UNSUBSCRIBE && type != SPOTD_COMMAND_OFFLINE_STATUS &&
+         type != SPOTD_COMMAND_ZONES;
+}
+
+/**
+ * Write the response to GET /status. Status is polled often, so everything
+ * but the playback position is formatted once and reused for as long as the
+ * status does not change.
+ *
+ * @param  worker  The worker that handles the connection
+ * @param  connection  The client connection
+ * @param  keep_alive  Non-zero if the connection is kept open
+ */
+static void write_http_status(server_worker_t *worker, client_connection_t *connection,
+                              int keep_alive) {
+  spotd_buffer *cache = &worker->status_cache;
+  spotd_command *command;
+  spotd_status status;
+  char text[128];
+  int position_ms, position_length;
+
+  command = spotd_command_create(SPOTD_COMMAND_STATUS, 0, NULL);
+  dispatch_command(connection, command, &status);
+
+  position_ms = status.position_ms;
+  status.position_ms = 0;
+
+  if (!worker->status_cache_valid ||
+      memcmp(&status, &worker->cached_status, sizeof(spotd_status)) != 0) {
+    spotd_buffer_consume(cache, cache->length);
+
+    snprintf(text, sizeof(text), "\"state\":\"%s\",\"duration_ms\":%d,\"volume\":%d,\"track\":",
+             spotd_player_state_name(status.state), status.duration_ms, status.volume);
+    spotd_buffer_append(cache, text, strlen(text));
+
+    if (status.track_link[0] != '\0') {
+      spotd_json_append_string(cache, status.track_link);
+    } else {
+      spotd_buffer_append(cache, "null", 4);
+    }
+    spotd_buffer_append(cache, "}", 1);
+
+    worker->cached_status = status;
+    worker->status_cache_valid = 1;
+  }
+
+  position_length = snprintf(text, sizeof(text), "{\"position_ms\":%d,", position_ms);
+
+  spotd_http_write_header(&connection->output, 200, position_length + cache->length, keep_alive);
+  spotd_buffer_append(&connection->output, text, position_length);
+  spotd_buffer_append(&connection->output, cache->data, cache->length);
+}
+
+/**
+ * Write an HTTP response with a JSON object holding one string member
+ *
+ * @param  connection  The client connection
+ * @param  status_code  The HTTP status code
+ * @param  key  The member name
+ * @param  value  The member value
+ * @param  keep_alive  Non-zero if the connection is kept open
+ */
+static void write_http_result(client_connection_t *connection, int status_code,
+                              const char *key, const char *value, int keep_alive) {
+  char body[128];
+  int body_length;
+
+  body_length = snprintf(body, sizeof(body), "{\"%s\":\"%s\"}", key, value);
+  spotd_http_write_response(&connection->output, status_code, body, body_length, keep_alive);
+}
+
+/**
+ * Dispatch a parsed command. This is shared by the text and binary protocols.
+ * Status requests are answered from the status callback, subscriptions are
+ * handled by the server, and all other commands are passed to the
+ * command_received callback.
+ *
+ * @param  connection  The client connection the command came from
+ * @param  command  The command to dispatch. The command is released by this
+ *   function or by the receiver of the command.
+ * @param  status  Receives the player status if the command is
+ *   SPOTD_COMMAND_STATUS
+ * @return  0 on success, -1 if the command was dropped because the client
+ *   is over its rate limit
+ */
+static int dispatch_command(client_connection_t *connection, spotd_command *command,
+                            spotd_status *status) {
+  switch (command->type) {
+  case SPOTD_COMMAND_STATUS:
+    memset(status, 0, sizeof(spotd_status));
+
+    if (g_callbacks->status_requested != NULL) {
+      g_callbacks->status_requested(status);
+    }
+
+    spotd_command_release(command);
+    break;
+  case SPOTD_COMMAND_OFFLINE_STATUS:
+    // Answered from the counters, see handle_text_line()
+    spotd_command_release(command);
+    break;
+  case SPOTD_COMMAND_ZONES:
+    // Answered from the zones_requested callback, see handle_text_line()
+    spotd_command_release(command);
+    break;
+  case SPOTD_COMMAND_SUBSCRIBE:
+    if (!connection->subscribed) {
+      connection->subscribed = 1;
+      __atomic_add_fetch(&g_num_subscribers, 1, __ATOMIC_RELAXED);
+    }
+
+    spotd_command_release(command);
+    break;
+  case SPOTD_COMMAND_UNSUBSCRIBE:
+    if (connection->subscribed) {
+      connection->subscribed = 0;
+      __atomic_sub_fetch(&g_num_subscribers, 1, __ATOMIC_RELAXED);
+    }
+
+    spotd_command_release(command);
+    break;
+  default:
+    // Commands that reach the main loop are rate limited, so that one
+    // client can not starve the others
+    if (!take_rate_token(connection)) {
+      spotd_command_release(command);
+      return -1;
+    }
+
+    if (g_callbacks->command_received != NULL) {
+      // Pass the message to a callback, if it is set
+      g_callbacks->command_received(command);
+    } else {
+      spotd_command_release(command);
+    }
+    break;
+  }
+
+  return 0;
+}
+
+/**
+ * Take a token from the token bucket of a client. The bucket holds up to
+ * command_burst tokens and is refilled with command_rate tokens a second.
+ *
+ * @param  connection  The client connection
+ * @return  1 if a token was taken, 0 if the bucket is empty
+ */
+static int take_rate_token(client_connection_t *connection) {
+  int64_t now, limit;
+
+  if (g_config.command_rate <= 0) {
+    return 1;
+  }
+
+  now = monotonic_ms();
+  limit = (int64_t) g_config.command_burst * 1000;
+
+  // A token per 1000 / command_rate milliseconds
+  connection->rate_tokens += (now - connection->rate_refill_ms) * g_config.command_rate;
+  connection->rate_refill_ms = now;
+
+  if (connection->rate_tokens > limit) {
+    connection->rate_tokens = limit;
+  }
+
+  if (connection->rate_tokens < 1000) {
+    return 0;
+  }
+
+  connection->rate_tokens -= 1000;
+  return 1;
+}
+
+/**
+ * Create a PLAYLIST PLAY command
+ *
+ * @param  playlist  The playlist link, or its index in the user's playlists
+ * @param  start  Index of the track to start at
+ * @return  The command. The command must be freed with spotd_command_release().
+ */
+static spotd_command *create_playlist_command(const char *playlist, int start) {
+  char **arguments;
+
+  arguments = (char**) malloc(2 * sizeof(char*));
+  arguments[0] = strdup(playlist);
+  arguments[1] = (char *) malloc(12);
+  snprintf(arguments[1], 12, "%d", start);
+
+  return spotd_command_create(SPOTD_COMMAND_PLAYLIST_PLAY, 2, arguments);
+}
+
+/**
+ * Create a BITRATE command
+ *
+ * @param  kbps  The streaming bitrate in kbit/s
+ * @return  The command. The command must be freed with spotd_command_release().
+ */
+static spotd_command *create_bitrate_command(int kbps) {
+  char **arguments;
+
+  arguments = (char**) malloc(1 * sizeof(char*));
+  arguments[0] = (char *) malloc(12);
+  snprintf(arguments[0], 12, "%d", kbps);
+
+  return spotd_command_create(SPOTD_COMMAND_BITRATE, 1, arguments);
+}
+
+/**
+ * Create a ZONE VOLUME command
+ *
+ * @param  zone  The output zone
+ * @param  volume  The volume of the zone, 0-100
+ * @return  The command. The command must be freed with spotd_command_release().
+ */
+static spotd_command *create_zone_volume_command(int zone, int volume) {
+  char **arguments;
+
+  arguments = (char**) malloc(2 * sizeof(char*));
+  arguments[0] = (char *) malloc(12);
+  snprintf(arguments[0], 12, "%d", zone);
+  arguments[1] = (char *) malloc(12);
+  snprintf(arguments[1], 12, "%d", volume);
+
+  return spotd_command_create(SPOTD_COMMAND_ZONE_VOLUME, 2, arguments);
+}
+
+/**
+ * Create an OFFLINE ADD or OFFLINE REMOVE command
+ *
+ * @param  playlist  The playlist link, or its index in the user's playlists
+ * @param  offline  Non-zero to mark the playlist for offline sync, zero to
+ *   unmark it
+ * @return  The command. The command must be freed with spotd_command_release().
+ */
+static spotd_command *create_offline_command(const char *playlist, int offline) {
+  char **arguments;
+
+  arguments = (char**) malloc(2 * sizeof(char*));
+  arguments[0] = strdup(playlist);
+  arguments[1] = strdup(offline ? "1" : "0");
+
+  return spotd_command_create(SPOTD_COMMAND_OFFLINE, 2, arguments);
+}
+
+/**
+ * Create a SEARCH command
+ *
+ * @param  query  The search query
+ * @param  offset  Index of the first result to return
+ * @param  limit  Maximum number of results to return
+ * @return  The command. The command must be freed with spotd_command_release().
+ */
+static spotd_command *create_search_command(const char *query, int offset, int limit) {
+  char **arguments;
+
+  arguments = (char**) malloc(3 * sizeof(char*));
+  arguments[0] = strdup(query);
+  arguments[1] = (char *) malloc(12);
+  snprintf(arguments[1], 12, "%d", offset);
+  arguments[2] = (char *) malloc(12);
+  snprintf(arguments[2], 12, "%d", limit);
+
+  return spotd_command_create(SPOTD_COMMAND_SEARCH, 3, arguments);
+}
+
+/**
+ * Create a WARM command
+ *
+ * @param  links  Track links separated by whitespace, not necessarily
+ *   NUL-terminated
+ * @param  length  Length of links
+ * @return  The command, or NULL if there are no links or more than
+ *   SPOTD_WARM_MAX_LINKS. The command must be freed with spotd_command_release().
+ */
+static spotd_command *create_warm_command(const char *links, size_t length) {
+  const char *link_starts[SPOTD_WARM_MAX_LINKS];
+  size_t link_lengths[SPOTD_WARM_MAX_LINKS];
+  char **arguments;
+  size_t i = 0, start;
+  int num_links = 0, j;
+
+  for (;;) {
+    while (i < length && isspace((unsigned char) links[i])) {
+      i++;
+    }
+
+    if (i == length) {
+      break;
+    }
+
+    if (num_links == SPOTD_WARM_MAX_LINKS) {
+      return NULL;
+    }
+
+    start = i;
+    while (i < length && !isspace((unsigned char) links[i])) {
+      i++;
+    }
+
+    link_starts[num_links] = links + start;
+    link_lengths[num_links++] = i - start;
+  }
+
+  if (num_links == 0) {
+    return NULL;
+  }
+
+  arguments = (char**) malloc(num_links * sizeof(char*));
+  for (j = 0; j < num_links; j++) {
+    arguments[j] = strndup(link_starts[j], link_lengths[j]);
+  }
+
+  return spotd_command_create(SPOTD_COMMAND_WARM, num_links, arguments);
+}
+
+/**
+ * Parse a client message
+ *
+ * @param  client_message  The client message to parse
+ * @return  The parsed command if the message contained a valid command, NULL
+ *   otherwise. The resulting command must be freed with spotd_command_release().
+ */
+static spotd_command *parse_client_message(char *client_message) {
+  // Strip the message of \r and \n chars
+  char *stripped_message = strip_str(client_message, "\r\n");
+  int message_length = strlen(stripped_message);
+  spotd_command *command = NULL;
+  char **arguments;
+  char *start_str, *limit_str, *query;
+  int volume, index, start, offset, limit, kbps;
+
+  // Check if the message is a valid command
+  if (strncmp(stripped_message, "PLAY ", 5) == 0) {
+    // The PLAY command has one argument, allocate memory for it
+    arguments = (char**) malloc(1 * sizeof(char*));
+    char *track_name = (char *) malloc(message_length - 5 + 1);
+
+    // Copy the argument and add it to the arguments array
+    strncpy(track_name, stripped_message + 5, message_length - 5);
+    track_name[message_length - 5] = '\0';
+    arguments[0] = track_name;
+
+    // Create the PLAY command object
+    command = spotd_command_create(SPOTD_COMMAND_PLAY_TRACK, 1, arguments);
+  } else if (strcmp(stripped_message, "STOP") == 0) {
+    command = spotd_command_create(SPOTD_COMMAND_STOP, 0, NULL);
+  } else if (strcmp(stripped_message, "STATUS") == 0) {
+    command = spotd_command_create(SPOTD_COMMAND_STATUS, 0, NULL);
+  } else if (strcmp(stripped_message, "PAUSE") == 0) {
+    command = spotd_command_create(SPOTD_COMMAND_PAUSE, 0, NULL);
+  } else if (strcmp(stripped_message, "RESUME") == 0) {
+    command = spotd_command_create(SPOTD_COMMAND_RESUME, 0, NULL);
+  } else if (strcmp(stripped_message, "SUBSCRIBE") == 0) {
+    command = spotd_command_create(SPOTD_COMMAND_SUBSCRIBE, 0, NULL);
+  } else if (strcmp(stripped_message, "UNSUBSCRIBE") == 0) {
+    command = spotd_command_create(SPOTD_COMMAND_UNSUBSCRIBE, 0, NULL);
+  } else if (strncmp(stripped_message, "QUEUE ADD ", 10) == 0 && message_length > 10) {
+    arguments = (char**) malloc(1 * sizeof(char*));
+    arguments[0] = strdup(stripped_message + 10);
+
+    command = spotd_command_create(SPOTD_COMMAND_QUEUE_ADD, 1, arguments);
+  } else if (strncmp(stripped_message, "QUEUE REMOVE ", 13) == 0) {
+    index = parse_int(stripped_message + 13, 0, SPOTD_QUEUE_MAX - 1);
+
+    if (index >= 0) {
+      arguments = (char**) malloc(1 * sizeof(char*));
+      arguments[0] = (char *) malloc(12);
+      snprintf(arguments[0], 12, "%d", index);
+
+      command = spotd_command_create(SPOTD_COMMAND_QUEUE_REMOVE, 1, arguments);
+    }
+  } else if (strcmp(stripped_message, "QUEUE NEXT") == 0) {
+    command = spotd_command_create(SPOTD_COMMAND_QUEUE_NEXT, 0, NULL);
+  } else if (strcmp(stripped_message, "QUEUE CLEAR") == 0) {
+    command = spotd_command_create(SPOTD_COMMAND_QUEUE_CLEAR, 0, NULL);
+  } else if (strncmp(stripped_message, "PLAYLIST PLAY ", 14) == 0 && message_length > 14) {
+    // The playlist may be followed by the index of the track to start at
+    start_str = strchr(stripped_message + 14, ' ');
+    start = 0;
+    if (start_str != NULL) {
+      *start_str++ = '\0';
+      start = parse_int(start_str, 0, INT32_MAX);
+    }
+
+    if (start >= 0) {
+      command = create_playlist_command(stripped_message + 14, start);
+    }
+  } else if (strcmp(stripped_message, "PLAYLIST NEXT") == 0) {
+    command = spotd_command_create(SPOTD_COMMAND_PLAYLIST_NEXT, 0, NULL);
+  } else if (strncmp(stripped_message, "SEARCH ", 7) == 0 && message_length > 7) {
+    // The query may be preceded by the offset and the number of results
+    query = stripped_message + 7;
+    offset = 0;
+    limit = DEFAULT_SEARCH_LIMIT;
+
+    if ((start_str = strchr(query, ' ')) != NULL &&
+        (limit_str = strchr(start_str + 1, ' ')) != NULL) {
+      *start_str = *limit_str = '\0';
+
+      if ((offset = parse_int(query, 0, INT32_MAX)) >= 0 &&
+          (limit = parse_int(start_str + 1, 1, SPOTD_SEARCH_PAGE_MAX)) >= 0) {
+        query = limit_str + 1;
+      } else {
+        *start_str = *limit_str = ' ';
+        offset = 0;
+        limit = DEFAULT_SEARCH_LIMIT;
+      }
+    }
+
+    if (query[0] != '\0' && strlen(query) < MAX_SEARCH_QUERY) {
+      command = create_search_command(query, offset, limit);
+    }
+  } else if (strncmp(stripped_message, "BITRATE ", 8) == 0) {
+    kbps = parse_int(stripped_message + 8, 1, INT32_MAX);
+
+    if (kbps > 0) {
+      command = create_bitrate_command(kbps);
+    }
+  } else if (strncmp(stripped_message, "OFFLINE ADD ", 12) == 0 && message_length > 12) {
+    command = create_offline_command(stripped_message + 12, 1);
+  } else if (strncmp(stripped_message, "OFFLINE REMOVE ", 15) == 0 && message_length > 15) {
+    command = create_offline_command(stripped_message + 15, 0);
+  } else if (strcmp(stripped_message, "OFFLINE STATUS") == 0) {
+    command = spotd_command_create(SPOTD_COMMAND_OFFLINE_STATUS, 0, NULL);
+  } else if (strcmp(stripped_message, "ZONES") == 0) {
+    command = spotd_command_create(SPOTD_COMMAND_ZONES, 0, NULL);
+  } else if (strncmp(stripped_message, "ZONE ", 5) == 0) {
+    // ZONE <zone> VOLUME <level>
+    start_str = strchr(stripped_message + 5, ' ');
+
+    if (start_str != NULL && strncmp(start_str, " VOLUME ", 8) == 0) {
+      *start_str = '\0';
+      index = parse_int(stripped_message + 5, 0, SPOTD_MAX_ZONES - 1);
+      volume = parse_int(start_str + 8, 0, 100);
+
+      if (index >= 0 && volume >= 0) {
+        command = create_zone_volume_command(index, volume);
+      }
+    }
+  } else if (strncmp(stripped_message, "WARM ", 5) == 0) {
+    command = create_warm_command(stripped_message + 5, message_length - 5);
+  } else if (strncmp(stripped_message, "VOLUME ", 7) == 0) {
+    volume = parse_int(stripped_message + 7, 0, 100);
+
+    if (volume >= 0) {
+      arguments = (char**) malloc(1 * sizeof(char*));
+      arguments[0] = (char *) malloc(12);
+      snprintf(arguments[0], 12, "%d", volume);
+
+      command = spotd_command_create(SPOTD_COMMAND_VOLUME, 1, arguments);
+    }
   }
 
   // Cleanup
@@ -28,22 +28,104 @@
 #define _SPOTD_SERVER_H_
 
 #include <pthread.h>
+#include <sys/types.h>
 #include "types.h"
+#include "buffer.h"
 #include "queue.h"
+#include "timerwheel.h"
 
 /* --- Types --- */
 typedef struct spotd_server_callbacks {
   void (*command_received)(spotd_command* command);
+  void (*status_requested)(spotd_status *status);
+  // Copies up to max_links links of the play queue, returns how many
+  int (*queue_requested)(char (*links)[SPOTD_LINK_MAX], int max_links);
+  void (*stats_requested)(spotd_stats *stats);
+  // Copies the status of up to max_zones output zones, returns how many
+  int (*zones_requested)(spotd_zone_status *zones, int max_zones);
 } spotd_server_callbacks;
 
-typedef struct client_thread {
-  LIST_ENTRY(client_thread) link;
-  pthread_t thread_id;
+typedef enum spotd_protocol {
+  SPOTD_PROTOCOL_CONTROL   = 0, // Line based control protocol, optionally binary
+  SPOTD_PROTOCOL_HTTP      = 1, // HTTP/1.1 JSON API
+  SPOTD_PROTOCOL_WEBSOCKET = 2  // WebSocket, upgraded from an HTTP connection
+} spotd_protocol;
+
+// Maximum number of configured bind addresses
+#define SPOTD_SERVER_MAX_BIND_ADDRESSES 8
+// Maximum number of listening sockets passed on a hot restart
+#define SPOTD_SERVER_MAX_SOCKETS 64
+
+// A listening socket, as passed from a running server to its replacement
+typedef struct spotd_server_socket {
+  int socket_desc;
+  int is_unix;             // Non-zero for the Unix domain socket
+  spotd_protocol protocol; // The protocol spoken on the socket
+  int worker;              // Index of the worker thread owning the socket
+} spotd_server_socket;
+
+typedef struct spotd_server_config {
+  const char *bind_addresses[SPOTD_SERVER_MAX_BIND_ADDRESSES]; // TCP bind addresses
+  int num_bind_addresses;       // Number of bind addresses, 0 for all interfaces
+  int port;                     // TCP port to listen on, 0 to disable TCP
+  int http_port;                // HTTP API port, 0 to disable HTTP
+  int backlog;                  // Listen backlog, 0 for SOMAXCONN
+  int worker_threads;           // Server threads, more than 1 enables SO_REUSEPORT
+  const char *unix_socket_path; // Path of the Unix socket, NULL to disable it
+  gid_t unix_socket_gid;        // Group allowed on the Unix socket, (gid_t) -1 for none
+  int max_connections;          // Maximum number of clients, 0 for no limit
+  int idle_timeout_ms;          // Close connections idle this long, 0 to disable
+  int command_timeout_ms;       // Time to finish sending a started command, 0 to disable
+  int command_rate;             // Commands per second per client, 0 for no limit
+  int command_burst;            // Commands a client may send at once, 0 for command_rate
+  int io_uring;                 // Use io_uring for socket I/O if the kernel supports it
+  // Listening sockets taken over from a running server. When given, these
+  // are used instead of binding the configured ports and socket path.
+  const spotd_server_socket *inherited_sockets;
+  int num_inherited_sockets;
+} spotd_server_config;
+
+struct server_worker;
+
+typedef struct client_connection {
+  LIST_ENTRY(client_connection) link;
+  LIST_ENTRY(client_connection) id_link;
+  uint64_t id;                  // Unique ID, used to route command results
+  struct server_worker *worker; // The worker thread handling the connection
   int socket_desc;
-} client_thread_t;
+  spotd_protocol protocol;
+  int binary;         // Non-zero if the connection uses the binary protocol
+  int subscribed;     // Non-zero if events are pushed to the connection
+  int closing;        // Non-zero if the connection is closed once output is sent
+  int dropped_events; // Events dropped because the client is not reading
+  int awaiting_result; // HTTP: the response waits for the result of a command
+  int http_keep_alive; // HTTP: keep-alive of the request waiting for a result
+  spotd_buffer input;
+  spotd_buffer output;
+  spotd_buffer sending;     // io_uring: output handed to the kernel, not sent yet
+  int uring_requests;       // io_uring: requests in flight for the connection
+  int recv_armed;           // io_uring: a multishot receive is active
+  int recv_cancelled;       // io_uring: the receive is being cancelled
+  int send_armed;           // io_uring: a send is in flight
+  int uring_unarmed;        // io_uring: a request found the submission queue full
+  int retired;              // io_uring: closed, freed once the requests complete
+  int64_t last_activity_ms; // Last time data was received or sent
+  int64_t rate_tokens;      // Commands the client may send, in thousandths
+  int64_t rate_refill_ms;   // Last time rate_tokens was refilled
+  spotd_timer idle_timer;
+  spotd_timer command_timer;
+} client_connection_t;
 
 /* --- Functions --- */
-spotd_error spotd_server_start(int port, spotd_server_callbacks *callbacks);
-void spotd_server_stop();
+spotd_error spotd_server_start(const spotd_server_config *config,
+                               spotd_server_callbacks *callbacks);
+void spotd_server_stop(int handed_off);
+int spotd_server_get_sockets(spotd_server_socket *sockets, int max_sockets);
+void spotd_server_publish_event(const spotd_event *event);
+void spotd_server_complete_command(const spotd_command_origin *origin,
+                                   spotd_command_result result, spotd_error error,
+                                   const char *message);
+void spotd_server_complete_search(const spotd_command_origin *origin,
+                                  const spotd_search_page *page);
 
 #endif /* _SPOTD_SERVER_H_ */
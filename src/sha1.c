@@ -0,0 +1,130 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#include "sha1.h"
+
+#include <string.h>
+
+/* --- Function definitions --- */
+static void sha1_block(uint32_t state[5], const uint8_t block[64]);
+
+/* -- Functions --- */
+
+/**
+ * Compute the SHA-1 digest of a message. SHA-1 is only used for the
+ * WebSocket handshake, where the digest is not security relevant.
+ *
+ * @param  data  The message
+ * @param  length  Length of the message
+ * @param  digest  Receives the 20 byte digest
+ */
+void spotd_sha1(const void *data, size_t length, uint8_t digest[SPOTD_SHA1_DIGEST_SIZE]) {
+  uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+  const uint8_t *bytes = (const uint8_t *) data;
+  uint8_t block[64];
+  uint64_t bit_length = (uint64_t) length * 8;
+  size_t remaining = length;
+  int i;
+
+  for (; remaining >= 64; remaining -= 64, bytes += 64) {
+    sha1_block(state, bytes);
+  }
+
+  // Pad the last block with a one bit, zeros and the message length
+  memset(block, 0, sizeof(block));
+  memcpy(block, bytes, remaining);
+  block[remaining] = 0x80;
+
+  if (remaining >= 56) {
+    sha1_block(state, block);
+    memset(block, 0, sizeof(block));
+  }
+
+  for (i = 0; i < 8; i++) {
+    block[63 - i] = (uint8_t) (bit_length >> (i * 8));
+  }
+  sha1_block(state, block);
+
+  for (i = 0; i < 20; i++) {
+    digest[i] = (uint8_t) (state[i / 4] >> ((3 - i % 4) * 8));
+  }
+}
+
+/**
+ * Process one 64 byte block
+ *
+ * @param  state  The hash state
+ * @param  block  The block
+ */
+static void sha1_block(uint32_t state[5], const uint8_t block[64]) {
+  uint32_t w[80], a, b, c, d, e, f, k, temp;
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    w[i] = (uint32_t) block[i * 4] << 24 | (uint32_t) block[i * 4 + 1] << 16 |
+           (uint32_t) block[i * 4 + 2] << 8 | (uint32_t) block[i * 4 + 3];
+  }
+
+  for (i = 16; i < 80; i++) {
+    temp = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+    w[i] = temp << 1 | temp >> 31;
+  }
+
+  a = state[0];
+  b = state[1];
+  c = state[2];
+  d = state[3];
+  e = state[4];
+
+  for (i = 0; i < 80; i++) {
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5A827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ED9EBA1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8F1BBCDC;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xCA62C1D6;
+    }
+
+    temp = (a << 5 | a >> 27) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = b << 30 | b >> 2;
+    b = a;
+    a = temp;
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
@@ -0,0 +1,289 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#include "statefile.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* --- Constants --- */
+#define STATE_FILE_MAGIC "SPOTDSTF"
+#define STATE_FILE_VERSION 1
+// Records start on their own pages, so that writing one never touches the
+// pages of the other
+#define RECORD_OFFSET 4096
+#define RECORD_SIZE 16384
+#define NUM_RECORDS 2
+#define STATE_FILE_SIZE (RECORD_OFFSET + NUM_RECORDS * RECORD_SIZE)
+
+/* --- Types --- */
+typedef struct state_file_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+} state_file_header;
+
+// A record, followed by length bytes of state text
+typedef struct state_record {
+  uint64_t sequence;  // 0 for a record never written
+  uint32_t length;
+  uint32_t crc;       // CRC-32 of the sequence, the length and the text
+} state_record;
+
+/* --- Function definitions --- */
+static state_record *get_record(spotd_state_file *file, int index);
+static int is_valid_record(const state_record *record);
+static uint32_t record_crc(const state_record *record);
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t length);
+
+/* --- Functions --- */
+
+/**
+ * Open a state file, creating it if it does not exist
+ *
+ * @param  file  Receives the open state file
+ * @param  path  The path of the file
+ * @return  SPOTD_ERROR_OK, or SPOTD_ERROR_OTHER_PERMANENT if the file can
+ *   not be used, or is not a state file
+ */
+spotd_error spotd_state_file_open(spotd_state_file *file, const char *path) {
+  state_file_header *header;
+  struct stat st;
+  int initialize;
+
+  file->map = NULL;
+  spotd_buffer_init(&file->text);
+  file->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+  if (file->fd < 0) {
+    perror("Failed opening the state file");
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  if (fstat(file->fd, &st) < 0) {
+    perror("Failed opening the state file");
+    close(file->fd);
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  // Never overwrite anything but an empty file or a state file
+  initialize = st.st_size == 0;
+
+  if (!initialize && st.st_size != STATE_FILE_SIZE) {
+    fprintf(stderr, "Error: %s is not a spotd state file\n", path);
+    close(file->fd);
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  if (initialize && ftruncate(file->fd, STATE_FILE_SIZE) < 0) {
+    perror("Failed creating the state file");
+    close(file->fd);
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  file->map = (char *) mmap(NULL, STATE_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            file->fd, 0);
+
+  if (file->map == MAP_FAILED) {
+    perror("Failed mapping the state file");
+    file->map = NULL;
+    close(file->fd);
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  header = (state_file_header *) file->map;
+
+  if (initialize) {
+    memcpy(header->magic, STATE_FILE_MAGIC, sizeof(header->magic));
+    header->version = STATE_FILE_VERSION;
+    header->record_size = RECORD_SIZE;
+  } else if (memcmp(header->magic, STATE_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+             header->version != STATE_FILE_VERSION || header->record_size != RECORD_SIZE) {
+    fprintf(stderr, "Error: %s is not a spotd state file\n", path);
+    spotd_state_file_close(file);
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  return SPOTD_ERROR_OK;
+}
+
+/**
+ * Read the last state written to a state file
+ *
+ * @param  file  The state file
+ * @param  state  Receives the player state
+ * @return  SPOTD_ERROR_OK, or SPOTD_ERROR_OTHER_PERMANENT if the file holds
+ *   no valid state
+ */
+spotd_error spotd_state_file_read(spotd_state_file *file, spotd_handoff_state *state) {
+  state_record *record, *latest = NULL;
+  char text[RECORD_SIZE];
+  int i;
+
+  for (i = 0; i < NUM_RECORDS; i++) {
+    record = get_record(file, i);
+
+    if (is_valid_record(record) && (latest == NULL || record->sequence > latest->sequence)) {
+      latest = record;
+    }
+  }
+
+  if (latest == NULL) {
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  memcpy(text, latest + 1, latest->length);
+  text[latest->length] = '\0';
+
+  return spotd_handoff_parse_state(text, state, NULL, 0);
+}
+
+/**
+ * Write the player state to a state file. This only copies the state into
+ * the mapped file, and does not wait for the disk.
+ *
+ * @param  file  The state file
+ * @param  state  The player state
+ * @return  SPOTD_ERROR_OK, or SPOTD_ERROR_OTHER_PERMANENT if the state does
+ *   not fit in a record
+ */
+spotd_error spotd_state_file_write(spotd_state_file *file, const spotd_handoff_state *state) {
+  state_record *first = get_record(file, 0), *second = get_record(file, 1);
+  state_record *record;
+  uint64_t sequence;
+
+  spotd_buffer_consume(&file->text, file->text.length);
+  spotd_handoff_format_state(&file->text, state);
+
+  if (file->text.length > RECORD_SIZE - sizeof(state_record) - 1) {
+    return SPOTD_ERROR_OTHER_PERMANENT;
+  }
+
+  // The sequence numbers are taken from the file rather than remembered, as
+  // the previous process may have written to it after it was opened
+  sequence = (first->sequence > second->sequence ? first->sequence : second->sequence) + 1;
+  record = first->sequence < second->sequence ? first : second;
+
+  memcpy(record + 1, file->text.data, file->text.length);
+  record->length = (uint32_t) file->text.length;
+  record->sequence = sequence;
+  record->crc = record_crc(record);
+
+  return SPOTD_ERROR_OK;
+}
+
+/**
+ * Flush a state file to disk and close it
+ *
+ * @param  file  The state file
+ */
+void spotd_state_file_close(spotd_state_file *file) {
+  if (file->map != NULL) {
+    msync(file->map, STATE_FILE_SIZE, MS_SYNC);
+    munmap(file->map, STATE_FILE_SIZE);
+    file->map = NULL;
+  }
+
+  spotd_buffer_free(&file->text);
+
+  close(file->fd);
+  file->fd = -1;
+}
+
+/* --- Helpers --- */
+
+/**
+ * Get a record of a state file
+ *
+ * @param  file  The state file
+ * @param  index  The index of the record
+ * @return  The record in the mapped file
+ */
+static state_record *get_record(spotd_state_file *file, int index) {
+  return (state_record *) (file->map + RECORD_OFFSET + index * RECORD_SIZE);
+}
+
+/**
+ * Check whether a record was completely written
+ *
+ * @param  record  The record
+ * @return  Non-zero if the record holds a state
+ */
+static int is_valid_record(const state_record *record) {
+  return record->sequence != 0 && record->length < RECORD_SIZE - sizeof(state_record) &&
+         record->crc == record_crc(record);
+}
+
+/**
+ * Compute the checksum of a record
+ *
+ * @param  record  The record, with a valid length
+ * @return  The CRC-32 of the sequence number, the length and the text
+ */
+static uint32_t record_crc(const state_record *record) {
+  uint32_t crc;
+
+  crc = crc32_update(0, &record->sequence, sizeof(record->sequence));
+  crc = crc32_update(crc, &record->length, sizeof(record->length));
+  return crc32_update(crc, record + 1, record->length);
+}
+
+/**
+ * Update a CRC-32 (IEEE 802.3) with more data
+ *
+ * @param  crc  The CRC of the data so far, 0 to start
+ * @param  data  The data
+ * @param  length  Length of the data
+ * @return  The updated CRC
+ */
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t length) {
+  static uint32_t table[256];
+  const unsigned char *bytes = (const unsigned char *) data;
+  uint32_t value;
+  int i, j;
+
+  if (table[1] == 0) {
+    for (i = 0; i < 256; i++) {
+      value = (uint32_t) i;
+      for (j = 0; j < 8; j++) {
+        value = (value & 1) ? 0xedb88320u ^ (value >> 1) : value >> 1;
+      }
+      table[i] = value;
+    }
+  }
+
+  crc = ~crc;
+  while (length-- > 0) {
+    crc = table[(crc ^ *bytes++) & 0xff] ^ (crc >> 8);
+  }
+
+  return ~crc;
+}
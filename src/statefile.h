@@ -0,0 +1,59 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#ifndef _SPOTD_STATEFILE_H_
+#define _SPOTD_STATEFILE_H_
+
+#include <stdint.h>
+#include "types.h"
+#include "buffer.h"
+#include "handoff.h"
+
+/*
+ * Persistent player state. The state is kept in a small memory-mapped file
+ * with two records, each holding a sequence number, a CRC-32 and the state
+ * as handoff text lines. A new state overwrites the record with the lower
+ * sequence number, so a crash while writing leaves the other one intact,
+ * and the valid record with the higher sequence number is read back.
+ *
+ * Writing is a copy into the mapping: nothing is flushed to disk until the
+ * file is closed, the kernel writes the pages back in the background.
+ */
+
+/* --- Types --- */
+typedef struct spotd_state_file {
+  int fd;
+  char *map;          // The whole file, mapped shared
+  spotd_buffer text;  // Reused for formatting records
+} spotd_state_file;
+
+/* --- Functions --- */
+spotd_error spotd_state_file_open(spotd_state_file *file, const char *path);
+spotd_error spotd_state_file_read(spotd_state_file *file, spotd_handoff_state *state);
+spotd_error spotd_state_file_write(spotd_state_file *file, const spotd_handoff_state *state);
+void spotd_state_file_close(spotd_state_file *file);
+
+#endif /* _SPOTD_STATEFILE_H_ */
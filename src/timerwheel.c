@@ -0,0 +1,177 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#include "timerwheel.h"
+
+#include <stddef.h>
+
+/* --- Constants --- */
+#define SLOT_MASK (SPOTD_TIMER_WHEEL_SLOTS - 1)
+
+/* -- Functions --- */
+
+/**
+ * Initialize an empty timer wheel
+ *
+ * @param  wheel  The timer wheel
+ * @param  now_ms  The current monotonic time in milliseconds
+ */
+void spotd_timer_wheel_init(spotd_timer_wheel *wheel, int64_t now_ms) {
+  int i;
+
+  for (i = 0; i < SPOTD_TIMER_WHEEL_SLOTS; i++) {
+    LIST_INIT(&wheel->slots[i]);
+  }
+
+  wheel->current_tick = now_ms / SPOTD_TIMER_WHEEL_TICK_MS;
+  wheel->num_timers = 0;
+}
+
+/**
+ * Initialize an inactive timer
+ *
+ * @param  timer  The timer
+ * @param  callback  Called when the timer expires
+ * @param  data  Passed to the callback
+ */
+void spotd_timer_init(spotd_timer *timer, spotd_timer_callback callback, void *data) {
+  timer->active = 0;
+  timer->expires_tick = 0;
+  timer->callback = callback;
+  timer->data = data;
+}
+
+/**
+ * Schedule a timer. A timer that is already scheduled is moved to the new
+ * expiry time. Timers expire on the first tick at or after the expiry time.
+ *
+ * @param  wheel  The timer wheel
+ * @param  timer  The timer
+ * @param  expires_ms  The monotonic time at which the timer expires
+ */
+void spotd_timer_schedule(spotd_timer_wheel *wheel, spotd_timer *timer, int64_t expires_ms) {
+  int64_t tick = (expires_ms + SPOTD_TIMER_WHEEL_TICK_MS - 1) / SPOTD_TIMER_WHEEL_TICK_MS;
+
+  spotd_timer_cancel(wheel, timer);
+
+  if (tick <= wheel->current_tick) {
+    tick = wheel->current_tick + 1;
+  }
+
+  timer->expires_tick = tick;
+  timer->active = 1;
+  LIST_INSERT_HEAD(&wheel->slots[tick & SLOT_MASK], timer, link);
+  wheel->num_timers++;
+}
+
+/**
+ * Cancel a timer. Cancelling an inactive timer does nothing.
+ *
+ * @param  wheel  The timer wheel
+ * @param  timer  The timer
+ */
+void spotd_timer_cancel(spotd_timer_wheel *wheel, spotd_timer *timer) {
+  if (!timer->active) {
+    return;
+  }
+
+  LIST_REMOVE(timer, link);
+  timer->active = 0;
+  wheel->num_timers--;
+}
+
+/**
+ * Process all ticks up to the current time and run the callbacks of the
+ * expired timers. Callbacks may schedule and cancel any timer.
+ *
+ * @param  wheel  The timer wheel
+ * @param  now_ms  The current monotonic time in milliseconds
+ * @return  The number of expired timers
+ */
+int spotd_timer_wheel_advance(spotd_timer_wheel *wheel, int64_t now_ms) {
+  LIST_HEAD(, spotd_timer) expired;
+  spotd_timer *timer, *next;
+  int64_t now_tick = now_ms / SPOTD_TIMER_WHEEL_TICK_MS, tick;
+  int num_expired = 0, i;
+
+  LIST_INIT(&expired);
+
+  // Collect the expired timers first, so that callbacks can freely modify
+  // the wheel. After a long pause, every slot is visited once.
+  for (tick = wheel->current_tick + 1, i = 0;
+       tick <= now_tick && i < SPOTD_TIMER_WHEEL_SLOTS; tick++, i++) {
+    for (timer = LIST_FIRST(&wheel->slots[tick & SLOT_MASK]); timer != NULL; timer = next) {
+      next = LIST_NEXT(timer, link);
+
+      if (timer->expires_tick <= now_tick) {
+        LIST_REMOVE(timer, link);
+        LIST_INSERT_HEAD(&expired, timer, link);
+      }
+    }
+  }
+
+  if (now_tick > wheel->current_tick) {
+    wheel->current_tick = now_tick;
+  }
+
+  // A callback may cancel a timer that is still in the expired list
+  while ((timer = LIST_FIRST(&expired)) != NULL) {
+    LIST_REMOVE(timer, link);
+    timer->active = 0;
+    wheel->num_timers--;
+    num_expired++;
+
+    timer->callback(timer, timer->data);
+  }
+
+  return num_expired;
+}
+
+/**
+ * Get the time until the next tick that has timers in its slot, to be used
+ * as a poll() timeout
+ *
+ * @param  wheel  The timer wheel
+ * @param  now_ms  The current monotonic time in milliseconds
+ * @return  The timeout in milliseconds, or -1 if there are no timers
+ */
+int spotd_timer_wheel_next_timeout(const spotd_timer_wheel *wheel, int64_t now_ms) {
+  int64_t timeout;
+  int i;
+
+  if (wheel->num_timers == 0) {
+    return -1;
+  }
+
+  for (i = 1; i <= SPOTD_TIMER_WHEEL_SLOTS; i++) {
+    if (!LIST_EMPTY(&wheel->slots[(wheel->current_tick + i) & SLOT_MASK])) {
+      timeout = (wheel->current_tick + i) * SPOTD_TIMER_WHEEL_TICK_MS - now_ms;
+      return timeout > 0 ? (int) timeout : 0;
+    }
+  }
+
+  return -1;
+}
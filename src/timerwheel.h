@@ -0,0 +1,72 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#ifndef _SPOTD_TIMERWHEEL_H_
+#define _SPOTD_TIMERWHEEL_H_
+
+#include <stdint.h>
+#include "queue.h"
+
+/*
+ * A hashed timer wheel. Timers are kept in one of a fixed number of slots,
+ * selected by their expiry tick, so scheduling and cancelling a timer is
+ * O(1) and a tick only looks at the timers in one slot. Timers further away
+ * than one revolution of the wheel stay in their slot until their tick.
+ */
+
+/* --- Constants --- */
+// Number of slots, must be a power of two
+#define SPOTD_TIMER_WHEEL_SLOTS 512
+// Length of one tick in milliseconds
+#define SPOTD_TIMER_WHEEL_TICK_MS 100
+
+/* --- Types --- */
+typedef struct spotd_timer spotd_timer;
+typedef void (*spotd_timer_callback)(spotd_timer *timer, void *data);
+
+struct spotd_timer {
+  LIST_ENTRY(spotd_timer) link;
+  int64_t expires_tick;
+  int active;
+  spotd_timer_callback callback;
+  void *data;
+};
+
+typedef struct spotd_timer_wheel {
+  LIST_HEAD(, spotd_timer) slots[SPOTD_TIMER_WHEEL_SLOTS];
+  int64_t current_tick;  // The last tick that was processed
+  int num_timers;
+} spotd_timer_wheel;
+
+/* --- Functions --- */
+void spotd_timer_wheel_init(spotd_timer_wheel *wheel, int64_t now_ms);
+void spotd_timer_init(spotd_timer *timer, spotd_timer_callback callback, void *data);
+void spotd_timer_schedule(spotd_timer_wheel *wheel, spotd_timer *timer, int64_t expires_ms);
+void spotd_timer_cancel(spotd_timer_wheel *wheel, spotd_timer *timer);
+int spotd_timer_wheel_advance(spotd_timer_wheel *wheel, int64_t now_ms);
+int spotd_timer_wheel_next_timeout(const spotd_timer_wheel *wheel, int64_t now_ms);
+
+#endif /* _SPOTD_TIMERWHEEL_H_ */
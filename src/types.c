@@ -27,6 +27,7 @@
 #include "types.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 /**
  * Create a new spotd_command object
@@ -46,6 +47,8 @@ spotd_command *spotd_command_create(spotd_command_type type, int argc, char **ar
   command->type = type;
   command->argc = argc;
   command->argv = argv;
+  memset(&command->origin, 0, sizeof(spotd_command_origin));
+  command->origin.type = type;
 
   return command;
 }
@@ -67,3 +70,70 @@ void spotd_command_release(spotd_command *command) {
 
   free(command);
 }
+
+/**
+ * Get the protocol name of a player state
+ *
+ * @param  state  The player state
+ * @return  The name of the state, as sent to clients
+ */
+const char *spotd_player_state_name(spotd_player_state state) {
+  switch (state) {
+  case SPOTD_PLAYER_LOADING:
+    return "LOADING";
+  case SPOTD_PLAYER_PLAYING:
+    return "PLAYING";
+  case SPOTD_PLAYER_PAUSED:
+    return "PAUSED";
+  default:
+    return "STOPPED";
+  }
+}
+
+/**
+ * Get the protocol name of an event type
+ *
+ * @param  type  The event type
+ * @return  The name of the event, as sent to clients
+ */
+const char *spotd_event_type_name(spotd_event_type type) {
+  switch (type) {
+  case SPOTD_EVENT_TRACK_STARTED:
+    return "TRACK_STARTED";
+  case SPOTD_EVENT_TRACK_ENDED:
+    return "TRACK_ENDED";
+  case SPOTD_EVENT_STOPPED:
+    return "STOPPED";
+  case SPOTD_EVENT_POSITION:
+    return "POSITION";
+  case SPOTD_EVENT_VOLUME:
+    return "VOLUME";
+  case SPOTD_EVENT_DROPPED:
+    return "DROPPED";
+  case SPOTD_EVENT_PAUSED:
+    return "PAUSED";
+  case SPOTD_EVENT_RESUMED:
+    return "RESUMED";
+  default:
+    return "ERROR";
+  }
+}
+
+/**
+ * Get the protocol name of a command result
+ *
+ * @param  result  The command result
+ * @return  The name of the result, as sent to clients
+ */
+const char *spotd_command_result_name(spotd_command_result result) {
+  switch (result) {
+  case SPOTD_RESULT_OK:
+    return "OK";
+  case SPOTD_RESULT_LOADING:
+    return "LOADING";
+  case SPOTD_RESULT_STARTED:
+    return "STARTED";
+  default:
+    return "ERROR";
+  }
+}
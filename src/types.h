@@ -27,24 +27,175 @@
 #ifndef _SPOTD_TYPES_H_
 #define _SPOTD_TYPES_H_
 
+#include <stdint.h>
+#include "queue.h"
+
+// Maximum length of a Spotify link, including the terminating NUL
+#define SPOTD_LINK_MAX 128
+// Maximum number of tracks in the play queue
+#define SPOTD_QUEUE_MAX 64
+// Maximum length of a track or artist name, including the terminating NUL
+#define SPOTD_NAME_MAX 128
+// Maximum number of tracks in a page of search results
+#define SPOTD_SEARCH_PAGE_MAX 50
+// Maximum number of tracks in a single WARM command
+#define SPOTD_WARM_MAX_LINKS 100
+// Maximum number of output zones
+#define SPOTD_MAX_ZONES 8
+// Maximum length of an output device name, including the terminating NUL
+#define SPOTD_DEVICE_MAX 64
+
 typedef enum spotd_error {
   SPOTD_ERROR_OK              = 0, // No errors encountered
   SPOTD_ERROR_BIND_FAILED     = 1, // Server bind call failed
-  SPOTD_ERROR_OTHER_PERMANENT = 2  // Some other error occurred, and it is permanent
+  SPOTD_ERROR_OTHER_PERMANENT = 2, // Some other error occurred, and it is permanent
+  SPOTD_ERROR_UNSUPPORTED     = 3, // The operation is not supported on this system
+  SPOTD_ERROR_CANCELLED       = 4, // Superseded by a later command
+  SPOTD_ERROR_INVALID_LINK    = 5, // Not a valid Spotify track link
+  SPOTD_ERROR_INVALID_STATE   = 6  // Not possible in the current player state
 } spotd_error;
 
 typedef enum spotd_command_type {
-  SPOTD_COMMAND_PLAY_TRACK = 0, // Play a given track
-  SPOTD_COMMAND_STOP       = 1  // Stop playback
+  SPOTD_COMMAND_PLAY_TRACK     = 0,  // Play a given track
+  SPOTD_COMMAND_STOP           = 1,  // Stop playback
+  SPOTD_COMMAND_STATUS         = 2,  // Report the player status
+  SPOTD_COMMAND_SUBSCRIBE      = 3,  // Start pushing events to the client
+  SPOTD_COMMAND_UNSUBSCRIBE    = 4,  // Stop pushing events to the client
+  SPOTD_COMMAND_VOLUME         = 5,  // Set the playback volume
+  SPOTD_COMMAND_PAUSE          = 6,  // Pause playback
+  SPOTD_COMMAND_RESUME         = 7,  // Resume paused playback
+  SPOTD_COMMAND_QUEUE_ADD      = 8,  // Add a track to the end of the play queue
+  SPOTD_COMMAND_QUEUE_REMOVE   = 9,  // Remove the play queue entry at the given index
+  SPOTD_COMMAND_QUEUE_NEXT     = 10, // Play the first track of the play queue
+  SPOTD_COMMAND_QUEUE_CLEAR    = 11, // Remove all play queue entries
+  SPOTD_COMMAND_PLAYLIST_PLAY  = 12, // Play a playlist from the given track index
+  SPOTD_COMMAND_PLAYLIST_NEXT  = 13, // Play the next track of the playlist
+  SPOTD_COMMAND_SEARCH         = 14, // Search for tracks, answered with a page of results
+  SPOTD_COMMAND_WARM           = 15, // Load the given tracks into the cache in the background
+  SPOTD_COMMAND_BITRATE        = 16, // Set the streaming bitrate in kbit/s
+  SPOTD_COMMAND_OFFLINE        = 17, // Mark a playlist for offline sync, or unmark it
+  SPOTD_COMMAND_OFFLINE_STATUS = 18, // Report the offline sync progress
+  SPOTD_COMMAND_ZONE_VOLUME    = 19, // Set the volume of one output zone
+  SPOTD_COMMAND_ZONES          = 20  // Report the output zones
 } spotd_command_type;
 
+typedef enum spotd_player_state {
+  SPOTD_PLAYER_STOPPED = 0, // Nothing is playing
+  SPOTD_PLAYER_LOADING = 1, // Waiting for track metadata before playing
+  SPOTD_PLAYER_PLAYING = 2, // A track is playing
+  SPOTD_PLAYER_PAUSED  = 3  // A track is loaded, but paused
+} spotd_player_state;
+
+typedef struct spotd_status {
+  spotd_player_state state;
+  int volume;
+  int position_ms;
+  int duration_ms;
+  char track_link[SPOTD_LINK_MAX];
+} spotd_status;
+
+// Counters reported by GET /stats
+typedef struct spotd_stats {
+  int track_cache_size;
+  uint64_t track_cache_hits;
+  uint64_t track_cache_misses;
+  uint64_t track_cache_evictions;
+  int search_cache_size;
+  uint64_t search_cache_hits;
+  uint64_t search_cache_misses;
+  uint64_t search_cache_evictions;
+  int warm_pending;          // Tracks waiting to be loaded into the cache
+  uint64_t warm_prefetched;
+  uint64_t warm_failed;
+  int bitrate_kbps;          // The streaming bitrate
+  int offline_playlists;     // Playlists marked for offline sync
+  int offline_syncing;       // Non-zero while tracks are downloaded
+  int offline_queued_tracks; // Tracks waiting to be downloaded
+  uint64_t offline_queued_bytes;
+  int offline_done_tracks;   // Tracks downloaded
+  uint64_t offline_done_bytes;
+  int offline_error_tracks;  // Tracks that could not be downloaded
+  int login_ms;              // Time from process start to login, 0 until then
+  int startup_ttfa_ms;       // Time from process start to the first audio played
+  uint64_t ttfa_count;       // Tracks started by a command and played
+  int ttfa_last_ms;          // Time from the command to the first audio played
+  int ttfa_min_ms;
+  int ttfa_max_ms;
+  int ttfa_avg_ms;
+} spotd_stats;
+
+// An output zone, see spotd_server_callbacks#zones_requested
+typedef struct spotd_zone_status {
+  char device[SPOTD_DEVICE_MAX];
+  int volume;               // Applied on top of the player volume, 0-100
+  int backlog_ms;           // Audio waiting to be played on the zone
+  uint64_t dropped_frames;  // Frames the zone lost while it fell behind
+  int sync_error_us;        // How late the zone plays in sync mode, early if negative
+  int sync_ppm;             // Resampling correction for the drift of the device
+} spotd_zone_status;
+
+// A track found by a search
+typedef struct spotd_search_track {
+  char link[SPOTD_LINK_MAX];
+  char name[SPOTD_NAME_MAX];
+  char artist[SPOTD_NAME_MAX]; // The first artist of the track
+  int duration_ms;
+} spotd_search_track;
+
+// A page of search results, see spotd_server_complete_search()
+typedef struct spotd_search_page {
+  int total;      // Number of tracks matching the query
+  int offset;     // Index of the first track of the page
+  int num_tracks;
+  spotd_search_track tracks[SPOTD_SEARCH_PAGE_MAX];
+} spotd_search_page;
+
+typedef enum spotd_event_type {
+  SPOTD_EVENT_TRACK_STARTED = 0, // A track started playing, value is its duration
+  SPOTD_EVENT_TRACK_ENDED   = 1, // A track played to its end
+  SPOTD_EVENT_STOPPED       = 2, // Playback was stopped
+  SPOTD_EVENT_POSITION      = 3, // Periodic position tick, value is the position
+  SPOTD_EVENT_VOLUME        = 4, // The volume changed, value is the new volume
+  SPOTD_EVENT_ERROR         = 5, // An error occurred, value is a spotd_error
+  SPOTD_EVENT_DROPPED       = 6, // Events were dropped, value is the count
+  SPOTD_EVENT_PAUSED        = 7, // Playback was paused, value is the position
+  SPOTD_EVENT_RESUMED       = 8  // Playback was resumed, value is the position
+} spotd_event_type;
+
+typedef struct spotd_event {
+  spotd_event_type type;
+  int value;
+  char text[SPOTD_LINK_MAX]; // The track link, or an error message
+} spotd_event;
+
+typedef enum spotd_command_result {
+  SPOTD_RESULT_OK      = 0, // The command was executed
+  SPOTD_RESULT_LOADING = 1, // The track is loading, a final result follows
+  SPOTD_RESULT_STARTED = 2, // The track started playing
+  SPOTD_RESULT_ERROR   = 3  // The command failed
+} spotd_command_result;
+
+// Where to send the result of a command, see spotd_server_complete_command()
+typedef struct spotd_command_origin {
+  uint64_t connection_id; // The client connection, 0 if no result is expected
+  uint32_t request_id;    // The request ID chosen by the client
+  spotd_command_type type;
+  int flags;              // How the server formats the result
+  int64_t received_ms;    // Time the command was received, from monotonic_ms()
+} spotd_command_origin;
+
 typedef struct spotd_command {
+  TAILQ_ENTRY(spotd_command) link;
   spotd_command_type type;
   int argc;
   char **argv;
+  spotd_command_origin origin;
 } spotd_command;
 
 spotd_command *spotd_command_create(spotd_command_type type, int argc, char **argv);
 void spotd_command_release(spotd_command *command);
+const char *spotd_player_state_name(spotd_player_state state);
+const char *spotd_event_type_name(spotd_event_type type);
+const char *spotd_command_result_name(spotd_command_result result);
 
 #endif /* _SPOTD_TYPES_H_ */
@@ -0,0 +1,383 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#include "uring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* --- Function definitions --- */
+static int io_uring_setup(unsigned entries, struct io_uring_params *params);
+static int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags, void *arg, size_t arg_size);
+static int io_uring_register(int ring_fd, unsigned opcode, void *arg, unsigned num_args);
+static unsigned publish_sqes(spotd_uring *ring);
+
+/* -- Functions --- */
+
+/**
+ * Set up a ring. Fails on kernels older than 6.0, which lack single issuer
+ * rings, and with them multishot receives and registered buffer rings.
+ *
+ * @param  ring  The ring to set up
+ * @param  entries  Number of submission queue entries
+ * @return  0 on success, -1 if io_uring cannot be used
+ */
+int spotd_uring_init(spotd_uring *ring, unsigned entries) {
+  struct io_uring_params params;
+  unsigned i;
+  char *sq, *cq;
+
+  memset(ring, 0, sizeof(*ring));
+  ring->ring_fd = -1;
+
+  memset(&params, 0, sizeof(params));
+  // Every multishot request can post many completions
+  params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN |
+                 IORING_SETUP_SUBMIT_ALL | IORING_SETUP_CQSIZE;
+  params.cq_entries = entries * 4;
+
+  ring->ring_fd = io_uring_setup(entries, &params);
+  if (ring->ring_fd < 0) {
+    return -1;
+  }
+
+  if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) {
+    spotd_uring_free(ring);
+    return -1;
+  }
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size) {
+      ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    ring->sq_ring = NULL;
+    spotd_uring_free(ring);
+    return -1;
+  }
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      ring->cq_ring = NULL;
+      spotd_uring_free(ring);
+      return -1;
+    }
+  }
+
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                                            IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    spotd_uring_free(ring);
+    return -1;
+  }
+
+  sq = (char *) ring->sq_ring;
+  ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+
+  cq = (char *) ring->cq_ring;
+  ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  // Submission entries are used in order, so the index array never changes
+  for (i = 0; i < params.sq_entries; i++) {
+    ring->sq_array[i] = i;
+  }
+
+  ring->sqe_tail = ring->sqe_head = *ring->sq_tail;
+
+  return 0;
+}
+
+/**
+ * Tear down a ring. Requests still in flight are cancelled by the kernel.
+ *
+ * @param  ring  The ring
+ */
+void spotd_uring_free(spotd_uring *ring) {
+  if (ring->buf_ring != NULL) {
+    munmap(ring->buf_ring, ring->buf_count * sizeof(struct io_uring_buf));
+    free(ring->buffers);
+  }
+
+  if (ring->sqes != NULL) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+
+  if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+
+  if (ring->sq_ring != NULL) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+
+  if (ring->ring_fd >= 0) {
+    close(ring->ring_fd);
+  }
+
+  memset(ring, 0, sizeof(*ring));
+  ring->ring_fd = -1;
+}
+
+/**
+ * Register a ring of receive buffers with the kernel. Requests flagged with
+ * IOSQE_BUFFER_SELECT and this group take a buffer from the ring, and report
+ * its ID in the completion flags.
+ *
+ * @param  ring  The ring
+ * @param  group  The buffer group ID
+ * @param  count  Number of buffers, a power of two
+ * @param  size  Size of every buffer
+ * @return  0 on success, -1 on error
+ */
+int spotd_uring_setup_buffers(spotd_uring *ring, unsigned short group, unsigned count,
+                              unsigned size) {
+  struct io_uring_buf_reg reg;
+  void *buf_ring;
+  unsigned i;
+
+  // The buffer ring must be page aligned
+  buf_ring = mmap(NULL, count * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf_ring == MAP_FAILED) {
+    return -1;
+  }
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long) buf_ring;
+  reg.ring_entries = count;
+  reg.bgid = group;
+
+  if (io_uring_register(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    munmap(buf_ring, count * sizeof(struct io_uring_buf));
+    return -1;
+  }
+
+  ring->buf_ring = (struct io_uring_buf_ring *) buf_ring;
+  ring->buffers = (char *) malloc((size_t) count * size);
+  ring->buf_count = count;
+  ring->buf_size = size;
+  ring->buf_group = group;
+
+  for (i = 0; i < count; i++) {
+    spotd_uring_recycle_buffer(ring, i);
+  }
+
+  return 0;
+}
+
+/**
+ * Get a free submission queue entry. Queued entries are submitted first if
+ * the queue is full.
+ *
+ * @param  ring  The ring
+ * @return  A cleared entry, or NULL if the queue is still full
+ */
+struct io_uring_sqe *spotd_uring_get_sqe(spotd_uring *ring) {
+  struct io_uring_sqe *sqe;
+
+  if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_mask) {
+    spotd_uring_submit(ring);
+
+    if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_mask) {
+      return NULL;
+    }
+  }
+
+  sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+  ring->sqe_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+
+  return sqe;
+}
+
+/**
+ * Submit the queued entries without waiting for completions
+ *
+ * @param  ring  The ring
+ * @return  The number of submitted entries, or -1 on error
+ */
+int spotd_uring_submit(spotd_uring *ring) {
+  unsigned to_submit = publish_sqes(ring);
+  int r;
+
+  if (to_submit == 0) {
+    return 0;
+  }
+
+  do {
+    r = io_uring_enter(ring->ring_fd, to_submit, 0, 0, NULL, 0);
+  } while (r < 0 && errno == EINTR);
+
+  return r;
+}
+
+/**
+ * Submit the queued entries and wait for at least one completion
+ *
+ * @param  ring  The ring
+ * @param  timeout_ms  Maximum time to wait, -1 to wait without a limit
+ * @return  0 on success or timeout, -1 on error
+ */
+int spotd_uring_wait(spotd_uring *ring, int timeout_ms) {
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  unsigned to_submit = publish_sqes(ring);
+  int r;
+
+  if (timeout_ms < 0) {
+    r = io_uring_enter(ring->ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+  } else {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long long) (timeout_ms % 1000) * 1000000;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (unsigned long) &ts;
+
+    r = io_uring_enter(ring->ring_fd, to_submit, 1,
+                       IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+  }
+
+  if (r < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Get the next completion, if there is one
+ *
+ * @param  ring  The ring
+ * @return  The completion, or NULL. Mark it seen with spotd_uring_cqe_seen()
+ *   once handled.
+ */
+struct io_uring_cqe *spotd_uring_peek_cqe(spotd_uring *ring) {
+  unsigned head = *ring->cq_head;
+
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+/**
+ * Release the completion returned by spotd_uring_peek_cqe()
+ *
+ * @param  ring  The ring
+ */
+void spotd_uring_cqe_seen(spotd_uring *ring) {
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Get a receive buffer by the ID reported in a completion
+ *
+ * @param  ring  The ring
+ * @param  id  The buffer ID
+ * @return  The buffer
+ */
+char *spotd_uring_buffer(spotd_uring *ring, unsigned id) {
+  return ring->buffers + (size_t) id * ring->buf_size;
+}
+
+/**
+ * Give a receive buffer back to the kernel once its data has been used
+ *
+ * @param  ring  The ring
+ * @param  id  The buffer ID
+ */
+void spotd_uring_recycle_buffer(spotd_uring *ring, unsigned id) {
+  struct io_uring_buf *buf;
+  unsigned short tail = ring->buf_ring->tail;
+
+  buf = &ring->buf_ring->bufs[tail & (ring->buf_count - 1)];
+  buf->addr = (unsigned long) spotd_uring_buffer(ring, id);
+  buf->len = ring->buf_size;
+  buf->bid = (unsigned short) id;
+
+  __atomic_store_n(&ring->buf_ring->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
+
+/**
+ * Make the queued entries visible to the kernel
+ *
+ * @param  ring  The ring
+ * @return  The number of entries published
+ */
+static unsigned publish_sqes(spotd_uring *ring) {
+  unsigned published = ring->sqe_tail - ring->sqe_head;
+
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+  ring->sqe_head = ring->sqe_tail;
+
+  return published;
+}
+
+/* --- System calls --- */
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params) {
+  return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags, void *arg, size_t arg_size) {
+  return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, arg,
+                       arg_size);
+}
+
+static int io_uring_register(int ring_fd, unsigned opcode, void *arg, unsigned num_args) {
+  return (int) syscall(__NR_io_uring_register, ring_fd, opcode, arg, num_args);
+}
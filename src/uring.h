@@ -0,0 +1,87 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#ifndef _SPOTD_URING_H_
+#define _SPOTD_URING_H_
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*
+ * A minimal io_uring ring, set up with the raw system calls so that no
+ * library is needed. Receive buffers are provided to the kernel through a
+ * registered buffer ring, from which multishot receives pick a buffer for
+ * every completion.
+ *
+ * A ring is used by a single thread. spotd_uring_init() fails on kernels
+ * without the features the server relies on (6.0 and later), so that the
+ * caller can fall back to poll().
+ */
+
+/* --- Types --- */
+typedef struct spotd_uring {
+  int ring_fd;
+  // Submission queue
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sqe_tail;     // Next free entry, not yet visible to the kernel
+  unsigned sqe_head;     // Entries before this have been published
+  // Completion queue
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  // Mappings
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  // Provided receive buffers
+  struct io_uring_buf_ring *buf_ring;
+  char *buffers;
+  unsigned buf_count;
+  unsigned buf_size;
+  unsigned short buf_group;
+} spotd_uring;
+
+/* --- Functions --- */
+int spotd_uring_init(spotd_uring *ring, unsigned entries);
+void spotd_uring_free(spotd_uring *ring);
+int spotd_uring_setup_buffers(spotd_uring *ring, unsigned short group, unsigned count,
+                              unsigned size);
+struct io_uring_sqe *spotd_uring_get_sqe(spotd_uring *ring);
+int spotd_uring_submit(spotd_uring *ring);
+int spotd_uring_wait(spotd_uring *ring, int timeout_ms);
+struct io_uring_cqe *spotd_uring_peek_cqe(spotd_uring *ring);
+void spotd_uring_cqe_seen(spotd_uring *ring);
+char *spotd_uring_buffer(spotd_uring *ring, unsigned id);
+void spotd_uring_recycle_buffer(spotd_uring *ring, unsigned id);
+
+#endif /* _SPOTD_URING_H_ */
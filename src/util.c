@@ -28,6 +28,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 /**
  * Remove characters from a string.
@@ -51,3 +52,92 @@ char *strip_str(const char *str, const char *d) {
   stripped[stripped_len] = '\0';
   return stripped;
 }
+
+/**
+ * Parse a decimal integer in a range
+ *
+ * @param  str  The string to parse. The whole string must be a number.
+ * @param  min  The minimum allowed value, must not be negative
+ * @param  max  The maximum allowed value
+ * @return  The parsed number, or -1 if the string is not a number in range
+ */
+int parse_int(const char *str, int min, int max) {
+  char *end;
+  long value;
+
+  if (*str == '\0') {
+    return -1;
+  }
+
+  value = strtol(str, &end, 10);
+
+  if (*end != '\0' || value < min || value > max) {
+    return -1;
+  }
+
+  return (int) value;
+}
+
+/**
+ * Get the current time of the monotonic clock
+ *
+ * @return  The time in milliseconds, from an arbitrary starting point
+ */
+int64_t monotonic_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Get the current time of the monotonic clock, in finer steps
+ *
+ * @return  The time in microseconds, from the same starting point as
+ *   monotonic_ms()
+ */
+int64_t monotonic_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Encode data as base64
+ *
+ * @param  data  The data to encode
+ * @param  length  Length of the data
+ * @param  out  Receives the NUL terminated encoding, must have room for
+ *   4 * ((length + 2) / 3) + 1 characters
+ */
+void base64_encode(const unsigned char *data, size_t length, char *out) {
+  static const char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  uint32_t triple;
+  size_t i;
+
+  for (i = 0; i + 2 < length; i += 3) {
+    triple = (uint32_t) data[i] << 16 | (uint32_t) data[i + 1] << 8 | data[i + 2];
+    *out++ = alphabet[triple >> 18 & 0x3F];
+    *out++ = alphabet[triple >> 12 & 0x3F];
+    *out++ = alphabet[triple >> 6 & 0x3F];
+    *out++ = alphabet[triple & 0x3F];
+  }
+
+  if (i < length) {
+    triple = (uint32_t) data[i] << 16;
+    if (i + 1 < length) {
+      triple |= (uint32_t) data[i + 1] << 8;
+    }
+
+    *out++ = alphabet[triple >> 18 & 0x3F];
+    *out++ = alphabet[triple >> 12 & 0x3F];
+    *out++ = i + 1 < length ? alphabet[triple >> 6 & 0x3F] : '=';
+    *out++ = '=';
+  }
+
+  *out = '\0';
+}
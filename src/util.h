@@ -27,6 +27,13 @@
 #ifndef _SPOTD_UTIL_H_
 #define _SPOTD_UTIL_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 char *strip_str(const char *str, const char *d);
+int parse_int(const char *str, int min, int max);
+int64_t monotonic_ms(void);
+int64_t monotonic_us(void);
+void base64_encode(const unsigned char *data, size_t length, char *out);
 
 #endif /* _SPOTD_UTIL_H_ */
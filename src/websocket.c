@@ -0,0 +1,176 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#include "websocket.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sha1.h"
+#include "util.h"
+
+/* --- Constants --- */
+// Appended to the client key to compute the accept key
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+// Maximum payload of a control frame
+#define MAX_CONTROL_PAYLOAD 125
+
+/* -- Functions --- */
+
+/**
+ * Write the response that accepts a WebSocket upgrade request
+ *
+ * @param  out  The buffer to write the response to
+ * @param  key  The Sec-WebSocket-Key sent by the client
+ */
+void spotd_websocket_write_handshake(spotd_buffer *out, const char *key) {
+  char key_guid[128];
+  uint8_t digest[SPOTD_SHA1_DIGEST_SIZE];
+  char accept[32];
+  char response[256];
+  int length;
+
+  snprintf(key_guid, sizeof(key_guid), "%s%s", key, WEBSOCKET_GUID);
+  spotd_sha1(key_guid, strlen(key_guid), digest);
+  base64_encode(digest, sizeof(digest), accept);
+
+  length = snprintf(response, sizeof(response),
+      "HTTP/1.1 101 Switching Protocols\r\n"
+      "Upgrade: websocket\r\n"
+      "Connection: Upgrade\r\n"
+      "Sec-WebSocket-Accept: %s\r\n"
+      "\r\n",
+      accept);
+
+  spotd_buffer_append(out, response, length);
+}
+
+/**
+ * Parse a frame sent by a client. Client frames are always masked, the
+ * payload is unmasked in place.
+ *
+ * @param  data  The received data
+ * @param  length  Length of the received data
+ * @param  frame  Receives the parsed frame. The payload points into data.
+ * @return  The length of the complete frame in bytes, 0 if the frame is
+ *   incomplete, or -1 if the frame is malformed, fragmented or too large
+ */
+int spotd_websocket_parse_frame(char *data, size_t length, spotd_websocket_frame *frame) {
+  const uint8_t *header = (const uint8_t *) data;
+  size_t header_length = 2, payload_length, i;
+  const uint8_t *mask;
+
+  if (length < 2) {
+    return 0;
+  }
+
+  // FIN must be set, reserved bits must not be, and clients must mask
+  if ((header[0] & 0xF0) != 0x80 || (header[1] & 0x80) == 0) {
+    return -1;
+  }
+
+  frame->opcode = (spotd_websocket_opcode) (header[0] & 0x0F);
+  payload_length = header[1] & 0x7F;
+
+  if (payload_length == 126) {
+    if (length < 4) {
+      return 0;
+    }
+    payload_length = (size_t) header[2] << 8 | header[3];
+    header_length = 4;
+  } else if (payload_length == 127) {
+    // 64-bit lengths are far over the limit
+    return -1;
+  }
+
+  switch (frame->opcode) {
+  case SPOTD_WEBSOCKET_OP_TEXT:
+  case SPOTD_WEBSOCKET_OP_BINARY:
+    if (payload_length > SPOTD_WEBSOCKET_MAX_PAYLOAD) {
+      return -1;
+    }
+    break;
+  case SPOTD_WEBSOCKET_OP_CLOSE:
+  case SPOTD_WEBSOCKET_OP_PING:
+  case SPOTD_WEBSOCKET_OP_PONG:
+    if (payload_length > MAX_CONTROL_PAYLOAD) {
+      return -1;
+    }
+    break;
+  default:
+    return -1;
+  }
+
+  if (length < header_length + 4 + payload_length) {
+    return 0;
+  }
+
+  mask = header + header_length;
+  frame->payload = data + header_length + 4;
+  frame->payload_length = payload_length;
+
+  for (i = 0; i < payload_length; i++) {
+    frame->payload[i] ^= mask[i % 4];
+  }
+
+  return (int) (header_length + 4 + payload_length);
+}
+
+/**
+ * Write an unmasked frame, as sent by the server
+ *
+ * @param  out  The buffer to write the frame to
+ * @param  opcode  The frame opcode
+ * @param  payload  The frame payload
+ * @param  length  Length of the payload
+ */
+void spotd_websocket_write_frame(spotd_buffer *out, spotd_websocket_opcode opcode,
+                                 const char *payload, size_t length) {
+  uint8_t header[10];
+  size_t header_length;
+  int i;
+
+  header[0] = 0x80 | opcode;
+
+  if (length < 126) {
+    header[1] = (uint8_t) length;
+    header_length = 2;
+  } else if (length <= 0xFFFF) {
+    header[1] = 126;
+    header[2] = (uint8_t) (length >> 8);
+    header[3] = (uint8_t) length;
+    header_length = 4;
+  } else {
+    header[1] = 127;
+    for (i = 0; i < 8; i++) {
+      header[2 + i] = (uint8_t) ((uint64_t) length >> ((7 - i) * 8));
+    }
+    header_length = 10;
+  }
+
+  spotd_buffer_append(out, header, header_length);
+  spotd_buffer_append(out, payload, length);
+}
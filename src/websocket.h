@@ -0,0 +1,67 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#ifndef _SPOTD_WEBSOCKET_H_
+#define _SPOTD_WEBSOCKET_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "buffer.h"
+
+/*
+ * WebSocket (RFC 6455) framing for the status channel. Clients connect to
+ * the HTTP API with a GET /ws upgrade request. Text frames from the client
+ * carry text protocol commands and binary frames carry binary protocol
+ * frame bodies, without the length prefix. Fragmented messages are not
+ * supported, commands always fit in a single frame.
+ */
+
+/* --- Constants --- */
+// Maximum payload of a frame received from a client
+#define SPOTD_WEBSOCKET_MAX_PAYLOAD 4096
+
+/* --- Types --- */
+typedef enum spotd_websocket_opcode {
+  SPOTD_WEBSOCKET_OP_TEXT   = 0x1,
+  SPOTD_WEBSOCKET_OP_BINARY = 0x2,
+  SPOTD_WEBSOCKET_OP_CLOSE  = 0x8,
+  SPOTD_WEBSOCKET_OP_PING   = 0x9,
+  SPOTD_WEBSOCKET_OP_PONG   = 0xA
+} spotd_websocket_opcode;
+
+typedef struct spotd_websocket_frame {
+  spotd_websocket_opcode opcode;
+  char *payload;        // Points into the parsed data, unmasked in place
+  size_t payload_length;
+} spotd_websocket_frame;
+
+/* --- Functions --- */
+void spotd_websocket_write_handshake(spotd_buffer *out, const char *key);
+int spotd_websocket_parse_frame(char *data, size_t length, spotd_websocket_frame *frame);
+void spotd_websocket_write_frame(spotd_buffer *out, spotd_websocket_opcode opcode,
+                                 const char *payload, size_t length);
+
+#endif /* _SPOTD_WEBSOCKET_H_ */
@@ -0,0 +1,434 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+/*
+ * Benchmark of the audio pipeline: the path audio takes from libspotify's
+ * music_delivery callback through the zone fifos to the output threads of
+ * alsa-audio.c. The real main.c is compiled in, so that music_delivery is
+ * spotd's own, and the output threads play on "null:fast" devices, which
+ * discard the audio at once. The benchmark plays the part of libspotify,
+ * delivering synthetic audio as fast as spotd takes it, for each
+ * combination of chunk size, sample rate and burstiness.
+ *
+ * It is linked with --wrap for spotd_null_sink_write, to learn when each
+ * chunk reaches the device, and for malloc, calloc, realloc and
+ * pthread_mutex_lock, to count allocations and the time spent waiting for
+ * locks held by another thread.
+ *
+ * Reported for each combination:
+ *
+ *   frames_per_sec   Frames played per second, on each zone
+ *   ns_per_chunk     Time per chunk played, on each zone
+ *   delivery_ns      Mean time music_delivery takes to accept a chunk
+ *   rejected         Calls to music_delivery that found the buffer full
+ *   latency_*_ns     Time from music_delivery to the output device, by
+ *                    percentile
+ *   allocs_per_sec   Allocations per second, by spotd and the benchmark
+ *   lock_wait_ns     Time spent waiting for a locked mutex, all threads
+ *   lock_waits       Times a thread found a mutex locked
+ *
+ * With -j, each combination is printed as a line of JSON.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "histogram.h"
+#include "nullsink.h"
+
+/* spotd itself, with its main() renamed */
+#define main spotd_main
+#include "../src/main.c"
+#undef main
+
+/* --- Constants --- */
+#define BENCH_DEVICE "null:fast"
+#define BENCH_MAX_VALUES 16
+// Chunks in flight whose delivery time is kept. Well above the zone buffer
+// in chunks of the smallest size.
+#define BENCH_RING 65536
+#define BENCH_MIN_CHUNK 2
+#define BENCH_MAX_CHUNK 65536
+// Time the output threads get to play what was delivered, in seconds
+#define BENCH_DRAIN_SECONDS 10
+
+/* --- Types --- */
+typedef struct bench_result {
+  int chunk;
+  int rate;
+  int burst;
+  double seconds;
+  uint64_t chunks;          // Chunks played on each zone
+  uint64_t delivered;       // Chunks accepted by music_delivery
+  uint64_t rejected;
+  uint64_t delivery_ns;     // Time spent in accepted music_delivery calls
+  uint64_t allocs;
+  uint64_t alloc_bytes;
+  uint64_t lock_wait_ns;
+  uint64_t lock_waits;
+  spotd_histogram latency;  // Time from delivery to the device, in ns
+} bench_result;
+
+/* --- Data --- */
+// Time each chunk in flight was delivered, by its sequence number
+static int64_t *g_bench_sent_ns;
+// Counters updated by the wrappers, from any thread
+static uint64_t g_bench_played;
+static uint64_t g_bench_played_frames;
+static uint64_t g_bench_allocs;
+static uint64_t g_bench_alloc_bytes;
+static uint64_t g_bench_lock_wait_ns;
+static uint64_t g_bench_lock_waits;
+static bench_result g_bench_result;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+int __real_pthread_mutex_lock(pthread_mutex_t *mutex);
+void __real_spotd_null_sink_write(spotd_null_sink *sink, const int16_t *samples, int frames);
+
+/* -------------------------------  WRAPPERS  ------------------------------ */
+
+static int64_t bench_now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void *__wrap_malloc(size_t size) {
+  __atomic_add_fetch(&g_bench_allocs, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&g_bench_alloc_bytes, size, __ATOMIC_RELAXED);
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+  __atomic_add_fetch(&g_bench_allocs, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&g_bench_alloc_bytes, count * size, __ATOMIC_RELAXED);
+  return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  __atomic_add_fetch(&g_bench_allocs, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&g_bench_alloc_bytes, size, __ATOMIC_RELAXED);
+  return __real_realloc(ptr, size);
+}
+
+/**
+ * Lock a mutex, timing the wait if another thread holds it
+ */
+int __wrap_pthread_mutex_lock(pthread_mutex_t *mutex) {
+  int64_t start_ns;
+  int r;
+
+  if (pthread_mutex_trylock(mutex) == 0) {
+    return 0;
+  }
+
+  start_ns = bench_now_ns();
+  r = __real_pthread_mutex_lock(mutex);
+  __atomic_add_fetch(&g_bench_lock_wait_ns, bench_now_ns() - start_ns, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&g_bench_lock_waits, 1, __ATOMIC_RELAXED);
+
+  return r;
+}
+
+/**
+ * Note the arrival of a chunk at an output device. The sequence number of
+ * the chunk is in its first two samples.
+ */
+void __wrap_spotd_null_sink_write(spotd_null_sink *sink, const int16_t *samples, int frames) {
+  uint32_t sequence = (uint16_t) samples[0] | (uint32_t) (uint16_t) samples[1] << 16;
+
+  spotd_histogram_record(&g_bench_result.latency,
+                         bench_now_ns() - g_bench_sent_ns[sequence % BENCH_RING]);
+  __atomic_add_fetch(&g_bench_played_frames, frames, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&g_bench_played, 1, __ATOMIC_RELEASE);
+
+  __real_spotd_null_sink_write(sink, samples, frames);
+}
+
+/* ------------------------------  BENCHMARK  ------------------------------ */
+
+/**
+ * Deliver audio to spotd for a while, and measure how it flows through
+ *
+ * @param  result  The result, with chunk, rate and burst set
+ * @param  seconds  Time to deliver audio for
+ * @param  gap_us  Pause after each burst
+ */
+static void bench_run(bench_result *result, double seconds, int gap_us) {
+  sp_audioformat format;
+  int16_t *samples;
+  int64_t start_ns, end_ns, call_ns, drain_ns;
+  uint32_t sequence = 0;
+  uint64_t played_frames;
+  int i, n;
+
+  format.sample_type = SP_SAMPLETYPE_INT16_NATIVE_ENDIAN;
+  format.sample_rate = result->rate;
+  format.channels = 2;
+
+  samples = calloc((size_t) result->chunk * format.channels, sizeof(int16_t));
+  for (i = 2; i < result->chunk * format.channels; i++) {
+    samples[i] = (int16_t) (i * 64);
+  }
+
+  // A chunk at the new rate makes the output threads reopen their devices,
+  // which is not measured
+  g_bench_played = 0;
+  music_delivery(NULL, &format, samples, result->chunk);
+  while (__atomic_load_n(&g_bench_played, __ATOMIC_ACQUIRE) < (uint64_t) g_num_zones) {
+    sched_yield();
+  }
+
+  g_bench_played = 0;
+  g_bench_played_frames = 0;
+  g_bench_allocs = 0;
+  g_bench_alloc_bytes = 0;
+  g_bench_lock_wait_ns = 0;
+  g_bench_lock_waits = 0;
+  spotd_histogram_reset(&result->latency);
+
+  start_ns = bench_now_ns();
+  end_ns = start_ns + (int64_t) (seconds * 1e9);
+
+  while (bench_now_ns() < end_ns) {
+    for (i = 0; i < (result->burst > 0 ? result->burst : 1); i++) {
+      samples[0] = (int16_t) (sequence & 0xffff);
+      samples[1] = (int16_t) (sequence >> 16);
+      call_ns = bench_now_ns();
+      g_bench_sent_ns[sequence % BENCH_RING] = call_ns;
+
+      n = music_delivery(NULL, &format, samples, result->chunk);
+      if (n == 0) {
+        // The buffer is full, like libspotify try again later
+        result->rejected++;
+        sched_yield();
+        i--;
+        continue;
+      }
+
+      result->delivery_ns += bench_now_ns() - call_ns;
+      result->delivered++;
+      sequence++;
+    }
+
+    if (result->burst > 0 && gap_us > 0) {
+      usleep(gap_us);
+    }
+  }
+
+  // Wait for the output threads to play the rest
+  drain_ns = bench_now_ns() + (int64_t) BENCH_DRAIN_SECONDS * 1000000000;
+  while (__atomic_load_n(&g_bench_played, __ATOMIC_ACQUIRE) < result->delivered * g_num_zones &&
+         bench_now_ns() < drain_ns) {
+    sched_yield();
+  }
+
+  result->seconds = (bench_now_ns() - start_ns) / 1e9;
+  played_frames = __atomic_load_n(&g_bench_played_frames, __ATOMIC_RELAXED);
+  result->chunks = __atomic_load_n(&g_bench_played, __ATOMIC_RELAXED) / g_num_zones;
+  result->allocs = g_bench_allocs;
+  result->alloc_bytes = g_bench_alloc_bytes;
+  result->lock_wait_ns = g_bench_lock_wait_ns;
+  result->lock_waits = g_bench_lock_waits;
+
+  if (played_frames / g_num_zones != result->chunks * result->chunk) {
+    fprintf(stderr, "Warning: %" PRIu64 " frames played, expected %" PRIu64 "\n",
+            played_frames / g_num_zones, result->chunks * result->chunk);
+  }
+  if (result->chunks < result->delivered) {
+    fprintf(stderr, "Warning: %" PRIu64 " of %" PRIu64 " chunks not played\n",
+            result->delivered - result->chunks, result->delivered);
+  }
+
+  free(samples);
+}
+
+/**
+ * Print the result of a run
+ *
+ * @param  result  The result
+ * @param  json  Non-zero to print a line of JSON, zero for a table row
+ */
+static void bench_print(const bench_result *result, int json) {
+  const spotd_histogram *latency = &result->latency;
+  uint64_t chunks = result->chunks > 0 ? result->chunks : 1;
+
+  if (json) {
+    printf("{\"benchmark\":\"audio\",\"chunk\":%d,\"rate\":%d,\"burst\":%d,\"zones\":%d,"
+           "\"seconds\":%.3f,\"chunks\":%" PRIu64 ",\"frames_per_sec\":%.0f,"
+           "\"ns_per_chunk\":%.0f,\"delivery_ns\":%" PRIu64 ",\"rejected\":%" PRIu64 ","
+           "\"latency_p50_ns\":%" PRId64 ",\"latency_p99_ns\":%" PRId64 ","
+           "\"latency_p999_ns\":%" PRId64 ",\"latency_max_ns\":%" PRId64 ","
+           "\"allocs_per_sec\":%.0f,\"alloc_bytes_per_sec\":%.0f,"
+           "\"lock_wait_ns\":%" PRIu64 ",\"lock_waits\":%" PRIu64 "}\n",
+           result->chunk, result->rate, result->burst, g_num_zones, result->seconds,
+           result->chunks, result->chunks * result->chunk / result->seconds,
+           result->seconds * 1e9 / chunks,
+           result->delivered > 0 ? result->delivery_ns / result->delivered : 0,
+           result->rejected,
+           spotd_histogram_percentile(latency, 50), spotd_histogram_percentile(latency, 99),
+           spotd_histogram_percentile(latency, 99.9), latency->count > 0 ? latency->max : 0,
+           result->allocs / result->seconds, result->alloc_bytes / result->seconds,
+           result->lock_wait_ns, result->lock_waits);
+  } else {
+    printf("%6d %6d %5d %11.0f %9.0f %8" PRIu64 " %9" PRIu64 " %9.1f %9.1f %9.1f %9.0f %9.2f %8"
+           PRIu64 "\n",
+           result->chunk, result->rate, result->burst,
+           result->chunks * result->chunk / result->seconds,
+           result->seconds * 1e9 / chunks,
+           result->delivered > 0 ? result->delivery_ns / result->delivered : 0,
+           result->rejected,
+           spotd_histogram_percentile(latency, 50) / 1000.0,
+           spotd_histogram_percentile(latency, 99) / 1000.0,
+           spotd_histogram_percentile(latency, 99.9) / 1000.0,
+           result->allocs / result->seconds,
+           result->lock_wait_ns / 1e6, result->lock_waits);
+  }
+
+  fflush(stdout);
+}
+
+/**
+ * Parse a comma separated list of numbers
+ *
+ * @param  str  The list
+ * @param  values  Where to store the numbers
+ * @param  min  The smallest number allowed
+ * @param  max  The largest number allowed
+ * @return  The count of numbers, -1 if the list is invalid
+ */
+static int bench_parse_list(const char *str, int *values, int min, int max) {
+  char copy[256], *token, *save;
+  int count = 0;
+
+  if (strlen(str) >= sizeof(copy)) {
+    return -1;
+  }
+  strcpy(copy, str);
+
+  for (token = strtok_r(copy, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save)) {
+    if (count == BENCH_MAX_VALUES || (values[count] = parse_int(token, min, max)) < 0) {
+      return -1;
+    }
+    count++;
+  }
+
+  return count > 0 ? count : -1;
+}
+
+static void bench_usage(const char *progname) {
+  fprintf(stderr, "Usage: %s [-c chunks] [-r rates] [-b bursts] [-g gap_us] [-z zones] "
+          "[-d seconds] [-j]\n", progname);
+  fprintf(stderr, "  -c  Frames per music_delivery call, comma separated (256,1024,2048,4096,8192)\n");
+  fprintf(stderr, "  -r  Sample rates, comma separated (22050,44100,48000,96000)\n");
+  fprintf(stderr, "  -b  Chunks delivered between pauses, 0 for no pauses (0,16,256)\n");
+  fprintf(stderr, "  -g  Length of the pauses, in microseconds (5000)\n");
+  fprintf(stderr, "  -z  Number of zones (1)\n");
+  fprintf(stderr, "  -d  Seconds to run each combination for (1)\n");
+  fprintf(stderr, "  -j  Print the results as lines of JSON\n");
+}
+
+int main(int argc, char **argv) {
+  int chunks[BENCH_MAX_VALUES] = { 256, 1024, 2048, 4096, 8192 }, num_chunks = 5;
+  int rates[BENCH_MAX_VALUES] = { 22050, 44100, 48000, 96000 }, num_rates = 4;
+  int bursts[BENCH_MAX_VALUES] = { 0, 16, 256 }, num_bursts = 3;
+  int gap_us = 5000, zones = 1, seconds = 1, json = 0;
+  int opt, c, r, b, i;
+
+  while ((opt = getopt(argc, argv, "c:r:b:g:z:d:j")) != EOF) {
+    switch (opt) {
+    case 'c':
+      num_chunks = bench_parse_list(optarg, chunks, BENCH_MIN_CHUNK, BENCH_MAX_CHUNK);
+      break;
+    case 'r':
+      num_rates = bench_parse_list(optarg, rates, 8000, 192000);
+      break;
+    case 'b':
+      num_bursts = bench_parse_list(optarg, bursts, 0, 100000);
+      break;
+    case 'g':
+      gap_us = parse_int(optarg, 0, 10000000);
+      break;
+    case 'z':
+      zones = parse_int(optarg, 1, SPOTD_MAX_ZONES);
+      break;
+    case 'd':
+      seconds = parse_int(optarg, 1, 3600);
+      break;
+    case 'j':
+      json = 1;
+      break;
+    default:
+      bench_usage(argv[0]);
+      return 1;
+    }
+
+    if (num_chunks < 0 || num_rates < 0 || num_bursts < 0 || gap_us < 0 || zones < 0 ||
+        seconds < 0) {
+      bench_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  g_bench_sent_ns = calloc(BENCH_RING, sizeof(int64_t));
+
+  pthread_mutex_init(&g_delivery_mutex, NULL);
+  for (i = 0; i < zones; i++) {
+    add_zone(BENCH_DEVICE);
+  }
+  start_zones();
+
+  if (!json) {
+    printf("%6s %6s %5s %11s %9s %8s %9s %9s %9s %9s %9s %9s %8s\n",
+           "chunk", "rate", "burst", "frames/s", "ns/chunk", "deliv_ns", "rejected",
+           "p50_us", "p99_us", "p999_us", "allocs/s", "lockw_ms", "lockw_n");
+  }
+
+  for (c = 0; c < num_chunks; c++) {
+    for (r = 0; r < num_rates; r++) {
+      for (b = 0; b < num_bursts; b++) {
+        memset(&g_bench_result, 0, sizeof(bench_result));
+        g_bench_result.chunk = chunks[c];
+        g_bench_result.rate = rates[r];
+        g_bench_result.burst = bursts[b];
+
+        bench_run(&g_bench_result, seconds, gap_us);
+        bench_print(&g_bench_result, json);
+      }
+    }
+  }
+
+  return 0;
+}
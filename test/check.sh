@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# The MIT License (MIT)
+# 
+# Copyright (c) 2015 Mantas Norvaiša
+# 
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+# 
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+# 
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+# This file is part of spotd.
+#
+
+# Runs the regression checks of servercheck.c against spotd built with the
+# fake libspotify and AddressSanitizer. Fails if a check fails, or if spotd
+# reports a memory error or does not exit cleanly.
+#
+# Usage: check.sh <bin directory>
+
+BIN_DIR=${1:-../bin}
+PORT=${CHECK_PORT:-18888}
+HTTP_PORT=${CHECK_HTTP_PORT:-18080}
+WORK_DIR=$(mktemp -d)
+LOG="$WORK_DIR/spotd.log"
+
+"$BIN_DIR/spotd-fake-asan" -P "$PORT" -H "$HTTP_PORT" -u check -p check -C "$WORK_DIR" \
+    -o null -c 0 -r 0 > "$LOG" 2>&1 &
+SPOTD_PID=$!
+sleep 1
+
+"$BIN_DIR/spotd-check" -p "$PORT" -H "$HTTP_PORT"
+RESULT=$?
+
+kill -INT "$SPOTD_PID" 2> /dev/null
+wait "$SPOTD_PID"
+SPOTD_RESULT=$?
+
+if [ "$SPOTD_RESULT" -ne 0 ] || grep -q "AddressSanitizer" "$LOG"; then
+  echo "spotd failed, exit status $SPOTD_RESULT:"
+  cat "$LOG"
+  RESULT=1
+fi
+
+rm -rf "$WORK_DIR"
+exit $RESULT
@@ -0,0 +1,1305 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+/*
+ * A deterministic stand-in for libspotify, implementing the part of the API
+ * spotd uses, so that spotd can be run without a Spotify account, network or
+ * sound of its own. Build spotd against it with "make fake".
+ *
+ * It is configured with environment variables, read when the session is
+ * created:
+ *
+ *   FAKESPOTIFY_RATE         Sample rate of the audio delivered, 44100
+ *   FAKESPOTIFY_CHANNELS     Channels of the audio delivered, 2
+ *   FAKESPOTIFY_CHUNK        Frames delivered per music_delivery call, 2048
+ *   FAKESPOTIFY_SPEED        Seconds of audio delivered per second, 1. 0
+ *                            delivers as fast as spotd takes it.
+ *   FAKESPOTIFY_TRACK_MS     Duration of tracks that do not give one, 180000
+ *   FAKESPOTIFY_METADATA_MS  Time tracks, playlists and searches take to
+ *                            load, 0
+ *   FAKESPOTIFY_LOGIN_MS     Time logging in takes, 0
+ *   FAKESPOTIFY_PLAYLISTS    Number of playlists of the user, 3
+ *   FAKESPOTIFY_REVOKED      Non-zero to refuse the stored credentials, 0
+ *   FAKESPOTIFY_CONTROL      Path of a FIFO to read commands from, created if
+ *                            missing
+ *
+ * Any track link is valid. spotify:track:<id>_<ms> lasts <ms> milliseconds,
+ * tracks whose id starts with "error" can not be played. Playlist links
+ * spotify:playlist:<id>_<n> have <n> tracks, 10 if not given. The user's
+ * playlists are spotify:playlist:user<index>_10. Searches find 1000 tracks,
+ * named after the query, and fail for queries starting with "error". Users
+ * whose name starts with "error" can not log in.
+ *
+ * The audio is a quiet sawtooth that follows the position in the track, so
+ * that gaps and repeats can be found in what spotd plays.
+ *
+ * Commands read from the control FIFO, one per line:
+ *
+ *   end              End the playing track now
+ *   token_lost       Report that the play token was lost, pausing playback
+ *   metadata <ms>    Change the time tracks, playlists and searches take to
+ *                    load
+ *   stall <ms>       Deliver no audio for a while, like a stalled network
+ *
+ * There is a single session, as with libspotify. The callbacks are called
+ * from the same threads as libspotify calls them: music_delivery,
+ * end_of_track and notify_main_thread from the player thread of the fake,
+ * the others from sp_session_process_events().
+ */
+
+#include <libspotify/api.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* --- Constants --- */
+#define FAKE_ID_MAX 128
+#define FAKE_NAME_MAX 256
+#define FAKE_LINK_MAX 256
+#define FAKE_PATH_MAX 512
+#define FAKE_CONTROL_MAX 256
+// Tracks of playlists that give no number of tracks
+#define FAKE_PLAYLIST_TRACKS 10
+// Tracks found by every search
+#define FAKE_SEARCH_RESULTS 1000
+// Size of a synced track, for the offline sync status
+#define FAKE_TRACK_BYTES 4000000
+// Longest time sp_session_process_events() asks to be called again in
+#define FAKE_MAX_TIMEOUT_MS 1000
+// Interval the player thread checks for events when not delivering audio
+#define FAKE_POLL_MS 5
+// File in the settings directory that remembers the user
+#define FAKE_USER_FILE "fakespotify-user"
+
+/* --- Types --- */
+struct sp_track {
+  int refs;
+  char id[FAKE_ID_MAX];
+  char name[FAKE_NAME_MAX];
+  int duration_ms;
+  int64_t ready_ms;  // Time the metadata is loaded
+  int playable;
+  sp_track *next;    // Live tracks, see find_track()
+};
+
+struct sp_link {
+  int refs;
+  sp_linktype type;
+  char text[FAKE_LINK_MAX];
+  sp_track *track;   // For track links
+};
+
+struct sp_artist {
+  const char *name;
+};
+
+struct sp_playlist {
+  int refs;
+  char link[FAKE_LINK_MAX];
+  char id[FAKE_ID_MAX];
+  int num_tracks;
+  sp_track **tracks;  // Created when first asked for
+  int64_t ready_ms;
+  int loaded;         // Set once playlist_state_changed was called
+  int offline;
+  sp_playlist_callbacks *callbacks;
+  void *userdata;
+  sp_playlist *next;  // Playlists waiting to load
+};
+
+struct sp_playlistcontainer {
+  int num_playlists;
+  sp_playlist **playlists;
+};
+
+struct sp_search {
+  char query[FAKE_NAME_MAX];
+  int offset;
+  int count;
+  sp_track **tracks;
+  int num_tracks;
+  int64_t ready_ms;
+  int loaded;
+  sp_error error;
+  search_complete_cb *callback;
+  void *userdata;
+  sp_search *next;    // Searches waiting to complete
+};
+
+struct sp_session {
+  sp_session_callbacks callbacks;
+  char settings[FAKE_PATH_MAX];
+
+  // Configuration
+  int rate;
+  int channels;
+  int chunk;
+  int speed;
+  int track_ms;
+  int metadata_ms;
+  int login_ms;
+  int revoked;
+
+  pthread_t thread;
+  pthread_mutex_t mutex;  // Protects everything below
+  int stop;
+
+  // Events for sp_session_process_events()
+  int64_t login_ms_due;   // 0 if not logging in
+  sp_error login_error;
+  int token_lost;
+  int metadata_pending;   // Tracks are loading
+  int offline_changed;
+  int64_t next_due_ms;    // Earliest event, INT64_MAX if none
+  int notified;           // notify_main_thread was called for the event
+  sp_playlist *loading_playlists;
+  sp_search *searches;
+
+  // The player
+  sp_track *track;
+  int playing;
+  int64_t position;       // Frames delivered of the track
+  int64_t end_position;   // Frames in the track
+  int64_t next_delivery_us;
+  int64_t stall_until_ms;
+  int16_t *samples;
+
+  // Control FIFO
+  int control_fd;
+  char control[FAKE_CONTROL_MAX];
+  size_t control_length;
+
+  sp_bitrate bitrate;
+  sp_playlistcontainer container;
+};
+
+/* --- Globals --- */
+// libspotify refuses to start without an application key. spotd links it
+// from appkey.c, which is not needed with the fake.
+const uint8_t g_appkey[] = { 0 };
+const size_t g_appkey_size = sizeof(g_appkey);
+
+static sp_session *g_session;
+static sp_track *g_tracks;
+static pthread_mutex_t g_tracks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sp_artist g_artist = { "Fake Artist" };
+
+/* --------------------------------  HELPERS  ------------------------------ */
+
+static int64_t now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t now_ms(void) {
+  return now_us() / 1000;
+}
+
+/**
+ * Read a number from the environment
+ *
+ * @param  name  The variable
+ * @param  fallback  The value if it is not set or not a number
+ * @return  The value
+ */
+static int env_int(const char *name, int fallback) {
+  const char *value = getenv(name);
+  char *end;
+  long n;
+
+  if (value == NULL || *value == '\0') {
+    return fallback;
+  }
+
+  n = strtol(value, &end, 10);
+
+  return *end == '\0' && n >= 0 && n <= INT_MAX ? (int) n : fallback;
+}
+
+/**
+ * Get the number at the end of an id, after the last underscore
+ *
+ * @param  id  The id
+ * @param  fallback  The value if the id does not end in a number
+ * @return  The number
+ */
+static int id_number(const char *id, int fallback) {
+  const char *underscore = strrchr(id, '_');
+  char *end;
+  long n;
+
+  if (underscore == NULL || underscore[1] == '\0') {
+    return fallback;
+  }
+
+  n = strtol(underscore + 1, &end, 10);
+
+  return *end == '\0' && n > 0 && n <= INT_MAX ? (int) n : fallback;
+}
+
+/**
+ * Make an event due. The caller holds the session mutex.
+ *
+ * @param  session  The session
+ * @param  due_ms  Time the event is due
+ */
+static void schedule(sp_session *session, int64_t due_ms) {
+  if (due_ms < session->next_due_ms) {
+    session->next_due_ms = due_ms;
+    session->notified = 0;
+  }
+}
+
+/**
+ * Get a track by its id. Tracks are shared, like in libspotify.
+ *
+ * @param  id  The track id
+ * @param  name  The track name, NULL to name it after the id
+ * @return  The track, with a reference taken
+ */
+static sp_track *find_track(const char *id, const char *name) {
+  sp_track *track;
+  int metadata_ms = g_session != NULL ? g_session->metadata_ms : 0;
+
+  pthread_mutex_lock(&g_tracks_mutex);
+
+  for (track = g_tracks; track != NULL; track = track->next) {
+    if (strcmp(track->id, id) == 0) {
+      track->refs++;
+      pthread_mutex_unlock(&g_tracks_mutex);
+      return track;
+    }
+  }
+
+  track = calloc(1, sizeof(sp_track));
+  track->refs = 1;
+  snprintf(track->id, sizeof(track->id), "%s", id);
+  snprintf(track->name, sizeof(track->name), "%s", name != NULL ? name : id);
+  track->duration_ms = id_number(id, g_session != NULL ? g_session->track_ms : 180000);
+  track->playable = strncmp(id, "error", 5) != 0;
+  track->ready_ms = now_ms() + metadata_ms;
+  track->next = g_tracks;
+  g_tracks = track;
+
+  pthread_mutex_unlock(&g_tracks_mutex);
+
+  if (metadata_ms > 0 && g_session != NULL) {
+    pthread_mutex_lock(&g_session->mutex);
+    g_session->metadata_pending = 1;
+    schedule(g_session, track->ready_ms);
+    pthread_mutex_unlock(&g_session->mutex);
+  }
+
+  return track;
+}
+
+/* ------------------------------  THE PLAYER  ----------------------------- */
+
+/**
+ * Fill the sample buffer with the audio at a position in the track
+ *
+ * @param  session  The session
+ * @param  position  The first frame
+ * @param  frames  The number of frames
+ */
+static void synthesize(sp_session *session, int64_t position, int frames) {
+  int i, c;
+  int16_t value;
+
+  for (i = 0; i < frames; i++) {
+    value = (int16_t) ((((position + i) * 64) & 0xffff) - 32768) / 8;
+    for (c = 0; c < session->channels; c++) {
+      session->samples[i * session->channels + c] = value;
+    }
+  }
+}
+
+/**
+ * Execute a command read from the control FIFO. The caller holds the
+ * session mutex.
+ *
+ * @param  session  The session
+ * @param  command  The command, without the newline
+ */
+static void control_command(sp_session *session, const char *command) {
+  if (strcmp(command, "end") == 0) {
+    session->position = session->end_position;
+  } else if (strcmp(command, "token_lost") == 0) {
+    session->token_lost = 1;
+    schedule(session, now_ms());
+  } else if (strncmp(command, "metadata ", 9) == 0) {
+    session->metadata_ms = atoi(command + 9);
+  } else if (strncmp(command, "stall ", 6) == 0) {
+    session->stall_until_ms = now_ms() + atoi(command + 6);
+  } else if (command[0] != '\0') {
+    fprintf(stderr, "fakespotify: Unknown control command \"%s\"\n", command);
+  }
+}
+
+/**
+ * Read commands from the control FIFO. The caller holds the session mutex.
+ *
+ * @param  session  The session
+ */
+static void read_control(sp_session *session) {
+  char *newline;
+  ssize_t n;
+
+  if (session->control_fd < 0) {
+    return;
+  }
+
+  n = read(session->control_fd, session->control + session->control_length,
+           sizeof(session->control) - session->control_length - 1);
+  if (n <= 0) {
+    return;
+  }
+
+  session->control_length += n;
+  session->control[session->control_length] = '\0';
+
+  while ((newline = strchr(session->control, '\n')) != NULL) {
+    *newline = '\0';
+    control_command(session, session->control);
+    session->control_length -= newline + 1 - session->control;
+    memmove(session->control, newline + 1, session->control_length + 1);
+  }
+
+  // A line too long for the buffer is dropped
+  if (session->control_length == sizeof(session->control) - 1) {
+    session->control_length = 0;
+  }
+}
+
+/**
+ * Deliver the next chunk of audio of the playing track. The caller holds
+ * the session mutex.
+ *
+ * @param  session  The session
+ * @return  Non-zero if the track ended
+ */
+static int deliver(sp_session *session) {
+  sp_audioformat format;
+  int64_t frames;
+  int delivered;
+
+  frames = session->end_position - session->position;
+  if (frames <= 0) {
+    return 1;
+  }
+  if (frames > session->chunk) {
+    frames = session->chunk;
+  }
+
+  format.sample_type = SP_SAMPLETYPE_INT16_NATIVE_ENDIAN;
+  format.sample_rate = session->rate;
+  format.channels = session->channels;
+
+  synthesize(session, session->position, (int) frames);
+  delivered = session->callbacks.music_delivery(session, &format, session->samples,
+                                                (int) frames);
+  session->position += delivered;
+
+  // Paced at the configured speed. Time lost while spotd did not take the
+  // audio is not made up for.
+  if (delivered > 0 && session->speed > 0) {
+    if (session->next_delivery_us < now_us() - 100000) {
+      session->next_delivery_us = now_us();
+    }
+    session->next_delivery_us += (int64_t) delivered * 1000000 / session->rate / session->speed;
+  } else if (delivered == 0) {
+    session->next_delivery_us = now_us() + FAKE_POLL_MS * 1000;
+  }
+
+  return session->position >= session->end_position;
+}
+
+/**
+ * The player thread of the fake, delivering audio and waking up the main
+ * thread when events are due
+ *
+ * @param  arg  The session
+ */
+static void *player_thread(void *arg) {
+  sp_session *session = arg;
+  int64_t wait_us;
+  int ended, notify;
+
+  pthread_mutex_lock(&session->mutex);
+
+  while (!session->stop) {
+    read_control(session);
+
+    ended = 0;
+    if (session->track != NULL && session->playing && now_ms() >= session->stall_until_ms &&
+        now_us() >= session->next_delivery_us) {
+      ended = deliver(session);
+      if (ended) {
+        session->playing = 0;
+      }
+    }
+
+    notify = !session->notified && now_ms() >= session->next_due_ms;
+    if (notify) {
+      session->notified = 1;
+    }
+
+    // Wait until the next chunk is due, or poll for events
+    wait_us = FAKE_POLL_MS * 1000;
+    if (session->track != NULL && session->playing) {
+      wait_us = session->next_delivery_us - now_us();
+      if (wait_us > FAKE_POLL_MS * 1000) {
+        wait_us = FAKE_POLL_MS * 1000;
+      }
+    }
+
+    pthread_mutex_unlock(&session->mutex);
+
+    if (ended) {
+      session->callbacks.end_of_track(session);
+    }
+    if (notify) {
+      session->callbacks.notify_main_thread(session);
+    }
+    if (wait_us > 0) {
+      usleep((useconds_t) wait_us);
+    }
+
+    pthread_mutex_lock(&session->mutex);
+  }
+
+  pthread_mutex_unlock(&session->mutex);
+
+  return NULL;
+}
+
+/* -------------------------------  SESSION  ------------------------------- */
+
+const char *sp_error_message(sp_error error) {
+  switch (error) {
+  case SP_ERROR_OK:
+    return "No error";
+  case SP_ERROR_BAD_API_VERSION:
+    return "Invalid API version";
+  case SP_ERROR_BAD_USERNAME_OR_PASSWORD:
+    return "Invalid username or password";
+  case SP_ERROR_OTHER_PERMANENT:
+    return "Unknown permanent error";
+  case SP_ERROR_OTHER_TRANSIENT:
+    return "Unknown transient error";
+  case SP_ERROR_INVALID_INDATA:
+    return "Invalid input";
+  case SP_ERROR_IS_LOADING:
+    return "Resource not loaded yet";
+  case SP_ERROR_NO_CREDENTIALS:
+    return "No credentials stored";
+  case SP_ERROR_TRACK_NOT_PLAYABLE:
+    return "Track not playable";
+  default:
+    return "Unknown error";
+  }
+}
+
+sp_error sp_session_create(const sp_session_config *config, sp_session **sess) {
+  sp_session *session;
+  const char *control;
+
+  if (config->api_version != SPOTIFY_API_VERSION) {
+    return SP_ERROR_BAD_API_VERSION;
+  }
+  if (g_session != NULL) {
+    return SP_ERROR_API_INITIALIZATION_FAILED;
+  }
+
+  session = calloc(1, sizeof(sp_session));
+  session->callbacks = *config->callbacks;
+  snprintf(session->settings, sizeof(session->settings), "%s",
+           config->settings_location != NULL ? config->settings_location : ".");
+
+  session->rate = env_int("FAKESPOTIFY_RATE", 44100);
+  session->channels = env_int("FAKESPOTIFY_CHANNELS", 2);
+  session->chunk = env_int("FAKESPOTIFY_CHUNK", 2048);
+  session->speed = env_int("FAKESPOTIFY_SPEED", 1);
+  session->track_ms = env_int("FAKESPOTIFY_TRACK_MS", 180000);
+  session->metadata_ms = env_int("FAKESPOTIFY_METADATA_MS", 0);
+  session->login_ms = env_int("FAKESPOTIFY_LOGIN_MS", 0);
+  session->revoked = env_int("FAKESPOTIFY_REVOKED", 0);
+  session->container.num_playlists = env_int("FAKESPOTIFY_PLAYLISTS", 3);
+
+  if (session->rate == 0 || session->channels == 0 || session->chunk == 0) {
+    free(session);
+    return SP_ERROR_INVALID_ARGUMENT;
+  }
+
+  session->samples = malloc((size_t) session->chunk * session->channels * sizeof(int16_t));
+  session->next_due_ms = INT64_MAX;
+  session->control_fd = -1;
+
+  if ((control = getenv("FAKESPOTIFY_CONTROL")) != NULL && *control != '\0') {
+    if (mkfifo(control, 0600) < 0 && errno != EEXIST) {
+      perror("fakespotify: Creating the control FIFO failed");
+    }
+    // Opened for writing too, so that reads do not see the end of the file
+    // while no writer has it open
+    session->control_fd = open(control, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (session->control_fd < 0) {
+      perror("fakespotify: Opening the control FIFO failed");
+    }
+  }
+
+  pthread_mutex_init(&session->mutex, NULL);
+  g_session = session;
+  pthread_create(&session->thread, NULL, player_thread, session);
+
+  *sess = session;
+  return SP_ERROR_OK;
+}
+
+sp_error sp_session_release(sp_session *session) {
+  int i;
+
+  pthread_mutex_lock(&session->mutex);
+  session->stop = 1;
+  pthread_mutex_unlock(&session->mutex);
+  pthread_join(session->thread, NULL);
+
+  if (session->track != NULL) {
+    sp_track_release(session->track);
+  }
+  for (i = 0; session->container.playlists != NULL && i < session->container.num_playlists;
+       i++) {
+    sp_playlist_release(session->container.playlists[i]);
+  }
+  free(session->container.playlists);
+  if (session->control_fd >= 0) {
+    close(session->control_fd);
+  }
+
+  g_session = NULL;
+  free(session->samples);
+  free(session);
+
+  return SP_ERROR_OK;
+}
+
+/**
+ * Start logging in. logged_in is called once FAKESPOTIFY_LOGIN_MS passed.
+ */
+static void start_login(sp_session *session, const char *username, int relogin) {
+  pthread_mutex_lock(&session->mutex);
+  session->login_error = strncmp(username, "error", 5) == 0 || (relogin && session->revoked) ?
+                         SP_ERROR_BAD_USERNAME_OR_PASSWORD : SP_ERROR_OK;
+  session->login_ms_due = now_ms() + session->login_ms;
+  schedule(session, session->login_ms_due);
+  pthread_mutex_unlock(&session->mutex);
+}
+
+sp_error sp_session_login(sp_session *session, const char *username, const char *password,
+                          bool remember_me, const char *blob) {
+  char path[FAKE_PATH_MAX + sizeof(FAKE_USER_FILE) + 1];
+  FILE *file;
+
+  if (remember_me && strncmp(username, "error", 5) != 0) {
+    snprintf(path, sizeof(path), "%s/%s", session->settings, FAKE_USER_FILE);
+    if ((file = fopen(path, "w")) != NULL) {
+      fputs(username, file);
+      fclose(file);
+    }
+  }
+
+  start_login(session, username, 0);
+
+  return SP_ERROR_OK;
+}
+
+int sp_session_remembered_user(sp_session *session, char *buffer, size_t buffer_size) {
+  char path[FAKE_PATH_MAX + sizeof(FAKE_USER_FILE) + 1];
+  char username[FAKE_NAME_MAX];
+  FILE *file;
+  size_t length;
+
+  snprintf(path, sizeof(path), "%s/%s", session->settings, FAKE_USER_FILE);
+  if ((file = fopen(path, "r")) == NULL) {
+    return -1;
+  }
+
+  length = fread(username, 1, sizeof(username) - 1, file);
+  username[length] = '\0';
+  fclose(file);
+
+  if (buffer != NULL && buffer_size > 0) {
+    snprintf(buffer, buffer_size, "%s", username);
+  }
+
+  return (int) length;
+}
+
+sp_error sp_session_relogin(sp_session *session) {
+  char username[FAKE_NAME_MAX];
+
+  if (sp_session_remembered_user(session, username, sizeof(username)) < 0) {
+    return SP_ERROR_NO_CREDENTIALS;
+  }
+
+  start_login(session, username, 1);
+
+  return SP_ERROR_OK;
+}
+
+sp_error sp_session_logout(sp_session *session) {
+  return SP_ERROR_OK;
+}
+
+sp_error sp_session_process_events(sp_session *session, int *next_timeout) {
+  sp_playlist *playlist, **playlist_link;
+  sp_search *search, **search_link;
+  int64_t now = now_ms(), next_due = INT64_MAX;
+  sp_track *track;
+  sp_error login_error;
+  int logged_in = 0, token_lost, metadata_updated = 0, offline_changed;
+
+  pthread_mutex_lock(&session->mutex);
+
+  if (session->login_ms_due != 0) {
+    if (now >= session->login_ms_due) {
+      session->login_ms_due = 0;
+      logged_in = 1;
+      login_error = session->login_error;
+    } else {
+      next_due = session->login_ms_due;
+    }
+  }
+
+  token_lost = session->token_lost;
+  if (token_lost) {
+    session->token_lost = 0;
+    session->playing = 0;
+  }
+
+  offline_changed = session->offline_changed;
+  session->offline_changed = 0;
+
+  if (session->metadata_pending) {
+    session->metadata_pending = 0;
+    pthread_mutex_lock(&g_tracks_mutex);
+    for (track = g_tracks; track != NULL; track = track->next) {
+      if (track->ready_ms > now) {
+        session->metadata_pending = 1;
+        if (track->ready_ms < next_due) {
+          next_due = track->ready_ms;
+        }
+      } else if (track->ready_ms > now - FAKE_MAX_TIMEOUT_MS) {
+        metadata_updated = 1;
+      }
+    }
+    pthread_mutex_unlock(&g_tracks_mutex);
+  }
+
+  // Playlists and searches that are ready are taken off their lists here,
+  // and their callbacks called below, without the mutex
+  playlist = NULL;
+  for (playlist_link = &session->loading_playlists; *playlist_link != NULL; ) {
+    if ((*playlist_link)->ready_ms <= now) {
+      sp_playlist *ready = *playlist_link;
+      *playlist_link = ready->next;
+      ready->next = playlist;
+      playlist = ready;
+    } else {
+      if ((*playlist_link)->ready_ms < next_due) {
+        next_due = (*playlist_link)->ready_ms;
+      }
+      playlist_link = &(*playlist_link)->next;
+    }
+  }
+
+  search = NULL;
+  for (search_link = &session->searches; *search_link != NULL; ) {
+    if ((*search_link)->ready_ms <= now) {
+      sp_search *ready = *search_link;
+      *search_link = ready->next;
+      ready->next = search;
+      search = ready;
+    } else {
+      if ((*search_link)->ready_ms < next_due) {
+        next_due = (*search_link)->ready_ms;
+      }
+      search_link = &(*search_link)->next;
+    }
+  }
+
+  session->next_due_ms = INT64_MAX;
+  schedule(session, next_due);
+
+  pthread_mutex_unlock(&session->mutex);
+
+  if (logged_in && session->callbacks.logged_in != NULL) {
+    session->callbacks.logged_in(session, login_error);
+  }
+  if (token_lost && session->callbacks.play_token_lost != NULL) {
+    session->callbacks.play_token_lost(session);
+  }
+  if (metadata_updated && session->callbacks.metadata_updated != NULL) {
+    session->callbacks.metadata_updated(session);
+  }
+  if (offline_changed && session->callbacks.offline_status_updated != NULL) {
+    session->callbacks.offline_status_updated(session);
+  }
+
+  while (playlist != NULL) {
+    sp_playlist *ready = playlist;
+    playlist = ready->next;
+    ready->next = NULL;
+    ready->loaded = 1;
+    if (ready->callbacks != NULL && ready->callbacks->playlist_state_changed != NULL) {
+      ready->callbacks->playlist_state_changed(ready, ready->userdata);
+    }
+    sp_playlist_release(ready);
+  }
+
+  while (search != NULL) {
+    sp_search *ready = search;
+    search = ready->next;
+    ready->next = NULL;
+    ready->loaded = 1;
+    ready->callback(ready, ready->userdata);
+  }
+
+  *next_timeout = FAKE_MAX_TIMEOUT_MS;
+  if (next_due != INT64_MAX) {
+    now = now_ms();
+    *next_timeout = next_due <= now ? 0 :
+                    next_due - now < FAKE_MAX_TIMEOUT_MS ? (int) (next_due - now) :
+                    FAKE_MAX_TIMEOUT_MS;
+  }
+
+  return SP_ERROR_OK;
+}
+
+sp_error sp_session_player_load(sp_session *session, sp_track *track) {
+  if (!sp_track_is_loaded(track)) {
+    return SP_ERROR_IS_LOADING;
+  }
+  if (!track->playable) {
+    return SP_ERROR_TRACK_NOT_PLAYABLE;
+  }
+
+  sp_track_add_ref(track);
+
+  pthread_mutex_lock(&session->mutex);
+  if (session->track != NULL) {
+    sp_track_release(session->track);
+  }
+  session->track = track;
+  session->playing = 0;
+  session->position = 0;
+  session->end_position = (int64_t) track->duration_ms * session->rate / 1000;
+  session->next_delivery_us = 0;
+  pthread_mutex_unlock(&session->mutex);
+
+  return SP_ERROR_OK;
+}
+
+sp_error sp_session_player_seek(sp_session *session, int offset) {
+  pthread_mutex_lock(&session->mutex);
+  session->position = (int64_t) offset * session->rate / 1000;
+  pthread_mutex_unlock(&session->mutex);
+
+  return SP_ERROR_OK;
+}
+
+sp_error sp_session_player_play(sp_session *session, bool play) {
+  pthread_mutex_lock(&session->mutex);
+  session->playing = play && session->track != NULL;
+  pthread_mutex_unlock(&session->mutex);
+
+  return SP_ERROR_OK;
+}
+
+sp_error sp_session_player_unload(sp_session *session) {
+  sp_track *track;
+
+  pthread_mutex_lock(&session->mutex);
+  track = session->track;
+  session->track = NULL;
+  session->playing = 0;
+  pthread_mutex_unlock(&session->mutex);
+
+  if (track != NULL) {
+    sp_track_release(track);
+  }
+
+  return SP_ERROR_OK;
+}
+
+sp_error sp_session_player_prefetch(sp_session *session, sp_track *track) {
+  return sp_track_is_loaded(track) ? SP_ERROR_OK : SP_ERROR_IS_LOADING;
+}
+
+sp_error sp_session_preferred_bitrate(sp_session *session, sp_bitrate bitrate) {
+  session->bitrate = bitrate;
+  return SP_ERROR_OK;
+}
+
+sp_error sp_session_preferred_offline_bitrate(sp_session *session, sp_bitrate bitrate,
+                                              bool allow_resync) {
+  return SP_ERROR_OK;
+}
+
+sp_error sp_session_set_cache_size(sp_session *session, size_t size) {
+  return SP_ERROR_OK;
+}
+
+/* -------------------------------  OFFLINE  ------------------------------- */
+
+int sp_offline_num_playlists(sp_session *session) {
+  int i, count = 0;
+
+  for (i = 0; session->container.playlists != NULL && i < session->container.num_playlists;
+       i++) {
+    count += session->container.playlists[i]->offline;
+  }
+
+  return count;
+}
+
+/**
+ * Tracks of the playlists marked for offline sync are synced at once
+ */
+bool sp_offline_sync_get_status(sp_session *session, sp_offline_sync_status *status) {
+  int i;
+
+  memset(status, 0, sizeof(sp_offline_sync_status));
+
+  for (i = 0; session->container.playlists != NULL && i < session->container.num_playlists;
+       i++) {
+    if (session->container.playlists[i]->offline) {
+      status->done_tracks += session->container.playlists[i]->num_tracks;
+    }
+  }
+  status->done_bytes = (uint64_t) status->done_tracks * FAKE_TRACK_BYTES;
+
+  return status->done_tracks > 0;
+}
+
+/* --------------------------------  LINKS  -------------------------------- */
+
+sp_link *sp_link_create_from_string(const char *text) {
+  sp_link *link;
+
+  if (strncmp(text, "spotify:track:", 14) == 0 && text[14] != '\0' &&
+      strlen(text + 14) < FAKE_ID_MAX) {
+    link = calloc(1, sizeof(sp_link));
+    link->type = SP_LINKTYPE_TRACK;
+    link->track = find_track(text + 14, NULL);
+  } else if ((strncmp(text, "spotify:playlist:", 17) == 0 && text[17] != '\0') ||
+             (strncmp(text, "spotify:user:", 13) == 0 && strstr(text, ":playlist:") != NULL)) {
+    link = calloc(1, sizeof(sp_link));
+    link->type = SP_LINKTYPE_PLAYLIST;
+  } else {
+    return NULL;
+  }
+
+  link->refs = 1;
+  snprintf(link->text, sizeof(link->text), "%s", text);
+
+  return link;
+}
+
+sp_link *sp_link_create_from_track(sp_track *track, int offset) {
+  sp_link *link = calloc(1, sizeof(sp_link));
+
+  link->refs = 1;
+  link->type = SP_LINKTYPE_TRACK;
+  link->track = track;
+  sp_track_add_ref(track);
+  snprintf(link->text, sizeof(link->text), "spotify:track:%s", track->id);
+
+  return link;
+}
+
+sp_link *sp_link_create_from_playlist(sp_playlist *playlist) {
+  sp_link *link = calloc(1, sizeof(sp_link));
+
+  link->refs = 1;
+  link->type = SP_LINKTYPE_PLAYLIST;
+  snprintf(link->text, sizeof(link->text), "%s", playlist->link);
+
+  return link;
+}
+
+int sp_link_as_string(sp_link *link, char *buffer, int buffer_size) {
+  return snprintf(buffer, buffer_size, "%s", link->text);
+}
+
+sp_linktype sp_link_type(sp_link *link) {
+  return link->type;
+}
+
+sp_track *sp_link_as_track(sp_link *link) {
+  return link->track;
+}
+
+sp_error sp_link_add_ref(sp_link *link) {
+  __atomic_add_fetch(&link->refs, 1, __ATOMIC_RELAXED);
+  return SP_ERROR_OK;
+}
+
+sp_error sp_link_release(sp_link *link) {
+  if (__atomic_sub_fetch(&link->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    if (link->track != NULL) {
+      sp_track_release(link->track);
+    }
+    free(link);
+  }
+
+  return SP_ERROR_OK;
+}
+
+/* --------------------------  TRACKS AND ARTISTS  ------------------------- */
+
+bool sp_track_is_loaded(sp_track *track) {
+  return now_ms() >= track->ready_ms;
+}
+
+sp_error sp_track_error(sp_track *track) {
+  if (!sp_track_is_loaded(track)) {
+    return SP_ERROR_IS_LOADING;
+  }
+
+  return track->playable ? SP_ERROR_OK : SP_ERROR_OTHER_PERMANENT;
+}
+
+const char *sp_track_name(sp_track *track) {
+  return sp_track_is_loaded(track) ? track->name : "";
+}
+
+int sp_track_duration(sp_track *track) {
+  return sp_track_is_loaded(track) ? track->duration_ms : 0;
+}
+
+int sp_track_num_artists(sp_track *track) {
+  return sp_track_is_loaded(track) ? 1 : 0;
+}
+
+sp_artist *sp_track_artist(sp_track *track, int index) {
+  return index == 0 ? &g_artist : NULL;
+}
+
+sp_error sp_track_add_ref(sp_track *track) {
+  pthread_mutex_lock(&g_tracks_mutex);
+  track->refs++;
+  pthread_mutex_unlock(&g_tracks_mutex);
+
+  return SP_ERROR_OK;
+}
+
+sp_error sp_track_release(sp_track *track) {
+  sp_track **link;
+
+  pthread_mutex_lock(&g_tracks_mutex);
+
+  if (--track->refs == 0) {
+    for (link = &g_tracks; *link != NULL; link = &(*link)->next) {
+      if (*link == track) {
+        *link = track->next;
+        break;
+      }
+    }
+    free(track);
+  }
+
+  pthread_mutex_unlock(&g_tracks_mutex);
+
+  return SP_ERROR_OK;
+}
+
+const char *sp_artist_name(sp_artist *artist) {
+  return artist->name;
+}
+
+/* -------------------------------  SEARCHES  ------------------------------ */
+
+sp_search *sp_search_create(sp_session *session, const char *query, int track_offset,
+                            int track_count, int album_offset, int album_count,
+                            int artist_offset, int artist_count, int playlist_offset,
+                            int playlist_count, sp_search_type search_type,
+                            search_complete_cb *callback, void *userdata) {
+  sp_search *search = calloc(1, sizeof(sp_search));
+  char id[FAKE_ID_MAX], name[FAKE_NAME_MAX];
+  int i, j;
+
+  snprintf(search->query, sizeof(search->query), "%s", query);
+  search->offset = track_offset;
+  search->callback = callback;
+  search->userdata = userdata;
+  search->error = strncmp(query, "error", 5) == 0 ? SP_ERROR_OTHER_TRANSIENT : SP_ERROR_OK;
+
+  if (search->error == SP_ERROR_OK && track_offset < FAKE_SEARCH_RESULTS) {
+    search->num_tracks = FAKE_SEARCH_RESULTS - track_offset;
+    if (search->num_tracks > track_count) {
+      search->num_tracks = track_count;
+    }
+    search->tracks = calloc(search->num_tracks, sizeof(sp_track *));
+
+    for (i = 0; i < search->num_tracks; i++) {
+      // Track ids are made of the query, without characters links can not
+      // have
+      snprintf(id, sizeof(id), "search-%.64s-%d", query, track_offset + i);
+      for (j = 0; id[j] != '\0'; j++) {
+        if (id[j] == ' ' || id[j] == ':' || id[j] == '\n') {
+          id[j] = '-';
+        }
+      }
+      snprintf(name, sizeof(name), "%.200s %d", query, track_offset + i);
+      search->tracks[i] = find_track(id, name);
+    }
+  }
+
+  pthread_mutex_lock(&session->mutex);
+  search->ready_ms = now_ms() + session->metadata_ms;
+  search->next = session->searches;
+  session->searches = search;
+  schedule(session, search->ready_ms);
+  pthread_mutex_unlock(&session->mutex);
+
+  return search;
+}
+
+bool sp_search_is_loaded(sp_search *search) {
+  return search->loaded;
+}
+
+sp_error sp_search_error(sp_search *search) {
+  return search->loaded ? search->error : SP_ERROR_IS_LOADING;
+}
+
+int sp_search_num_tracks(sp_search *search) {
+  return search->loaded ? search->num_tracks : 0;
+}
+
+sp_track *sp_search_track(sp_search *search, int index) {
+  return search->loaded && index >= 0 && index < search->num_tracks ?
+         search->tracks[index] : NULL;
+}
+
+int sp_search_total_tracks(sp_search *search) {
+  return search->loaded && search->error == SP_ERROR_OK ? FAKE_SEARCH_RESULTS : 0;
+}
+
+sp_error sp_search_release(sp_search *search) {
+  sp_search **link;
+  int i;
+
+  // A search released before it completed never calls back
+  if (g_session != NULL) {
+    pthread_mutex_lock(&g_session->mutex);
+    for (link = &g_session->searches; *link != NULL; link = &(*link)->next) {
+      if (*link == search) {
+        *link = search->next;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&g_session->mutex);
+  }
+
+  for (i = 0; i < search->num_tracks; i++) {
+    sp_track_release(search->tracks[i]);
+  }
+  free(search->tracks);
+  free(search);
+
+  return SP_ERROR_OK;
+}
+
+/* ------------------------------  PLAYLISTS  ------------------------------ */
+
+/**
+ * Create a playlist
+ *
+ * @param  session  The session
+ * @param  link  The playlist link
+ * @param  delay_ms  Time it takes to load
+ * @return  The playlist, with a reference taken
+ */
+static sp_playlist *create_playlist(sp_session *session, const char *link, int delay_ms) {
+  sp_playlist *playlist = calloc(1, sizeof(sp_playlist));
+  const char *id = strrchr(link, ':') + 1;
+
+  playlist->refs = 1;
+  snprintf(playlist->link, sizeof(playlist->link), "%s", link);
+  snprintf(playlist->id, sizeof(playlist->id), "%s", id);
+  playlist->num_tracks = id_number(id, FAKE_PLAYLIST_TRACKS);
+  playlist->tracks = calloc(playlist->num_tracks, sizeof(sp_track *));
+  playlist->ready_ms = now_ms() + delay_ms;
+
+  // Kept alive until it has loaded and called back
+  if (delay_ms > 0) {
+    playlist->refs++;
+    pthread_mutex_lock(&session->mutex);
+    playlist->next = session->loading_playlists;
+    session->loading_playlists = playlist;
+    schedule(session, playlist->ready_ms);
+    pthread_mutex_unlock(&session->mutex);
+  } else {
+    playlist->loaded = 1;
+  }
+
+  return playlist;
+}
+
+sp_playlist *sp_playlist_create(sp_session *session, sp_link *link) {
+  if (link->type != SP_LINKTYPE_PLAYLIST) {
+    return NULL;
+  }
+
+  return create_playlist(session, link->text, session->metadata_ms);
+}
+
+bool sp_playlist_is_loaded(sp_playlist *playlist) {
+  return playlist->loaded;
+}
+
+sp_error sp_playlist_add_callbacks(sp_playlist *playlist, sp_playlist_callbacks *callbacks,
+                                   void *userdata) {
+  playlist->callbacks = callbacks;
+  playlist->userdata = userdata;
+  return SP_ERROR_OK;
+}
+
+sp_error sp_playlist_remove_callbacks(sp_playlist *playlist, sp_playlist_callbacks *callbacks,
+                                      void *userdata) {
+  if (playlist->callbacks == callbacks && playlist->userdata == userdata) {
+    playlist->callbacks = NULL;
+  }
+  return SP_ERROR_OK;
+}
+
+int sp_playlist_num_tracks(sp_playlist *playlist) {
+  return playlist->loaded ? playlist->num_tracks : 0;
+}
+
+sp_track *sp_playlist_track(sp_playlist *playlist, int index) {
+  char id[FAKE_ID_MAX];
+
+  if (!playlist->loaded || index < 0 || index >= playlist->num_tracks) {
+    return NULL;
+  }
+
+  if (playlist->tracks[index] == NULL) {
+    snprintf(id, sizeof(id), "%.100s-%d", playlist->id, index);
+    playlist->tracks[index] = find_track(id, NULL);
+  }
+
+  return playlist->tracks[index];
+}
+
+const char *sp_playlist_name(sp_playlist *playlist) {
+  return playlist->id;
+}
+
+sp_error sp_playlist_add_ref(sp_playlist *playlist) {
+  __atomic_add_fetch(&playlist->refs, 1, __ATOMIC_RELAXED);
+  return SP_ERROR_OK;
+}
+
+sp_error sp_playlist_release(sp_playlist *playlist) {
+  int i;
+
+  if (__atomic_sub_fetch(&playlist->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    for (i = 0; i < playlist->num_tracks; i++) {
+      if (playlist->tracks[i] != NULL) {
+        sp_track_release(playlist->tracks[i]);
+      }
+    }
+    free(playlist->tracks);
+    free(playlist);
+  }
+
+  return SP_ERROR_OK;
+}
+
+/**
+ * Only the user's own playlists can be synced
+ */
+sp_error sp_playlist_set_offline_mode(sp_session *session, sp_playlist *playlist,
+                                      bool offline) {
+  int i;
+
+  for (i = 0; session->container.playlists != NULL && i < session->container.num_playlists;
+       i++) {
+    if (strcmp(session->container.playlists[i]->link, playlist->link) == 0) {
+      session->container.playlists[i]->offline = offline;
+
+      pthread_mutex_lock(&session->mutex);
+      session->offline_changed = 1;
+      schedule(session, now_ms());
+      pthread_mutex_unlock(&session->mutex);
+
+      return SP_ERROR_OK;
+    }
+  }
+
+  return SP_ERROR_INVALID_INDATA;
+}
+
+sp_playlistcontainer *sp_session_playlistcontainer(sp_session *session) {
+  char link[FAKE_LINK_MAX];
+  int i;
+
+  if (session->container.playlists == NULL) {
+    session->container.playlists = calloc(session->container.num_playlists + 1,
+                                          sizeof(sp_playlist *));
+    for (i = 0; i < session->container.num_playlists; i++) {
+      snprintf(link, sizeof(link), "spotify:playlist:user%d_%d", i, FAKE_PLAYLIST_TRACKS);
+      session->container.playlists[i] = create_playlist(session, link, 0);
+    }
+  }
+
+  return &session->container;
+}
+
+int sp_playlistcontainer_num_playlists(sp_playlistcontainer *pc) {
+  return pc->num_playlists;
+}
+
+sp_playlist *sp_playlistcontainer_playlist(sp_playlistcontainer *pc, int index) {
+  return index >= 0 && index < pc->num_playlists ? pc->playlists[index] : NULL;
+}
+
+sp_error sp_playlistcontainer_release(sp_playlistcontainer *pc) {
+  return SP_ERROR_OK;
+}
@@ -0,0 +1,177 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#include "histogram.h"
+
+#include <string.h>
+
+/**
+ * Get the bucket a value is counted in. Values below
+ * SPOTD_HISTOGRAM_SUB_COUNT have a bucket each, larger values share a bucket
+ * with those equal in their SPOTD_HISTOGRAM_SUB_BITS highest bits.
+ *
+ * @param  value  The value, not negative
+ * @return  The bucket index
+ */
+static int bucket_of(int64_t value) {
+  int shift;
+
+  if (value < SPOTD_HISTOGRAM_SUB_COUNT) {
+    return (int) value;
+  }
+
+  shift = 63 - __builtin_clzll((uint64_t) value) - (SPOTD_HISTOGRAM_SUB_BITS - 1);
+
+  return SPOTD_HISTOGRAM_SUB_COUNT + (shift - 1) * (SPOTD_HISTOGRAM_SUB_COUNT / 2) +
+         (int) (value >> shift) - SPOTD_HISTOGRAM_SUB_COUNT / 2;
+}
+
+/**
+ * Get the largest value counted in a bucket
+ *
+ * @param  bucket  The bucket index
+ * @return  The value
+ */
+static int64_t highest_of(int bucket) {
+  int shift, sub;
+
+  if (bucket < SPOTD_HISTOGRAM_SUB_COUNT) {
+    return bucket;
+  }
+
+  bucket -= SPOTD_HISTOGRAM_SUB_COUNT;
+  shift = bucket / (SPOTD_HISTOGRAM_SUB_COUNT / 2) + 1;
+  sub = bucket % (SPOTD_HISTOGRAM_SUB_COUNT / 2) + SPOTD_HISTOGRAM_SUB_COUNT / 2;
+
+  if (shift + SPOTD_HISTOGRAM_SUB_BITS - 1 >= 63) {
+    return INT64_MAX;
+  }
+
+  return (((int64_t) sub + 1) << shift) - 1;
+}
+
+/**
+ * Empty a histogram
+ *
+ * @param  histogram  The histogram
+ */
+void spotd_histogram_reset(spotd_histogram *histogram) {
+  memset(histogram, 0, sizeof(spotd_histogram));
+  histogram->min = INT64_MAX;
+}
+
+/**
+ * Count a value. Safe to call from several threads at once.
+ *
+ * @param  histogram  The histogram
+ * @param  value  The value, negative values are counted as 0
+ */
+void spotd_histogram_record(spotd_histogram *histogram, int64_t value) {
+  int64_t seen;
+
+  if (value < 0) {
+    value = 0;
+  }
+
+  __atomic_add_fetch(&histogram->buckets[bucket_of(value)], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&histogram->count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&histogram->sum, (uint64_t) value, __ATOMIC_RELAXED);
+
+  seen = __atomic_load_n(&histogram->min, __ATOMIC_RELAXED);
+  while (value < seen && !__atomic_compare_exchange_n(&histogram->min, &seen, value, 1,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  seen = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+  while (value > seen && !__atomic_compare_exchange_n(&histogram->max, &seen, value, 1,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * Add the values of a histogram to another. Not safe while values are
+ * recorded in either.
+ *
+ * @param  histogram  The histogram added to
+ * @param  other  The histogram added
+ */
+void spotd_histogram_merge(spotd_histogram *histogram, const spotd_histogram *other) {
+  int i;
+
+  for (i = 0; i < SPOTD_HISTOGRAM_BUCKETS; i++) {
+    histogram->buckets[i] += other->buckets[i];
+  }
+
+  histogram->count += other->count;
+  histogram->sum += other->sum;
+  if (other->min < histogram->min) {
+    histogram->min = other->min;
+  }
+  if (other->max > histogram->max) {
+    histogram->max = other->max;
+  }
+}
+
+/**
+ * Get a percentile of the values
+ *
+ * @param  histogram  The histogram
+ * @param  percentile  The percentile, 0-100
+ * @return  The largest value that may be at the percentile, within the
+ *   precision of the histogram, 0 for an empty histogram
+ */
+int64_t spotd_histogram_percentile(const spotd_histogram *histogram, double percentile) {
+  uint64_t rank, seen = 0;
+  int64_t value;
+  int i;
+
+  if (histogram->count == 0) {
+    return 0;
+  }
+
+  rank = (uint64_t) (percentile / 100.0 * histogram->count + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+
+  for (i = 0; i < SPOTD_HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen >= rank) {
+      value = highest_of(i);
+      return value < histogram->max ? value : histogram->max;
+    }
+  }
+
+  return histogram->max;
+}
+
+/**
+ * Get the mean of the values
+ *
+ * @param  histogram  The histogram
+ * @return  The mean, 0 for an empty histogram
+ */
+int64_t spotd_histogram_mean(const spotd_histogram *histogram) {
+  return histogram->count > 0 ? (int64_t) (histogram->sum / histogram->count) : 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+#ifndef _SPOTD_HISTOGRAM_H_
+#define _SPOTD_HISTOGRAM_H_
+
+#include <stdint.h>
+
+/*
+ * Histograms of latencies for the benchmarks, in the manner of HdrHistogram:
+ * values are counted in buckets whose width grows with the value, so that
+ * every value is kept to within 1/64 of itself, from 1 up to INT64_MAX, in a
+ * fixed amount of memory. Values may be recorded from several threads at
+ * once.
+ */
+
+/* --- Constants --- */
+// Bits of a value kept exactly, see spotd_histogram_record()
+#define SPOTD_HISTOGRAM_SUB_BITS 7
+#define SPOTD_HISTOGRAM_SUB_COUNT (1 << SPOTD_HISTOGRAM_SUB_BITS)
+#define SPOTD_HISTOGRAM_BUCKETS \
+  (SPOTD_HISTOGRAM_SUB_COUNT + (64 - SPOTD_HISTOGRAM_SUB_BITS) * SPOTD_HISTOGRAM_SUB_COUNT / 2)
+
+/* --- Types --- */
+typedef struct spotd_histogram {
+  uint64_t count;
+  uint64_t sum;
+  int64_t min;
+  int64_t max;
+  uint64_t buckets[SPOTD_HISTOGRAM_BUCKETS];
+} spotd_histogram;
+
+/* --- Functions --- */
+void spotd_histogram_reset(spotd_histogram *histogram);
+void spotd_histogram_record(spotd_histogram *histogram, int64_t value);
+void spotd_histogram_merge(spotd_histogram *histogram, const spotd_histogram *other);
+int64_t spotd_histogram_percentile(const spotd_histogram *histogram, double percentile);
+int64_t spotd_histogram_mean(const spotd_histogram *histogram);
+
+#endif /* _SPOTD_HISTOGRAM_H_ */
@@ -0,0 +1,952 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+/*
+ * Load generator for the control server. It opens many connections to a
+ * running spotd, sends a mix of text protocol commands at a target rate for
+ * a while, and reports the round trip time of each kind of command, the
+ * time connections take to set up and the throughput reached.
+ *
+ * Every command is sent with a request ID and is complete with its final
+ * reply, so deferred commands such as PLAY are timed until they were
+ * executed. With a target rate, commands are sent on a fixed schedule and
+ * timed from the time they were due, so that time spent waiting for a free
+ * connection counts too. Without one, every connection sends its next
+ * command as soon as the previous one completed.
+ *
+ * spotd limits the clients and the commands a client may send by default.
+ * To measure the server rather than those limits, run it with "-c 0 -r 0",
+ * against the fake libspotify, and with enough file descriptors:
+ *
+ *   make fake loadgen
+ *   ulimit -n 65536
+ *   FAKESPOTIFY_SPEED=0 bin/spotd-fake -o null:fast -c 0 -r 0 &
+ *   bin/spotd-loadgen -n 2000 -q 20000 -d 10
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "histogram.h"
+
+/* --- Constants --- */
+#define LOADGEN_MAX_MIX 16
+#define LOADGEN_MAX_COMMAND 256
+#define LOADGEN_MAX_THREADS 64
+#define LOADGEN_MAX_PIPELINE 64
+#define LOADGEN_INPUT_SIZE 4096
+// Commands are only written to connections that sent all earlier output
+#define LOADGEN_OUTPUT_SIZE (LOADGEN_MAX_COMMAND + 16)
+#define LOADGEN_EPOLL_EVENTS 256
+// Connections per thread connecting at once, so that the listen backlog of
+// the server does not overflow
+#define LOADGEN_MAX_CONNECTING 128
+// Time a connection may take to be greeted, in seconds
+#define LOADGEN_CONNECT_TIMEOUT 10
+// Time waited for the replies to the last commands, in seconds
+#define LOADGEN_DRAIN_TIMEOUT 5
+
+/* --- Types --- */
+typedef enum loadgen_state {
+  LOADGEN_IDLE       = 0, // Not connected yet
+  LOADGEN_CONNECTING = 1, // Waiting for the connection to be accepted
+  LOADGEN_GREETING   = 2, // Waiting for the greeting
+  LOADGEN_READY      = 3, // Sending commands
+  LOADGEN_CLOSED     = 4  // Failed or closed by the server
+} loadgen_state;
+
+// A kind of command sent, with the share of commands that are of its kind
+typedef struct loadgen_mix {
+  int weight;
+  char command[LOADGEN_MAX_COMMAND];
+} loadgen_mix;
+
+// A command waiting for its final reply
+typedef struct loadgen_request {
+  uint32_t id;
+  int mix;          // Index of the command in the mix
+  int64_t due_ns;   // Time the command was due to be sent
+  int expect;       // Lines of a multi-line reply still to come
+} loadgen_request;
+
+typedef struct loadgen_connection {
+  int fd;
+  loadgen_state state;
+  int64_t connect_ns;
+  uint32_t next_id;
+  loadgen_request requests[LOADGEN_MAX_PIPELINE];
+  int outstanding;
+  char input[LOADGEN_INPUT_SIZE];
+  size_t input_length;
+  char output[LOADGEN_OUTPUT_SIZE];
+  size_t output_length;
+} loadgen_connection;
+
+// Counters of one kind of command
+typedef struct loadgen_counters {
+  uint64_t sent;
+  uint64_t completed;
+  uint64_t errors;     // Answered with ERROR, RATE LIMITED or INVALID COMMAND
+  uint64_t unanswered; // Not answered before the connection closed, or at all
+  spotd_histogram latency;
+} loadgen_counters;
+
+typedef struct loadgen_thread {
+  pthread_t thread;
+  int epoll_fd;
+  loadgen_connection *connections;
+  int num_connections;
+  int cursor;          // Next connection to send a command on
+  double rate;         // Commands per second sent by this thread, 0 for no schedule
+  unsigned int seed;
+  int connected;
+  int failed;          // Connections that could not be set up
+  int lost;            // Connections closed by the server while sending
+  uint64_t unexpected; // Replies to unknown request IDs
+  uint64_t late;       // Commands sent more than a millisecond after they were due
+  spotd_histogram connect;
+  loadgen_counters counters[LOADGEN_MAX_MIX];
+} loadgen_thread;
+
+/* --- Data --- */
+static struct addrinfo *g_address;
+static loadgen_mix g_mix[LOADGEN_MAX_MIX];
+static int g_num_mix;
+static int g_total_weight;
+static int g_pipeline = 1;
+static double g_seconds = 10;
+// Start and end of sending commands, the same for all threads
+static int64_t g_start_ns;
+static int64_t g_end_ns;
+static pthread_barrier_t g_connected_barrier;
+static pthread_barrier_t g_started_barrier;
+
+/* --------------------------------  HELPERS  ------------------------------ */
+
+static int64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Pick a command of the mix, by weight
+ *
+ * @param  thread  The thread, whose random seed is used
+ * @return  The index of the command
+ */
+static int pick_command(loadgen_thread *thread) {
+  int n = rand_r(&thread->seed) % g_total_weight, i;
+
+  for (i = 0; i < g_num_mix - 1; i++) {
+    if ((n -= g_mix[i].weight) < 0) {
+      break;
+    }
+  }
+
+  return i;
+}
+
+/**
+ * Send what is waiting in the output buffer of a connection
+ *
+ * @param  conn  The connection
+ * @return  0 on success, even if not all of it was sent, -1 if the
+ *   connection failed
+ */
+static int flush_output(loadgen_connection *conn) {
+  ssize_t n;
+
+  while (conn->output_length > 0) {
+    n = send(conn->fd, conn->output, conn->output_length, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+
+    conn->output_length -= n;
+    memmove(conn->output, conn->output + n, conn->output_length);
+  }
+
+  return 0;
+}
+
+/**
+ * Close a connection that failed, or that the server closed
+ *
+ * @param  thread  The thread owning the connection
+ * @param  conn  The connection
+ */
+static void close_connection(loadgen_thread *thread, loadgen_connection *conn) {
+  int i;
+
+  if (conn->state == LOADGEN_READY) {
+    thread->lost++;
+  } else if (conn->state != LOADGEN_CLOSED) {
+    thread->failed++;
+  }
+
+  for (i = 0; i < conn->outstanding; i++) {
+    thread->counters[conn->requests[i].mix].unanswered++;
+  }
+  conn->outstanding = 0;
+
+  if (conn->fd >= 0) {
+    close(conn->fd);
+    conn->fd = -1;
+  }
+  conn->state = LOADGEN_CLOSED;
+}
+
+/* ------------------------------  CONNECTIONS  ---------------------------- */
+
+/**
+ * Start connecting a connection
+ *
+ * @param  thread  The thread owning the connection
+ * @param  conn  The connection
+ */
+static void start_connect(loadgen_thread *thread, loadgen_connection *conn) {
+  struct epoll_event event;
+  int one = 1;
+
+  conn->connect_ns = now_ns();
+  conn->state = LOADGEN_CONNECTING;
+  conn->next_id = 1;
+
+  conn->fd = socket(g_address->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (conn->fd < 0) {
+    perror("socket");
+    close_connection(thread, conn);
+    return;
+  }
+
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  if (connect(conn->fd, g_address->ai_addr, g_address->ai_addrlen) < 0 &&
+      errno != EINPROGRESS) {
+    close_connection(thread, conn);
+    return;
+  }
+
+  event.events = EPOLLIN | EPOLLOUT;
+  event.data.ptr = conn;
+  epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event);
+}
+
+/**
+ * Handle the result of connecting a connection
+ *
+ * @param  thread  The thread owning the connection
+ * @param  conn  The connection
+ */
+static void finish_connect(loadgen_thread *thread, loadgen_connection *conn) {
+  struct epoll_event event;
+  socklen_t length = sizeof(int);
+  int error = 0;
+
+  if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+    close_connection(thread, conn);
+    return;
+  }
+
+  conn->state = LOADGEN_GREETING;
+
+  event.events = EPOLLIN;
+  event.data.ptr = conn;
+  epoll_ctl(thread->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+/* -------------------------------  COMMANDS  ------------------------------ */
+
+/**
+ * Send a command on a connection
+ *
+ * @param  thread  The thread owning the connection
+ * @param  conn  The connection
+ * @param  due_ns  Time the command was due to be sent
+ */
+static void send_command(loadgen_thread *thread, loadgen_connection *conn, int64_t due_ns) {
+  loadgen_request *request = &conn->requests[conn->outstanding++];
+  struct epoll_event event;
+  int n;
+
+  request->id = conn->next_id++;
+  if (conn->next_id == 0) {
+    conn->next_id = 1;
+  }
+  request->mix = pick_command(thread);
+  request->due_ns = due_ns;
+  request->expect = 0;
+
+  n = snprintf(conn->output + conn->output_length,
+               sizeof(conn->output) - conn->output_length, "#%" PRIu32 " %s\n",
+               request->id, g_mix[request->mix].command);
+  conn->output_length += n;
+  thread->counters[request->mix].sent++;
+
+  if (flush_output(conn) < 0) {
+    close_connection(thread, conn);
+    return;
+  }
+
+  if (conn->output_length > 0) {
+    event.events = EPOLLIN | EPOLLOUT;
+    event.data.ptr = conn;
+    epoll_ctl(thread->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+  }
+}
+
+/**
+ * Check whether a connection can take another command
+ */
+static int can_send(const loadgen_connection *conn) {
+  return conn->state == LOADGEN_READY && conn->outstanding < g_pipeline &&
+         conn->output_length == 0;
+}
+
+/**
+ * Send a command on the next connection that can take one
+ *
+ * @param  thread  The thread
+ * @param  due_ns  Time the command was due to be sent
+ * @return  0 if it was sent, -1 if no connection could take it
+ */
+static int send_scheduled(loadgen_thread *thread, int64_t due_ns) {
+  loadgen_connection *conn;
+  int i;
+
+  for (i = 0; i < thread->num_connections; i++) {
+    conn = &thread->connections[thread->cursor];
+    thread->cursor = (thread->cursor + 1) % thread->num_connections;
+
+    if (can_send(conn)) {
+      send_command(thread, conn, due_ns);
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Handle a reply line
+ *
+ * @param  thread  The thread owning the connection
+ * @param  conn  The connection
+ * @param  line  The line, without the newline
+ * @return  Non-zero if a command completed
+ */
+static int handle_line(loadgen_thread *thread, loadgen_connection *conn, char *line) {
+  loadgen_request *request = NULL;
+  loadgen_counters *counters;
+  unsigned long id;
+  char *end;
+  int i, n;
+
+  if (conn->state == LOADGEN_GREETING) {
+    spotd_histogram_record(&thread->connect, now_ns() - conn->connect_ns);
+    conn->state = LOADGEN_READY;
+    thread->connected++;
+    return 0;
+  }
+
+  // Lines without a request ID are events
+  if (line[0] != '#') {
+    return 0;
+  }
+
+  id = strtoul(line + 1, &end, 10);
+  for (i = 0; i < conn->outstanding; i++) {
+    if (conn->requests[i].id == id) {
+      request = &conn->requests[i];
+      break;
+    }
+  }
+
+  if (request == NULL || *end != ' ') {
+    thread->unexpected++;
+    return 0;
+  }
+
+  line = end + 1;
+
+  if (request->expect > 0) {
+    // A line of a multi-line reply
+    request->expect--;
+  } else if (strncmp(line, "LOADING", 7) == 0) {
+    // A PLAY answered later
+    return 0;
+  } else if (sscanf(line, "ZONES %d", &n) == 1 || sscanf(line, "RESULTS %*d %*d %d", &n) == 1) {
+    request->expect = n;
+  } else if (strncmp(line, "ERROR", 5) == 0 || strncmp(line, "RATE LIMITED", 12) == 0 ||
+             strncmp(line, "INVALID COMMAND", 15) == 0) {
+    thread->counters[request->mix].errors++;
+  }
+
+  if (request->expect > 0) {
+    return 0;
+  }
+
+  counters = &thread->counters[request->mix];
+  counters->completed++;
+  spotd_histogram_record(&counters->latency, now_ns() - request->due_ns);
+
+  *request = conn->requests[--conn->outstanding];
+
+  return 1;
+}
+
+/**
+ * Read and handle the replies waiting on a connection
+ *
+ * @param  thread  The thread owning the connection
+ * @param  conn  The connection
+ * @return  The number of commands completed
+ */
+static int read_replies(loadgen_thread *thread, loadgen_connection *conn) {
+  char *line, *newline;
+  int completed = 0;
+  ssize_t n;
+
+  for (;;) {
+    n = recv(conn->fd, conn->input + conn->input_length,
+             sizeof(conn->input) - conn->input_length - 1, 0);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+      close_connection(thread, conn);
+      return completed;
+    }
+    if (n < 0) {
+      return completed;
+    }
+
+    conn->input_length += n;
+    conn->input[conn->input_length] = '\0';
+
+    line = conn->input;
+    while ((newline = strchr(line, '\n')) != NULL) {
+      *newline = '\0';
+      completed += handle_line(thread, conn, line);
+      line = newline + 1;
+    }
+
+    conn->input_length -= line - conn->input;
+    memmove(conn->input, line, conn->input_length);
+
+    // A line longer than the buffer is dropped
+    if (conn->input_length == sizeof(conn->input) - 1) {
+      conn->input_length = 0;
+    }
+  }
+}
+
+/**
+ * Handle the events of a connection
+ *
+ * @param  thread  The thread owning the connection
+ * @param  event  The epoll event
+ */
+static void handle_event(loadgen_thread *thread, struct epoll_event *event) {
+  loadgen_connection *conn = event->data.ptr;
+  struct epoll_event mod;
+  int completed;
+
+  if (conn->state == LOADGEN_CONNECTING) {
+    finish_connect(thread, conn);
+    return;
+  }
+
+  if (event->events & EPOLLOUT) {
+    if (flush_output(conn) < 0) {
+      close_connection(thread, conn);
+      return;
+    }
+    if (conn->output_length == 0) {
+      mod.events = EPOLLIN;
+      mod.data.ptr = conn;
+      epoll_ctl(thread->epoll_fd, EPOLL_CTL_MOD, conn->fd, &mod);
+    }
+  }
+
+  if (event->events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+    completed = read_replies(thread, conn);
+
+    // Without a schedule, a connection sends its next command as soon as
+    // one completes
+    while (thread->rate == 0 && completed-- > 0 && now_ns() < g_end_ns && can_send(conn)) {
+      send_command(thread, conn, now_ns());
+    }
+  }
+}
+
+/* --------------------------------  THREADS  ------------------------------ */
+
+/**
+ * Set up the connections of a thread
+ *
+ * @param  thread  The thread
+ */
+static void connect_all(loadgen_thread *thread) {
+  struct epoll_event events[LOADGEN_EPOLL_EVENTS];
+  int64_t deadline_ns = now_ns() + (int64_t) LOADGEN_CONNECT_TIMEOUT * 1000000000;
+  int next = 0, pending, n, i;
+
+  for (;;) {
+    // Keep a limited number of connections connecting
+    pending = 0;
+    for (i = 0; i < next; i++) {
+      pending += thread->connections[i].state == LOADGEN_CONNECTING ||
+                 thread->connections[i].state == LOADGEN_GREETING;
+    }
+    while (pending < LOADGEN_MAX_CONNECTING && next < thread->num_connections) {
+      start_connect(thread, &thread->connections[next++]);
+      pending++;
+    }
+
+    if ((pending == 0 && next == thread->num_connections) || now_ns() > deadline_ns) {
+      break;
+    }
+
+    n = epoll_wait(thread->epoll_fd, events, LOADGEN_EPOLL_EVENTS, 100);
+    for (i = 0; i < n; i++) {
+      handle_event(thread, &events[i]);
+    }
+  }
+
+  // Connections not set up in time have failed
+  for (i = 0; i < thread->num_connections; i++) {
+    if (thread->connections[i].state != LOADGEN_READY &&
+        thread->connections[i].state != LOADGEN_CLOSED) {
+      close_connection(thread, &thread->connections[i]);
+    }
+  }
+}
+
+/**
+ * Thread sending commands on its share of the connections
+ *
+ * @param  arg  The thread
+ */
+static void *loadgen_run(void *arg) {
+  struct epoll_event events[LOADGEN_EPOLL_EVENTS];
+  loadgen_thread *thread = arg;
+  int64_t due_ns, now, interval_ns = 0, drain_ns;
+  int timeout, outstanding, n, i, j;
+
+  thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  connect_all(thread);
+
+  pthread_barrier_wait(&g_connected_barrier);
+  pthread_barrier_wait(&g_started_barrier);
+
+  // Commands are due at fixed intervals from the start, or, without a
+  // schedule, every connection starts with a full pipeline
+  due_ns = g_start_ns;
+  if (thread->rate > 0) {
+    interval_ns = (int64_t) (1e9 / thread->rate);
+  } else {
+    for (i = 0; i < thread->num_connections; i++) {
+      for (j = 0; j < g_pipeline && can_send(&thread->connections[i]); j++) {
+        send_command(thread, &thread->connections[i], g_start_ns);
+      }
+    }
+  }
+
+  while ((now = now_ns()) < g_end_ns) {
+    if (thread->rate > 0) {
+      while (due_ns <= now && due_ns < g_end_ns) {
+        if (send_scheduled(thread, due_ns) < 0) {
+          break;
+        }
+        if (now - due_ns > 1000000) {
+          thread->late++;
+        }
+        due_ns += interval_ns;
+      }
+    }
+
+    // Wait for replies until the next command is due
+    timeout = 100;
+    if (thread->rate > 0) {
+      timeout = due_ns <= now ? 1 : (int) ((due_ns - now + 999999) / 1000000);
+    }
+    if (now + (int64_t) timeout * 1000000 > g_end_ns) {
+      timeout = (int) ((g_end_ns - now + 999999) / 1000000);
+    }
+
+    n = epoll_wait(thread->epoll_fd, events, LOADGEN_EPOLL_EVENTS, timeout);
+    for (i = 0; i < n; i++) {
+      handle_event(thread, &events[i]);
+    }
+  }
+
+  // Wait for the replies to the last commands
+  drain_ns = now_ns() + (int64_t) LOADGEN_DRAIN_TIMEOUT * 1000000000;
+  for (;;) {
+    outstanding = 0;
+    for (i = 0; i < thread->num_connections; i++) {
+      outstanding += thread->connections[i].outstanding;
+    }
+    if (outstanding == 0 || now_ns() > drain_ns) {
+      break;
+    }
+
+    n = epoll_wait(thread->epoll_fd, events, LOADGEN_EPOLL_EVENTS, 100);
+    for (i = 0; i < n; i++) {
+      handle_event(thread, &events[i]);
+    }
+  }
+
+  for (i = 0; i < thread->num_connections; i++) {
+    for (j = 0; j < thread->connections[i].outstanding; j++) {
+      thread->counters[thread->connections[i].requests[j].mix].unanswered++;
+    }
+    if (thread->connections[i].fd >= 0) {
+      close(thread->connections[i].fd);
+    }
+  }
+  close(thread->epoll_fd);
+
+  return NULL;
+}
+
+/* --------------------------------  REPORT  ------------------------------- */
+
+/**
+ * Print the results of one kind of command, or of all
+ *
+ * @param  name  The command
+ * @param  counters  The counters of the command
+ * @param  json  Non-zero to print a line of JSON, zero for a table row
+ */
+static void print_counters(const char *name, const loadgen_counters *counters, int json) {
+  const spotd_histogram *latency = &counters->latency;
+  const char *c;
+
+  if (json) {
+    printf("{\"benchmark\":\"loadgen\",\"command\":\"");
+    for (c = name; *c != '\0'; c++) {
+      if (*c == '"' || *c == '\\') {
+        putchar('\\');
+      }
+      putchar(*c);
+    }
+    printf("\",\"sent\":%" PRIu64 ",\"completed\":%" PRIu64 ",\"errors\":%" PRIu64 ","
+           "\"unanswered\":%" PRIu64 ",\"per_sec\":%.1f,\"latency_mean_ns\":%" PRId64 ","
+           "\"latency_p50_ns\":%" PRId64 ",\"latency_p99_ns\":%" PRId64 ","
+           "\"latency_p999_ns\":%" PRId64 ",\"latency_max_ns\":%" PRId64 "}\n",
+           counters->sent, counters->completed, counters->errors, counters->unanswered,
+           counters->completed / g_seconds, spotd_histogram_mean(latency),
+           spotd_histogram_percentile(latency, 50), spotd_histogram_percentile(latency, 99),
+           spotd_histogram_percentile(latency, 99.9), latency->count > 0 ? latency->max : 0);
+  } else {
+    printf("%-32.32s %9" PRIu64 " %9.1f %7" PRIu64 " %7" PRIu64 " %9.1f %9.1f %9.1f %9.1f\n",
+           name, counters->completed, counters->completed / g_seconds, counters->errors,
+           counters->unanswered, spotd_histogram_percentile(latency, 50) / 1000.0,
+           spotd_histogram_percentile(latency, 99) / 1000.0,
+           spotd_histogram_percentile(latency, 99.9) / 1000.0,
+           (latency->count > 0 ? latency->max : 0) / 1000.0);
+  }
+}
+
+/**
+ * Add up the results of the threads and print them
+ */
+static void report(loadgen_thread *threads, int num_threads, int num_connections,
+                   double connect_seconds, double rate, int json) {
+  static loadgen_counters counters[LOADGEN_MAX_MIX], all;
+  static spotd_histogram connect;
+  uint64_t unexpected = 0, late = 0;
+  int connected = 0, failed = 0, lost = 0, i, t;
+
+  spotd_histogram_reset(&connect);
+  spotd_histogram_reset(&all.latency);
+  for (i = 0; i < g_num_mix; i++) {
+    spotd_histogram_reset(&counters[i].latency);
+  }
+
+  for (t = 0; t < num_threads; t++) {
+    connected += threads[t].connected;
+    failed += threads[t].failed;
+    lost += threads[t].lost;
+    unexpected += threads[t].unexpected;
+    late += threads[t].late;
+    spotd_histogram_merge(&connect, &threads[t].connect);
+
+    for (i = 0; i < g_num_mix; i++) {
+      counters[i].sent += threads[t].counters[i].sent;
+      counters[i].completed += threads[t].counters[i].completed;
+      counters[i].errors += threads[t].counters[i].errors;
+      counters[i].unanswered += threads[t].counters[i].unanswered;
+      spotd_histogram_merge(&counters[i].latency, &threads[t].counters[i].latency);
+    }
+  }
+
+  for (i = 0; i < g_num_mix; i++) {
+    all.sent += counters[i].sent;
+    all.completed += counters[i].completed;
+    all.errors += counters[i].errors;
+    all.unanswered += counters[i].unanswered;
+    spotd_histogram_merge(&all.latency, &counters[i].latency);
+  }
+
+  if (json) {
+    printf("{\"benchmark\":\"loadgen\",\"connections\":%d,\"connected\":%d,\"failed\":%d,"
+           "\"lost\":%d,\"connect_seconds\":%.3f,\"connects_per_sec\":%.0f,"
+           "\"connect_p50_ns\":%" PRId64 ",\"connect_p99_ns\":%" PRId64 ","
+           "\"connect_p999_ns\":%" PRId64 ",\"connect_max_ns\":%" PRId64 ","
+           "\"threads\":%d,\"pipeline\":%d,\"target_per_sec\":%.0f,\"seconds\":%.3f,"
+           "\"per_sec\":%.1f,\"late\":%" PRIu64 ",\"unexpected\":%" PRIu64 "}\n",
+           num_connections, connected, failed, lost, connect_seconds,
+           connected / connect_seconds, spotd_histogram_percentile(&connect, 50),
+           spotd_histogram_percentile(&connect, 99), spotd_histogram_percentile(&connect, 99.9),
+           connect.count > 0 ? connect.max : 0, num_threads, g_pipeline, rate, g_seconds,
+           all.completed / g_seconds, late, unexpected);
+  } else {
+    printf("Connections: %d of %d set up in %.3f s (%.0f/s), %d failed, %d lost\n",
+           connected, num_connections, connect_seconds, connected / connect_seconds, failed,
+           lost);
+    printf("Setup time (us): p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+           spotd_histogram_percentile(&connect, 50) / 1000.0,
+           spotd_histogram_percentile(&connect, 99) / 1000.0,
+           spotd_histogram_percentile(&connect, 99.9) / 1000.0,
+           (connect.count > 0 ? connect.max : 0) / 1000.0);
+    if (rate > 0) {
+      printf("Throughput: %.1f commands/s of %.0f targeted, %" PRIu64 " sent late\n",
+             all.completed / g_seconds, rate, late);
+    } else {
+      printf("Throughput: %.1f commands/s\n", all.completed / g_seconds);
+    }
+    if (unexpected > 0) {
+      printf("Replies to unknown requests: %" PRIu64 "\n", unexpected);
+    }
+    printf("\n%-32s %9s %9s %7s %7s %9s %9s %9s %9s\n", "command", "completed", "per_sec",
+           "errors", "unanswd", "p50_us", "p99_us", "p999_us", "max_us");
+  }
+
+  for (i = 0; i < g_num_mix; i++) {
+    print_counters(g_mix[i].command, &counters[i], json);
+  }
+  print_counters("all", &all, json);
+}
+
+/* ---------------------------------  MAIN  -------------------------------- */
+
+/**
+ * Add a command to the mix
+ *
+ * @param  spec  "<weight> <command>"
+ * @return  0 on success, -1 if the spec is invalid or the mix is full
+ */
+static int add_mix(const char *spec) {
+  char *end;
+  long weight;
+
+  weight = strtol(spec, &end, 10);
+  if (end == spec || *end != ' ' || weight < 1 || weight > 1000000 ||
+      g_num_mix == LOADGEN_MAX_MIX || strlen(end + 1) == 0 ||
+      strlen(end + 1) >= LOADGEN_MAX_COMMAND || strchr(end + 1, '\n') != NULL) {
+    return -1;
+  }
+
+  g_mix[g_num_mix].weight = (int) weight;
+  strcpy(g_mix[g_num_mix].command, end + 1);
+  g_num_mix++;
+  g_total_weight += (int) weight;
+
+  return 0;
+}
+
+static void usage(const char *progname) {
+  fprintf(stderr, "usage: %s [-h <host>] [-p <port>] [-n <connections>] [-t <threads>] "
+          "[-q <rate>] [-P <pipeline>] [-d <seconds>] [-m '<weight> <command>']... "
+          "[-s <seed>] [-j]\n", progname);
+  fprintf(stderr, "  -h  Host spotd runs on (127.0.0.1)\n");
+  fprintf(stderr, "  -p  Control port (8888)\n");
+  fprintf(stderr, "  -n  Connections (1000)\n");
+  fprintf(stderr, "  -t  Threads (4)\n");
+  fprintf(stderr, "  -q  Commands per second over all connections, 0 for as many as\n"
+                  "      the connections complete (1000)\n");
+  fprintf(stderr, "  -P  Commands a connection may have waiting for a reply (1)\n");
+  fprintf(stderr, "  -d  Seconds to send commands for (10)\n");
+  fprintf(stderr, "  -m  A command to send, and its weight in the mix. Given several times.\n");
+  fprintf(stderr, "  -s  Random seed for picking commands (1)\n");
+  fprintf(stderr, "  -j  Print the results as lines of JSON\n");
+}
+
+int main(int argc, char **argv) {
+  static const char *default_mix[] = {
+    "50 STATUS",
+    "10 ZONES",
+    "10 VOLUME 80",
+    "5 OFFLINE STATUS",
+    "10 SEARCH load",
+    "5 QUEUE ADD spotify:track:load_60000",
+    "5 QUEUE CLEAR",
+    "5 PLAY spotify:track:load_60000"
+  };
+  const char *host = "127.0.0.1", *port = "8888";
+  struct addrinfo hints;
+  struct rlimit limit;
+  loadgen_thread *threads;
+  loadgen_connection *connections;
+  int num_connections = 1000, num_threads = 4, seed = 1, json = 0;
+  double rate = 1000, connect_seconds;
+  int64_t connect_start_ns;
+  int connected = 0, opt, r, i;
+
+  while ((opt = getopt(argc, argv, "h:p:n:t:q:P:d:m:s:j")) != EOF) {
+    switch (opt) {
+    case 'h':
+      host = optarg;
+      break;
+    case 'p':
+      port = optarg;
+      break;
+    case 'n':
+      num_connections = atoi(optarg);
+      break;
+    case 't':
+      num_threads = atoi(optarg);
+      break;
+    case 'q':
+      rate = atof(optarg);
+      break;
+    case 'P':
+      g_pipeline = atoi(optarg);
+      break;
+    case 'd':
+      g_seconds = atof(optarg);
+      break;
+    case 'm':
+      if (add_mix(optarg) < 0) {
+        fprintf(stderr, "Error: invalid command \"%s\"\n", optarg);
+        return 1;
+      }
+      break;
+    case 's':
+      seed = atoi(optarg);
+      break;
+    case 'j':
+      json = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (num_connections < 1 || num_threads < 1 || num_threads > LOADGEN_MAX_THREADS ||
+      rate < 0 || g_pipeline < 1 || g_pipeline > LOADGEN_MAX_PIPELINE || g_seconds <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (num_threads > num_connections) {
+    num_threads = num_connections;
+  }
+
+  if (g_num_mix == 0) {
+    for (i = 0; i < (int) (sizeof(default_mix) / sizeof(default_mix[0])); i++) {
+      add_mix(default_mix[i]);
+    }
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ((r = getaddrinfo(host, port, &hints, &g_address)) != 0) {
+    fprintf(stderr, "Could not resolve %s: %s\n", host, gai_strerror(r));
+    return 1;
+  }
+
+  // Every connection takes a file descriptor
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  threads = calloc(num_threads, sizeof(loadgen_thread));
+  connections = calloc(num_connections, sizeof(loadgen_connection));
+
+  pthread_barrier_init(&g_connected_barrier, NULL, num_threads + 1);
+  pthread_barrier_init(&g_started_barrier, NULL, num_threads + 1);
+
+  connect_start_ns = now_ns();
+
+  for (i = 0; i < num_threads; i++) {
+    threads[i].connections = connections + (int64_t) num_connections * i / num_threads;
+    threads[i].num_connections = (int) ((int64_t) num_connections * (i + 1) / num_threads -
+                                        (int64_t) num_connections * i / num_threads);
+    threads[i].rate = rate / num_threads;
+    threads[i].seed = (unsigned int) seed * (i + 1);
+    spotd_histogram_reset(&threads[i].connect);
+    for (r = 0; r < g_num_mix; r++) {
+      spotd_histogram_reset(&threads[i].counters[r].latency);
+    }
+    pthread_create(&threads[i].thread, NULL, loadgen_run, &threads[i]);
+  }
+
+  pthread_barrier_wait(&g_connected_barrier);
+  connect_seconds = (now_ns() - connect_start_ns) / 1e9;
+
+  g_start_ns = now_ns();
+  g_end_ns = g_start_ns + (int64_t) (g_seconds * 1e9);
+  pthread_barrier_wait(&g_started_barrier);
+
+  for (i = 0; i < num_threads; i++) {
+    pthread_join(threads[i].thread, NULL);
+    connected += threads[i].connected;
+  }
+
+  report(threads, num_threads, num_connections, connect_seconds, rate, json);
+
+  if (connected == 0) {
+    fprintf(stderr, "Error: could not connect to %s port %s\n", host, port);
+  }
+
+  freeaddrinfo(g_address);
+  free(connections);
+  free(threads);
+
+  return connected > 0 ? 0 : 1;
+}
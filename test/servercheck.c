@@ -0,0 +1,362 @@
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2015 Mantas Norvaiša
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of spotd.
+ */
+
+/*
+ * Regression checks of the server, run against a spotd built with the fake
+ * libspotify and AddressSanitizer, see check.sh. Each check drives the
+ * server through a path that once went wrong, and then makes sure that
+ * spotd still answers. Memory errors on the way are reported by
+ * AddressSanitizer in the log of spotd.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/* --- Constants --- */
+#define CHECK_MAX_CLIENTS 64
+// Time each check runs for, in milliseconds
+#define CHECK_DURATION_MS 3000
+// Interval clients send a byte while waiting, in milliseconds
+#define CHECK_TRICKLE_MS 2
+
+/* --- Types --- */
+typedef struct check_client {
+  int fd;
+  int64_t next_send_ms;
+} check_client;
+
+typedef struct check {
+  const char *name;
+  int (*run)(void);
+} check;
+
+/* --- Data --- */
+static int g_port = 18888;
+static int g_http_port = 18080;
+
+/* --------------------------------  HELPERS  ------------------------------ */
+
+static int64_t now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Connect to spotd on the loopback interface
+ *
+ * @param  port  The port
+ * @return  The socket, -1 on error
+ */
+static int connect_to(int port) {
+  struct sockaddr_in address;
+  int fd;
+
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/**
+ * Send a string
+ *
+ * @param  fd  The socket
+ * @param  text  The string
+ * @return  0 on success, -1 on error
+ */
+static int send_text(int fd, const char *text) {
+  return send(fd, text, strlen(text), MSG_NOSIGNAL) == (ssize_t) strlen(text) ? 0 : -1;
+}
+
+/**
+ * Read a line, waiting at most a second
+ *
+ * @param  fd  The socket
+ * @param  line  Where to store the line, without the newline
+ * @param  size  Size of line
+ * @return  0 on success, -1 on error or timeout
+ */
+static int read_line(int fd, char *line, size_t size) {
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  size_t length = 0;
+  char c;
+
+  while (length < size - 1) {
+    if (poll(&pfd, 1, 1000) <= 0 || recv(fd, &c, 1, 0) != 1) {
+      return -1;
+    }
+    if (c == '\n') {
+      break;
+    }
+    line[length++] = c;
+  }
+
+  line[length] = '\0';
+  return 0;
+}
+
+/**
+ * Close a connection at once, with a reset, so that the server fails
+ * sending to it
+ *
+ * @param  fd  The socket
+ */
+static void reset_connection(int fd) {
+  struct linger linger = { 1, 0 };
+
+  setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+  close(fd);
+}
+
+/**
+ * Check that spotd still answers a command
+ *
+ * @return  0 if it does, -1 otherwise
+ */
+static int check_alive(void) {
+  char line[256];
+  int fd, r = -1;
+
+  if ((fd = connect_to(g_port)) < 0) {
+    return -1;
+  }
+
+  if (read_line(fd, line, sizeof(line)) == 0 && send_text(fd, "STATUS\n") == 0 &&
+      read_line(fd, line, sizeof(line)) == 0 && strncmp(line, "STATUS ", 7) == 0) {
+    r = 0;
+  }
+
+  close(fd);
+  return r;
+}
+
+/* ---------------------------------  CHECKS  ------------------------------ */
+
+/**
+ * Subscribers that go away while events are pushed to them. The server
+ * closes them while handling its inbox, while they may still have poll
+ * events of their own.
+ */
+static int check_subscribers_reset(void) {
+  check_client clients[CHECK_MAX_CLIENTS];
+  int64_t end_ms = now_ms() + CHECK_DURATION_MS, now;
+  char line[256];
+  int control, volume = 0, i;
+
+  // Volume changes are pushed to the subscribers as events
+  if ((control = connect_to(g_port)) < 0 || read_line(control, line, sizeof(line)) < 0) {
+    return -1;
+  }
+
+  for (i = 0; i < CHECK_MAX_CLIENTS; i++) {
+    clients[i].fd = -1;
+  }
+
+  while ((now = now_ms()) < end_ms) {
+    for (i = 0; i < CHECK_MAX_CLIENTS; i++) {
+      if (clients[i].fd < 0) {
+        if ((clients[i].fd = connect_to(g_port)) < 0 ||
+            send_text(clients[i].fd, "SUBSCRIBE\n") < 0) {
+          return -1;
+        }
+        clients[i].next_send_ms = now + rand() % 20;
+      } else if (now >= clients[i].next_send_ms) {
+        // Keep the connection busy until it goes away
+        if (rand() % 4 == 0) {
+          reset_connection(clients[i].fd);
+          clients[i].fd = -1;
+        } else {
+          send_text(clients[i].fd, "STATUS\n");
+          clients[i].next_send_ms = now + CHECK_TRICKLE_MS;
+        }
+      }
+    }
+
+    volume = (volume + 1) % 100;
+    snprintf(line, sizeof(line), "VOLUME %d\n", volume);
+    if (send_text(control, line) < 0) {
+      return -1;
+    }
+    usleep(CHECK_TRICKLE_MS * 1000);
+  }
+
+  for (i = 0; i < CHECK_MAX_CLIENTS; i++) {
+    if (clients[i].fd >= 0) {
+      close(clients[i].fd);
+    }
+  }
+  close(control);
+
+  return 0;
+}
+
+/**
+ * HTTP clients that ask for the connection to be closed once their command
+ * was executed, and keep sending while they wait. The server closes them
+ * when the result is delivered from its inbox, while they may still have
+ * poll events of their own.
+ */
+static int check_http_close_after_result(void) {
+  static const char request[] =
+    "POST /play?link=spotify:track:check_60000 HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Connection: close\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n";
+  check_client clients[CHECK_MAX_CLIENTS];
+  int64_t end_ms = now_ms() + CHECK_DURATION_MS, now;
+  char buffer[4096];
+  ssize_t n;
+  int i;
+
+  for (i = 0; i < CHECK_MAX_CLIENTS; i++) {
+    clients[i].fd = -1;
+  }
+
+  while ((now = now_ms()) < end_ms) {
+    for (i = 0; i < CHECK_MAX_CLIENTS; i++) {
+      if (clients[i].fd < 0) {
+        if ((clients[i].fd = connect_to(g_http_port)) < 0 ||
+            send_text(clients[i].fd, request) < 0) {
+          return -1;
+        }
+        clients[i].next_send_ms = now + CHECK_TRICKLE_MS;
+        continue;
+      }
+
+      // Read the response, until the server closes the connection
+      n = recv(clients[i].fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+      if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        close(clients[i].fd);
+        clients[i].fd = -1;
+      } else if (now >= clients[i].next_send_ms) {
+        // The start of a pipelined request, never finished
+        send_text(clients[i].fd, "G");
+        clients[i].next_send_ms = now + CHECK_TRICKLE_MS;
+      }
+    }
+
+    usleep(CHECK_TRICKLE_MS * 1000 / 2);
+  }
+
+  for (i = 0; i < CHECK_MAX_CLIENTS; i++) {
+    if (clients[i].fd >= 0) {
+      close(clients[i].fd);
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * A link that is valid, but not to a track, played twice. Nothing is kept
+ * in the track cache for it, so the second time fails the same way instead
+ * of finding an entry without a track.
+ */
+static int check_non_track_link(void) {
+  char line[256];
+  int fd, i, r = 0;
+
+  if ((fd = connect_to(g_port)) < 0) {
+    return -1;
+  }
+
+  if (read_line(fd, line, sizeof(line)) < 0) {
+    r = -1;
+  }
+
+  for (i = 0; i < 2 && r == 0; i++) {
+    if (send_text(fd, "PLAY spotify:playlist:check_10\n") < 0 ||
+        read_line(fd, line, sizeof(line)) < 0) {
+      r = -1;
+    }
+  }
+
+  close(fd);
+  return r == 0 ? check_alive() : -1;
+}
+
+static const check g_checks[] = {
+  { "subscribers reset while events are pushed", check_subscribers_reset },
+  { "HTTP connections closed after their result", check_http_close_after_result },
+  { "non-track link played twice", check_non_track_link },
+};
+
+/* ---------------------------------  MAIN  -------------------------------- */
+
+int main(int argc, char **argv) {
+  int failed = 0, opt, i;
+
+  while ((opt = getopt(argc, argv, "p:H:")) != EOF) {
+    switch (opt) {
+    case 'p':
+      g_port = atoi(optarg);
+      break;
+    case 'H':
+      g_http_port = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-p <port>] [-H <http port>]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  srand(1);
+
+  for (i = 0; i < (int) (sizeof(g_checks) / sizeof(g_checks[0])); i++) {
+    if (g_checks[i].run() < 0 || check_alive() < 0) {
+      printf("FAIL  %s\n", g_checks[i].name);
+      failed++;
+    } else {
+      printf("ok    %s\n", g_checks[i].name);
+    }
+  }
+
+  return failed > 0 ? 1 : 0;
+}